@@ -15,6 +15,9 @@
 #include <string>
 #include <iterator>
 #include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
 
 float tensor_sum_elements(const ggml_tensor * tensor) {
     float sum = 0;
@@ -41,6 +44,7 @@ void tensor_dump(const ggml_tensor * tensor, const char * name) {
 struct benchmark_params_struct {
     int32_t n_threads     = 1;
     int32_t n_iterations  = 10;
+    int32_t n_noise       = 0;
 };
 
 void print_usage(int /*argc*/, char ** argv, struct benchmark_params_struct params) {
@@ -50,6 +54,7 @@ void print_usage(int /*argc*/, char ** argv, struct benchmark_params_struct para
     fprintf(stderr, "  -h, --help            show this help message and exit\n");
     fprintf(stderr, "  -t N, --threads N     number of threads to use during computation (default: %d)\n", params.n_threads);
     fprintf(stderr, "  -i N, --iter N     number of iterations to use during computation (default: %d)\n", params.n_iterations);
+    fprintf(stderr, "  --noise N             number of busy background threads, to simulate interrupted cores (default: %d)\n", params.n_noise);
     fprintf(stderr, "\n");
 }
 
@@ -73,6 +78,12 @@ int main(int argc, char ** argv)  {
                 break;
             }
             benchmark_params.n_iterations = std::stoi(argv[i]);
+        } else if (arg == "--noise") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            benchmark_params.n_noise = std::stoi(argv[i]);
         }  else if (arg == "-h" || arg == "--help") {
             print_usage(argc, argv, benchmark_params);
             exit(0);
@@ -209,24 +220,51 @@ int main(int argc, char ** argv)  {
     // Let's use the F32 result from above as a reference for the q4_0 multiplication
     float sum_of_F32_reference = tensor_sum_elements(gf.nodes[0]);
 
-    printf("Iteration;NThreads; SizeX; SizeY; SizeZ; Required_FLOPS; Elapsed_u_Seconds; gigaFLOPS\n");
+    // keep the threads alive between the iterations, so that we only measure the node itself
+    struct ggml_threadpool * pool = ggml_threadpool_new(benchmark_params.n_threads);
+
+    // background load that steals time slices from the compute threads
+    std::atomic<bool> noise_stop(false);
+    std::vector<std::thread> noise;
+    for (int i = 0; i < benchmark_params.n_noise; i++) {
+        noise.emplace_back([&noise_stop]() {
+            volatile uint64_t x = 0;
+            while (!noise_stop.load(std::memory_order_relaxed)) {
+                x = x + 1;
+            }
+        });
+    }
+
+    printf("Iteration;NThreads; SizeX; SizeY; SizeZ; Required_FLOPS; Elapsed_u_Seconds; gigaFLOPS; Idle_u_Seconds\n");
     printf("=====================================================================================\n");
 
+    std::vector<long long int> usec_all;
+    std::vector<long long int> wait_all;
+
     double  gflops_sum = 0;
     for (int i=0;i<benchmark_params.n_iterations ;i++) {
 
+        ggml_threadpool_reset_stats(pool);
+
         long long int start = ggml_time_us();
         //printf("Running ggml_graph_compute\n");
-        ggml_graph_compute(ctx, &gf31);
+        ggml_graph_compute_with_pool(ctx, &gf31, pool);
         long long int stop = ggml_time_us();
+
+        // time the threads spent waiting for each other, summed over all threads
+        const struct ggml_threadpool_stats stats = ggml_threadpool_get_stats(pool);
+        const long long int wait = stats.t_spin_us + stats.t_sleep_us;
         long long int usec = stop-start;
         double gflops = (double)(flops_per_matrix)/usec/1000.0;
         gflops_sum += gflops;
-        printf("%9i;%8i;%6i;%6i;%6i;%15lli;%18lli;%10.2f\n",
+        printf("%9i;%8i;%6i;%6i;%6i;%15lli;%18lli;%10.2f;%15lli\n",
             i,
             gf31.n_threads,
             sizex, sizey, sizez, flops_per_matrix,
-            usec,gflops);
+            usec,gflops,wait);
+
+        usec_all.push_back(usec);
+        wait_all.push_back(wait);
 
 #ifdef VERBOSE_DEBUGGING
         TENSOR_DUMP("res",gf31.nodes[0])
@@ -249,9 +287,28 @@ int main(int argc, char ** argv)  {
         }
 
         // Running a different graph computation to make sure we override the CPU cache lines
-        ggml_graph_compute(ctx, &gf32);
+        ggml_graph_compute_with_pool(ctx, &gf32, pool);
     }
+
+    noise_stop = true;
+    for (auto & t : noise) {
+        t.join();
+    }
+
+    ggml_threadpool_free(pool);
+
     printf("\n");
     printf("Average%78.2f\n",gflops_sum/((double)benchmark_params.n_iterations));
     printf("=====================================================================================\n");
+
+    // the tail of the node latency is what the slowest thread costs us
+    std::sort(usec_all.begin(), usec_all.end());
+    std::sort(wait_all.begin(), wait_all.end());
+
+    const size_t n = usec_all.size();
+    printf("\n");
+    printf("Node latency (us): min %lli, p50 %lli, p90 %lli, max %lli\n",
+        usec_all[0], usec_all[n/2], usec_all[(n*9)/10], usec_all[n - 1]);
+    printf("Thread idle time (us): min %lli, p50 %lli, p90 %lli, max %lli\n",
+        wait_all[0], wait_all[n/2], wait_all[(n*9)/10], wait_all[n - 1]);
 }
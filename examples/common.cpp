@@ -1,3 +1,5 @@
+// for llama_sample_token_speculative_with_rng
+#define LLAMA_API_INTERNAL
 #include "common.h"
 
 #include <cassert>
@@ -87,6 +89,40 @@ void process_escapes(std::string& input) {
     input.resize(output_idx);
 }
 
+bool llama_kv_type_parse(const std::string & name, llama_kv_type & type) {
+    static const std::pair<const char *, llama_kv_type> types[] = {
+        { "f32",  LLAMA_KV_TYPE_F32  },
+        { "f16",  LLAMA_KV_TYPE_F16  },
+        { "q8_0", LLAMA_KV_TYPE_Q8_0 },
+        { "q4_0", LLAMA_KV_TYPE_Q4_0 },
+        { "q4_1", LLAMA_KV_TYPE_Q4_1 },
+        { "q5_0", LLAMA_KV_TYPE_Q5_0 },
+        { "q5_1", LLAMA_KV_TYPE_Q5_1 },
+    };
+    for (const auto & t : types) {
+        if (name == t.first) {
+            type = t.second;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool llama_numa_parse(const std::string & name, llama_numa_strategy & numa) {
+    static const std::pair<const char *, llama_numa_strategy> strategies[] = {
+        { "disabled",   LLAMA_NUMA_DISABLED   },
+        { "interleave", LLAMA_NUMA_INTERLEAVE },
+        { "isolate",    LLAMA_NUMA_ISOLATE    },
+    };
+    for (const auto & s : strategies) {
+        if (name == s.first) {
+            numa = s.second;
+            return true;
+        }
+    }
+    return false;
+}
+
 bool gpt_params_parse(int argc, char ** argv, gpt_params & params) {
     bool invalid_param = false;
     bool escape_prompt = false;
@@ -115,6 +151,12 @@ bool gpt_params_parse(int argc, char ** argv, gpt_params & params) {
                 break;
             }
             params.n_threads = std::stoi(argv[i]);
+        } else if (arg == "--spin") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.n_spin = std::stoi(argv[i]);
         } else if (arg == "-p" || arg == "--prompt") {
             if (++i >= argc) {
                 invalid_param = true;
@@ -166,6 +208,16 @@ bool gpt_params_parse(int argc, char ** argv, gpt_params & params) {
             params.n_ctx = std::stoi(argv[i]);
         } else if (arg == "--memory-f32") {
             params.memory_f16 = false;
+        } else if (arg == "-ctk" || arg == "--cache-type-k") {
+            if (++i >= argc || !llama_kv_type_parse(argv[i], params.cache_type_k)) {
+                invalid_param = true;
+                break;
+            }
+        } else if (arg == "-ctv" || arg == "--cache-type-v") {
+            if (++i >= argc || !llama_kv_type_parse(argv[i], params.cache_type_v)) {
+                invalid_param = true;
+                break;
+            }
         } else if (arg == "--top-p") {
             if (++i >= argc) {
                 invalid_param = true;
@@ -232,6 +284,25 @@ bool gpt_params_parse(int argc, char ** argv, gpt_params & params) {
                 break;
             }
             params.mirostat_tau = std::stof(argv[i]);
+        } else if (arg == "--grammar") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.grammar = argv[i];
+        } else if (arg == "--grammar-file") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            std::ifstream file(argv[i]);
+            if (!file) {
+                fprintf(stderr, "error: failed to open file '%s'\n", argv[i]);
+                invalid_param = true;
+                break;
+            }
+            params.grammar.clear();
+            std::copy(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>(), back_inserter(params.grammar));
         } else if (arg == "-b" || arg == "--batch-size") {
             if (++i >= argc) {
                 invalid_param = true;
@@ -251,6 +322,24 @@ bool gpt_params_parse(int argc, char ** argv, gpt_params & params) {
                 break;
             }
             params.model = argv[i];
+        } else if (arg == "-md" || arg == "--model-draft") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.model_draft = argv[i];
+        } else if (arg == "--draft") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.n_draft = std::stoi(argv[i]);
+        } else if (arg == "--lookup") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.n_lookup = std::stoi(argv[i]);
         } else if (arg == "-a" || arg == "--alias") {
             if (++i >= argc) {
                 invalid_param = true;
@@ -297,6 +386,29 @@ bool gpt_params_parse(int argc, char ** argv, gpt_params & params) {
 #endif
         } else if (arg == "--no-mmap") {
             params.use_mmap = false;
+        } else if (arg == "--repack") {
+            params.repack = true;
+            params.use_mmap = false;
+        } else if (arg == "--direct-io") {
+            params.direct_io = true;
+            params.use_mmap = false;
+        } else if (arg == "--numa") {
+            if (++i >= argc || !llama_numa_parse(argv[i], params.numa)) {
+                invalid_param = true;
+                break;
+            }
+        } else if (arg == "--hugepages") {
+            params.hugepages = true;
+        } else if (arg == "--mmap-budget") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.mmap_budget_mb = std::stoi(argv[i]);
+            if (params.mmap_budget_mb < 0) {
+                invalid_param = true;
+                break;
+            }
         } else if (arg == "--mtest") {
             params.mem_test = true;
         } else if (arg == "--verbose-prompt") {
@@ -389,6 +501,7 @@ void gpt_print_usage(int /*argc*/, char ** argv, const gpt_params & params) {
     fprintf(stderr, "  --color               colorise output to distinguish prompt and user input from generations\n");
     fprintf(stderr, "  -s SEED, --seed SEED  RNG seed (default: -1, use random seed for < 0)\n");
     fprintf(stderr, "  -t N, --threads N     number of threads to use during computation (default: %d)\n", params.n_threads);
+    fprintf(stderr, "  --spin N              busy-wait iterations before an idle thread goes to sleep (default: %d, -1 = never sleep)\n", params.n_spin);
     fprintf(stderr, "  -p PROMPT, --prompt PROMPT\n");
     fprintf(stderr, "                        prompt to start generation with (default: empty)\n");
     fprintf(stderr, "  -e                    process prompt escapes sequences (\\n, \\r, \\t, \\', \\\", \\\\)\n");
@@ -414,6 +527,8 @@ void gpt_print_usage(int /*argc*/, char ** argv, const gpt_params & params) {
     fprintf(stderr, "                        (default: %d, 0 = disabled, 1 = Mirostat, 2 = Mirostat 2.0)\n", params.mirostat);
     fprintf(stderr, "  --mirostat-lr N       Mirostat learning rate, parameter eta (default: %.1f)\n", (double)params.mirostat_eta);
     fprintf(stderr, "  --mirostat-ent N      Mirostat target entropy, parameter tau (default: %.1f)\n", (double)params.mirostat_tau);
+    fprintf(stderr, "  --grammar GRAMMAR     constrain the generation to a grammar in the form of examples/grammar-parser.h\n");
+    fprintf(stderr, "  --grammar-file FNAME  read the grammar from a file\n");
     fprintf(stderr, "  -l TOKEN_ID(+/-)BIAS, --logit-bias TOKEN_ID(+/-)BIAS\n");
     fprintf(stderr, "                        modifies the likelihood of token appearing in the completion,\n");
     fprintf(stderr, "                        i.e. `--logit-bias 15043+1` to increase likelihood of token ' Hello',\n");
@@ -423,6 +538,10 @@ void gpt_print_usage(int /*argc*/, char ** argv, const gpt_params & params) {
     fprintf(stderr, "  --no-penalize-nl      do not penalize newline token\n");
     fprintf(stderr, "  --memory-f32          use f32 instead of f16 for memory key+value (default: disabled)\n");
     fprintf(stderr, "                        not recommended: doubles context memory required and no measurable increase in quality\n");
+    fprintf(stderr, "  -ctk TYPE, --cache-type-k TYPE\n");
+    fprintf(stderr, "                        data type of the K cache: f32, f16, q8_0, q4_0, q4_1, q5_0 or q5_1 (default: f16)\n");
+    fprintf(stderr, "  -ctv TYPE, --cache-type-v TYPE\n");
+    fprintf(stderr, "                        data type of the V cache: f32 or f16 (default: f16)\n");
     fprintf(stderr, "  --temp N              temperature (default: %.1f)\n", (double)params.temp);
     fprintf(stderr, "  -b N, --batch-size N  batch size for prompt processing (default: %d)\n", params.n_batch);
     fprintf(stderr, "  --perplexity          compute perplexity over the prompt\n");
@@ -432,7 +551,14 @@ void gpt_print_usage(int /*argc*/, char ** argv, const gpt_params & params) {
     }
     if (llama_mmap_supported()) {
         fprintf(stderr, "  --no-mmap             do not memory-map model (slower load but may reduce pageouts if not using mlock)\n");
+        fprintf(stderr, "  --mmap-budget N       keep at most N MiB of the memory-mapped model resident, the layers that do not fit are\n");
+        fprintf(stderr, "                        streamed from the file on every eval (default: 0 = no limit)\n");
     }
+    fprintf(stderr, "  --repack              interleave the rows of the quantized weights for faster generation (implies --no-mmap)\n");
+    fprintf(stderr, "  --direct-io           read the model bypassing the page cache (implies --no-mmap)\n");
+    fprintf(stderr, "  --numa STRATEGY       placement of the memory on NUMA systems: interleave over all the nodes, or isolate\n");
+    fprintf(stderr, "                        the threads and the memory on the node of the main thread (default: disabled)\n");
+    fprintf(stderr, "  --hugepages           back the model and the context buffers with huge pages (hugetlbfs if reserved, else THP)\n");
 #ifdef LLAMA_SUPPORTS_GPU_OFFLOAD
     fprintf(stderr, "  -ngl N, --n-gpu-layers N\n");
     fprintf(stderr, "                        number of layers to store in VRAM\n");
@@ -443,6 +569,11 @@ void gpt_print_usage(int /*argc*/, char ** argv, const gpt_params & params) {
     fprintf(stderr, "  --lora-base FNAME     optional model to use as a base for the layers modified by the LoRA adapter\n");
     fprintf(stderr, "  -m FNAME, --model FNAME\n");
     fprintf(stderr, "                        model path (default: %s)\n", params.model.c_str());
+    fprintf(stderr, "  -md FNAME, --model-draft FNAME\n");
+    fprintf(stderr, "                        draft model for speculative decoding, must share the vocabulary of the model (default: none)\n");
+    fprintf(stderr, "  --draft N             number of tokens to draft for speculative decoding (default: %d)\n", params.n_draft);
+    fprintf(stderr, "  --lookup N            speculative decoding without a draft model, drafts the tokens that follow the longest of the last\n");
+    fprintf(stderr, "                        1 .. N tokens that occurs in the prompt (default: %d, 0 = disabled)\n", params.n_lookup);
     fprintf(stderr, "\n");
 }
 
@@ -476,15 +607,32 @@ std::vector<llama_token> llama_tokenize(struct llama_context * ctx, const std::s
     return res;
 }
 
+std::vector<llama_token> llama_tokenize(struct llama_context * ctx, const std::string & text, bool add_bos, int n_threads) {
+    std::vector<llama_token> res(text.size() + (int) add_bos);
+    const int n = llama_tokenize_parallel(ctx, text.c_str(), res.data(), res.size(), add_bos, n_threads);
+    assert(n >= 0);
+    res.resize(n);
+
+    return res;
+}
+
 struct llama_context * llama_init_from_gpt_params(const gpt_params & params) {
     auto lparams = llama_context_default_params();
 
     lparams.n_ctx        = params.n_ctx;
     lparams.n_gpu_layers = params.n_gpu_layers;
     lparams.seed         = params.seed;
+    lparams.n_spin       = params.n_spin;
     lparams.f16_kv       = params.memory_f16;
+    lparams.type_k       = params.cache_type_k;
+    lparams.type_v       = params.cache_type_v;
     lparams.use_mmap     = params.use_mmap;
     lparams.use_mlock    = params.use_mlock;
+    lparams.repack       = params.repack;
+    lparams.direct_io    = params.direct_io;
+    lparams.numa         = params.numa;
+    lparams.hugepages    = params.hugepages;
+    lparams.mmap_budget  = (size_t) params.mmap_budget_mb*1024*1024;
     lparams.logits_all   = params.perplexity;
     lparams.embedding    = params.embedding;
 
@@ -509,6 +657,225 @@ struct llama_context * llama_init_from_gpt_params(const gpt_params & params) {
     return lctx;
 }
 
+struct llama_context * llama_init_draft_from_gpt_params(const gpt_params & params) {
+    gpt_params params_draft = params;
+
+    params_draft.model = params.model_draft;
+    params_draft.lora_adapter.clear();
+    params_draft.perplexity = false;
+    params_draft.embedding  = false;
+
+    return llama_init_from_gpt_params(params_draft);
+}
+
+std::vector<llama_draft_token> llama_draft(struct llama_context * ctx_draft, llama_seq_id seq_id, const std::vector<llama_token> & tokens, int & n_past, int n_draft, const gpt_params & params) {
+    std::vector<llama_draft_token> draft;
+    if (tokens.empty() || n_draft <= 0) {
+        return draft;
+    }
+
+    // the logits of the last token are needed to draft the next one
+    n_past = std::min(n_past, (int) tokens.size() - 1);
+    llama_kv_cache_seq_rm(ctx_draft, seq_id, n_past, -1);
+
+    const int n_vocab = llama_n_vocab(ctx_draft);
+    const int top_k   = params.top_k <= 0 ? n_vocab : params.top_k;
+
+    std::vector<int>          pos;
+    std::vector<llama_seq_id> seq;
+    const float * logits = NULL;
+
+    while (n_past < (int) tokens.size()) {
+        const int n_eval = std::min(params.n_batch, (int) tokens.size() - n_past);
+
+        pos.resize(n_eval);
+        seq.assign(n_eval, seq_id);
+        for (int i = 0; i < n_eval; i++) {
+            pos[i] = n_past + i;
+        }
+        if (llama_eval_batch(ctx_draft, &tokens[n_past], pos.data(), seq.data(), n_eval, params.n_threads)) {
+            return draft;
+        }
+        n_past += n_eval;
+        logits = llama_get_logits(ctx_draft) + (n_eval - 1)*n_vocab;
+    }
+
+    for (int i = 0; i < n_draft; i++) {
+        llama_draft_token token;
+        if (params.temp <= 0) {
+            token.id = std::max_element(logits, logits + n_vocab) - logits;
+        } else {
+            llama_token_data_array candidates_p = llama_sample_chain(ctx_draft, logits, top_k, params.tfs_z, params.typical_p, params.top_p, params.temp);
+            token.id = llama_sample_token(ctx_draft, &candidates_p);
+            token.candidates.assign(candidates_p.data, candidates_p.data + candidates_p.size);
+        }
+        draft.push_back(token);
+
+        if (i == n_draft - 1 || token.id == llama_token_eos()) {
+            break;
+        }
+
+        if (llama_eval_batch(ctx_draft, &token.id, &n_past, &seq_id, 1, params.n_threads)) {
+            break;
+        }
+        n_past++;
+        logits = llama_get_logits(ctx_draft);
+    }
+
+    return draft;
+}
+
+llama_token llama_sample_draft(struct llama_context * ctx, llama_token_data_array * candidates, llama_draft_token & draft) {
+    llama_token_data_array draft_p = { draft.candidates.data(), draft.candidates.size(), true };
+
+    return llama_sample_token_speculative(ctx, candidates, draft.candidates.empty() ? NULL : &draft_p, draft.id);
+}
+
+llama_token llama_sample_draft(struct llama_context * ctx, llama_token_data_array * candidates, llama_draft_token & draft, std::mt19937 & rng) {
+    llama_token_data_array draft_p = { draft.candidates.data(), draft.candidates.size(), true };
+
+    return llama_sample_token_speculative_with_rng(ctx, candidates, draft.candidates.empty() ? NULL : &draft_p, draft.id, rng);
+}
+
+static uint64_t llama_ngram_hash(const llama_token * tokens, int n) {
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ull;
+    for (int i = 0; i < n; i++) {
+        hash = (hash ^ (uint32_t) tokens[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+void llama_ngram_index_update(llama_ngram_index & index, const std::vector<llama_token> & text) {
+    const int n = index.n;
+    const int n_old = (int) index.tokens.size();
+    if (n <= 0 || (int) text.size() <= n_old) {
+        return;
+    }
+    index.tokens.insert(index.tokens.end(), text.begin() + n_old, text.end());
+    index.next.resize(n);
+
+    // an n-gram is indexed once a token follows it
+    for (int k = 1; k <= n; k++) {
+        for (int i = std::max(0, n_old - k); i + k < (int) index.tokens.size(); i++) {
+            index.next[k - 1][llama_ngram_hash(&index.tokens[i], k)] = i + k;
+        }
+    }
+}
+
+std::vector<llama_draft_token> llama_draft_lookup(const llama_ngram_index & index, const std::vector<llama_token> & text, int n_draft) {
+    std::vector<llama_draft_token> draft;
+
+    // the longest n-gram is the most likely to be copied
+    for (int k = std::min((int) index.next.size(), (int) text.size()); k > 0; k--) {
+        const llama_token * ngram = &text[text.size() - k];
+        const auto it = index.next[k - 1].find(llama_ngram_hash(ngram, k));
+        if (it == index.next[k - 1].end() || !std::equal(ngram, ngram + k, &index.tokens[it->second - k])) {
+            continue;
+        }
+
+        const int end = std::min((int) index.tokens.size(), it->second + n_draft);
+        for (int i = it->second; i < end; i++) {
+            draft.push_back({ index.tokens[i], {} });
+        }
+        break;
+    }
+    return draft;
+}
+
+static int llama_stop_matcher_next(const llama_stop_matcher::node & node, unsigned char c) {
+    for (const auto & edge : node.next) {
+        if (edge.first == c) {
+            return edge.second;
+        }
+    }
+    return -1;
+}
+
+void llama_stop_matcher_init(llama_stop_matcher & matcher, const std::vector<std::string> & words) {
+    matcher.words = words;
+    matcher.nodes.assign(1, llama_stop_matcher::node());
+    matcher.state = 0;
+    matcher.n_fed = 0;
+
+    // the trie of the words
+    for (size_t i = 0; i < words.size(); i++) {
+        int cur = 0;
+        for (unsigned char c : words[i]) {
+            int next = llama_stop_matcher_next(matcher.nodes[cur], c);
+            if (next < 0) {
+                next = (int) matcher.nodes.size();
+                matcher.nodes.emplace_back();
+                matcher.nodes[next].depth = matcher.nodes[cur].depth + 1;
+                matcher.nodes[cur].next.emplace_back(c, next);
+            }
+            cur = next;
+        }
+        if (cur != 0 && matcher.nodes[cur].word < 0) {
+            matcher.nodes[cur].word = (int) i;
+        }
+    }
+
+    // the failure links, breadth first so that the link of a node is set before the ones of its children
+    std::vector<int> queue(1, 0);
+    for (size_t i = 0; i < queue.size(); i++) {
+        const int cur = queue[i];
+        for (const auto & edge : matcher.nodes[cur].next) {
+            const int child = edge.second;
+            int fail = 0;
+            if (cur != 0) {
+                for (int f = matcher.nodes[cur].fail; ; f = matcher.nodes[f].fail) {
+                    const int next = llama_stop_matcher_next(matcher.nodes[f], edge.first);
+                    if (next >= 0) {
+                        fail = next;
+                        break;
+                    }
+                    if (f == 0) {
+                        break;
+                    }
+                }
+            }
+            auto & node = matcher.nodes[child];
+            node.fail = fail;
+            if (node.word < 0) {
+                node.word = matcher.nodes[fail].word;
+            }
+            queue.push_back(child);
+        }
+    }
+}
+
+int llama_stop_matcher_feed(llama_stop_matcher & matcher, const char * text, size_t n, size_t & pos) {
+    int word = -1;
+    if (matcher.nodes.empty()) {
+        matcher.n_fed += n;
+        return word;
+    }
+    for (size_t i = 0; i < n; i++) {
+        const unsigned char c = text[i];
+        int next;
+        while ((next = llama_stop_matcher_next(matcher.nodes[matcher.state], c)) < 0 && matcher.state != 0) {
+            matcher.state = matcher.nodes[matcher.state].fail;
+        }
+        matcher.state = next < 0 ? 0 : next;
+
+        const int w = matcher.nodes[matcher.state].word;
+        if (w >= 0) {
+            const size_t start = matcher.n_fed + i + 1 - matcher.words[w].size();
+            if (word < 0 || start < pos) {
+                word = w;
+                pos = start;
+            }
+        }
+    }
+    matcher.n_fed += n;
+    return word;
+}
+
+size_t llama_stop_matcher_partial(const llama_stop_matcher & matcher) {
+    return matcher.nodes.empty() ? 0 : matcher.nodes[matcher.state].depth;
+}
+
 void console_init(console_state & con_st) {
 #if defined(_WIN32)
     // Windows-specific console initialization
@@ -23,11 +23,15 @@ int32_t get_num_physical_cores();
 struct gpt_params {
     int32_t seed          = -1;  // RNG seed
     int32_t n_threads     = get_num_physical_cores();
+    int32_t n_spin        = 100000; // busy-wait iterations before an idle thread sleeps (-1 = never sleep)
     int32_t n_predict     = -1;  // new tokens to predict
     int32_t n_ctx         = 512; // context size
     int32_t n_batch       = 512; // batch size for prompt processing (must be >=32 to use BLAS)
     int32_t n_keep        = 0;   // number of tokens to keep from initial prompt
     int32_t n_gpu_layers  = 0;   // number of layers to store in VRAM
+    int32_t mmap_budget_mb = 0;  // MiB of the memory-mapped model kept resident (0 = no limit)
+    int32_t n_draft       = 8;   // number of tokens to draft for speculative decoding
+    int32_t n_lookup      = 0;   // longest n-gram of prompt lookup decoding, speculative decoding without a draft model (0 = disabled)
 
     // sampling parameters
     std::unordered_map<llama_token, float> logit_bias; // logit bias for specific tokens
@@ -46,16 +50,20 @@ struct gpt_params {
 
     std::string model             = "models/7B/ggml-model.bin"; // model path
     std::string model_alias       = "unknown"; // model alias
+    std::string model_draft       = "";  // draft model for speculative decoding (empty = disabled)
     std::string prompt            = "";
     std::string path_prompt_cache = "";  // path to file for saving/loading prompt eval state
     std::string input_prefix      = "";  // string to prefix user inputs with
     std::string input_suffix      = "";  // string to suffix user inputs with
     std::vector<std::string> antiprompt; // string upon seeing which more user input is prompted
+    std::string grammar           = "";  // grammar the generation must match (empty = unconstrained)
 
     std::string lora_adapter = "";  // lora adapter path
     std::string lora_base    = "";  // base model path for the lora adapter
 
     bool memory_f16        = true;  // use f16 instead of f32 for memory kv
+    llama_kv_type cache_type_k = LLAMA_KV_TYPE_DEFAULT; // data type of the K cache (default = as memory_f16)
+    llama_kv_type cache_type_v = LLAMA_KV_TYPE_DEFAULT; // data type of the V cache (default = as memory_f16)
     bool random_prompt     = false; // do not randomize prompt if none provided
     bool use_color         = false; // use color to distinguish generations and inputs
     bool interactive       = false; // interactive mode
@@ -70,12 +78,22 @@ struct gpt_params {
     bool perplexity        = false; // compute perplexity over the prompt
     bool use_mmap          = true;  // use mmap for faster loads
     bool use_mlock         = false; // use mlock to keep model in memory
+    bool repack            = false; // interleave the rows of the quantized weights at load time
+    bool direct_io         = false; // read the weights bypassing the page cache
+    bool hugepages         = false; // back the model and the context buffers with huge pages
+    llama_numa_strategy numa = LLAMA_NUMA_DISABLED; // placement of the memory on NUMA systems
     bool mem_test          = false; // compute maximum memory usage
     bool verbose_prompt    = false; // print prompt tokens before generation
 };
 
 bool gpt_params_parse(int argc, char ** argv, gpt_params & params);
 
+// parses the name of a KV cache type as in --cache-type-k, e.g. "q8_0"
+bool llama_kv_type_parse(const std::string & name, llama_kv_type & type);
+
+// parses the name of a NUMA strategy as in --numa, e.g. "interleave"
+bool llama_numa_parse(const std::string & name, llama_numa_strategy & numa);
+
 void gpt_print_usage(int argc, char ** argv, const gpt_params & params);
 
 std::string gpt_random_prompt(std::mt19937 & rng);
@@ -86,12 +104,85 @@ std::string gpt_random_prompt(std::mt19937 & rng);
 
 std::vector<llama_token> llama_tokenize(struct llama_context * ctx, const std::string & text, bool add_bos);
 
+// same as above, for long texts: the text is split and tokenized on n_threads threads
+std::vector<llama_token> llama_tokenize(struct llama_context * ctx, const std::string & text, bool add_bos, int n_threads);
+
 //
 // Model utils
 //
 
 struct llama_context * llama_init_from_gpt_params(const gpt_params & params);
 
+// loads params.model_draft with the context parameters of params
+struct llama_context * llama_init_draft_from_gpt_params(const gpt_params & params);
+
+//
+// Speculative decoding utils
+//
+
+// a token proposed by the draft model, with the probabilities it was sampled from (empty if it was greedy)
+struct llama_draft_token {
+    llama_token id;
+    std::vector<llama_token_data> candidates;
+};
+
+// Makes the draft model evaluate the tokens of sequence seq_id it has not seen yet, tokens[n_past..], and proposes the
+// next n_draft tokens with the sampling parameters of params (without the penalties)
+// n_past is the number of tokens of the sequence in the KV cache of ctx_draft, it is updated and counts all the drafted
+// tokens but the last one, only the part that turns out to match the sequence stays valid
+std::vector<llama_draft_token> llama_draft(struct llama_context * ctx_draft, llama_seq_id seq_id, const std::vector<llama_token> & tokens, int & n_past, int n_draft, const gpt_params & params);
+
+// selects the next token from the candidates of the model, accepting the draft token or replacing it as
+// llama_sample_token_speculative() does
+llama_token llama_sample_draft(struct llama_context * ctx, llama_token_data_array * candidates, llama_draft_token & draft);
+
+// same, with the random draws taken from rng instead of the RNG of ctx
+llama_token llama_sample_draft(struct llama_context * ctx, llama_token_data_array * candidates, llama_draft_token & draft, std::mt19937 & rng);
+
+// the n-grams of a text, e.g. the prompt, to draft its continuation when the generation copies from it
+struct llama_ngram_index {
+    int n = 0; // longest n-gram, the n-grams of 1 .. n tokens are indexed
+    std::vector<llama_token> tokens;
+    std::vector<std::unordered_map<uint64_t, int>> next; // next[k - 1]: hash of a k-gram -> position after its last occurrence
+};
+
+// indexes the tokens of text that are new to the index, text[index.tokens.size()..]
+void llama_ngram_index_update(llama_ngram_index & index, const std::vector<llama_token> & text);
+
+// proposes the up to n_draft tokens that follow the last occurrence in the index of the longest suffix of text of at
+// most index.n tokens, as certain draft tokens, none if not even the last token occurs
+std::vector<llama_draft_token> llama_draft_lookup(const llama_ngram_index & index, const std::vector<llama_token> & text, int n_draft);
+
+//
+// Stop strings
+//
+
+// an Aho-Corasick automaton over a set of stop strings, fed the generated text a piece at a time, finds the stop
+// strings in time linear in the bytes fed without looking at the previous text again
+struct llama_stop_matcher {
+    struct node {
+        std::vector<std::pair<unsigned char, int>> next;
+        int fail  = 0;  // the node of the longest proper suffix of this one that is in the automaton
+        int depth = 0;
+        int word  = -1; // the longest word that ends at this node, -1 if none
+    };
+
+    std::vector<std::string> words;
+    std::vector<node> nodes;
+    int    state = 0;
+    size_t n_fed = 0;
+};
+
+// builds the automaton of the non-empty words and resets it to the start of a text
+void llama_stop_matcher_init(llama_stop_matcher & matcher, const std::vector<std::string> & words);
+
+// feeds the next n bytes of the text, returns the index of the word that starts first among the ones that end in
+// these bytes and sets pos to its position in the text fed since init, -1 if no word ends in them
+int llama_stop_matcher_feed(llama_stop_matcher & matcher, const char * text, size_t n, size_t & pos);
+
+// the number of bytes at the end of the text fed so far that are the start of a word
+size_t llama_stop_matcher_partial(const llama_stop_matcher & matcher);
+
 //
 // Console utils
 //
@@ -0,0 +1,37 @@
+// Parser for grammars in an extended Backus-Naur form, producing the rules of llama_grammar_init()
+//
+// A grammar is a list of rules `name ::= definition`, the output must match the rule `root`. A definition is a
+// sequence of string literals "...", character ranges [a-z0-9_] and [^"\\], references to other rules and groups
+// (...), separated by | between alternates. The elements can be followed by the repetition operators *, + and ?.
+// Comments start with #. For example, a grammar for arithmetic:
+//
+//   root  ::= expr
+//   expr  ::= term ([-+*/] term)*
+//   term  ::= num | "(" space expr ")" space
+//   num   ::= [0-9]+ space
+//   space ::= [ \t\n]*
+
+#pragma once
+
+#include "llama.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace grammar_parser {
+    struct parse_state {
+        std::map<std::string, uint32_t>                 symbol_ids;
+        std::vector<std::vector<llama_grammar_element>> rules;
+
+        // the rules in the form expected by llama_grammar_init(), valid as long as the state
+        std::vector<const llama_grammar_element *> c_rules() const;
+    };
+
+    // parses a grammar, on error returns a state without rules and describes the problem in err
+    parse_state parse(const char * src, std::string & err);
+
+    void print_grammar(FILE * file, const parse_state & state);
+}
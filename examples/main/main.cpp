@@ -4,9 +4,11 @@
 #endif
 
 #include "common.h"
+#include "grammar-parser.h"
 #include "llama.h"
 #include "build-info.h"
 
+#include <algorithm>
 #include <cassert>
 #include <cinttypes>
 #include <cmath>
@@ -281,6 +283,59 @@ int main(int argc, char ** argv) {
     std::vector<llama_token> last_n_tokens(n_ctx);
     std::fill(last_n_tokens.begin(), last_n_tokens.end(), 0);
 
+    // token counts of the last repeat_last_n tokens for the penalties
+    const int n_penalty_window = params.repeat_last_n < 0 ? n_ctx : std::min(params.repeat_last_n, n_ctx);
+    llama_penalty_state * penalties = llama_penalty_state_init(llama_n_vocab(ctx), n_penalty_window);
+    for (int i = 0; i < n_penalty_window; i++) {
+        llama_penalty_state_push(penalties, last_n_tokens[n_ctx - n_penalty_window + i]);
+    }
+
+    grammar_parser::parse_state parsed_grammar;
+    llama_grammar * grammar = NULL;
+    if (!params.grammar.empty()) {
+        std::string err;
+        parsed_grammar = grammar_parser::parse(params.grammar.c_str(), err);
+        if (parsed_grammar.rules.empty()) {
+            fprintf(stderr, "%s: error: failed to parse grammar: %s\n", __func__, err.c_str());
+            return 1;
+        }
+        if (params.verbose_prompt) {
+            grammar_parser::print_grammar(stderr, parsed_grammar);
+        }
+        std::vector<const llama_grammar_element *> grammar_rules(parsed_grammar.c_rules());
+        grammar = llama_grammar_init(ctx, grammar_rules.data(), grammar_rules.size(), parsed_grammar.symbol_ids.at("root"));
+        if (grammar == NULL) {
+            fprintf(stderr, "%s: error: invalid grammar\n", __func__);
+            return 1;
+        }
+    }
+
+    // speculative decoding: the draft model proposes the next tokens, the model verifies them in one batch
+    llama_context * ctx_draft = NULL;
+    std::vector<llama_token> embd_draft; // the tokens in the KV cache of the model, for the draft model to catch up on
+    int n_past_draft = 0;                // the number of them in the KV cache of the draft model
+    if (!params.model_draft.empty()) {
+        ctx_draft = llama_init_draft_from_gpt_params(params);
+        if (ctx_draft == NULL) {
+            fprintf(stderr, "%s: error: unable to load draft model\n", __func__);
+            return 1;
+        }
+        if (llama_n_vocab(ctx_draft) != llama_n_vocab(ctx)) {
+            fprintf(stderr, "%s: error: the draft model has a different vocabulary\n", __func__);
+            return 1;
+        }
+    }
+
+    // prompt lookup decoding: the tokens that follow the longest generated n-gram that occurs in the prompt are the draft
+    llama_ngram_index lookup;
+    if (ctx_draft == NULL && params.n_lookup > 0) {
+        lookup.n = params.n_lookup;
+    }
+
+    if ((ctx_draft != NULL || lookup.n > 0) && params.mirostat != 0) {
+        fprintf(stderr, "%s: warning: speculative decoding is disabled with mirostat sampling\n", __func__);
+    }
+
     if (params.interactive) {
         const char *control_message;
         if (con_st.multiline_input) {
@@ -313,33 +368,169 @@ int main(int argc, char ** argv) {
     console_set_color(con_st, CONSOLE_COLOR_PROMPT);
 
     std::vector<llama_token> embd;
+    int n_embd_evaluated = 0; // leading tokens of embd already evaluated by speculative decoding
+
+    bool grammar_dead_end = false;
+
+    // samples the next token from a row of logits of the model and records it in the penalties and the grammar,
+    // draft is the token proposed by the draft model for this position, if any
+    auto sample_token = [&](float * logits, llama_draft_token * draft) -> llama_token {
+        const float   temp            = params.temp;
+        const int32_t top_k           = params.top_k <= 0 ? llama_n_vocab(ctx) : params.top_k;
+        const float   top_p           = params.top_p;
+        const float   tfs_z           = params.tfs_z;
+        const float   typical_p       = params.typical_p;
+        const float   repeat_penalty  = params.repeat_penalty;
+        const float   alpha_presence  = params.presence_penalty;
+        const float   alpha_frequency = params.frequency_penalty;
+        const int     mirostat        = params.mirostat;
+        const float   mirostat_tau    = params.mirostat_tau;
+        const float   mirostat_eta    = params.mirostat_eta;
+        const bool    penalize_nl     = params.penalize_nl;
+
+        const int n_vocab = llama_n_vocab(ctx);
+
+        llama_token id = 0;
+
+        // Apply params.logit_bias map
+        for (auto it = params.logit_bias.begin(); it != params.logit_bias.end(); it++) {
+            logits[it->first] += it->second;
+        }
+
+        // Apply penalties
+        float nl_logit = logits[llama_token_nl()];
+        llama_sample_penalties(ctx, logits, penalties, repeat_penalty, alpha_frequency, alpha_presence);
+        if (!penalize_nl) {
+            logits[llama_token_nl()] = nl_logit;
+        }
+
+        if (temp <= 0 || mirostat != 0 || grammar != NULL) {
+            std::vector<llama_token_data> candidates;
+            candidates.reserve(n_vocab);
+            for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
+                candidates.emplace_back(llama_token_data{token_id, logits[token_id], 0.0f});
+            }
+
+            llama_token_data_array candidates_p = { candidates.data(), candidates.size(), false };
+
+            if (grammar != NULL) {
+                llama_sample_grammar(ctx, &candidates_p, grammar);
+            }
+
+            if (temp <= 0) {
+                // Greedy sampling
+                if (draft != NULL) {
+                    llama_sample_top_k(ctx, &candidates_p, 1, 1);
+                    id = llama_sample_draft(ctx, &candidates_p, *draft);
+                } else {
+                    id = llama_sample_token_greedy(ctx, &candidates_p);
+                }
+            } else if (mirostat == 1) {
+                static float mirostat_mu = 2.0f * mirostat_tau;
+                const int mirostat_m = 100;
+                llama_sample_temperature(ctx, &candidates_p, temp);
+                id = llama_sample_token_mirostat(ctx, &candidates_p, mirostat_tau, mirostat_eta, mirostat_m, &mirostat_mu);
+            } else if (mirostat == 2) {
+                static float mirostat_mu = 2.0f * mirostat_tau;
+                llama_sample_temperature(ctx, &candidates_p, temp);
+                id = llama_sample_token_mirostat_v2(ctx, &candidates_p, mirostat_tau, mirostat_eta, &mirostat_mu);
+            } else {
+                // Temperature sampling in the order of llama_sample_chain
+                llama_sample_top_k(ctx, &candidates_p, top_k, 1);
+                llama_sample_tail_free(ctx, &candidates_p, tfs_z, 1);
+                llama_sample_typical(ctx, &candidates_p, typical_p, 1);
+                llama_sample_top_p(ctx, &candidates_p, top_p, 1);
+                llama_sample_temperature(ctx, &candidates_p, temp);
+                id = draft != NULL ? llama_sample_draft(ctx, &candidates_p, *draft) : llama_sample_token(ctx, &candidates_p);
+            }
+        } else {
+            // Temperature sampling
+            llama_token_data_array candidates_p = llama_sample_chain(ctx, logits, top_k, tfs_z, typical_p, top_p, temp);
+            id = draft != NULL ? llama_sample_draft(ctx, &candidates_p, *draft) : llama_sample_token(ctx, &candidates_p);
+        }
+
+        // the grammar cannot be continued, the generation ends there
+        if (grammar != NULL && !llama_grammar_accept_token(ctx, grammar, id)) {
+            id = llama_token_eos();
+            grammar_dead_end = true;
+        }
+
+        last_n_tokens.erase(last_n_tokens.begin());
+        last_n_tokens.push_back(id);
+        llama_penalty_state_push(penalties, id);
+
+        return id;
+    };
+
+    // the reverse prompts, fed the text of the output a token at a time
+    llama_stop_matcher antiprompt_matcher;
+    llama_stop_matcher_init(antiprompt_matcher, params.antiprompt);
+    bool antiprompt_found = false;
+
+    // checks if one of the reverse prompts ends in the text of a token of the output
+    // the reverse prompt might be tokenized with some following characters, so it does not need to end the text
+    auto feed_antiprompt = [&](llama_token id) {
+        const char * text = llama_token_to_str(ctx, id);
+        size_t pos;
+        antiprompt_found = llama_stop_matcher_feed(antiprompt_matcher, text, strlen(text), pos) >= 0;
+    };
+
+    // adds a sampled token to the output
+    auto push_token = [&](llama_token id) {
+        // replace end of text token with newline token when in interactive mode
+        if (id == llama_token_eos() && params.interactive && !params.instruct) {
+            id = llama_token_newline.front();
+            if (params.antiprompt.size() != 0) {
+                // tokenize and inject first reverse prompt
+                const auto first_antiprompt = ::llama_tokenize(ctx, params.antiprompt.front(), false);
+                embd_inp.insert(embd_inp.end(), first_antiprompt.begin(), first_antiprompt.end());
+            }
+        }
+
+        // add it to the context
+        embd.push_back(id);
+        feed_antiprompt(id);
+
+        // decrement remaining sampling budget
+        --n_remain;
+    };
 
     while ((n_remain != 0 && !is_antiprompt) || params.interactive) {
+        // the speculative decoding has evaluated all the generated tokens but the last one
+        embd.erase(embd.begin(), embd.begin() + n_embd_evaluated);
+        n_embd_evaluated = 0;
+
         // predict
         if (embd.size() > 0) {
-            // infinite text generation via context swapping
+            // infinite text generation via context shifting
             // if we run out of context:
-            // - take the n_keep first tokens from the original prompt (via n_past)
-            // - take half of the last (n_ctx - n_keep) tokens and recompute the logits in batches
+            // - keep the n_keep first tokens from the original prompt
+            // - discard half of the following tokens and shift the rest back in the KV cache, no re-evaluation needed
             if (n_past + (int) embd.size() > n_ctx) {
-                const int n_left = n_past - params.n_keep;
-
                 // always keep the first token - BOS
-                n_past = std::max(1, params.n_keep);
+                const int n_keep    = std::max(1, params.n_keep);
+                const int n_left    = n_past - n_keep;
+                const int n_discard = n_left/2;
+
+                llama_kv_cache_seq_rm   (ctx, 0, n_keep,             n_keep + n_discard);
+                llama_kv_cache_seq_shift(ctx, 0, n_keep + n_discard, n_past, -n_discard);
 
-                // insert n_left/2 tokens at the start of embd from last_n_tokens
-                embd.insert(embd.begin(), last_n_tokens.begin() + n_ctx - n_left/2 - embd.size(), last_n_tokens.end() - embd.size());
+                n_past -= n_discard;
+
+                if (ctx_draft != NULL) {
+                    llama_kv_cache_seq_rm   (ctx_draft, 0, n_keep,             n_keep + n_discard);
+                    llama_kv_cache_seq_shift(ctx_draft, 0, n_keep + n_discard, -1, -n_discard);
+
+                    n_past_draft -= std::max(0, std::min(n_past_draft - n_keep, n_discard));
+                    embd_draft.erase(embd_draft.begin() + n_keep, embd_draft.begin() + n_keep + n_discard);
+                }
 
                 // stop saving session if we run out of context
                 path_session.clear();
+            }
 
-                //printf("\n---\n");
-                //printf("resetting: '");
-                //for (int i = 0; i < (int) embd.size(); i++) {
-                //    printf("%s", llama_token_to_str(ctx, embd[i]));
-                //}
-                //printf("'\n");
-                //printf("\n---\n");
+            if (ctx_draft != NULL) {
+                embd_draft.insert(embd_draft.end(), embd.begin(), embd.end());
             }
 
             // try to reuse a matching prefix from the loaded session instead of re-eval (via n_past)
@@ -388,19 +579,6 @@ int main(int argc, char ** argv) {
 
         if ((int) embd_inp.size() <= n_consumed && !is_interacting) {
             // out of user input, sample next token
-            const float   temp            = params.temp;
-            const int32_t top_k           = params.top_k <= 0 ? llama_n_vocab(ctx) : params.top_k;
-            const float   top_p           = params.top_p;
-            const float   tfs_z           = params.tfs_z;
-            const float   typical_p       = params.typical_p;
-            const int32_t repeat_last_n   = params.repeat_last_n < 0 ? n_ctx : params.repeat_last_n;
-            const float   repeat_penalty  = params.repeat_penalty;
-            const float   alpha_presence  = params.presence_penalty;
-            const float   alpha_frequency = params.frequency_penalty;
-            const int     mirostat        = params.mirostat;
-            const float   mirostat_tau    = params.mirostat_tau;
-            const float   mirostat_eta    = params.mirostat_eta;
-            const bool    penalize_nl     = params.penalize_nl;
 
             // optionally save the session on first sample (for faster prompt loading next time)
             if (!path_session.empty() && need_to_save_session) {
@@ -408,91 +586,85 @@ int main(int argc, char ** argv) {
                 llama_save_session_file(ctx, path_session.c_str(), session_tokens.data(), session_tokens.size());
             }
 
-            llama_token id = 0;
+            const llama_token id = sample_token(llama_get_logits(ctx), NULL);
+            push_token(id);
 
-            {
-                auto logits  = llama_get_logits(ctx);
-                auto n_vocab = llama_n_vocab(ctx);
-
-                // Apply params.logit_bias map
-                for (auto it = params.logit_bias.begin(); it != params.logit_bias.end(); it++) {
-                    logits[it->first] += it->second;
+            // speculative decoding: id is evaluated together with the tokens drafted after it, the tokens up to the
+            // first one the model disagrees with are generated at once
+            int n_draft = std::min(params.n_draft, n_ctx - n_past - 1);
+            if (params.n_predict != -1) {
+                n_draft = std::min(n_draft, n_remain - 1);
+            }
+            std::vector<llama_draft_token> draft;
+            if (params.mirostat == 0 && id != llama_token_eos() && embd.back() == id && n_draft > 0) {
+                if (ctx_draft != NULL) {
+                    embd_draft.push_back(id);
+                    draft = llama_draft(ctx_draft, 0, embd_draft, n_past_draft, n_draft, params);
+                    embd_draft.pop_back();
+                } else if (lookup.n > 0) {
+                    llama_ngram_index_update(lookup, embd_inp);
+                    draft = llama_draft_lookup(lookup, last_n_tokens, n_draft);
+                }
+            }
+            if (!draft.empty()) {
+                if (ctx_draft != NULL) {
+                    embd_draft.push_back(id);
                 }
 
-                std::vector<llama_token_data> candidates;
-                candidates.reserve(n_vocab);
-                for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
-                    candidates.emplace_back(llama_token_data{token_id, logits[token_id], 0.0f});
+                std::vector<llama_token>  batch(1, id);
+                std::vector<int>          pos(1, n_past);
+                for (const auto & token : draft) {
+                    batch.push_back(token.id);
+                    pos.push_back(n_past + (int) pos.size());
                 }
+                std::vector<llama_seq_id> seq_id(batch.size(), 0);
 
-                llama_token_data_array candidates_p = { candidates.data(), candidates.size(), false };
-
-                // Apply penalties
-                float nl_logit = logits[llama_token_nl()];
-                auto last_n_repeat = std::min(std::min((int)last_n_tokens.size(), repeat_last_n), n_ctx);
-                llama_sample_repetition_penalty(ctx, &candidates_p,
-                    last_n_tokens.data() + last_n_tokens.size() - last_n_repeat,
-                    last_n_repeat, repeat_penalty);
-                llama_sample_frequency_and_presence_penalties(ctx, &candidates_p,
-                    last_n_tokens.data() + last_n_tokens.size() - last_n_repeat,
-                    last_n_repeat, alpha_frequency, alpha_presence);
-                if (!penalize_nl) {
-                    logits[llama_token_nl()] = nl_logit;
+                if (llama_eval_batch(ctx, batch.data(), pos.data(), seq_id.data(), (int) batch.size(), params.n_threads)) {
+                    fprintf(stderr, "%s : failed to eval\n", __func__);
+                    return 1;
                 }
+                n_past++;
 
-                if (temp <= 0) {
-                    // Greedy sampling
-                    id = llama_sample_token_greedy(ctx, &candidates_p);
-                } else {
-                    if (mirostat == 1) {
-                        static float mirostat_mu = 2.0f * mirostat_tau;
-                        const int mirostat_m = 100;
-                        llama_sample_temperature(ctx, &candidates_p, temp);
-                        id = llama_sample_token_mirostat(ctx, &candidates_p, mirostat_tau, mirostat_eta, mirostat_m, &mirostat_mu);
-                    } else if (mirostat == 2) {
-                        static float mirostat_mu = 2.0f * mirostat_tau;
-                        llama_sample_temperature(ctx, &candidates_p, temp);
-                        id = llama_sample_token_mirostat_v2(ctx, &candidates_p, mirostat_tau, mirostat_eta, &mirostat_mu);
-                    } else {
-                        // Temperature sampling
-                        llama_sample_top_k(ctx, &candidates_p, top_k, 1);
-                        llama_sample_tail_free(ctx, &candidates_p, tfs_z, 1);
-                        llama_sample_typical(ctx, &candidates_p, typical_p, 1);
-                        llama_sample_top_p(ctx, &candidates_p, top_p, 1);
-                        llama_sample_temperature(ctx, &candidates_p, temp);
-                        id = llama_sample_token(ctx, &candidates_p);
+                const int n_vocab = llama_n_vocab(ctx);
+                for (size_t i = 0; i < draft.size(); i++) {
+                    const llama_token id_next = sample_token(llama_get_logits(ctx) + i*n_vocab, &draft[i]);
+                    push_token(id_next);
+                    if (id_next != draft[i].id || id_next == llama_token_eos() || antiprompt_found) {
+                        break;
+                    }
+
+                    // accepted, the draft token is in the KV cache already
+                    if (ctx_draft != NULL) {
+                        embd_draft.push_back(id_next);
+                    }
+                    n_past++;
+
+                    if (i == draft.size() - 1) {
+                        push_token(sample_token(llama_get_logits(ctx) + (i + 1)*n_vocab, NULL));
                     }
                 }
-                // printf("`%d`", candidates_p.size);
 
-                last_n_tokens.erase(last_n_tokens.begin());
-                last_n_tokens.push_back(id);
-            }
+                // roll back the rejected draft tokens, the last generated token is evaluated next like any other
+                llama_kv_cache_seq_rm(ctx, 0, n_past, -1);
+                n_past_draft = std::min(n_past_draft, n_past);
 
-            // replace end of text token with newline token when in interactive mode
-            if (id == llama_token_eos() && params.interactive && !params.instruct) {
-                id = llama_token_newline.front();
-                if (params.antiprompt.size() != 0) {
-                    // tokenize and inject first reverse prompt
-                    const auto first_antiprompt = ::llama_tokenize(ctx, params.antiprompt.front(), false);
-                    embd_inp.insert(embd_inp.end(), first_antiprompt.begin(), first_antiprompt.end());
+                n_embd_evaluated = (int) embd.size() - 1;
+                if (!path_session.empty()) {
+                    session_tokens.insert(session_tokens.end(), embd.begin(), embd.end() - 1);
+                    n_session_consumed = session_tokens.size();
                 }
             }
 
-            // add it to the context
-            embd.push_back(id);
-
             // echo this to console
             input_echo = true;
-
-            // decrement remaining sampling budget
-            --n_remain;
         } else {
             // some user input remains from prompt or interaction, forward it to processing
             while ((int) embd_inp.size() > n_consumed) {
                 embd.push_back(embd_inp[n_consumed]);
                 last_n_tokens.erase(last_n_tokens.begin());
                 last_n_tokens.push_back(embd_inp[n_consumed]);
+                llama_penalty_state_push(penalties, embd_inp[n_consumed]);
+                feed_antiprompt(embd_inp[n_consumed]);
                 ++n_consumed;
                 if ((int) embd.size() >= params.n_batch) {
                     break;
@@ -517,30 +689,14 @@ int main(int argc, char ** argv) {
 
             // check for reverse prompt
             if (params.antiprompt.size()) {
-                std::string last_output;
-                for (auto id : last_n_tokens) {
-                    last_output += llama_token_to_str(ctx, id);
-                }
-
                 is_antiprompt = false;
-                // Check if each of the reverse prompts appears at the end of the output.
-                // If we're not running interactively, the reverse prompt might be tokenized with some following characters
-                // so we'll compensate for that by widening the search window a bit.
-                for (std::string & antiprompt : params.antiprompt) {
-                    size_t extra_padding = params.interactive ? 0 : 2;
-                    size_t search_start_pos = last_output.length() > static_cast<size_t>(antiprompt.length() + extra_padding)
-                        ? last_output.length() - static_cast<size_t>(antiprompt.length() + extra_padding)
-                        : 0;
-
-                    if (last_output.find(antiprompt.c_str(), search_start_pos) != std::string::npos) {
-                        if (params.interactive) {
-                            is_interacting = true;
-                            console_set_color(con_st, CONSOLE_COLOR_USER_INPUT);
-                        }
-                        is_antiprompt = true;
-                        fflush(stdout);
-                        break;
+                if (antiprompt_found) {
+                    if (params.interactive) {
+                        is_interacting = true;
+                        console_set_color(con_st, CONSOLE_COLOR_USER_INPUT);
                     }
+                    is_antiprompt = true;
+                    fflush(stdout);
                 }
             }
 
@@ -589,6 +745,13 @@ int main(int argc, char ** argv) {
                     }
 
                     n_remain -= line_inp.size();
+
+                    // the answer to the new input starts over from the root of the grammar
+                    if (grammar != NULL) {
+                        llama_grammar_free(grammar);
+                        std::vector<const llama_grammar_element *> grammar_rules(parsed_grammar.c_rules());
+                        grammar = llama_grammar_init(ctx, grammar_rules.data(), grammar_rules.size(), parsed_grammar.symbol_ids.at("root"));
+                    }
                 }
 
                 input_echo = false; // do not echo this again
@@ -599,6 +762,12 @@ int main(int argc, char ** argv) {
             }
         }
 
+        // no token can continue the grammar, also in interactive mode
+        if (grammar_dead_end) {
+            fprintf(stderr, " [end of grammar]\n");
+            break;
+        }
+
         // end of text token
         if (!embd.empty() && embd.back() == llama_token_eos()) {
             if (params.instruct) {
@@ -622,6 +791,13 @@ int main(int argc, char ** argv) {
     }
 
     llama_print_timings(ctx);
+    if (ctx_draft != NULL) {
+        llama_free(ctx_draft);
+    }
+    if (grammar != NULL) {
+        llama_grammar_free(grammar);
+    }
+    llama_penalty_state_free(penalties);
     llama_free(ctx);
 
     return 0;
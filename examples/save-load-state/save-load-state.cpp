@@ -28,6 +28,8 @@ int main(int argc, char ** argv) {
     lparams.n_ctx     = params.n_ctx;
     lparams.seed      = params.seed;
     lparams.f16_kv    = params.memory_f16;
+    lparams.type_k    = params.cache_type_k;
+    lparams.type_v    = params.cache_type_v;
     lparams.use_mmap  = params.use_mmap;
     lparams.use_mlock = params.use_mlock;
 
@@ -1,16 +1,26 @@
 #include "common.h"
+#include "grammar-parser.h"
 #include "llama.h"
 #include "build-info.h"
 
 #include "httplib.h"
 #include "json.hpp"
 
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <thread>
+
 struct server_params
 {
   std::string hostname = "127.0.0.1";
   int32_t port = 8080;
   int32_t read_timeout = 600;
   int32_t write_timeout = 600;
+  int32_t n_slots = 1;
+  int32_t prefix_cache_mb = 0;
   bool verbose = false;
 };
 
@@ -20,77 +30,258 @@ static size_t common_part(const std::vector<llama_token> & a, const std::vector<
   return i;
 }
 
-enum stop_type {
-    STOP_FULL,
-    STOP_PARTIAL,
+enum slot_state {
+    SLOT_IDLE,       // free, keeps the tokens of its last request in the KV cache
+    SLOT_PENDING,    // has a new request, waiting to be admitted by the scheduler
+    SLOT_PROCESSING, // evaluating its prompt or generating
+    SLOT_DONE,       // finished, waiting for the client to collect the result
 };
 
-bool ends_with(const std::string &str, const std::string &suffix)
+// a request being processed by the server, its tokens are sequence `id` in the KV cache
+struct llama_server_slot
 {
-    return str.size() >= suffix.size() &&
-           0 == str.compare(str.size() - suffix.size(), suffix.size(), suffix);
-}
+  int id = 0;
+  slot_state state = SLOT_IDLE;
+  int task_id = 0; // request the slot was last handed, a release of an older request is ignored
+  bool released = false;
 
-size_t find_partial_stop_string(const std::string &stop, const std::string &text)
-{
-    if (!text.empty()) {
-        const char text_last_char = text.back();
-        for (int64_t char_index = stop.size() - 1; char_index >= 0; char_index--) {
-            if (stop[char_index] == text_last_char) {
-                const std::string current_partial = stop.substr(0, char_index + 1);
-                if (ends_with(text, current_partial)) {
-                    return text.size() - char_index - 1;
-                }
-            }
-        }
-    }
-    return std::string::npos;
-}
-
-struct llama_server_context
-{
+  gpt_params params;
   bool stream = false;
+
   bool has_next_token = false;
+  bool cancelled = false;
   std::string generated_text = "";
+  std::string pending_text = ""; // streamed text not yet sent to the client
 
   size_t num_tokens_predicted = 0;
   size_t n_past = 0;
-  size_t n_consumed = 0;
-  size_t n_session_consumed = 0;
   size_t n_remain = 0;
+  int i_batch = -1;   // index of the logits of the slot in the current batch, -1 if there is nothing to sample
+
+  int n_past_draft = 0; // number of tokens of the slot in the KV cache of the draft model
+  std::vector<llama_draft_token> draft; // tokens proposed by the draft model, evaluated after the last token
+  llama_ngram_index lookup; // the prompt, for prompt lookup decoding
+
+  size_t sent_count = 0;
+  llama_detokenizer * detok = nullptr; // holds back the first bytes of the characters split across tokens
+  llama_stop_matcher stop; // the stop strings of the request, fed the generated text
 
   std::vector<llama_token> embd;
   std::vector<llama_token> last_n_tokens;
+  llama_penalty_state * penalties = nullptr; // counts of the last repeat_last_n tokens
+  llama_grammar * grammar = nullptr; // constrains the generation, null if the request has no grammar
+
+  std::mt19937 rng;
+  float mirostat_mu = 0.0f;
+
+  std::string stopping_word;
+};
+
+// a node of the prefix cache, holds the KV data of the tokens of the edge from its parent
+struct prefix_cache_node
+{
+  std::vector<llama_token> tokens;
+  std::vector<uint8_t> data;
+  std::map<llama_token, std::unique_ptr<prefix_cache_node>> children; // by the first token of their edge
+  prefix_cache_node * parent = nullptr;
+  uint64_t last_used = 0;
+};
+
+// a radix tree over the evaluated prompts, a new prompt restores the KV data of its longest cached
+// prefix instead of evaluating it, the least recently used leaves are evicted above the memory budget
+struct prefix_cache
+{
+  prefix_cache_node root;
+  size_t budget = 0; // bytes of KV data, 0 disables the cache
+  size_t size = 0;
+  size_t token_size = 0;
+  uint64_t clock = 0;
+
+  // walk the longest cached prefix of the first n tokens, as the nodes and the number of tokens used of each
+  size_t match(const std::vector<llama_token> &tokens, size_t n, std::vector<std::pair<prefix_cache_node *, size_t>> &path)
+  {
+    clock++;
+    size_t n_match = 0;
+    prefix_cache_node * node = &root;
+    while (n_match < n) {
+      auto it = node->children.find(tokens[n_match]);
+      if (it == node->children.end()) {
+        break;
+      }
+      prefix_cache_node * child = it->second.get();
+      size_t k = 0;
+      while (k < child->tokens.size() && n_match + k < n && child->tokens[k] == tokens[n_match + k]) {
+        k++;
+      }
+      child->last_used = clock;
+      path.emplace_back(child, k);
+      n_match += k;
+      if (k < child->tokens.size()) {
+        break;
+      }
+      node = child;
+    }
+    return n_match;
+  }
+
+  // restore the cached prefix of the prompt that sequence seq_id does not hold yet, returns the new n_past
+  size_t restore(llama_context *ctx, llama_seq_id seq_id, const std::vector<llama_token> &prompt, size_t n_past)
+  {
+    if (budget == 0 || prompt.empty()) {
+      return n_past;
+    }
+
+    // we have to evaluate at least 1 token to generate logits
+    std::vector<std::pair<prefix_cache_node *, size_t>> path;
+    match(prompt, prompt.size() - 1, path);
+
+    size_t p0 = 0;
+    for (const auto & step : path) {
+      const size_t p1 = p0 + step.second;
+      if (p1 > n_past) {
+        const size_t i0 = std::max(p0, n_past);
+        if (!llama_set_seq_data(ctx, seq_id, i0, p1 - i0, step.first->data.data() + (i0 - p0)*token_size)) {
+          break;
+        }
+        n_past = p1;
+      }
+      p0 = p1;
+    }
+
+    return n_past;
+  }
+
+  // add the evaluated prompt of sequence seq_id
+  void insert(llama_context *ctx, llama_seq_id seq_id, const std::vector<llama_token> &prompt)
+  {
+    if (budget == 0) {
+      return;
+    }
+
+    std::vector<std::pair<prefix_cache_node *, size_t>> path;
+    size_t n_match = match(prompt, prompt.size(), path);
+
+    prefix_cache_node * node = &root;
+    if (!path.empty()) {
+      node = path.back().first;
+      const size_t k = path.back().second;
+      if (k < node->tokens.size()) {
+        // split the edge where the prompt diverges
+        std::unique_ptr<prefix_cache_node> mid(new prefix_cache_node);
+        mid->tokens.assign(node->tokens.begin(), node->tokens.begin() + k);
+        mid->data.assign(node->data.begin(), node->data.begin() + k*token_size);
+        mid->parent = node->parent;
+        mid->last_used = clock;
+
+        node->tokens.erase(node->tokens.begin(), node->tokens.begin() + k);
+        node->data.erase(node->data.begin(), node->data.begin() + k*token_size);
+
+        auto & slot = node->parent->children[mid->tokens[0]];
+        mid->children[node->tokens[0]] = std::move(slot);
+        node->parent = mid.get();
+        slot = std::move(mid);
+        node = node->parent;
+      }
+    }
 
+    const size_t n_new = prompt.size() - n_match;
+    if (n_new > 0 && n_new*token_size <= budget) {
+      std::unique_ptr<prefix_cache_node> leaf(new prefix_cache_node);
+      leaf->tokens.assign(prompt.begin() + n_match, prompt.end());
+      leaf->data.resize(n_new*token_size);
+      if (llama_copy_seq_data(ctx, seq_id, n_match, prompt.size(), leaf->data.data())) {
+        leaf->parent = node;
+        leaf->last_used = clock;
+        size += leaf->data.size();
+        node->children[leaf->tokens[0]] = std::move(leaf);
+      }
+    }
+
+    while (size > budget && evict()) {}
+  }
+
+  // remove the least recently used leaf, the nodes on the path to a leaf are never used after it
+  bool evict()
+  {
+    prefix_cache_node * lru = nullptr;
+    std::vector<prefix_cache_node *> stack(1, &root);
+    while (!stack.empty()) {
+      prefix_cache_node * node = stack.back();
+      stack.pop_back();
+      if (node->children.empty() && node != &root && (lru == nullptr || node->last_used < lru->last_used)) {
+        lru = node;
+      }
+      for (auto & child : node->children) {
+        stack.push_back(child.second.get());
+      }
+    }
+    if (lru == nullptr) {
+      return false;
+    }
+    size -= lru->data.size();
+    lru->parent->children.erase(lru->tokens[0]);
+    return true;
+  }
+};
+
+struct llama_server_context
+{
   llama_context *ctx = nullptr;
+  llama_context *ctx_draft = nullptr; // speculative decoding, same sequences as ctx
   gpt_params params;
 
-  std::string stopping_word;
+  std::vector<llama_server_slot> slots;
+  int n_ctx_slot = 0; // context size available to each slot
+
+  // only used by the scheduler thread
+  prefix_cache prefixes;
+
+  // guards the state of the slots, ctx is only used by the scheduler thread
+  std::mutex mutex;
+  std::condition_variable cv_tasks;
+  std::condition_variable cv_results;
+
+  // serializes the evaluations of the scheduler with the /embedding requests
+  std::mutex eval_mutex;
+
+  std::thread scheduler;
+  bool running = false;
+
+  int n_tasks = 0; // requests handed to the slots so far
 
   bool verbose = false;
   int json_indent = -1;
 
   ~llama_server_context()
   {
+      if (scheduler.joinable()) {
+          {
+              std::unique_lock<std::mutex> lock(mutex);
+              running = false;
+          }
+          cv_tasks.notify_all();
+          scheduler.join();
+      }
+      for (auto & slot : slots) {
+          llama_penalty_state_free(slot.penalties);
+          if (slot.detok) {
+              llama_detokenizer_free(slot.detok);
+          }
+          if (slot.grammar) {
+              llama_grammar_free(slot.grammar);
+          }
+      }
+      if (ctx_draft) {
+          llama_free(ctx_draft);
+          ctx_draft = nullptr;
+      }
       if (ctx) {
           llama_free(ctx);
           ctx = nullptr;
       }
   }
 
-  void rewind() {
-    params.antiprompt.clear();
-    num_tokens_predicted = 0;
-    generated_text = "";
-    generated_text.reserve(params.n_ctx);
-    stopping_word = "";
-
-    n_remain = 0;
-    n_past = 0;
-    n_consumed = 0;
-  }
-
-  bool loadModel(const gpt_params &params_)
+  bool loadModel(const gpt_params &params_, int n_slots, size_t prefix_cache_size)
   {
     params = params_;
     ctx = llama_init_from_gpt_params(params);
@@ -100,89 +291,403 @@ struct llama_server_context
       return false;
     }
 
-    last_n_tokens.resize(params.n_ctx);
-    std::fill(last_n_tokens.begin(), last_n_tokens.end(), 0);
+    if (!params.model_draft.empty())
+    {
+      ctx_draft = llama_init_draft_from_gpt_params(params);
+      if (ctx_draft == NULL)
+      {
+        fprintf(stderr, "%s: error: unable to load draft model\n", __func__);
+        return false;
+      }
+      if (llama_n_vocab(ctx_draft) != llama_n_vocab(ctx))
+      {
+        fprintf(stderr, "%s: error: the draft model has a different vocabulary\n", __func__);
+        return false;
+      }
+    }
+
+    n_ctx_slot = params.n_ctx / n_slots;
+
+    prefixes.budget = prefix_cache_size;
+    prefixes.token_size = llama_get_seq_data_size(ctx, 1);
+
+    slots.resize(n_slots);
+    for (int i = 0; i < n_slots; i++) {
+      slots[i].id = i;
+    }
+
+    running = true;
+    scheduler = std::thread([this] {
+      while (updateSlots()) {}
+    });
     return true;
   }
 
-  bool loadPrompt() {
-    params.prompt.insert(0, 1, ' '); // always add a first space
-    std::vector<llama_token> prompt_tokens = ::llama_tokenize(ctx, params.prompt, true);
+  // wait for an idle slot, preferring the one whose cached tokens share the longest prefix with the
+  // prompt, and hand it the request
+  llama_server_slot * launchSlot(const llama_server_slot &request)
+  {
+    std::string prompt = request.params.prompt;
+    prompt.insert(0, 1, ' '); // always add a first space
+    std::vector<llama_token> prompt_tokens = ::llama_tokenize(ctx, prompt, true);
+
+    std::unique_lock<std::mutex> lock(mutex);
+
+    llama_server_slot * slot = nullptr;
+    cv_results.wait(lock, [&] {
+      size_t n_best = 0;
+      for (auto & s : slots) {
+        if (s.state != SLOT_IDLE) {
+          continue;
+        }
+        const size_t n_common = std::min(s.n_past, common_part(s.embd, prompt_tokens));
+        if (slot == nullptr || n_common > n_best) {
+          slot = &s;
+          n_best = n_common;
+        }
+      }
+      return slot != nullptr;
+    });
+
+    slot->params = request.params;
+    slot->stream = request.stream;
+
+    // the slot takes over the grammar of the request
+    if (slot->grammar) {
+      llama_grammar_free(slot->grammar);
+    }
+    slot->grammar = request.grammar;
+
+    slot->num_tokens_predicted = 0;
+    slot->generated_text = "";
+    slot->generated_text.reserve(n_ctx_slot);
+    slot->pending_text = "";
+    slot->stopping_word = "";
+    slot->sent_count = 0;
+    if (slot->detok) {
+      llama_detokenizer_free(slot->detok);
+    }
+    slot->detok = llama_detokenizer_init();
+    llama_stop_matcher_init(slot->stop, slot->params.antiprompt);
+    slot->cancelled = false;
+    slot->task_id = ++n_tasks;
+    slot->released = false;
+
+    loadPrompt(*slot, prompt_tokens);
+
+    slot->n_remain = slot->params.n_predict;
+    slot->rng.seed(slot->params.seed);
+    slot->mirostat_mu = 2.0f * slot->params.mirostat_tau;
+
+    slot->state = SLOT_PENDING;
+    cv_tasks.notify_one();
+
+    return slot;
+  }
+
+  // the client is gone or has collected the result, only the first release of a request has an effect
+  void releaseSlot(llama_server_slot &slot, int task_id)
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (slot.task_id != task_id || slot.released) {
+      return;
+    }
+    slot.released = true;
+    if (slot.state == SLOT_DONE) {
+      slot.state = SLOT_IDLE;
+      cv_results.notify_all();
+    } else if (slot.state != SLOT_IDLE) {
+      slot.cancelled = true;
+      cv_tasks.notify_one();
+    }
+  }
+
+  // wait for new output of the slot, returns false once the slot is done
+  bool nextResult(llama_server_slot &slot, std::string &text)
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    cv_results.wait(lock, [&] {
+      return !slot.pending_text.empty() || slot.state == SLOT_DONE;
+    });
+    text = std::move(slot.pending_text);
+    slot.pending_text.clear();
+    return slot.state != SLOT_DONE;
+  }
+
+  void loadPrompt(llama_server_slot &slot, std::vector<llama_token> prompt_tokens) {
+    gpt_params &params = slot.params;
+
+    slot.last_n_tokens.resize(n_ctx_slot);
 
     if (params.n_keep < 0) {
       params.n_keep = (int)prompt_tokens.size();
     }
-    params.n_keep = std::min(params.n_ctx - 4, params.n_keep);
+    params.n_keep = std::min(n_ctx_slot - 4, params.n_keep);
 
     // if input prompt is too big, truncate like normal
-    if (prompt_tokens.size() >= (size_t)params.n_ctx) {
-      const int n_left = (params.n_ctx - params.n_keep)/2;
-      std::vector<llama_token> new_tokens(prompt_tokens.begin(), prompt_tokens.begin() + params.n_keep);
+    if (prompt_tokens.size() >= (size_t)n_ctx_slot) {
+      // always keep the BOS token
+      const int n_keep = std::max(1, params.n_keep);
+      const int n_left = (n_ctx_slot - n_keep)/2;
+      std::vector<llama_token> new_tokens(prompt_tokens.begin(), prompt_tokens.begin() + n_keep);
       new_tokens.insert(new_tokens.end(), prompt_tokens.end() - n_left, prompt_tokens.end());
-      std::copy(prompt_tokens.end() - params.n_ctx, prompt_tokens.end(), last_n_tokens.begin());
+      std::copy(prompt_tokens.end() - n_ctx_slot, prompt_tokens.end(), slot.last_n_tokens.begin());
       prompt_tokens = new_tokens;
     } else {
       size_t ps = prompt_tokens.size();
-      std::fill(last_n_tokens.begin(), last_n_tokens.end() - ps, 0);
-      std::copy(prompt_tokens.begin(), prompt_tokens.end(), last_n_tokens.end() - ps);
+      std::fill(slot.last_n_tokens.begin(), slot.last_n_tokens.end() - ps, 0);
+      std::copy(prompt_tokens.begin(), prompt_tokens.end(), slot.last_n_tokens.end() - ps);
+    }
+
+    const int n_penalty_window = params.repeat_last_n < 0 ? n_ctx_slot : std::min(params.repeat_last_n, n_ctx_slot);
+    llama_penalty_state_free(slot.penalties);
+    slot.penalties = llama_penalty_state_init(llama_n_vocab(ctx), n_penalty_window);
+    for (int i = 0; i < n_penalty_window; i++) {
+      llama_penalty_state_push(slot.penalties, slot.last_n_tokens[n_ctx_slot - n_penalty_window + i]);
     }
 
     // compare the evaluated prompt with the new prompt
-    n_past = common_part(embd, prompt_tokens);
-    embd = prompt_tokens;
-    if (n_past == prompt_tokens.size()) {
+    slot.n_past = std::min(slot.n_past, common_part(slot.embd, prompt_tokens));
+    slot.n_past_draft = std::min((size_t) slot.n_past_draft, common_part(slot.embd, prompt_tokens));
+    slot.embd = prompt_tokens;
+    slot.lookup = llama_ngram_index();
+    slot.lookup.n = ctx_draft ? 0 : this->params.n_lookup;
+    llama_ngram_index_update(slot.lookup, prompt_tokens);
+    if (slot.n_past == prompt_tokens.size()) {
       // we have to evaluate at least 1 token to generate logits.
-      n_past--;
+      slot.n_past--;
     }
-    has_next_token = true;
-    return true;
+    slot.has_next_token = true;
   }
 
-  void beginCompletion()
+  // one step of the scheduler: admit the new requests, evaluate one batch made of the next token of
+  // every generating slot and as much prompt as fits, then sample the slots that reached their last token
+  bool updateSlots()
   {
-    // number of tokens to keep when resetting context
+    std::vector<llama_token> tokens;
+    std::vector<int> pos;
+    std::vector<llama_seq_id> seq_id;
+    std::vector<std::pair<llama_server_slot *, int>> drafting; // slots to draft for, with the number of tokens
 
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      cv_tasks.wait(lock, [&] {
+        if (!running) {
+          return true;
+        }
+        for (const auto & slot : slots) {
+          if (slot.state == SLOT_PENDING || slot.state == SLOT_PROCESSING || slot.cancelled) {
+            return true;
+          }
+        }
+        return false;
+      });
 
-    n_remain = params.n_predict;
-    llama_set_rng_seed(ctx, params.seed);
-  }
+      if (!running) {
+        return false;
+      }
+
+      for (auto & slot : slots) {
+        if (slot.cancelled) {
+          if (verbose) {
+            fprintf(stderr, "slot %d: request cancelled\n", slot.id);
+          }
+          slot.cancelled = false;
+          slot.state = SLOT_IDLE;
+          cv_results.notify_all();
+          continue;
+        }
+
+        if (slot.state == SLOT_PENDING) {
+          // drop the cached tokens that differ from the new prompt
+          llama_kv_cache_seq_rm(ctx, slot.id, slot.n_past, -1);
+
+          const size_t n_past = slot.n_past;
+          slot.n_past = prefixes.restore(ctx, slot.id, slot.embd, n_past);
+          if (verbose && slot.n_past > n_past) {
+            fprintf(stderr, "slot %d: restored %zu prompt tokens from the prefix cache\n", slot.id, slot.n_past - n_past);
+          }
+
+          slot.state = SLOT_PROCESSING;
+        }
 
-  llama_token nextToken() {
-    llama_token result = -1;
+        if (slot.state == SLOT_PROCESSING && slot.embd.size() >= (size_t)n_ctx_slot) {
+          // Shift context, always keeping the BOS token: the oldest half of the tokens
+          // after n_keep is discarded and the rest is moved back without re-evaluation
+          const int n_keep    = std::max(1, slot.params.n_keep);
+          const int n_left    = slot.n_past - n_keep;
+          const int n_discard = n_left/2;
 
-    if (embd.size() >= (size_t)params.n_ctx) {
-      // Reset context
-      const int n_left = (params.n_ctx - params.n_keep)/2;
+          llama_kv_cache_seq_rm   (ctx, slot.id, n_keep,             n_keep + n_discard);
+          llama_kv_cache_seq_shift(ctx, slot.id, n_keep + n_discard, slot.n_past, -n_discard);
+
+          if (ctx_draft) {
+            llama_kv_cache_seq_rm   (ctx_draft, slot.id, n_keep,             n_keep + n_discard);
+            llama_kv_cache_seq_shift(ctx_draft, slot.id, n_keep + n_discard, -1, -n_discard);
+
+            slot.n_past_draft -= std::max(0, std::min(slot.n_past_draft - n_keep, n_discard));
+          }
 
-      std::vector<llama_token> new_tokens(embd.begin(), embd.begin() + params.n_keep);
-      new_tokens.insert(new_tokens.end(), embd.end() - n_left, embd.end());
-      embd = new_tokens;
-      n_past = params.n_keep;
+          slot.embd.erase(slot.embd.begin() + n_keep, slot.embd.begin() + n_keep + n_discard);
+          slot.n_past -= n_discard;
+        }
+
+        slot.i_batch = -1;
+        slot.draft.clear();
+
+        // speculative decoding: a generating slot evaluates the tokens proposed by the draft model, or found in the
+        // prompt, together with its last token, and keeps those that match what it samples
+        if ((ctx_draft || slot.lookup.n > 0) && slot.state == SLOT_PROCESSING && slot.embd.size() - slot.n_past == 1 && slot.params.mirostat == 0) {
+          int n_draft = std::min(params.n_draft, n_ctx_slot - (int) slot.embd.size() - 1);
+          if (slot.params.n_predict != -1) {
+            n_draft = std::min(n_draft, (int) slot.n_remain - 1);
+          }
+          if (n_draft > 0) {
+            drafting.emplace_back(&slot, n_draft);
+          }
+        }
+      }
+    }
+
+    // the draft model runs without the lock, ctx_draft and the tokens of a processing slot belong to the scheduler
+    for (const auto & d : drafting) {
+      llama_server_slot & slot = *d.first;
+      if (ctx_draft) {
+        slot.draft = llama_draft(ctx_draft, slot.id, slot.embd, slot.n_past_draft, d.second, slot.params);
+      } else {
+        slot.draft = llama_draft_lookup(slot.lookup, slot.embd, d.second);
+      }
     }
 
-    while (n_past < embd.size())
     {
-      int n_eval = (int)embd.size() - n_past;
-      if (n_eval > params.n_batch)
-      {
-        n_eval = params.n_batch;
+      std::unique_lock<std::mutex> lock(mutex);
+
+      // the generating slots go first so that a long prompt never stalls them
+      const size_t n_batch = std::max(params.n_batch, (int)slots.size());
+      for (int prefill = 0; prefill < 2; prefill++) {
+        for (auto & slot : slots) {
+          if (slot.state != SLOT_PROCESSING) {
+            continue;
+          }
+
+          const size_t n_pending = slot.embd.size() - slot.n_past;
+          if ((n_pending == 1) == (prefill == 1)) {
+            continue;
+          }
+
+          const size_t n_eval = std::min(n_pending, n_batch - tokens.size());
+          for (size_t i = 0; i < n_eval; i++) {
+            tokens.push_back(slot.embd[slot.n_past + i]);
+            pos.push_back(slot.n_past + i);
+            seq_id.push_back(slot.id);
+          }
+          if (n_eval > 0 && n_eval == n_pending) {
+            slot.i_batch = (int)tokens.size() - 1;
+          }
+
+          // the draft tokens follow the last token, as many as fit in the batch
+          if (n_eval > 0) {
+            slot.draft.resize(std::min(slot.draft.size(), n_batch - tokens.size()));
+          } else {
+            slot.draft.clear();
+          }
+          for (size_t i = 0; i < slot.draft.size(); i++) {
+            tokens.push_back(slot.draft[i].id);
+            pos.push_back(slot.n_past + 1 + i);
+            seq_id.push_back(slot.id);
+          }
+        }
       }
-      if (llama_eval(ctx, &embd[n_past], n_eval, n_past, params.n_threads))
-      {
+    }
+
+    if (tokens.empty()) {
+      return true;
+    }
+
+    std::unique_lock<std::mutex> eval_lock(eval_mutex);
+    bool finished = false;
+
+    // evaluate the batch, splitting it if the KV cache is too fragmented to hold it in one piece
+    size_t n_chunk = tokens.size();
+    for (size_t i = 0; i < tokens.size(); ) {
+      const size_t n_tokens = std::min(n_chunk, tokens.size() - i);
+
+      if (llama_eval_batch(ctx, &tokens[i], &pos[i], &seq_id[i], n_tokens, params.n_threads)) {
+        if (n_chunk > 1) {
+          n_chunk /= 2;
+          continue;
+        }
+
         fprintf(stderr, "%s : failed to eval\n", __func__);
-        has_next_token = false;
-        return result;
+
+        std::unique_lock<std::mutex> lock(mutex);
+        for (auto & slot : slots) {
+          if (slot.state == SLOT_PROCESSING) {
+            slot.has_next_token = false;
+            slot.state = SLOT_DONE;
+          }
+        }
+        cv_results.notify_all();
+        return true;
+      }
+
+      std::unique_lock<std::mutex> lock(mutex);
+      for (size_t k = i; k < i + n_tokens; k++) {
+        slots[seq_id[k]].n_past++;
       }
-      n_past += n_eval;
+      for (auto & slot : slots) {
+        if (slot.i_batch >= (int)i && slot.i_batch < (int)(i + n_tokens)) {
+          if (slot.num_tokens_predicted == 0) {
+            // the prompt is evaluated, share it with the next requests
+            prefixes.insert(ctx, slot.id, slot.embd);
+          }
+
+          // the draft tokens are only verified if their logits are in the same chunk
+          const size_t n_draft = slot.i_batch + slot.draft.size() < i + n_tokens ? slot.draft.size() : 0;
+          for (size_t k = 0; k <= n_draft; k++) {
+            llama_draft_token * draft = k < n_draft ? &slot.draft[k] : nullptr;
+            const llama_token id = sampleToken(slot, llama_get_logits(ctx) + (slot.i_batch - i + k)*llama_n_vocab(ctx), draft);
+            processToken(slot, id);
+            if (draft == nullptr || id != draft->id || !slot.has_next_token) {
+              break;
+            }
+          }
+          finished = finished || slot.state == SLOT_DONE;
+        }
+      }
+      cv_results.notify_all();
+
+      i += n_tokens;
     }
 
-    // out of user input, sample next token
+    // roll back the rejected draft tokens, the last sampled token is evaluated next like any other
+    std::unique_lock<std::mutex> lock(mutex);
+    for (auto & slot : slots) {
+      if (!slot.draft.empty()) {
+        slot.n_past = std::min(slot.n_past, slot.embd.size() - 1);
+        llama_kv_cache_seq_rm(ctx, slot.id, slot.n_past, -1);
+        slot.n_past_draft = std::min(slot.n_past_draft, (int) slot.n_past);
+      }
+    }
+    lock.unlock();
+
+    // the timings are only read here, between two evaluations of ctx
+    if (finished) {
+      llama_print_timings(ctx);
+    }
+
+    return true;
+  }
+
+  // draft is the token proposed by the draft model for this position, if any
+  llama_token sampleToken(llama_server_slot &slot, float * logits, llama_draft_token * draft = nullptr) {
+    const gpt_params &params = slot.params;
+
     const float temp = params.temp;
     const int32_t top_k = params.top_k <= 0 ? llama_n_vocab(ctx) : params.top_k;
     const float top_p = params.top_p;
     const float tfs_z = params.tfs_z;
     const float typical_p = params.typical_p;
-    const int32_t repeat_last_n = params.repeat_last_n < 0 ? params.n_ctx : params.repeat_last_n;
     const float repeat_penalty = params.repeat_penalty;
     const float alpha_presence = params.presence_penalty;
     const float alpha_frequency = params.frequency_penalty;
@@ -192,7 +697,6 @@ struct llama_server_context
     const bool penalize_nl = params.penalize_nl;
     llama_token id = 0;
     {
-      auto *logits = llama_get_logits(ctx);
       auto n_vocab = llama_n_vocab(ctx);
 
       // Apply params.logit_bias map
@@ -201,122 +705,147 @@ struct llama_server_context
         logits[it->first] += it->second;
       }
 
-      std::vector<llama_token_data> candidates;
-      candidates.reserve(n_vocab);
-      for (llama_token token_id = 0; token_id < n_vocab; token_id++)
-      {
-        candidates.emplace_back(llama_token_data{token_id, logits[token_id], 0.0f});
-      }
-
-      llama_token_data_array candidates_p = {candidates.data(), candidates.size(), false};
-
       // Apply penalties
       float nl_logit = logits[llama_token_nl()];
-      auto last_n_repeat = std::min(std::min((int)last_n_tokens.size(), repeat_last_n), params.n_ctx);
-      llama_sample_repetition_penalty(ctx, &candidates_p,
-                                      last_n_tokens.data() + last_n_tokens.size() - last_n_repeat,
-                                      last_n_repeat, repeat_penalty);
-      llama_sample_frequency_and_presence_penalties(ctx, &candidates_p,
-                                                    last_n_tokens.data() + last_n_tokens.size() - last_n_repeat,
-                                                    last_n_repeat, alpha_frequency, alpha_presence);
+      llama_sample_penalties(ctx, logits, slot.penalties, repeat_penalty, alpha_frequency, alpha_presence);
       if (!penalize_nl)
       {
         logits[llama_token_nl()] = nl_logit;
       }
 
-      if (temp <= 0)
-      {
-        // Greedy sampling
-        id = llama_sample_token_greedy(ctx, &candidates_p);
-      }
-      else
+      if (temp <= 0 || mirostat != 0 || slot.grammar)
       {
-        if (mirostat == 1)
+        std::vector<llama_token_data> candidates;
+        candidates.reserve(n_vocab);
+        for (llama_token token_id = 0; token_id < n_vocab; token_id++)
+        {
+          candidates.emplace_back(llama_token_data{token_id, logits[token_id], 0.0f});
+        }
+
+        llama_token_data_array candidates_p = {candidates.data(), candidates.size(), false};
+
+        if (slot.grammar)
+        {
+          llama_sample_grammar(ctx, &candidates_p, slot.grammar);
+        }
+
+        if (temp <= 0)
+        {
+          // Greedy sampling
+          if (draft)
+          {
+            llama_sample_top_k(ctx, &candidates_p, 1, 1);
+            id = llama_sample_draft(ctx, &candidates_p, *draft, slot.rng);
+          }
+          else
+          {
+            id = llama_sample_token_greedy(ctx, &candidates_p);
+          }
+        }
+        else if (mirostat == 1)
         {
-          static float mirostat_mu = 2.0f * mirostat_tau;
           const int mirostat_m = 100;
           llama_sample_temperature(ctx, &candidates_p, temp);
-          id = llama_sample_token_mirostat(ctx, &candidates_p, mirostat_tau, mirostat_eta, mirostat_m, &mirostat_mu);
+          id = llama_sample_token_mirostat(ctx, &candidates_p, mirostat_tau, mirostat_eta, mirostat_m, &slot.mirostat_mu);
         }
         else if (mirostat == 2)
         {
-          static float mirostat_mu = 2.0f * mirostat_tau;
           llama_sample_temperature(ctx, &candidates_p, temp);
-          id = llama_sample_token_mirostat_v2(ctx, &candidates_p, mirostat_tau, mirostat_eta, &mirostat_mu);
+          id = llama_sample_token_mirostat_v2(ctx, &candidates_p, mirostat_tau, mirostat_eta, &slot.mirostat_mu);
         }
         else
         {
-          // Temperature sampling
+          // Temperature sampling in the order of llama_sample_chain
+          llama_sample_top_k(ctx, &candidates_p, top_k, 1);
           llama_sample_tail_free(ctx, &candidates_p, tfs_z, 1);
           llama_sample_typical(ctx, &candidates_p, typical_p, 1);
           llama_sample_top_p(ctx, &candidates_p, top_p, 1);
-          llama_sample_top_k(ctx, &candidates_p, top_k, 1);
           llama_sample_temperature(ctx, &candidates_p, temp);
-          id = llama_sample_token(ctx, &candidates_p);
+          id = draft ? llama_sample_draft(ctx, &candidates_p, *draft, slot.rng) : sampleDistribution(slot, candidates_p);
         }
       }
-      last_n_tokens.erase(last_n_tokens.begin());
-      last_n_tokens.push_back(id);
-      num_tokens_predicted++;
+      else
+      {
+        // Temperature sampling
+        llama_token_data_array candidates_p = llama_sample_chain(ctx, logits, top_k, tfs_z, typical_p, top_p, temp);
+        id = draft ? llama_sample_draft(ctx, &candidates_p, *draft, slot.rng) : sampleDistribution(slot, candidates_p);
+      }
+      // the grammar cannot be continued, the generation ends there
+      if (slot.grammar && !llama_grammar_accept_token(ctx, slot.grammar, id))
+      {
+        id = llama_token_eos();
+      }
+      slot.last_n_tokens.erase(slot.last_n_tokens.begin());
+      slot.last_n_tokens.push_back(id);
+      llama_penalty_state_push(slot.penalties, id);
+      slot.num_tokens_predicted++;
     }
 
-    // add it to the context
-    embd.push_back(id);
-    result = id;
-    // decrement remaining sampling budget
-    --n_remain;
+    return id;
+  }
 
-    if (!embd.empty() && embd.back() == llama_token_eos()) {
-        stopping_word = llama_token_to_str(ctx, embd.back());
-        has_next_token = false;
-        if (verbose) {
-            fprintf(stderr, "eos token found!\n");
-        }
-        return result;
+  // same as llama_sample_token, but with the RNG of the slot
+  llama_token sampleDistribution(llama_server_slot &slot, llama_token_data_array &candidates_p) {
+    llama_sample_softmax(ctx, &candidates_p);
+    std::vector<float> probs(candidates_p.size);
+    for (size_t i = 0; i < candidates_p.size; i++) {
+      probs[i] = candidates_p.data[i].p;
     }
-
-    has_next_token = params.n_predict == -1 ? true : n_remain != 0;
-    return result;
+    std::discrete_distribution<> dist(probs.begin(), probs.end());
+    return candidates_p.data[dist(slot.rng)].id;
   }
 
-  size_t findStoppingStrings(const std::string &text, const size_t last_token_size,
-                             const stop_type type)
-  {
-    size_t stop_pos = std::string::npos;
-    for (const std::string &word : params.antiprompt) {
-        size_t pos;
-        if (type == STOP_FULL) {
-            const size_t tmp = word.size() + last_token_size;
-            const size_t from_pos = text.size() > tmp ? text.size() - tmp : 0;
-            pos = text.find(word, from_pos);
-        } else {
-            pos = find_partial_stop_string(word, text);
-        }
-        if (pos != std::string::npos &&
-            (stop_pos == std::string::npos || pos < stop_pos)) {
-            if (type == STOP_FULL) {
-                stopping_word = word;
-                has_next_token = false;
-            }
-            stop_pos = pos;
-        }
+  // append the sampled token to the slot and queue the text that can be sent to the client
+  void processToken(llama_server_slot &slot, llama_token id) {
+    // add it to the context
+    slot.embd.push_back(id);
+    // decrement remaining sampling budget
+    --slot.n_remain;
+
+    // append the complete characters of the token to the text, the room needed is the text of the token plus 3 bytes
+    const char * token_text = llama_token_to_str(ctx, id);
+    const size_t n_text = slot.generated_text.size();
+    const size_t n_room = strlen(token_text) + 3;
+    slot.generated_text.resize(n_text + n_room);
+    const int n_new = llama_detokenizer_push(ctx, slot.detok, id, &slot.generated_text[n_text], n_room);
+    slot.generated_text.resize(n_text + n_new);
+
+    if (id == llama_token_eos()) {
+      slot.stopping_word = token_text;
+      slot.has_next_token = false;
+      if (verbose) {
+        fprintf(stderr, "eos token found!\n");
+      }
+    } else {
+      slot.has_next_token = slot.params.n_predict == -1 ? true : slot.n_remain != 0;
+
+      // finish the last character
+      if (!slot.has_next_token && llama_detokenizer_n_pending(slot.detok) > 0) {
+        slot.has_next_token = true;
+        slot.n_remain++;
+      }
     }
-    return stop_pos;
-  }
 
-  std::string doCompletion()
-  {
-    llama_token token = nextToken();
-    if (token == -1) {
-      return "";
+    // only the new text can complete a stop string, the start of one is held back until it is known not to be one
+    size_t stop_pos = std::string::npos;
+    const int i_stop = llama_stop_matcher_feed(slot.stop, slot.generated_text.data() + n_text, n_new, stop_pos);
+    if (i_stop >= 0) {
+      slot.stopping_word = slot.params.antiprompt[i_stop];
+      slot.has_next_token = false;
+      slot.generated_text.erase(stop_pos);
+    } else if (slot.stream) {
+      stop_pos = slot.generated_text.size() - llama_stop_matcher_partial(slot.stop);
     }
+    const size_t pos = std::min(slot.sent_count, slot.generated_text.size());
 
-    std::string token_text = llama_token_to_str(ctx, token);
-    generated_text += token_text;
+    const size_t n_send = std::min(stop_pos, slot.generated_text.size()) - pos;
+    slot.pending_text.append(slot.generated_text, pos, n_send);
+    slot.sent_count += n_send;
 
     if (verbose) {
       fprintf(stderr,
               "next token: {\n"
+              "    slot: %d,\n"
               "    token: %d,\n"
               "    token_text: \"%s\",\n"
               "    has_next_token: %d,\n"
@@ -324,14 +853,18 @@ struct llama_server_context
               "    num_tokens_predicted: %ld,\n"
               "    stopping_word: \"%s\",\n"
               "}\n",
-              token, token_text.c_str(), has_next_token, n_remain, num_tokens_predicted,
-              stopping_word.c_str());
+              slot.id, id, token_text, slot.has_next_token, slot.n_remain, slot.num_tokens_predicted,
+              slot.stopping_word.c_str());
     }
 
-    return token_text;
+    if (!slot.has_next_token) {
+      slot.state = SLOT_DONE;
+    }
   }
 
   std::vector<float> embedding(std::string content, int threads) {
+    std::unique_lock<std::mutex> eval_lock(eval_mutex);
+
     content.insert(0, 1, ' ');
     std::vector<llama_token> tokens = ::llama_tokenize(ctx, content, true);
     if (tokens.size() > 0)
@@ -362,10 +895,17 @@ void server_print_usage(int /*argc*/, char **argv, const gpt_params &params, con
   fprintf(stderr, "  -h, --help            show this help message and exit\n");
   fprintf(stderr, "  -v, --verbose         verbose output (default: false)\n");
   fprintf(stderr, "  -t N, --threads N     number of threads to use during computation (default: %d)\n", params.n_threads);
+  fprintf(stderr, "  --spin N              busy-wait iterations before an idle thread goes to sleep (default: %d, -1 = never sleep)\n", params.n_spin);
   fprintf(stderr, "  -c N, --ctx-size N    size of the prompt context (default: %d)\n", params.n_ctx);
   fprintf(stderr, "  -b N, --batch-size N  batch size for prompt processing (default: %d)\n", params.n_batch);
+  fprintf(stderr, "  -np N, --parallel N   number of requests processed concurrently, each gets ctx-size/N tokens of context (default: %d)\n", sparams.n_slots);
+  fprintf(stderr, "  --prefix-cache N      MiB of memory to keep the KV cache of evaluated prompts, new prompts skip their cached prefix (default: %d, 0 = disabled)\n", sparams.prefix_cache_mb);
   fprintf(stderr, "  --memory-f32          use f32 instead of f16 for memory key+value (default: disabled)\n");
   fprintf(stderr, "                        not recommended: doubles context memory required and no measurable increase in quality\n");
+  fprintf(stderr, "  -ctk TYPE, --cache-type-k TYPE\n");
+  fprintf(stderr, "                        data type of the K cache: f32, f16, q8_0, q4_0, q4_1, q5_0 or q5_1 (default: f16)\n");
+  fprintf(stderr, "  -ctv TYPE, --cache-type-v TYPE\n");
+  fprintf(stderr, "                        data type of the V cache: f32 or f16 (default: f16)\n");
   fprintf(stderr, "  --embedding           enable embedding mode\n");
   fprintf(stderr, "  --keep                number of tokens to keep from the initial prompt (default: %d, -1 = all)\n", params.n_keep);
   if (llama_mlock_supported())
@@ -375,13 +915,25 @@ void server_print_usage(int /*argc*/, char **argv, const gpt_params &params, con
   if (llama_mmap_supported())
   {
     fprintf(stderr, "  --no-mmap             do not memory-map model (slower load but may reduce pageouts if not using mlock)\n");
+    fprintf(stderr, "  --mmap-budget N       keep at most N MiB of the memory-mapped model resident, the layers that do not fit are\n");
+    fprintf(stderr, "                        streamed from the file on every eval (default: 0 = no limit)\n");
   }
+  fprintf(stderr, "  --repack              interleave the rows of the quantized weights for faster generation (implies --no-mmap)\n");
+  fprintf(stderr, "  --direct-io           read the model bypassing the page cache (implies --no-mmap)\n");
+  fprintf(stderr, "  --numa STRATEGY       placement of the memory on NUMA systems: interleave over all the nodes, or isolate\n");
+  fprintf(stderr, "                        the threads and the memory on the node of the main thread (default: disabled)\n");
+  fprintf(stderr, "  --hugepages           back the model and the context buffers with huge pages (hugetlbfs if reserved, else THP)\n");
 #ifdef LLAMA_SUPPORTS_GPU_OFFLOAD
   fprintf(stderr, "  -ngl N, --n-gpu-layers N\n");
   fprintf(stderr, "                        number of layers to store in VRAM\n");
 #endif
   fprintf(stderr, "  -m FNAME, --model FNAME\n");
   fprintf(stderr, "                        model path (default: %s)\n", params.model.c_str());
+  fprintf(stderr, "  -md FNAME, --model-draft FNAME\n");
+  fprintf(stderr, "                        draft model for speculative decoding, must share the vocabulary of the model (default: none)\n");
+  fprintf(stderr, "  --draft N             number of tokens to draft for speculative decoding (default: %d)\n", params.n_draft);
+  fprintf(stderr, "  --lookup N            speculative decoding without a draft model, drafts the tokens that follow the longest of the last\n");
+  fprintf(stderr, "                        1 .. N tokens that occurs in the prompt (default: %d, 0 = disabled)\n", params.n_lookup);
   fprintf(stderr, "  -a ALIAS, --alias ALIAS\n");
   fprintf(stderr, "                        set an alias for the model, will be added as `model` field in completion response\n");
   fprintf(stderr, "  --lora FNAME          apply LoRA adapter (implies --no-mmap)\n");
@@ -438,6 +990,33 @@ bool server_params_parse(int argc, char **argv, server_params &sparams, gpt_para
       }
       params.model = argv[i];
     }
+    else if (arg == "-md" || arg == "--model-draft")
+    {
+      if (++i >= argc)
+      {
+        invalid_param = true;
+        break;
+      }
+      params.model_draft = argv[i];
+    }
+    else if (arg == "--draft")
+    {
+      if (++i >= argc)
+      {
+        invalid_param = true;
+        break;
+      }
+      params.n_draft = std::stoi(argv[i]);
+    }
+    else if (arg == "--lookup")
+    {
+      if (++i >= argc)
+      {
+        invalid_param = true;
+        break;
+      }
+      params.n_lookup = std::stoi(argv[i]);
+    }
     else if (arg == "-a" || arg == "--alias")
     {
       if (++i >= argc)
@@ -469,6 +1048,22 @@ bool server_params_parse(int argc, char **argv, server_params &sparams, gpt_para
     {
       params.memory_f16 = false;
     }
+    else if (arg == "-ctk" || arg == "--cache-type-k")
+    {
+      if (++i >= argc || !llama_kv_type_parse(argv[i], params.cache_type_k))
+      {
+        invalid_param = true;
+        break;
+      }
+    }
+    else if (arg == "-ctv" || arg == "--cache-type-v")
+    {
+      if (++i >= argc || !llama_kv_type_parse(argv[i], params.cache_type_v))
+      {
+        invalid_param = true;
+        break;
+      }
+    }
     else if (arg == "--threads" || arg == "-t")
     {
         if (++i >= argc) {
@@ -477,6 +1072,30 @@ bool server_params_parse(int argc, char **argv, server_params &sparams, gpt_para
         }
         params.n_threads = std::stoi(argv[i]);
     }
+    else if (arg == "--spin")
+    {
+        if (++i >= argc) {
+            invalid_param = true;
+            break;
+        }
+        params.n_spin = std::stoi(argv[i]);
+    }
+    else if (arg == "-np" || arg == "--parallel")
+    {
+        if (++i >= argc) {
+            invalid_param = true;
+            break;
+        }
+        sparams.n_slots = std::max(1, std::stoi(argv[i]));
+    }
+    else if (arg == "--prefix-cache")
+    {
+        if (++i >= argc) {
+            invalid_param = true;
+            break;
+        }
+        sparams.prefix_cache_mb = std::max(0, std::stoi(argv[i]));
+    }
     else if (arg == "-b" || arg == "--batch-size")
     {
         if (++i >= argc) {
@@ -517,6 +1136,42 @@ bool server_params_parse(int argc, char **argv, server_params &sparams, gpt_para
             break;
         }
         params.lora_base = argv[i];
+    }
+    else if (arg == "--repack")
+    {
+        params.repack = true;
+        params.use_mmap = false;
+    }
+    else if (arg == "--direct-io")
+    {
+        params.direct_io = true;
+        params.use_mmap = false;
+    }
+    else if (arg == "--numa")
+    {
+      if (++i >= argc || !llama_numa_parse(argv[i], params.numa))
+      {
+        invalid_param = true;
+        break;
+      }
+    }
+    else if (arg == "--hugepages")
+    {
+        params.hugepages = true;
+    }
+    else if (arg == "--mmap-budget")
+    {
+      if (++i >= argc)
+      {
+        invalid_param = true;
+        break;
+      }
+      params.mmap_budget_mb = std::stoi(argv[i]);
+      if (params.mmap_budget_mb < 0)
+      {
+        invalid_param = true;
+        break;
+      }
     } else if (arg == "-v" || arg == "--verbose") {
         sparams.verbose = true;
     }
@@ -537,124 +1192,126 @@ bool server_params_parse(int argc, char **argv, server_params &sparams, gpt_para
   return true;
 }
 
-json format_generation_settings(llama_server_context &llama) {
-  const bool ignore_eos = -INFINITY == llama.params.logit_bias[llama_token_eos()];
+json format_generation_settings(const llama_server_slot &slot) {
+  const auto eos_bias = slot.params.logit_bias.find(llama_token_eos());
+  const bool ignore_eos = eos_bias != slot.params.logit_bias.end() && eos_bias->second == -INFINITY;
   return json {
-    { "seed", llama.params.seed },
-    { "temp", llama.params.temp },
-    { "top_k", llama.params.top_k },
-    { "top_p", llama.params.top_p },
-    { "tfs_z", llama.params.tfs_z },
-    { "typical_p", llama.params.typical_p },
-    { "repeat_last_n", llama.params.repeat_last_n },
-    { "repeat_penalty", llama.params.repeat_penalty },
-    { "presence_penalty", llama.params.presence_penalty },
-    { "frequency_penalty", llama.params.frequency_penalty },
-    { "mirostat", llama.params.mirostat },
-    { "mirostat_tau", llama.params.mirostat_tau },
-    { "mirostat_eta", llama.params.mirostat_eta },
-    { "penalize_nl", llama.params.penalize_nl },
-    { "stop", llama.params.antiprompt },
-    { "n_predict", llama.params.n_predict },
-    { "n_keep", llama.params.n_keep },
+    { "seed", slot.params.seed },
+    { "temp", slot.params.temp },
+    { "top_k", slot.params.top_k },
+    { "top_p", slot.params.top_p },
+    { "tfs_z", slot.params.tfs_z },
+    { "typical_p", slot.params.typical_p },
+    { "repeat_last_n", slot.params.repeat_last_n },
+    { "repeat_penalty", slot.params.repeat_penalty },
+    { "presence_penalty", slot.params.presence_penalty },
+    { "frequency_penalty", slot.params.frequency_penalty },
+    { "mirostat", slot.params.mirostat },
+    { "mirostat_tau", slot.params.mirostat_tau },
+    { "mirostat_eta", slot.params.mirostat_eta },
+    { "penalize_nl", slot.params.penalize_nl },
+    { "stop", slot.params.antiprompt },
+    { "n_predict", slot.params.n_predict },
+    { "n_keep", slot.params.n_keep },
     { "ignore_eos", ignore_eos },
-    { "stream", llama.stream },
-    { "logit_bias", llama.params.logit_bias },
+    { "stream", slot.stream },
+    { "logit_bias", slot.params.logit_bias },
+    { "grammar", slot.params.grammar },
   };
 }
 
-bool parse_options_completion(json body, llama_server_context& llama, Response &res)
+bool parse_options_completion(json body, llama_server_context& llama, llama_server_slot &request, Response &res)
 {
-  gpt_params default_params;
+  request.params = llama.params;
   if (!body["stream"].is_null()) {
-    llama.stream = body["stream"].get<bool>();
+    request.stream = body["stream"].get<bool>();
   } else {
-    llama.stream = false;
+    request.stream = false;
   }
   if (!body["n_predict"].is_null()) {
-    llama.params.n_predict = body["n_predict"].get<int>();
+    request.params.n_predict = body["n_predict"].get<int>();
   } else {
-    llama.params.n_predict = default_params.n_predict;
+    request.params.n_predict = llama.params.n_predict;
   }
   if (!body["top_k"].is_null()) {
-    llama.params.top_k = body["top_k"].get<int>();
+    request.params.top_k = body["top_k"].get<int>();
   } else {
-    llama.params.top_k = default_params.top_k;
+    request.params.top_k = llama.params.top_k;
   }
   if (!body["top_p"].is_null()) {
-    llama.params.top_p = body["top_p"].get<float>();
+    request.params.top_p = body["top_p"].get<float>();
   } else {
-    llama.params.top_p = default_params.top_p;
+    request.params.top_p = llama.params.top_p;
   }
   if (!body["tfs_z"].is_null()) {
-    llama.params.tfs_z = body["tfs_z"].get<float>();
+    request.params.tfs_z = body["tfs_z"].get<float>();
   } else {
-    llama.params.tfs_z = default_params.tfs_z;
+    request.params.tfs_z = llama.params.tfs_z;
   }
   if (!body["typical_p"].is_null()) {
-    llama.params.typical_p = body["typical_p"].get<float>();
+    request.params.typical_p = body["typical_p"].get<float>();
   } else {
-    llama.params.typical_p = default_params.typical_p;
+    request.params.typical_p = llama.params.typical_p;
   }
   if (!body["repeat_last_n"].is_null()) {
-    llama.params.repeat_last_n = body["repeat_last_n"].get<int>();
+    request.params.repeat_last_n = body["repeat_last_n"].get<int>();
   } else {
-    llama.params.repeat_last_n = default_params.repeat_last_n;
+    request.params.repeat_last_n = llama.params.repeat_last_n;
   }
   if (!body["temperature"].is_null()) {
-    llama.params.temp = body["temperature"].get<float>();
+    request.params.temp = body["temperature"].get<float>();
   } else {
-    llama.params.temp = default_params.temp;
+    request.params.temp = llama.params.temp;
   }
   if (!body["repeat_penalty"].is_null()) {
-    llama.params.repeat_penalty = body["repeat_penalty"].get<float>();
+    request.params.repeat_penalty = body["repeat_penalty"].get<float>();
   } else {
-    llama.params.repeat_penalty = default_params.repeat_penalty;
+    request.params.repeat_penalty = llama.params.repeat_penalty;
   }
   if (!body["presence_penalty"].is_null()) {
-    llama.params.presence_penalty = body["presence_penalty"].get<float>();
+    request.params.presence_penalty = body["presence_penalty"].get<float>();
   } else {
-    llama.params.presence_penalty = default_params.presence_penalty;
+    request.params.presence_penalty = llama.params.presence_penalty;
   }
   if (!body["frequency_penalty"].is_null()) {
-    llama.params.frequency_penalty = body["frequency_penalty"].get<float>();
+    request.params.frequency_penalty = body["frequency_penalty"].get<float>();
   } else {
-    llama.params.frequency_penalty = default_params.frequency_penalty;
+    request.params.frequency_penalty = llama.params.frequency_penalty;
   }
   if (!body["mirostat"].is_null()) {
-    llama.params.mirostat = body["mirostat"].get<float>();
+    request.params.mirostat = body["mirostat"].get<float>();
   } else {
-    llama.params.mirostat = default_params.mirostat;
+    request.params.mirostat = llama.params.mirostat;
   }
   if (!body["mirostat_tau"].is_null()) {
-    llama.params.mirostat_tau = body["mirostat_tau"].get<float>();
+    request.params.mirostat_tau = body["mirostat_tau"].get<float>();
   } else {
-    llama.params.mirostat_tau = default_params.mirostat_tau;
+    request.params.mirostat_tau = llama.params.mirostat_tau;
   }
   if (!body["mirostat_eta"].is_null()) {
-    llama.params.mirostat_eta = body["mirostat_eta"].get<float>();
+    request.params.mirostat_eta = body["mirostat_eta"].get<float>();
   } else {
-    llama.params.mirostat_eta = default_params.mirostat_eta;
+    request.params.mirostat_eta = llama.params.mirostat_eta;
   }
   if (!body["penalize_nl"].is_null()) {
-    llama.params.penalize_nl = body["penalize_nl"].get<float>();
+    request.params.penalize_nl = body["penalize_nl"].get<float>();
   } else {
-    llama.params.penalize_nl = default_params.penalize_nl;
+    request.params.penalize_nl = llama.params.penalize_nl;
   }
   if (!body["n_keep"].is_null()) {
-    llama.params.n_keep = body["n_keep"].get<int>();
+    request.params.n_keep = body["n_keep"].get<int>();
   } else {
-    llama.params.n_keep = default_params.n_keep;
+    request.params.n_keep = llama.params.n_keep;
   }
   if (!body["seed"].is_null()) {
-    llama.params.seed = body["seed"].get<int>();
+    request.params.seed = body["seed"].get<int>();
   } else {
-    llama.params.seed = time(NULL);
+    request.params.seed = time(NULL);
   }
 
-  llama.params.logit_bias.clear();
+  request.params.logit_bias.clear();
   if (!body["ignore_eos"].is_null() && body["ignore_eos"].get<bool>()) {
-    llama.params.logit_bias[llama_token_eos()] = -INFINITY;
+    request.params.logit_bias[llama_token_eos()] = -INFINITY;
   }
   if (body["logit_bias"].is_array()) {
     int n_vocab = llama_n_vocab(llama.ctx);
@@ -662,13 +1319,13 @@ bool parse_options_completion(json body, llama_server_context& llama, Response &
       if (el.is_array() && el.size() == 2 && el[0].is_number_integer() && el[1].is_number_float()) {
         llama_token tok = el[0].get<llama_token>();
         if (tok < 0 || tok >= n_vocab) continue;
-        llama.params.logit_bias[tok] = el[1].get<float>();
+        request.params.logit_bias[tok] = el[1].get<float>();
       }
     }
   }
 
   if (!body["prompt"].is_null()) {
-    llama.params.prompt = body["prompt"].get<std::string>();
+    request.params.prompt = body["prompt"].get<std::string>();
   } else {
     json data = {{"status", "error"}, {"reason", "You need to pass the prompt"}};
     res.set_content(data.dump(llama.json_indent), "application/json");
@@ -676,22 +1333,43 @@ bool parse_options_completion(json body, llama_server_context& llama, Response &
     return false;
   }
 
-  llama.params.antiprompt.clear();
+  request.params.antiprompt.clear();
   if (!body["stop"].is_null()) {
     const auto stop = body["stop"].get<std::vector<std::string>>();
     std::copy_if(stop.begin(), stop.end(),
-                 std::back_inserter(llama.params.antiprompt),
+                 std::back_inserter(request.params.antiprompt),
                  [](const std::string &str) { return !str.empty(); });
   }
 
+  request.grammar = nullptr;
+  if (!body["grammar"].is_null()) {
+    request.params.grammar = body["grammar"].get<std::string>();
+  } else {
+    request.params.grammar = llama.params.grammar;
+  }
+  if (!request.params.grammar.empty()) {
+    std::string err;
+    grammar_parser::parse_state parsed_grammar = grammar_parser::parse(request.params.grammar.c_str(), err);
+    if (!parsed_grammar.rules.empty()) {
+      std::vector<const llama_grammar_element *> grammar_rules(parsed_grammar.c_rules());
+      request.grammar = llama_grammar_init(llama.ctx, grammar_rules.data(), grammar_rules.size(), parsed_grammar.symbol_ids.at("root"));
+    }
+    if (request.grammar == nullptr) {
+      json data = {{"status", "error"}, {"reason", "Invalid grammar: " + (err.empty() ? std::string("bad rules") : err)}};
+      res.set_content(data.dump(llama.json_indent), "application/json");
+      res.status = 400;
+      return false;
+    }
+  }
+
   if (llama.verbose) {
-    json tmp = format_generation_settings(llama);
+    json tmp = format_generation_settings(request);
     fprintf(stderr,
             "-------------------------\n"
             "/completion parameters: %s\n"
             "PROMPT[%s]\n",
             tmp.dump(4, ' ', false, json::error_handler_t::replace).c_str(),
-            llama.params.prompt.c_str());
+            request.params.prompt.c_str());
   }
 
   return true;
@@ -726,13 +1404,16 @@ int main(int argc, char **argv)
           std::thread::hardware_concurrency(), llama_print_system_info());
 
   // load the model
-  if (!llama.loadModel(params))
+  if (!llama.loadModel(params, sparams.n_slots, (size_t)sparams.prefix_cache_mb*1024*1024))
   {
     return 1;
   }
 
   Server svr;
 
+  // one worker per slot plus one for the other endpoints
+  svr.new_task_queue = [&sparams] { return new ThreadPool(sparams.n_slots + 1); };
+
   svr.set_default_headers({
       {"Access-Control-Allow-Origin", "*"},
       {"Access-Control-Allow-Headers", "content-type"}
@@ -753,120 +1434,59 @@ int main(int argc, char **argv)
           return;
       }
 
-      llama.rewind();
-      llama_reset_timings(llama.ctx);
-
-      if (!parse_options_completion(json::parse(req.body), llama, res)) {
-          return;
-      }
-
-      if (!llama.loadPrompt()) {
-          json data = {{"status", "error"}, {"reason", "Context too long."}};
-          res.set_content(
-              data.dump(llama.json_indent, ' ', false, json::error_handler_t::replace),
-              "application/json");
-          res.status = 400;
+      llama_server_slot request;
+      if (!parse_options_completion(json::parse(req.body), llama, request, res)) {
           return;
       }
 
-      llama.beginCompletion();
+      llama_server_slot * slot = llama.launchSlot(request);
+      const int task_id = slot->task_id;
 
-      if (!llama.stream) {
-          while (llama.has_next_token) {
-              const std::string token_text = llama.doCompletion();
-              const size_t stop_pos = llama.findStoppingStrings(
-                  llama.generated_text, token_text.size(), STOP_FULL);
-
-              if (stop_pos != std::string::npos) {
-                  llama.generated_text.erase(llama.generated_text.begin() + stop_pos,
-                                             llama.generated_text.end());
-              }
+      if (!slot->stream) {
+          std::string token_text;
+          while (llama.nextResult(*slot, token_text)) {
           }
 
-          json data = {{"content", llama.generated_text},
+          json data = {{"content", slot->generated_text},
                        {"stop", true},
-                       {"model", llama.params.model_alias},
-                       {"tokens_predicted", llama.num_tokens_predicted},
-                       {"generation_settings", format_generation_settings(llama)},
-                       {"prompt", llama.params.prompt},
-                       {"stopping_word", llama.stopping_word}};
+                       {"model", slot->params.model_alias},
+                       {"tokens_predicted", slot->num_tokens_predicted},
+                       {"generation_settings", format_generation_settings(*slot)},
+                       {"prompt", slot->params.prompt},
+                       {"stopping_word", slot->stopping_word}};
 
-          llama_print_timings(llama.ctx);
+          llama.releaseSlot(*slot, task_id);
 
           res.set_content(
               data.dump(llama.json_indent, ' ', false, json::error_handler_t::replace),
               "application/json");
       } else {
-          const auto chunked_content_provider = [&](size_t, DataSink &sink) {
-              size_t sent_count = 0;
-              int32_t multibyte_pending = 0;
-
-              while (llama.has_next_token) {
-                  const std::string token_text = llama.doCompletion();
-
-                  if (multibyte_pending > 0) {
-                      multibyte_pending -= token_text.size();
-                  } else if (token_text.size() == 1) {
-                      const char c = token_text[0];
-                      // 2-byte characters: 110xxxxx 10xxxxxx
-                      if ((c & 0xE0) == 0xC0) {
-                          multibyte_pending = 1;
-                      // 3-byte characters: 1110xxxx 10xxxxxx 10xxxxxx
-                      } else if ((c & 0xF0) == 0xE0) {
-                          multibyte_pending = 2;
-                      // 4-byte characters: 11110xxx 10xxxxxx 10xxxxxx 10xxxxxx
-                      } else if ((c & 0xF8) == 0xF0) {
-                          multibyte_pending = 3;
-                      } else {
-                          multibyte_pending = 0;
-                      }
-                  }
-
-                  if (multibyte_pending > 0) {
-                      if (!llama.has_next_token) {
-                          llama.has_next_token = true;
-                          llama.n_remain++;
-                      }
-                      continue;
-                  }
+          const auto chunked_content_provider = [&llama, slot, task_id](size_t, DataSink &sink) {
+              bool has_next_token = true;
 
-                  size_t pos = std::min(sent_count, llama.generated_text.size());
-
-                  const char *str_test = llama.generated_text.c_str() + pos;
-                  size_t stop_pos =
-                      llama.findStoppingStrings(str_test, token_text.size(), STOP_FULL);
-                  if (stop_pos != std::string::npos) {
-                      llama.generated_text.erase(
-                          llama.generated_text.begin() + pos + stop_pos,
-                          llama.generated_text.end());
-                      pos = std::min(sent_count, llama.generated_text.size());
-                  } else {
-                      stop_pos = llama.findStoppingStrings(str_test, token_text.size(),
-                                                           STOP_PARTIAL);
-                  }
-
-                  std::string to_send = llama.generated_text.substr(pos, stop_pos);
-                  sent_count += to_send.size();
+              while (has_next_token) {
+                  std::string to_send;
+                  has_next_token = llama.nextResult(*slot, to_send);
 
                   json data;
-                  if (llama.has_next_token) {
+                  if (has_next_token) {
                       data = {{"content", to_send}, {"stop", false}};
                   } else {
                       // Generation is done, send extra information.
                       data = {
                           {"content", to_send},
                           {"stop", true},
-                          {"model", llama.params.model_alias},
-                          {"tokens_predicted", llama.num_tokens_predicted},
-                          {"generation_settings", format_generation_settings(llama)},
-                          {"prompt", llama.params.prompt},
-                          {"stopping_word", llama.stopping_word},
-                          {"generated_text", llama.generated_text}};
+                          {"model", slot->params.model_alias},
+                          {"tokens_predicted", slot->num_tokens_predicted},
+                          {"generation_settings", format_generation_settings(*slot)},
+                          {"prompt", slot->params.prompt},
+                          {"stopping_word", slot->stopping_word},
+                          {"generated_text", slot->generated_text}};
                   }
 
                   std::string str =
                       "data: " +
-                      data.dump(llama.has_next_token ? -1 : llama.json_indent, ' ', false,
+                      data.dump(has_next_token ? -1 : llama.json_indent, ' ', false,
                                 json::error_handler_t::replace) +
                       "\n\n";
 
@@ -878,16 +1498,20 @@ int main(int argc, char **argv)
                       if (llama.verbose) {
                           fprintf(stderr, "stream closed\n");
                       }
-                      llama_print_timings(llama.ctx);
+                      llama.releaseSlot(*slot, task_id);
                       return false;
                   }
               }
 
-              llama_print_timings(llama.ctx);
+              llama.releaseSlot(*slot, task_id);
               sink.done();
               return true;
           };
-          res.set_chunked_content_provider("text/event-stream", chunked_content_provider);
+          // also called when the connection is closed before the provider has run to the end
+          const auto on_complete = [&llama, slot, task_id](bool) {
+              llama.releaseSlot(*slot, task_id);
+          };
+          res.set_chunked_content_provider("text/event-stream", chunked_content_provider, on_complete);
       }
   });
 
@@ -71,6 +71,51 @@ static int sched_yield (void) {
     Sleep (0);
     return 0;
 }
+
+typedef CRITICAL_SECTION   pthread_mutex_t;
+typedef CONDITION_VARIABLE pthread_cond_t;
+
+static int pthread_mutex_init(pthread_mutex_t * mutex, void * unused) {
+    (void) unused;
+    InitializeCriticalSection(mutex);
+    return 0;
+}
+
+static int pthread_mutex_destroy(pthread_mutex_t * mutex) {
+    DeleteCriticalSection(mutex);
+    return 0;
+}
+
+static int pthread_mutex_lock(pthread_mutex_t * mutex) {
+    EnterCriticalSection(mutex);
+    return 0;
+}
+
+static int pthread_mutex_unlock(pthread_mutex_t * mutex) {
+    LeaveCriticalSection(mutex);
+    return 0;
+}
+
+static int pthread_cond_init(pthread_cond_t * cond, void * unused) {
+    (void) unused;
+    InitializeConditionVariable(cond);
+    return 0;
+}
+
+static int pthread_cond_destroy(pthread_cond_t * cond) {
+    (void) cond;
+    return 0;
+}
+
+static int pthread_cond_wait(pthread_cond_t * cond, pthread_mutex_t * mutex) {
+    SleepConditionVariableCS(cond, mutex, INFINITE);
+    return 0;
+}
+
+static int pthread_cond_broadcast(pthread_cond_t * cond) {
+    WakeAllConditionVariable(cond);
+    return 0;
+}
 #else
 #include <pthread.h>
 #include <stdatomic.h>
@@ -1516,6 +1561,20 @@ static void ggml_vec_dot_q5_0_q8_0(const int n, float * restrict s, const void *
 static void ggml_vec_dot_q5_1_q8_1(const int n, float * restrict s, const void * restrict vx, const void * restrict vy);
 static void ggml_vec_dot_q8_0_q8_0(const int n, float * restrict s, const void * restrict vx, const void * restrict vy);
 
+#if defined(__AVX2__)
+static void ggml_vec_dot_q4_0_q8_0_tile(const int n, float * restrict s, size_t bs, const void * restrict vx, size_t bx, const void * restrict vy, size_t by);
+static void ggml_vec_dot_q4_1_q8_1_tile(const int n, float * restrict s, size_t bs, const void * restrict vx, size_t bx, const void * restrict vy, size_t by);
+static void ggml_vec_dot_q5_0_q8_0_tile(const int n, float * restrict s, size_t bs, const void * restrict vx, size_t bx, const void * restrict vy, size_t by);
+static void ggml_vec_dot_q5_1_q8_1_tile(const int n, float * restrict s, size_t bs, const void * restrict vx, size_t bx, const void * restrict vy, size_t by);
+static void ggml_vec_dot_q8_0_q8_0_tile(const int n, float * restrict s, size_t bs, const void * restrict vx, size_t bx, const void * restrict vy, size_t by);
+#else
+#define ggml_vec_dot_q4_0_q8_0_tile NULL
+#define ggml_vec_dot_q4_1_q8_1_tile NULL
+#define ggml_vec_dot_q5_0_q8_0_tile NULL
+#define ggml_vec_dot_q5_1_q8_1_tile NULL
+#define ggml_vec_dot_q8_0_q8_0_tile NULL
+#endif
+
 static const quantize_fns_t quantize_fns[GGML_TYPE_COUNT] = {
     [GGML_TYPE_Q4_0] = {
         .dequantize_row_q         = (dequantize_row_q_t) dequantize_row_q4_0,
@@ -1523,6 +1582,7 @@ static const quantize_fns_t quantize_fns[GGML_TYPE_COUNT] = {
         .quantize_row_q_reference = (quantize_row_q_t) quantize_row_q4_0_reference,
         .quantize_row_q_dot       = quantize_row_q8_0,
         .vec_dot_q                = ggml_vec_dot_q4_0_q8_0,
+        .vec_dot_q_tile           = ggml_vec_dot_q4_0_q8_0_tile,
         .vec_dot_type             = GGML_TYPE_Q8_0,
     },
     [GGML_TYPE_Q4_1] = {
@@ -1531,6 +1591,7 @@ static const quantize_fns_t quantize_fns[GGML_TYPE_COUNT] = {
         .quantize_row_q_reference = (quantize_row_q_t) quantize_row_q4_1_reference,
         .quantize_row_q_dot       = quantize_row_q8_1,
         .vec_dot_q                = ggml_vec_dot_q4_1_q8_1,
+        .vec_dot_q_tile           = ggml_vec_dot_q4_1_q8_1_tile,
         .vec_dot_type             = GGML_TYPE_Q8_1,
     },
     [GGML_TYPE_Q5_0] = {
@@ -1539,6 +1600,7 @@ static const quantize_fns_t quantize_fns[GGML_TYPE_COUNT] = {
         .quantize_row_q_reference = (quantize_row_q_t) quantize_row_q5_0_reference,
         .quantize_row_q_dot       = quantize_row_q8_0,
         .vec_dot_q                = ggml_vec_dot_q5_0_q8_0,
+        .vec_dot_q_tile           = ggml_vec_dot_q5_0_q8_0_tile,
         .vec_dot_type             = GGML_TYPE_Q8_0,
     },
     [GGML_TYPE_Q5_1] = {
@@ -1547,6 +1609,7 @@ static const quantize_fns_t quantize_fns[GGML_TYPE_COUNT] = {
         .quantize_row_q_reference = (quantize_row_q_t) quantize_row_q5_1_reference,
         .quantize_row_q_dot       = quantize_row_q8_1,
         .vec_dot_q                = ggml_vec_dot_q5_1_q8_1,
+        .vec_dot_q_tile           = ggml_vec_dot_q5_1_q8_1_tile,
         .vec_dot_type             = GGML_TYPE_Q8_1,
     },
     [GGML_TYPE_Q8_0] = {
@@ -1555,6 +1618,7 @@ static const quantize_fns_t quantize_fns[GGML_TYPE_COUNT] = {
         .quantize_row_q_reference = (quantize_row_q_t) quantize_row_q8_0_reference,
         .quantize_row_q_dot       = quantize_row_q8_0,
         .vec_dot_q                = ggml_vec_dot_q8_0_q8_0,
+        .vec_dot_q_tile           = ggml_vec_dot_q8_0_q8_0_tile,
         .vec_dot_type             = GGML_TYPE_Q8_0,
     },
     [GGML_TYPE_Q8_1] = {
@@ -3162,6 +3226,176 @@ static void ggml_vec_dot_q8_0_q8_0(const int n, float * restrict s, const void *
 #endif
 }
 
+#if defined(__AVX2__)
+// unpack a block of x to 32 bytes - signed for the types with vec_dot_type Q8_0, unsigned for the ones with Q8_1
+static inline __m256i ggml_unpack_q_block(const enum ggml_type type, const void * restrict vx, const int i, float * restrict d, float * restrict m) {
+    switch (type) {
+        case GGML_TYPE_Q4_0:
+            {
+                const block_q4_0 * restrict x = (const block_q4_0 *) vx + i;
+                *d = GGML_FP16_TO_FP32(x->d);
+                return _mm256_sub_epi8(bytes_from_nibbles_32(x->qs), _mm256_set1_epi8(8));
+            }
+        case GGML_TYPE_Q4_1:
+            {
+                const block_q4_1 * restrict x = (const block_q4_1 *) vx + i;
+                *d = GGML_FP16_TO_FP32(x->d);
+                *m = GGML_FP16_TO_FP32(x->m);
+                return bytes_from_nibbles_32(x->qs);
+            }
+        case GGML_TYPE_Q5_0:
+            {
+                const block_q5_0 * restrict x = (const block_q5_0 *) vx + i;
+                *d = GGML_FP16_TO_FP32(x->d);
+                const __m256i bxhi = _mm256_andnot_si256(bytes_from_bits_32(x->qh), _mm256_set1_epi8((char)0xF0));
+                return _mm256_or_si256(bytes_from_nibbles_32(x->qs), bxhi);
+            }
+        case GGML_TYPE_Q5_1:
+            {
+                const block_q5_1 * restrict x = (const block_q5_1 *) vx + i;
+                *d = GGML_FP16_TO_FP32(x->d);
+                *m = GGML_FP16_TO_FP32(x->m);
+                const __m256i bxhi = _mm256_and_si256(bytes_from_bits_32(x->qh), _mm256_set1_epi8(0x10));
+                return _mm256_or_si256(bytes_from_nibbles_32(x->qs), bxhi);
+            }
+        case GGML_TYPE_Q8_0:
+            {
+                const block_q8_0 * restrict x = (const block_q8_0 *) vx + i;
+                *d = GGML_FP16_TO_FP32(x->d);
+                return _mm256_loadu_si256((const __m256i *) x->qs);
+            }
+        default:
+            {
+                GGML_ASSERT(false);
+            }
+    }
+}
+
+// register tile of the batched mul_mat
+// every block of x is unpacked once for the GGML_VEC_DOT_TILE_N rows of y and every block of y is loaded
+// once for the GGML_VEC_DOT_TILE_M rows of x. the operations per block are the same as in the
+// ggml_vec_dot_*() functions, so the results are identical to GGML_VEC_DOT_TILE_M*GGML_VEC_DOT_TILE_N calls of them
+static inline void ggml_vec_dot_q_tile(const enum ggml_type type, const int n, float * restrict s, size_t bs, const void * restrict vx, size_t bx, const void * restrict vy, size_t by) {
+    const int qk = QK8_0;
+    const int nb = n / qk;
+
+    assert(n % qk == 0);
+
+    const bool has_min = type == GGML_TYPE_Q4_1 || type == GGML_TYPE_Q5_1;
+
+    __m256 acc[GGML_VEC_DOT_TILE_M][GGML_VEC_DOT_TILE_N];
+    float summs[GGML_VEC_DOT_TILE_M][GGML_VEC_DOT_TILE_N];
+
+    for (int r = 0; r < GGML_VEC_DOT_TILE_M; ++r) {
+        for (int c = 0; c < GGML_VEC_DOT_TILE_N; ++c) {
+            acc[r][c]   = _mm256_setzero_ps();
+            summs[r][c] = 0.0f;
+        }
+    }
+
+    for (int i = 0; i < nb; ++i) {
+        __m256i qx[GGML_VEC_DOT_TILE_M];
+        float   dx[GGML_VEC_DOT_TILE_M];
+        float   mx[GGML_VEC_DOT_TILE_M];
+
+        for (int r = 0; r < GGML_VEC_DOT_TILE_M; ++r) {
+            qx[r] = ggml_unpack_q_block(type, (const char *) vx + r*bx, i, &dx[r], &mx[r]);
+        }
+
+        for (int c = 0; c < GGML_VEC_DOT_TILE_N; ++c) {
+            __m256i qy;
+            float   dy;
+            float   sy = 0.0f;
+
+            if (has_min) {
+                const block_q8_1 * restrict y = (const block_q8_1 *) ((const char *) vy + c*by) + i;
+                qy = _mm256_loadu_si256((const __m256i *) y->qs);
+                dy = y->d;
+                sy = y->s;
+            } else {
+                const block_q8_0 * restrict y = (const block_q8_0 *) ((const char *) vy + c*by) + i;
+                qy = _mm256_loadu_si256((const __m256i *) y->qs);
+                dy = GGML_FP16_TO_FP32(y->d);
+            }
+
+            for (int r = 0; r < GGML_VEC_DOT_TILE_M; ++r) {
+                const __m256 d = _mm256_set1_ps(dx[r]*dy);
+
+                if (has_min) {
+                    summs[r][c] += mx[r]*sy;
+                    acc[r][c] = _mm256_fmadd_ps(d, mul_sum_us8_pairs_float(qx[r], qy), acc[r][c]);
+                } else {
+                    acc[r][c] = _mm256_fmadd_ps(d, mul_sum_i8_pairs_float(qx[r], qy), acc[r][c]);
+                }
+            }
+        }
+    }
+
+    for (int r = 0; r < GGML_VEC_DOT_TILE_M; ++r) {
+        for (int c = 0; c < GGML_VEC_DOT_TILE_N; ++c) {
+            s[c*bs + r] = hsum_float_8(acc[r][c]) + summs[r][c];
+        }
+    }
+}
+
+static void ggml_vec_dot_q4_0_q8_0_tile(const int n, float * restrict s, size_t bs, const void * restrict vx, size_t bx, const void * restrict vy, size_t by) {
+    ggml_vec_dot_q_tile(GGML_TYPE_Q4_0, n, s, bs, vx, bx, vy, by);
+}
+
+static void ggml_vec_dot_q4_1_q8_1_tile(const int n, float * restrict s, size_t bs, const void * restrict vx, size_t bx, const void * restrict vy, size_t by) {
+    ggml_vec_dot_q_tile(GGML_TYPE_Q4_1, n, s, bs, vx, bx, vy, by);
+}
+
+static void ggml_vec_dot_q5_0_q8_0_tile(const int n, float * restrict s, size_t bs, const void * restrict vx, size_t bx, const void * restrict vy, size_t by) {
+    ggml_vec_dot_q_tile(GGML_TYPE_Q5_0, n, s, bs, vx, bx, vy, by);
+}
+
+static void ggml_vec_dot_q5_1_q8_1_tile(const int n, float * restrict s, size_t bs, const void * restrict vx, size_t bx, const void * restrict vy, size_t by) {
+    ggml_vec_dot_q_tile(GGML_TYPE_Q5_1, n, s, bs, vx, bx, vy, by);
+}
+
+static void ggml_vec_dot_q8_0_q8_0_tile(const int n, float * restrict s, size_t bs, const void * restrict vx, size_t bx, const void * restrict vy, size_t by) {
+    ggml_vec_dot_q_tile(GGML_TYPE_Q8_0, n, s, bs, vx, bx, vy, by);
+}
+
+// dot products of GGML_INTERLEAVE_ROWS interleaved rows of x with y, see ggml_interleave_rows()
+// every block of y is loaded once for all the rows, the results are the same as with ggml_vec_dot_q4_0_q8_0
+static void ggml_vec_dot_q4_0_q8_0_interleaved(const int n, float * restrict s, const void * restrict vx, const void * restrict vy) {
+    const int qk = QK8_0;
+    const int nb = n / qk;
+
+    assert(n % qk == 0);
+
+    const block_q4_0 * restrict x = vx;
+    const block_q8_0 * restrict y = vy;
+
+    __m256 acc[GGML_INTERLEAVE_ROWS];
+
+    for (int r = 0; r < GGML_INTERLEAVE_ROWS; ++r) {
+        acc[r] = _mm256_setzero_ps();
+    }
+
+    for (int i = 0; i < nb; ++i) {
+        const float dy = GGML_FP16_TO_FP32(y[i].d);
+        const __m256i by = _mm256_loadu_si256((const __m256i *)y[i].qs);
+
+        for (int r = 0; r < GGML_INTERLEAVE_ROWS; ++r) {
+            const block_q4_0 * restrict xr = &x[i*GGML_INTERLEAVE_ROWS + r];
+
+            const __m256 d = _mm256_set1_ps(GGML_FP16_TO_FP32(xr->d) * dy);
+
+            const __m256i bx = _mm256_sub_epi8(bytes_from_nibbles_32(xr->qs), _mm256_set1_epi8(8));
+
+            acc[r] = _mm256_fmadd_ps(d, mul_sum_i8_pairs_float(bx, by), acc[r]);
+        }
+    }
+
+    for (int r = 0; r < GGML_INTERLEAVE_ROWS; ++r) {
+        s[r] = hsum_float_8(acc[r]);
+    }
+}
+#endif
+
 // compute GGML_VEC_DOT_UNROLL dot products at once
 // xs - x row stride in bytes
 inline static void ggml_vec_dot_f16_unroll(const int n, const int xs, float * restrict s, void * restrict xv, ggml_fp16_t * restrict y) {
@@ -3540,6 +3774,7 @@ static const char * GGML_OP_NAME[GGML_OP_COUNT] = {
     "DIAG",
     "DIAG_MASK_INF",
     "DIAG_MASK_ZERO",
+    "MASK_INF",
     "SOFT_MAX",
     "ROPE",
     "ROPE_BACK",
@@ -3555,7 +3790,7 @@ static const char * GGML_OP_NAME[GGML_OP_COUNT] = {
     "MAP_BINARY",
 };
 
-static_assert(GGML_OP_COUNT == 51, "GGML_OP_COUNT != 51");
+static_assert(GGML_OP_COUNT == 52, "GGML_OP_COUNT != 52");
 
 
 static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
@@ -3602,6 +3837,7 @@ static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "diag(x)",
     "diag_mask_inf(x)",
     "diag_mask_zero(x)",
+    "mask_inf(x)",
     "soft_max(x)",
     "rope(x)",
     "rope_back(x)",
@@ -3617,7 +3853,7 @@ static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "f(x,y)",
 };
 
-static_assert(GGML_OP_COUNT == 51, "GGML_OP_COUNT != 51");
+static_assert(GGML_OP_COUNT == 52, "GGML_OP_COUNT != 52");
 
 static_assert(sizeof(struct ggml_object)%GGML_MEM_ALIGN == 0, "ggml_object size must be a multiple of GGML_MEM_ALIGN");
 static_assert(sizeof(struct ggml_tensor)%GGML_MEM_ALIGN == 0, "ggml_tensor size must be a multiple of GGML_MEM_ALIGN");
@@ -3665,6 +3901,10 @@ struct ggml_compute_params {
     // work buffer for all threads
     size_t wsize;
     void * wdata;
+
+    // shared counter used by ops that hand out work to the threads dynamically
+    // reset to 0 before each COMPUTE task
+    atomic_int * current_chunk;
 };
 
 //
@@ -4149,6 +4389,7 @@ struct ggml_tensor * ggml_new_tensor_impl(
         /*.perf_time_us =*/ 0,
         /*.data         =*/ (data == NULL && !ctx->no_alloc) ? (void *)(result + 1) : data,
         /*.name         =*/ { 0 },
+        /*.n_interleave =*/ 0,
         /*.pad          =*/ { 0 },
     };
 
@@ -6170,6 +6411,56 @@ struct ggml_tensor * ggml_diag_mask_zero_inplace(
     return ggml_diag_mask_zero_impl(ctx, a, n_past, true);
 }
 
+// ggml_mask_inf
+
+struct ggml_tensor * ggml_mask_inf_impl(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * b,
+        bool                  inplace) {
+    GGML_ASSERT(b->type == GGML_TYPE_I32);
+    GGML_ASSERT(b->ne[0] == a->ne[0] && b->ne[1] == a->ne[1]);
+    GGML_ASSERT(ggml_is_contiguous(b));
+
+    bool is_node = false;
+
+    if (a->grad) {
+        GGML_ASSERT(false); // TODO: implement backward
+        is_node = true;
+    }
+
+    struct ggml_tensor * result = inplace ? ggml_view_tensor(ctx, a) : ggml_dup_tensor(ctx, a);
+
+    ggml_scratch_save(ctx);
+
+    struct ggml_tensor * c = ggml_new_i32(ctx, inplace ? 1 : 0);
+    ggml_set_name(c, "inplace");
+
+    ggml_scratch_load(ctx);
+
+    result->op     = GGML_OP_MASK_INF;
+    result->grad   = is_node ? ggml_dup_tensor(ctx, result) : NULL;
+    result->src0   = a;
+    result->src1   = b;
+    result->opt[0] = c;
+
+    return result;
+}
+
+struct ggml_tensor * ggml_mask_inf(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * b) {
+    return ggml_mask_inf_impl(ctx, a, b, false);
+}
+
+struct ggml_tensor * ggml_mask_inf_inplace(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * b) {
+    return ggml_mask_inf_impl(ctx, a, b, true);
+}
+
 // ggml_soft_max
 
 struct ggml_tensor * ggml_soft_max_impl(
@@ -6258,6 +6549,52 @@ struct ggml_tensor * ggml_rope_inplace(
     return ggml_rope_impl(ctx, a, n_past, n_dims, mode, true);
 }
 
+// ggml_rope_pos
+
+struct ggml_tensor * ggml_rope_pos_impl(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * b,
+        int                   n_dims,
+        int                   mode,
+        bool                  inplace) {
+    GGML_ASSERT(b->type == GGML_TYPE_I32);
+    GGML_ASSERT(ggml_is_vector(b) && b->ne[0] == a->ne[2]);
+    GGML_ASSERT((mode & 1) == 0);
+
+    bool is_node = false;
+
+    if (a->grad) {
+        GGML_ASSERT(false); // TODO: implement backward
+        is_node = true;
+    }
+
+    struct ggml_tensor * result = ggml_rope_impl(ctx, a, 0, n_dims, mode, inplace);
+
+    result->grad   = is_node ? ggml_dup_tensor(ctx, result) : NULL;
+    result->opt[0] = b;
+
+    return result;
+}
+
+struct ggml_tensor * ggml_rope_pos(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * b,
+        int                   n_dims,
+        int                   mode) {
+    return ggml_rope_pos_impl(ctx, a, b, n_dims, mode, false);
+}
+
+struct ggml_tensor * ggml_rope_pos_inplace(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * b,
+        int                   n_dims,
+        int                   mode) {
+    return ggml_rope_pos_impl(ctx, a, b, n_dims, mode, true);
+}
+
 // ggml_rope_back
 
 struct ggml_tensor * ggml_rope_back(
@@ -7189,6 +7526,66 @@ static void ggml_compute_forward_dup_f32(
     }
 }
 
+static void ggml_compute_forward_dup_q(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        struct ggml_tensor * dst) {
+    GGML_ASSERT(ggml_nelements(dst) == ggml_nelements(src0));
+
+    if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
+        return;
+    }
+
+    const enum ggml_type type = src0->type;
+
+    // quantized rows are copied or dequantized whole, the rows of src0 and dst must have the same length
+    GGML_ASSERT(dst->type == type || dst->type == GGML_TYPE_F32);
+    GGML_ASSERT(src0->ne[0] == dst->ne[0]);
+    GGML_ASSERT(src0->nb[0] == GGML_TYPE_SIZE[type]);
+    GGML_ASSERT(dst->nb[0] == GGML_TYPE_SIZE[dst->type]);
+
+    const int64_t ne00 = src0->ne[0];
+    const int64_t ne01 = src0->ne[1];
+    const int64_t ne02 = src0->ne[2];
+
+    const int64_t ne1 = dst->ne[1];
+    const int64_t ne2 = dst->ne[2];
+
+    const dequantize_row_q_t dequantize_row_q = quantize_fns[type].dequantize_row_q;
+    const size_t rs = ne00/GGML_BLCK_SIZE[type]*GGML_TYPE_SIZE[type];
+
+    const int ith = params->ith; // thread index
+    const int nth = params->nth; // number of threads
+
+    // parallelize by rows
+    const int nr = ggml_nrows(src0);
+    // number of rows per thread
+    const int dr = (nr + nth - 1) / nth;
+    // row range for this thread
+    const int ir0 = dr * ith;
+    const int ir1 = MIN(ir0 + dr, nr);
+
+    for (int ir = ir0; ir < ir1; ir++) {
+        // the same row index in src0 and dst
+        const int64_t i03 = ir/(ne02*ne01);
+        const int64_t i02 = (ir - i03*ne02*ne01)/ne01;
+        const int64_t i01 = (ir - i03*ne02*ne01 - i02*ne01);
+
+        const int64_t i3 = ir/(ne2*ne1);
+        const int64_t i2 = (ir - i3*ne2*ne1)/ne1;
+        const int64_t i1 = (ir - i3*ne2*ne1 - i2*ne1);
+
+        const char * src0_row = (const char *) src0->data + i01*src0->nb[1] + i02*src0->nb[2] + i03*src0->nb[3];
+              char * dst_row  = (char *)        dst->data + i1*dst->nb[1]   + i2*dst->nb[2]   + i3*dst->nb[3];
+
+        if (dst->type == type) {
+            memcpy(dst_row, src0_row, rs);
+        } else {
+            dequantize_row_q(src0_row, (float *) dst_row, ne00);
+        }
+    }
+}
+
 static void ggml_compute_forward_dup(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
@@ -7197,6 +7594,10 @@ static void ggml_compute_forward_dup(
         ggml_compute_forward_dup_same_cont(params, src0, dst);
         return;
     }
+    if (ggml_is_quantized(src0->type)) {
+        ggml_compute_forward_dup_q(params, src0, dst);
+        return;
+    }
     switch (src0->type) {
         case GGML_TYPE_F16:
             {
@@ -9445,6 +9846,25 @@ static void ggml_compute_forward_rms_norm_back(
 
 // ggml_compute_forward_mul_mat
 
+// the src0 rows are split in chunks of roughly this size that the threads pull from a shared counter
+// this keeps the working set of a chunk in L2 and lets the faster threads take over the work of the
+// slower ones instead of waiting for them at the end of the node
+#define GGML_MUL_MAT_CHUNK_SIZE (256*1024)
+
+// number of src0 rows per chunk, a multiple of n_align
+static int ggml_mul_mat_chunk_rows(int nr, size_t row_size, int nth, int n_align) {
+    if (nth == 1) {
+        return nr;
+    }
+
+    int dr = MAX(1, (int) (GGML_MUL_MAT_CHUNK_SIZE/row_size));
+
+    // make sure that there are a few chunks per thread, otherwise there is nothing to balance
+    dr = MIN(dr, MAX(1, nr/(4*nth)));
+
+    return (dr + n_align - 1)/n_align*n_align;
+}
+
 #if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS)
 // helper function to determine if it is better to use BLAS or not
 // for large matrices, BLAS is faster
@@ -9463,6 +9883,7 @@ static bool ggml_compute_forward_mul_mat_use_blas(
     // TODO: find the optimal values for these
     if (ggml_is_contiguous(src0) &&
         ggml_is_contiguous(src1) &&
+        src0->n_interleave == 0 &&
         (ne0 >= 32 && ne1 >= 32 && ne10 >= 32)) {
 
         /*printf("BLAS: %d %d %d %d %d\n", ne0, ne1, ne10, ne00, ne01);*/
@@ -9517,7 +9938,6 @@ static void ggml_compute_forward_mul_mat_f32(
     const int nb2  = dst->nb[2];
     const int nb3  = dst->nb[3];
 
-    const int ith = params->ith;
     const int nth = params->nth;
 
     assert(ne02 == ne12);
@@ -9605,35 +10025,40 @@ static void ggml_compute_forward_mul_mat_f32(
     // total rows in src0
     const int nr = ne01*ne02*ne03;
 
-    // rows per thread
-    const int dr = (nr + nth - 1)/nth;
+    // rows per chunk
+    const int dr = ggml_mul_mat_chunk_rows(nr, nb01, nth, 1);
 
-    // row range for this thread
-    const int ir0 = dr*ith;
-    const int ir1 = MIN(ir0 + dr, nr);
+    while (true) {
+        // row range for the next chunk
+        const int ir0 = dr*atomic_fetch_add(params->current_chunk, 1);
+        if (ir0 >= nr) {
+            break;
+        }
+        const int ir1 = MIN(ir0 + dr, nr);
 
-    for (int ir = ir0; ir < ir1; ++ir) {
-        // src0 indices
-        const int i03 = ir/(ne02*ne01);
-        const int i02 = (ir - i03*ne02*ne01)/ne01;
-        const int i01 = (ir - i03*ne02*ne01 - i02*ne01);
+        for (int ir = ir0; ir < ir1; ++ir) {
+            // src0 indices
+            const int i03 = ir/(ne02*ne01);
+            const int i02 = (ir - i03*ne02*ne01)/ne01;
+            const int i01 = (ir - i03*ne02*ne01 - i02*ne01);
 
-        for (int64_t ic = 0; ic < ne11; ++ic) {
-            // src1 indices
-            const int i13 = i03;
-            const int i12 = i02;
-            const int i11 = ic;
+            for (int64_t ic = 0; ic < ne11; ++ic) {
+                // src1 indices
+                const int i13 = i03;
+                const int i12 = i02;
+                const int i11 = ic;
 
-            // dst indices
-            const int i0 = i01;
-            const int i1 = i11;
-            const int i2 = i02;
-            const int i3 = i03;
-
-            ggml_vec_dot_f32(ne00,
-                    (float *) ((char *)  dst->data + (i0*nb0 + i1*nb1 + i2*nb2 + i3*nb3)),
-                    (float *) ((char *) src0->data + (i01*nb01 + i02*nb02 + i03*nb03)),
-                    (float *) ((char *) src1->data + (i11*nb11 + i12*nb12 + i13*nb13)));
+                // dst indices
+                const int i0 = i01;
+                const int i1 = i11;
+                const int i2 = i02;
+                const int i3 = i03;
+
+                ggml_vec_dot_f32(ne00,
+                        (float *) ((char *)  dst->data + (i0*nb0 + i1*nb1 + i2*nb2 + i3*nb3)),
+                        (float *) ((char *) src0->data + (i01*nb01 + i02*nb02 + i03*nb03)),
+                        (float *) ((char *) src1->data + (i11*nb11 + i12*nb12 + i13*nb13)));
+            }
         }
     }
 
@@ -9690,7 +10115,6 @@ static void ggml_compute_forward_mul_mat_f16_f32(
     const int nb2  = dst->nb[2];
     const int nb3  = dst->nb[3];
 
-    const int ith = params->ith;
     const int nth = params->nth;
 
     GGML_ASSERT(ne02 == ne12);
@@ -9813,35 +10237,40 @@ static void ggml_compute_forward_mul_mat_f16_f32(
     // total rows in src0
     const int nr = ne01*ne02*ne03;
 
-    // rows per thread
-    const int dr = (nr + nth - 1)/nth;
-
-    // row range for this thread
-    const int ir0 = dr*ith;
-    const int ir1 = MIN(ir0 + dr, nr);
+    // rows per chunk
+    const int dr = ggml_mul_mat_chunk_rows(nr, nb01, nth, 1);
 
     ggml_fp16_t * wdata = params->wdata;
 
-    for (int ir = ir0; ir < ir1; ++ir) {
-        // src0 indices
-        const int i03 = ir/(ne02*ne01);
-        const int i02 = (ir - i03*ne02*ne01)/ne01;
-        const int i01 = (ir - i03*ne02*ne01 - i02*ne01);
+    while (true) {
+        // row range for the next chunk
+        const int ir0 = dr*atomic_fetch_add(params->current_chunk, 1);
+        if (ir0 >= nr) {
+            break;
+        }
+        const int ir1 = MIN(ir0 + dr, nr);
 
-        const int i13 = i03;
-        const int i12 = i02;
+        for (int ir = ir0; ir < ir1; ++ir) {
+            // src0 indices
+            const int i03 = ir/(ne02*ne01);
+            const int i02 = (ir - i03*ne02*ne01)/ne01;
+            const int i01 = (ir - i03*ne02*ne01 - i02*ne01);
 
-        const int i0 = i01;
-        const int i2 = i02;
-        const int i3 = i03;
+            const int i13 = i03;
+            const int i12 = i02;
 
-        ggml_fp16_t * src0_row = (ggml_fp16_t *) ((char *) src0->data + (i01*nb01 + i02*nb02 + i03*nb03));
-        ggml_fp16_t * src1_col =                                wdata + (       0 + i12*ne11 + i13*ne12*ne11)*ne00;
+            const int i0 = i01;
+            const int i2 = i02;
+            const int i3 = i03;
 
-        float * dst_col = (float *) ((char *) dst->data + (i0*nb0 + 0*nb1 + i2*nb2 + i3*nb3));
+            ggml_fp16_t * src0_row = (ggml_fp16_t *) ((char *) src0->data + (i01*nb01 + i02*nb02 + i03*nb03));
+            ggml_fp16_t * src1_col =                                wdata + (       0 + i12*ne11 + i13*ne12*ne11)*ne00;
 
-        for (int64_t ic = 0; ic < ne11; ++ic) {
-            ggml_vec_dot_f16(ne00, &dst_col[ic*ne0], src0_row, src1_col + ic*ne00);
+            float * dst_col = (float *) ((char *) dst->data + (i0*nb0 + 0*nb1 + i2*nb2 + i3*nb3));
+
+            for (int64_t ic = 0; ic < ne11; ++ic) {
+                ggml_vec_dot_f16(ne00, &dst_col[ic*ne0], src0_row, src1_col + ic*ne00);
+            }
         }
     }
 
@@ -9896,7 +10325,6 @@ static void ggml_compute_forward_mul_mat_q_f32(
     const int nb2  = dst->nb[2];
     const int nb3  = dst->nb[3];
 
-    const int ith = params->ith;
     const int nth = params->nth;
 
     GGML_ASSERT(ne02 == ne12);
@@ -9907,6 +10335,7 @@ static void ggml_compute_forward_mul_mat_q_f32(
     const enum ggml_type type = src0->type;
     quantize_row_q_t const quantize_row_q_dot = quantize_fns[type].quantize_row_q_dot;
     vec_dot_q_t      const vec_dot_q          = quantize_fns[type].vec_dot_q;
+    vec_dot_q_tile_t const vec_dot_q_tile     = quantize_fns[type].vec_dot_q_tile;
     enum ggml_type   const vec_dot_type       = quantize_fns[type].vec_dot_type;
 
     // we don't support permuted src0 or src1
@@ -10017,38 +10446,116 @@ static void ggml_compute_forward_mul_mat_q_f32(
     // total rows in src0
     const int nr = ne01*ne02*ne03;
 
-    // rows per thread
-    const int dr = (nr + nth - 1)/nth;
-
-    // row range for this thread
-    const int ir0 = dr*ith;
-    const int ir1 = MIN(ir0 + dr, nr);
+    // rows per chunk
+    const int dr = ggml_mul_mat_chunk_rows(nr, nb01, nth, MAX(1, src0->n_interleave));
 
     void * wdata = params->wdata;
     const size_t row_size = ne00*GGML_TYPE_SIZE[vec_dot_type]/GGML_BLCK_SIZE[vec_dot_type];
 
-    for (int ir = ir0; ir < ir1; ++ir) {
-        // src0 indices
-        const int i03 = ir/(ne02*ne01);
-        const int i02 = (ir - i03*ne02*ne01)/ne01;
-        const int i01 = (ir - i03*ne02*ne01 - i02*ne01);
+    // columns of src1 per block in the batched case - a block is reused for all rows of a chunk, so keep it in L2
+    const int64_t blck_1 = MAX(GGML_VEC_DOT_TILE_N, (int64_t) (GGML_MUL_MAT_CHUNK_SIZE/row_size)/GGML_VEC_DOT_TILE_N*GGML_VEC_DOT_TILE_N);
 
-        const int i13 = i03;
-        const int i12 = i02;
+    while (true) {
+        // row range for the next chunk
+        const int ir0 = dr*atomic_fetch_add(params->current_chunk, 1);
+        if (ir0 >= nr) {
+            break;
+        }
+        const int ir1 = MIN(ir0 + dr, nr);
 
-        const int i0 = i01;
-        const int i2 = i02;
-        const int i3 = i03;
+#if defined(__AVX2__)
+        if (src0->n_interleave > 0) {
+            // interleaved src0: GGML_INTERLEAVE_ROWS rows per call, src1 is read once for all of them
+            GGML_ASSERT(type == GGML_TYPE_Q4_0 && src0->n_interleave == GGML_INTERLEAVE_ROWS);
 
-        void * src0_row = (void *) ((char *) src0->data + (i01*nb01 + i02*nb02 + i03*nb03));
-        char * src1_col =          ((char *)      wdata + (      (0 + i12*ne11 + i13*ne12*ne11)*row_size));
+            for (int ir = ir0; ir < ir1; ir += GGML_INTERLEAVE_ROWS) {
+                const int i03 = ir/(ne02*ne01);
+                const int i02 = (ir - i03*ne02*ne01)/ne01;
+                const int i01 = (ir - i03*ne02*ne01 - i02*ne01);
 
-        float * dst_col = (float *) ((char *) dst->data + (i0*nb0 + 0*nb1 + i2*nb2 + i3*nb3));
+                void * src0_group = (void *) ((char *) src0->data + (i01*nb01 + i02*nb02 + i03*nb03));
+                char * src1_col   =          ((char *)      wdata + (      (0 + i02*ne11 + i03*ne12*ne11)*row_size));
 
-        assert(ne00 % 32 == 0);
+                float * dst_col = (float *) ((char *) dst->data + (i01*nb0 + 0*nb1 + i02*nb2 + i03*nb3));
+
+                for (int64_t ic = 0; ic < ne11; ++ic) {
+                    ggml_vec_dot_q4_0_q8_0_interleaved(ne00, &dst_col[ic*ne0], src0_group, (void *) (src1_col + ic*row_size));
+                }
+            }
+
+            continue;
+        }
+#endif
+
+        if (vec_dot_q_tile && ne11 >= GGML_VEC_DOT_TILE_N) {
+            // batched case: walk the chunk in blocks of src1 columns and compute
+            // GGML_VEC_DOT_TILE_M x GGML_VEC_DOT_TILE_N tiles of dst at once
+            for (int64_t ic0 = 0; ic0 < ne11; ic0 += blck_1) {
+                const int64_t ic1 = MIN(ic0 + blck_1, ne11);
+
+                for (int ir = ir0; ir < ir1; ir += GGML_VEC_DOT_TILE_M) {
+                    const int i03 = ir/(ne02*ne01);
+                    const int i02 = (ir - i03*ne02*ne01)/ne01;
+                    const int i01 = (ir - i03*ne02*ne01 - i02*ne01);
+
+                    int64_t ic = ic0;
 
-        for (int64_t ic = 0; ic < ne11; ++ic) {
-            vec_dot_q(ne00, &dst_col[ic*ne0], src0_row, (void *) (src1_col + ic*row_size));
+                    // the rows of a tile must be in the same src0 matrix
+                    if (ir + GGML_VEC_DOT_TILE_M <= ir1 && i01 + GGML_VEC_DOT_TILE_M <= ne01) {
+                        void * src0_row = (void *) ((char *) src0->data + (i01*nb01 + i02*nb02 + i03*nb03));
+                        char * src1_col =          ((char *)      wdata + (      (0 + i02*ne11 + i03*ne12*ne11)*row_size));
+
+                        float * dst_col = (float *) ((char *) dst->data + (i01*nb0 + 0*nb1 + i02*nb2 + i03*nb3));
+
+                        for (; ic + GGML_VEC_DOT_TILE_N <= ic1; ic += GGML_VEC_DOT_TILE_N) {
+                            vec_dot_q_tile(ne00, &dst_col[ic*ne0], ne0, src0_row, nb01, (void *) (src1_col + ic*row_size), row_size);
+                        }
+                    }
+
+                    // leftovers
+                    for (int jr = ir; jr < MIN(ir + GGML_VEC_DOT_TILE_M, ir1); ++jr) {
+                        const int j03 = jr/(ne02*ne01);
+                        const int j02 = (jr - j03*ne02*ne01)/ne01;
+                        const int j01 = (jr - j03*ne02*ne01 - j02*ne01);
+
+                        void * src0_row = (void *) ((char *) src0->data + (j01*nb01 + j02*nb02 + j03*nb03));
+                        char * src1_col =          ((char *)      wdata + (      (0 + j02*ne11 + j03*ne12*ne11)*row_size));
+
+                        float * dst_col = (float *) ((char *) dst->data + (j01*nb0 + 0*nb1 + j02*nb2 + j03*nb3));
+
+                        for (int64_t jc = ic; jc < ic1; ++jc) {
+                            vec_dot_q(ne00, &dst_col[jc*ne0], src0_row, (void *) (src1_col + jc*row_size));
+                        }
+                    }
+                }
+            }
+
+            continue;
+        }
+
+        for (int ir = ir0; ir < ir1; ++ir) {
+            // src0 indices
+            const int i03 = ir/(ne02*ne01);
+            const int i02 = (ir - i03*ne02*ne01)/ne01;
+            const int i01 = (ir - i03*ne02*ne01 - i02*ne01);
+
+            const int i13 = i03;
+            const int i12 = i02;
+
+            const int i0 = i01;
+            const int i2 = i02;
+            const int i3 = i03;
+
+            void * src0_row = (void *) ((char *) src0->data + (i01*nb01 + i02*nb02 + i03*nb03));
+            char * src1_col =          ((char *)      wdata + (      (0 + i12*ne11 + i13*ne12*ne11)*row_size));
+
+            float * dst_col = (float *) ((char *) dst->data + (i0*nb0 + 0*nb1 + i2*nb2 + i3*nb3));
+
+            assert(ne00 % 32 == 0);
+
+            for (int64_t ic = 0; ic < ne11; ++ic) {
+                vec_dot_q(ne00, &dst_col[ic*ne0], src0_row, (void *) (src1_col + ic*row_size));
+            }
         }
     }
 
@@ -10732,6 +11239,79 @@ static void ggml_compute_forward_diag_mask_zero(
     }
 }
 
+// ggml_compute_forward_mask_inf
+
+static void ggml_compute_forward_mask_inf_f32(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
+        const struct ggml_tensor * opt0,
+        struct ggml_tensor * dst) {
+    assert(src1->type == GGML_TYPE_I32);
+    assert(ggml_is_contiguous(src1));
+
+    const bool inplace = (bool) ggml_get_i32_1d(opt0, 0);
+
+    if (!inplace && (params->type == GGML_TASK_INIT)) {
+        // memcpy needs to be synchronized across threads to avoid race conditions.
+        // => do it in INIT phase
+        GGML_ASSERT(ggml_nelements(dst) == ggml_nelements(src0));
+        GGML_ASSERT(ggml_is_contiguous(dst) && ggml_is_contiguous(src0));
+        memcpy(
+            ((char *)  dst->data),
+            ((char *) src0->data),
+            ggml_nbytes(dst));
+    }
+
+    if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
+        return;
+    }
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int64_t nc = dst->ne[0];
+    const int64_t n1 = dst->ne[1];
+    const int64_t n2 = dst->ne[2];
+    const int64_t nr = ggml_nrows(dst);
+
+    assert(dst->nb[0] == sizeof(float));
+
+    for (int64_t ir = ith; ir < nr; ir += nth) {
+        const int64_t i3 = ir/(n2*n1);
+        const int64_t i2 = (ir - i3*n2*n1)/n1;
+        const int64_t i1 = (ir - i3*n2*n1 - i2*n1);
+
+        const int32_t * mask = (const int32_t *) src1->data + i1*nc;
+
+        float * row = (float *)((char *) dst->data + i3*dst->nb[3] + i2*dst->nb[2] + i1*dst->nb[1]);
+
+        for (int64_t i0 = 0; i0 < nc; i0++) {
+            if (mask[i0] == 0) {
+                row[i0] = -INFINITY;
+            }
+        }
+    }
+}
+
+static void ggml_compute_forward_mask_inf(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
+        const struct ggml_tensor * opt0,
+        struct ggml_tensor * dst) {
+    switch (src0->type) {
+        case GGML_TYPE_F32:
+            {
+                ggml_compute_forward_mask_inf_f32(params, src0, src1, opt0, dst);
+            } break;
+        default:
+            {
+                GGML_ASSERT(false);
+            } break;
+    }
+}
+
 // ggml_compute_forward_soft_max
 
 static void ggml_compute_forward_soft_max_f32(
@@ -11070,6 +11650,9 @@ static void ggml_compute_forward_rope_f32(
     const int n_dims = ((int32_t *) src1->data)[1];
     const int mode   = ((int32_t *) src1->data)[2];
 
+    // optional per-row positions (ggml_rope_pos)
+    const int32_t * pos = dst->opt[0] ? (const int32_t *) dst->opt[0]->data : NULL;
+
     assert(n_past >= 0);
 
     const size_t nb00 = src0->nb[0];
@@ -11116,7 +11699,7 @@ static void ggml_compute_forward_rope_f32(
 
     for (int64_t i3 = 0; i3 < ne3; i3++) {
         for (int64_t i2 = ((mode & 1) == 0 ? 0 : n_past); i2 < ne2; i2++) {
-            const int64_t p = ((mode & 1) == 0 ? n_past + i2 : i2);
+            const int64_t p = pos ? pos[i2] : ((mode & 1) == 0 ? n_past + i2 : i2);
             for (int64_t i1 = 0; i1 < ne1; i1++) {
                 if (ir++ < ir0) continue;
                 if (ir   > ir1) break;
@@ -11183,6 +11766,9 @@ static void ggml_compute_forward_rope_f16(
     const int n_dims = ((int32_t *) src1->data)[1];
     const int mode   = ((int32_t *) src1->data)[2];
 
+    // optional per-row positions (ggml_rope_pos)
+    const int32_t * pos = dst->opt[0] ? (const int32_t *) dst->opt[0]->data : NULL;
+
     assert(n_past >= 0);
 
     const size_t nb00 = src0->nb[0];
@@ -11229,7 +11815,7 @@ static void ggml_compute_forward_rope_f16(
 
     for (int64_t i3 = 0; i3 < ne3; i3++) {
         for (int64_t i2 = ((mode & 1) == 0 ? 0 : n_past); i2 < ne2; i2++) {
-            const int64_t p = ((mode & 1) == 0 ? n_past + i2 : i2);
+            const int64_t p = pos ? pos[i2] : ((mode & 1) == 0 ? n_past + i2 : i2);
             for (int64_t i1 = 0; i1 < ne1; i1++) {
                 if (ir++ < ir0) continue;
                 if (ir   > ir1) break;
@@ -13017,6 +13603,10 @@ static void ggml_compute_forward(struct ggml_compute_params * params, struct ggm
             {
                 ggml_compute_forward_diag_mask_zero(params, tensor->src0, tensor->src1, tensor);
             } break;
+        case GGML_OP_MASK_INF:
+            {
+                ggml_compute_forward_mask_inf(params, tensor->src0, tensor->src1, tensor->opt[0], tensor);
+            } break;
         case GGML_OP_SOFT_MAX:
             {
                 ggml_compute_forward_soft_max(params, tensor->src0, tensor);
@@ -13642,6 +14232,10 @@ static void ggml_compute_backward(struct ggml_context * ctx, struct ggml_tensor
                     // noop
                 }
             } break;
+        case GGML_OP_MASK_INF:
+            {
+                GGML_ASSERT(false); // TODO: not implemented
+            } break;
         case GGML_OP_SOFT_MAX:
             {
                 // necessary for llama
@@ -13970,15 +14564,33 @@ typedef pthread_t ggml_thread_t;
 
 #endif
 
+typedef pthread_mutex_t ggml_mutex_t;
+typedef pthread_cond_t  ggml_cond_t;
+
+#define ggml_mutex_init(x)    pthread_mutex_init(x, NULL)
+#define ggml_mutex_destroy    pthread_mutex_destroy
+#define ggml_mutex_lock       pthread_mutex_lock
+#define ggml_mutex_unlock     pthread_mutex_unlock
+
+#define ggml_cond_init(x)     pthread_cond_init(x, NULL)
+#define ggml_cond_destroy     pthread_cond_destroy
+#define ggml_cond_wait        pthread_cond_wait
+#define ggml_cond_broadcast   pthread_cond_broadcast
+
 struct ggml_compute_state_shared {
     ggml_lock_t spin;
 
-    int n_threads;
+    int n_threads; // number of threads working on the current graph
+    int n_spin;    // busy-wait iterations before a waiting thread goes to sleep, < 0 - never sleep
+
+    atomic_int current_chunk; // see ggml_compute_params
 
     // synchronization primitives
-    atomic_int  n_ready;
-    atomic_bool has_work;
-    atomic_bool stop; // stop all threads
+    atomic_int n_dispatch; // incremented by the main thread each time it hands out a task
+    atomic_int n_done;     // number of workers that finished the current task
+
+    atomic_int n_sleeping;    // number of workers sleeping on cond_task
+    atomic_int main_sleeping; // the main thread is sleeping on cond_done
 };
 
 struct ggml_compute_state {
@@ -13987,97 +14599,338 @@ struct ggml_compute_state {
     struct ggml_compute_params params;
     struct ggml_tensor * node;
 
-    struct ggml_compute_state_shared * shared;
+    bool has_graph; // protected by pool->mutex
+
+    struct ggml_threadpool_stats stats;
+
+    struct ggml_threadpool * pool;
 };
 
-static thread_ret_t ggml_graph_compute_thread(void * data) {
-    struct ggml_compute_state * state = (struct ggml_compute_state *) data;
+//
+// thread pool
+//
+// the worker threads are created once and park on a condition variable between graphs
+// while a graph is being computed, waiting threads busy-wait for n_spin iterations and then
+// go to sleep, so that they don't burn the CPU while other threads do long single-threaded work
+//
 
-    const int n_threads = state->shared->n_threads;
+struct ggml_threadpool {
+    ggml_mutex_t mutex;
+    ggml_cond_t  cond;      // new graph or stop
+    ggml_cond_t  cond_task; // new task for the workers
+    ggml_cond_t  cond_done; // all workers finished the current task
 
-    while (true) {
-        if (atomic_fetch_add(&state->shared->n_ready, 1) == n_threads - 1) {
-            atomic_store(&state->shared->has_work, false);
-        } else {
-            while (atomic_load(&state->shared->has_work)) {
-                if (atomic_load(&state->shared->stop)) {
-                    return 0;
-                }
-                ggml_lock_lock  (&state->shared->spin);
-                ggml_lock_unlock(&state->shared->spin);
-            }
+    int  n_threads; // including the thread calling ggml_graph_compute_with_pool()
+    int  n_spin;
+    bool stop;      // protected by mutex
+
+    struct ggml_compute_state_shared shared;
+    struct ggml_compute_state * workers; // [n_threads - 1]
+
+    struct ggml_threadpool_stats stats; // main thread
+};
+
+// wait until the main thread hands out a task different from n_seen
+static void ggml_graph_compute_wait_task(struct ggml_compute_state * state, int n_seen) {
+    struct ggml_threadpool           * pool   = state->pool;
+    struct ggml_compute_state_shared * shared = &pool->shared;
+
+    const int64_t t_start_us = ggml_time_us();
+
+    for (int i = 0; shared->n_spin < 0 || i < shared->n_spin; i++) {
+        if (atomic_load(&shared->n_dispatch) != n_seen) {
+            state->stats.t_spin_us += ggml_time_us() - t_start_us;
+            return;
         }
+        ggml_lock_lock  (&shared->spin);
+        ggml_lock_unlock(&shared->spin);
+    }
 
-        atomic_fetch_sub(&state->shared->n_ready, 1);
+    const int64_t t_sleep_us = ggml_time_us();
 
-        // wait for work
-        while (!atomic_load(&state->shared->has_work)) {
-            if (atomic_load(&state->shared->stop)) {
-                return 0;
-            }
-            ggml_lock_lock  (&state->shared->spin);
-            ggml_lock_unlock(&state->shared->spin);
+    ggml_mutex_lock(&pool->mutex);
+    atomic_fetch_add(&shared->n_sleeping, 1);
+    while (atomic_load(&shared->n_dispatch) == n_seen) {
+        ggml_cond_wait(&pool->cond_task, &pool->mutex);
+    }
+    atomic_fetch_sub(&shared->n_sleeping, 1);
+    ggml_mutex_unlock(&pool->mutex);
+
+    state->stats.t_spin_us  += t_sleep_us - t_start_us;
+    state->stats.t_sleep_us += ggml_time_us() - t_sleep_us;
+    state->stats.n_sleep++;
+}
+
+// runs the tasks handed out by the main thread until the end of the current graph
+static void ggml_graph_compute_worker(struct ggml_compute_state * state) {
+    struct ggml_threadpool           * pool   = state->pool;
+    struct ggml_compute_state_shared * shared = &pool->shared;
+
+    int n_seen = 0;
+
+    while (true) {
+        ggml_graph_compute_wait_task(state, n_seen);
+        n_seen++;
+
+        struct ggml_tensor * node = state->node;
+
+        if (node && state->params.ith < state->params.nth) {
+            const int64_t t_start_us = ggml_time_us();
+            ggml_compute_forward(&state->params, node);
+            state->stats.t_compute_us += ggml_time_us() - t_start_us;
         }
 
-        // check if we should stop
-        if (atomic_load(&state->shared->stop)) {
+        // the last worker to finish wakes up the main thread if it went to sleep
+        if (atomic_fetch_add(&shared->n_done, 1) == shared->n_threads - 2 && atomic_load(&shared->main_sleeping)) {
+            ggml_mutex_lock(&pool->mutex);
+            ggml_cond_broadcast(&pool->cond_done);
+            ggml_mutex_unlock(&pool->mutex);
+        }
+
+        // a NULL node marks the end of the graph
+        if (!node) {
             break;
         }
+    }
+}
 
-        if (state->node) {
-            if (state->params.ith < state->params.nth) {
-                ggml_compute_forward(&state->params, state->node);
-            }
+static thread_ret_t ggml_graph_compute_thread(void * data) {
+    struct ggml_compute_state * state = (struct ggml_compute_state *) data;
+    struct ggml_threadpool    * pool  = state->pool;
 
-            state->node = NULL;
-        } else {
+    while (true) {
+        // park until we are part of a graph
+        ggml_mutex_lock(&pool->mutex);
+        while (!state->has_graph && !pool->stop) {
+            ggml_cond_wait(&pool->cond, &pool->mutex);
+        }
+        if (pool->stop) {
+            ggml_mutex_unlock(&pool->mutex);
             break;
         }
+        state->has_graph = false;
+        ggml_mutex_unlock(&pool->mutex);
+
+        ggml_graph_compute_worker(state);
     }
 
     return 0;
 }
 
-void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph) {
-    const int n_threads = cgraph->n_threads;
-
-    struct ggml_compute_state_shared state_shared = {
-        /*.spin      =*/ GGML_LOCK_INITIALIZER,
-        /*.n_threads =*/ n_threads,
-        /*.n_ready   =*/ 0,
-        /*.has_work  =*/ false,
-        /*.stop      =*/ false,
+struct ggml_threadpool * ggml_threadpool_new(int n_threads) {
+    n_threads = MAX(1, n_threads);
+
+    struct ggml_threadpool * pool = malloc(sizeof(struct ggml_threadpool));
+    GGML_ASSERT(pool);
+
+    ggml_mutex_init(&pool->mutex);
+    ggml_cond_init(&pool->cond);
+    ggml_cond_init(&pool->cond_task);
+    ggml_cond_init(&pool->cond_done);
+
+    pool->n_threads = n_threads;
+    pool->n_spin    = GGML_DEFAULT_N_SPIN;
+    pool->stop      = false;
+
+    pool->shared = (struct ggml_compute_state_shared) {
+        /*.spin          =*/ GGML_LOCK_INITIALIZER,
+        /*.n_threads     =*/ 1,
+        /*.n_spin        =*/ GGML_DEFAULT_N_SPIN,
+        /*.current_chunk =*/ 0,
+        /*.n_dispatch    =*/ 0,
+        /*.n_done        =*/ 0,
+        /*.n_sleeping    =*/ 0,
+        /*.main_sleeping =*/ 0,
     };
-    struct ggml_compute_state * workers = n_threads > 1 ? alloca(sizeof(struct ggml_compute_state)*(n_threads - 1)) : NULL;
 
-    // create thread pool
-    if (n_threads > 1) {
-        ggml_lock_init(&state_shared.spin);
+    ggml_lock_init(&pool->shared.spin);
+
+    pool->workers = NULL;
 
-        atomic_store(&state_shared.has_work, true);
+    memset(&pool->stats, 0, sizeof(pool->stats));
+
+    if (n_threads > 1) {
+        pool->workers = malloc(sizeof(struct ggml_compute_state)*(n_threads - 1));
+        GGML_ASSERT(pool->workers);
 
         for (int j = 0; j < n_threads - 1; j++) {
-            workers[j] = (struct ggml_compute_state) {
-                .thrd   = 0,
-                .params = {
-                    .type  = GGML_TASK_COMPUTE,
-                    .ith   = j + 1,
-                    .nth   = n_threads,
-                    .wsize = cgraph->work ? ggml_nbytes(cgraph->work) : 0,
-                    .wdata = cgraph->work ? cgraph->work->data : NULL,
-                },
-                .node   = NULL,
-                .shared = &state_shared,
+            pool->workers[j] = (struct ggml_compute_state) {
+                .thrd      = 0,
+                .node      = NULL,
+                .has_graph = false,
+                .stats     = { 0 },
+                .pool      = pool,
             };
 
-            int rc = ggml_thread_create(&workers[j].thrd, NULL, ggml_graph_compute_thread, &workers[j]);
+            int rc = ggml_thread_create(&pool->workers[j].thrd, NULL, ggml_graph_compute_thread, &pool->workers[j]);
             GGML_ASSERT(rc == 0);
             UNUSED(rc);
         }
     }
 
+    return pool;
+}
+
+void ggml_threadpool_free(struct ggml_threadpool * pool) {
+    if (pool == NULL) {
+        return;
+    }
+
+    ggml_mutex_lock(&pool->mutex);
+    pool->stop = true;
+    ggml_cond_broadcast(&pool->cond);
+    ggml_mutex_unlock(&pool->mutex);
+
+    for (int j = 0; j < pool->n_threads - 1; j++) {
+        int rc = ggml_thread_join(pool->workers[j].thrd, NULL);
+        GGML_ASSERT(rc == 0);
+        UNUSED(rc);
+    }
+
+    ggml_lock_destroy(&pool->shared.spin);
+
+    ggml_cond_destroy(&pool->cond_done);
+    ggml_cond_destroy(&pool->cond_task);
+    ggml_cond_destroy(&pool->cond);
+    ggml_mutex_destroy(&pool->mutex);
+
+    free(pool->workers);
+    free(pool);
+}
+
+int ggml_threadpool_n_threads(const struct ggml_threadpool * pool) {
+    return pool->n_threads;
+}
+
+void ggml_threadpool_set_n_spin(struct ggml_threadpool * pool, int n_spin) {
+    pool->n_spin = n_spin;
+}
+
+struct ggml_threadpool_stats ggml_threadpool_get_stats(const struct ggml_threadpool * pool) {
+    struct ggml_threadpool_stats result = pool->stats;
+
+    for (int j = 0; j < pool->n_threads - 1; j++) {
+        const struct ggml_threadpool_stats * stats = &pool->workers[j].stats;
+
+        result.t_compute_us += stats->t_compute_us;
+        result.t_spin_us    += stats->t_spin_us;
+        result.t_sleep_us   += stats->t_sleep_us;
+        result.n_sleep      += stats->n_sleep;
+    }
+
+    return result;
+}
+
+void ggml_threadpool_reset_stats(struct ggml_threadpool * pool) {
+    memset(&pool->stats, 0, sizeof(pool->stats));
+
+    for (int j = 0; j < pool->n_threads - 1; j++) {
+        memset(&pool->workers[j].stats, 0, sizeof(pool->workers[j].stats));
+    }
+}
+
+// hand out a task to the workers of the current graph
+// node == NULL signals the end of the graph
+static void ggml_graph_compute_dispatch(
+        struct ggml_threadpool * pool,
+        struct ggml_cgraph     * cgraph,
+        struct ggml_tensor     * node,
+        enum ggml_task_type      type) {
+    struct ggml_compute_state_shared * shared = &pool->shared;
+
+    for (int j = 0; j < shared->n_threads - 1; j++) {
+        pool->workers[j].params = (struct ggml_compute_params) {
+            .type  = type,
+            .ith   = j + 1,
+            .nth   = node ? node->n_tasks : 0,
+            .wsize = cgraph->work ? ggml_nbytes(cgraph->work) : 0,
+            .wdata = cgraph->work ? cgraph->work->data : NULL,
+            .current_chunk = &shared->current_chunk,
+        };
+        pool->workers[j].node = node;
+    }
+
+    atomic_store(&shared->n_done, 0);
+    atomic_fetch_add(&shared->n_dispatch, 1);
+
+    if (atomic_load(&shared->n_sleeping) > 0) {
+        ggml_mutex_lock(&pool->mutex);
+        ggml_cond_broadcast(&pool->cond_task);
+        ggml_mutex_unlock(&pool->mutex);
+    }
+}
+
+// wait until all workers of the current graph are done with the last task
+static void ggml_graph_compute_wait(struct ggml_threadpool * pool) {
+    struct ggml_compute_state_shared * shared = &pool->shared;
+
+    const int64_t t_start_us = ggml_time_us();
+
+    for (int i = 0; shared->n_spin < 0 || i < shared->n_spin; i++) {
+        if (atomic_load(&shared->n_done) == shared->n_threads - 1) {
+            pool->stats.t_spin_us += ggml_time_us() - t_start_us;
+            return;
+        }
+        ggml_lock_lock  (&shared->spin);
+        ggml_lock_unlock(&shared->spin);
+    }
+
+    const int64_t t_sleep_us = ggml_time_us();
+
+    ggml_mutex_lock(&pool->mutex);
+    atomic_store(&shared->main_sleeping, 1);
+    while (atomic_load(&shared->n_done) < shared->n_threads - 1) {
+        ggml_cond_wait(&pool->cond_done, &pool->mutex);
+    }
+    atomic_store(&shared->main_sleeping, 0);
+    ggml_mutex_unlock(&pool->mutex);
+
+    pool->stats.t_spin_us  += t_sleep_us - t_start_us;
+    pool->stats.t_sleep_us += ggml_time_us() - t_sleep_us;
+    pool->stats.n_sleep++;
+}
+
+// main thread part of a task
+static void ggml_graph_compute_forward_main(struct ggml_threadpool * pool, struct ggml_compute_params * params, struct ggml_tensor * node) {
+    const int64_t t_start_us = ggml_time_us();
+    ggml_compute_forward(params, node);
+    pool->stats.t_compute_us += ggml_time_us() - t_start_us;
+}
+
+void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph) {
+    struct ggml_threadpool * pool = ggml_threadpool_new(cgraph->n_threads);
+
+    ggml_graph_compute_with_pool(ctx, cgraph, pool);
+
+    ggml_threadpool_free(pool);
+}
+
+void ggml_graph_compute_range(struct ggml_context * ctx, struct ggml_cgraph * cgraph, struct ggml_threadpool * pool, int i_begin, int i_end) {
+    GGML_ASSERT(0 <= i_begin && i_begin <= i_end && i_end <= cgraph->n_nodes);
+
+    const int n_threads = MAX(1, MIN(cgraph->n_threads, pool->n_threads));
+
+    struct ggml_compute_state_shared * shared = &pool->shared;
+
+    // wake up the workers that take part in this graph
+    if (n_threads > 1) {
+        shared->n_threads = n_threads;
+        shared->n_spin    = pool->n_spin;
+
+        atomic_store(&shared->n_dispatch, 0);
+        atomic_store(&shared->n_done,     0);
+
+        ggml_mutex_lock(&pool->mutex);
+        for (int j = 0; j < n_threads - 1; j++) {
+            pool->workers[j].has_graph = true;
+        }
+        ggml_cond_broadcast(&pool->cond);
+        ggml_mutex_unlock(&pool->mutex);
+    }
+
     // initialize tasks + work buffer
-    {
+    // the whole graph is planned once, by its first range, the following ranges reuse the tasks and the work buffer
+    if (i_begin == 0) {
         size_t work_size = 0;
 
         // thread scheduling for the different operations
@@ -14232,6 +15085,7 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
                         node->n_tasks = 1;
                     } break;
                 case GGML_OP_DIAG_MASK_INF:
+                case GGML_OP_MASK_INF:
                 case GGML_OP_SOFT_MAX:
                 case GGML_OP_ROPE:
                 case GGML_OP_ROPE_BACK:
@@ -14345,7 +15199,7 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
     const int64_t perf_start_cycles  = ggml_perf_cycles();
     const int64_t perf_start_time_us = ggml_perf_time_us();
 
-    for (int i = 0; i < cgraph->n_nodes; i++) {
+    for (int i = i_begin; i < i_end; i++) {
         GGML_PRINT_DEBUG_5("%s: %d/%d\n", __func__, i, cgraph->n_nodes);
 
         struct ggml_tensor * node = cgraph->nodes[i];
@@ -14365,118 +15219,37 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
             /*.nth   =*/ node->n_tasks,
             /*.wsize =*/ cgraph->work ? ggml_nbytes(cgraph->work) : 0,
             /*.wdata =*/ cgraph->work ? cgraph->work->data : NULL,
+            /*.current_chunk =*/ &pool->shared.current_chunk,
         };
 
-        ggml_compute_forward(&params, node);
+        ggml_graph_compute_forward_main(pool, &params, node);
 
         // COMPUTE
-        if (node->n_tasks > 1) {
-            if (atomic_fetch_add(&state_shared.n_ready, 1) == n_threads - 1) {
-                atomic_store(&state_shared.has_work, false);
-            }
-
-            while (atomic_load(&state_shared.has_work)) {
-                ggml_lock_lock  (&state_shared.spin);
-                ggml_lock_unlock(&state_shared.spin);
-            }
+        atomic_store(&pool->shared.current_chunk, 0);
 
-            // launch thread pool
-            for (int j = 0; j < n_threads - 1; j++) {
-                workers[j].params = (struct ggml_compute_params) {
-                    .type  = GGML_TASK_COMPUTE,
-                    .ith   = j + 1,
-                    .nth   = node->n_tasks,
-                    .wsize = cgraph->work ? ggml_nbytes(cgraph->work) : 0,
-                    .wdata = cgraph->work ? cgraph->work->data : NULL,
-                };
-                workers[j].node = node;
-            }
-
-            atomic_fetch_sub(&state_shared.n_ready, 1);
-
-            while (atomic_load(&state_shared.n_ready) > 0) {
-                ggml_lock_lock  (&state_shared.spin);
-                ggml_lock_unlock(&state_shared.spin);
-            }
-
-            atomic_store(&state_shared.has_work, true);
+        if (node->n_tasks > 1) {
+            ggml_graph_compute_dispatch(pool, cgraph, node, GGML_TASK_COMPUTE);
         }
 
         params.type = GGML_TASK_COMPUTE;
-        ggml_compute_forward(&params, node);
+        ggml_graph_compute_forward_main(pool, &params, node);
 
         // wait for thread pool
         if (node->n_tasks > 1) {
-            if (atomic_fetch_add(&state_shared.n_ready, 1) == n_threads - 1) {
-                atomic_store(&state_shared.has_work, false);
-            }
-
-            while (atomic_load(&state_shared.has_work)) {
-                ggml_lock_lock  (&state_shared.spin);
-                ggml_lock_unlock(&state_shared.spin);
-            }
-
-            atomic_fetch_sub(&state_shared.n_ready, 1);
-
-            while (atomic_load(&state_shared.n_ready) != 0) {
-                ggml_lock_lock  (&state_shared.spin);
-                ggml_lock_unlock(&state_shared.spin);
-            }
+            ggml_graph_compute_wait(pool);
         }
 
         // FINALIZE
         if (node->n_tasks > 1) {
-            if (atomic_fetch_add(&state_shared.n_ready, 1) == n_threads - 1) {
-                atomic_store(&state_shared.has_work, false);
-            }
-
-            while (atomic_load(&state_shared.has_work)) {
-                ggml_lock_lock  (&state_shared.spin);
-                ggml_lock_unlock(&state_shared.spin);
-            }
-
-            // launch thread pool
-            for (int j = 0; j < n_threads - 1; j++) {
-                workers[j].params = (struct ggml_compute_params) {
-                    .type  = GGML_TASK_FINALIZE,
-                    .ith   = j + 1,
-                    .nth   = node->n_tasks,
-                    .wsize = cgraph->work ? ggml_nbytes(cgraph->work) : 0,
-                    .wdata = cgraph->work ? cgraph->work->data : NULL,
-                };
-                workers[j].node = node;
-            }
-
-            atomic_fetch_sub(&state_shared.n_ready, 1);
-
-            while (atomic_load(&state_shared.n_ready) > 0) {
-                ggml_lock_lock  (&state_shared.spin);
-                ggml_lock_unlock(&state_shared.spin);
-            }
-
-            atomic_store(&state_shared.has_work, true);
+            ggml_graph_compute_dispatch(pool, cgraph, node, GGML_TASK_FINALIZE);
         }
 
         params.type = GGML_TASK_FINALIZE;
-        ggml_compute_forward(&params, node);
+        ggml_graph_compute_forward_main(pool, &params, node);
 
         // wait for thread pool
         if (node->n_tasks > 1) {
-            if (atomic_fetch_add(&state_shared.n_ready, 1) == n_threads - 1) {
-                atomic_store(&state_shared.has_work, false);
-            }
-
-            while (atomic_load(&state_shared.has_work)) {
-                ggml_lock_lock  (&state_shared.spin);
-                ggml_lock_unlock(&state_shared.spin);
-            }
-
-            atomic_fetch_sub(&state_shared.n_ready, 1);
-
-            while (atomic_load(&state_shared.n_ready) != 0) {
-                ggml_lock_lock  (&state_shared.spin);
-                ggml_lock_unlock(&state_shared.spin);
-            }
+            ggml_graph_compute_wait(pool);
         }
 
         // performance stats (node)
@@ -14490,18 +15263,10 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
         }
     }
 
-    // join thread pool
+    // send the workers back to the pool
     if (n_threads > 1) {
-        atomic_store(&state_shared.stop, true);
-        atomic_store(&state_shared.has_work, true);
-
-        for (int j = 0; j < n_threads - 1; j++) {
-            int rc = ggml_thread_join(workers[j].thrd, NULL);
-            GGML_ASSERT(rc == 0);
-            UNUSED(rc);
-        }
-
-        ggml_lock_destroy(&state_shared.spin);
+        ggml_graph_compute_dispatch(pool, cgraph, NULL, GGML_TASK_COMPUTE);
+        ggml_graph_compute_wait(pool);
     }
 
     // performance stats (graph)
@@ -14522,6 +15287,10 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
     }
 }
 
+void ggml_graph_compute_with_pool(struct ggml_context * ctx, struct ggml_cgraph * cgraph, struct ggml_threadpool * pool) {
+    ggml_graph_compute_range(ctx, cgraph, pool, 0, cgraph->n_nodes);
+}
+
 void ggml_graph_reset(struct ggml_cgraph * cgraph) {
     for (int i = 0; i < cgraph->n_nodes; i++) {
         struct ggml_tensor * grad = cgraph->grads[i];
@@ -15598,6 +16367,51 @@ size_t ggml_quantize_chunk(enum ggml_type type, const float * src, void * dst, i
 
 ////////////////////////////////////////////////////////////////////////////////
 
+bool ggml_can_interleave_rows(const struct ggml_tensor * tensor) {
+#if defined(__AVX2__) && !defined(GGML_USE_CUBLAS) && !defined(GGML_USE_CLBLAST)
+    // the GPU backends read the weights of the CPU tensors as they are, so they can't be interleaved there
+    return tensor->type == GGML_TYPE_Q4_0 &&
+           tensor->backend == GGML_BACKEND_CPU &&
+           tensor->n_interleave == 0 &&
+           tensor->n_dims == 2 &&
+           tensor->ne[1] % GGML_INTERLEAVE_ROWS == 0 &&
+           ggml_is_contiguous(tensor);
+#else
+    UNUSED(tensor);
+    return false;
+#endif
+}
+
+void ggml_interleave_rows(struct ggml_tensor * tensor) {
+    GGML_ASSERT(ggml_can_interleave_rows(tensor));
+
+    const size_t  bs       = GGML_TYPE_SIZE[tensor->type];
+    const int64_t nb       = tensor->ne[0]/GGML_BLCK_SIZE[tensor->type];
+    const size_t  row_size = tensor->nb[1];
+    const int64_t nr       = ggml_nrows(tensor);
+
+    char * tmp = malloc(GGML_INTERLEAVE_ROWS*row_size);
+    GGML_ASSERT(tmp);
+
+    for (int64_t ir = 0; ir < nr; ir += GGML_INTERLEAVE_ROWS) {
+        char * group = (char *) tensor->data + ir*row_size;
+
+        memcpy(tmp, group, GGML_INTERLEAVE_ROWS*row_size);
+
+        for (int64_t i = 0; i < nb; ++i) {
+            for (int r = 0; r < GGML_INTERLEAVE_ROWS; ++r) {
+                memcpy(group + (i*GGML_INTERLEAVE_ROWS + r)*bs, tmp + r*row_size + i*bs, bs);
+            }
+        }
+    }
+
+    free(tmp);
+
+    tensor->n_interleave = GGML_INTERLEAVE_ROWS;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 int ggml_cpu_has_avx(void) {
 #if defined(__AVX__)
     return 1;
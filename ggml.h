@@ -200,6 +200,7 @@
 #define GGML_MAX_OPT           4
 #define GGML_MAX_NAME          32
 #define GGML_DEFAULT_N_THREADS 4
+#define GGML_DEFAULT_N_SPIN    100000
 
 #define GGML_ASSERT(x) \
     do { \
@@ -311,6 +312,7 @@ extern "C" {
         GGML_OP_DIAG,
         GGML_OP_DIAG_MASK_INF,
         GGML_OP_DIAG_MASK_ZERO,
+        GGML_OP_MASK_INF,
         GGML_OP_SOFT_MAX,
         GGML_OP_ROPE,
         GGML_OP_ROPE_BACK,
@@ -375,7 +377,9 @@ extern "C" {
 
         char name[GGML_MAX_NAME];
 
-        char padding[16];
+        int n_interleave; // > 0 - the blocks of groups of n_interleave rows are interleaved, see ggml_interleave_rows()
+
+        char padding[12];
     };
 
     static const size_t GGML_TENSOR_SIZE = sizeof(struct ggml_tensor);
@@ -864,6 +868,19 @@ extern "C" {
             struct ggml_tensor  * a,
             int                   n_past);
 
+    // set elements of a to -INF where the I32 mask b is 0
+    // b has shape [a->ne[0], a->ne[1]] and is broadcasted across the remaining dimensions
+    GGML_API struct ggml_tensor * ggml_mask_inf(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * a,
+            struct ggml_tensor  * b);
+
+    // in-place, returns view(a)
+    GGML_API struct ggml_tensor * ggml_mask_inf_inplace(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * a,
+            struct ggml_tensor  * b);
+
     GGML_API struct ggml_tensor * ggml_soft_max(
             struct ggml_context * ctx,
             struct ggml_tensor  * a);
@@ -892,6 +909,24 @@ extern "C" {
             int                   n_dims,
             int                   mode);
 
+    // rotary position embedding with an explicit position for each entry along dimension 2
+    // b is an I32 tensor with a->ne[2] elements
+    // mode & 1 must be 0
+    GGML_API struct ggml_tensor * ggml_rope_pos(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * a,
+            struct ggml_tensor  * b,
+            int                   n_dims,
+            int                   mode);
+
+    // in-place, returns view(a)
+    GGML_API struct ggml_tensor * ggml_rope_pos_inplace(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * a,
+            struct ggml_tensor  * b,
+            int                   n_dims,
+            int                   mode);
+
     // rotary position embedding backward, i.e compute dx from dy
     // a - dy
     GGML_API struct ggml_tensor * ggml_rope_back(
@@ -978,6 +1013,48 @@ extern "C" {
     GGML_API void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph);
     GGML_API void ggml_graph_reset  (struct ggml_cgraph * cgraph);
 
+    //
+    // thread pool
+    //
+    // ggml_graph_compute() creates and joins cgraph->n_threads - 1 threads on every call
+    // to avoid this, create a pool once and pass it to ggml_graph_compute_with_pool()
+    // the worker threads sleep between graphs
+    //
+    // within a graph, a thread that waits for the others busy-waits for n_spin iterations
+    // (default: GGML_DEFAULT_N_SPIN) and then goes to sleep until it is woken up
+    //
+
+    struct ggml_threadpool;
+
+    // time spent by the threads of a pool while computing graphs, summed over all threads
+    struct ggml_threadpool_stats {
+        int64_t t_compute_us; // running tasks
+        int64_t t_spin_us;    // busy-waiting for other threads
+        int64_t t_sleep_us;   // sleeping while waiting for other threads
+        int64_t n_sleep;      // number of times a thread went to sleep
+    };
+
+    GGML_API struct ggml_threadpool * ggml_threadpool_new(int n_threads);
+    GGML_API void                     ggml_threadpool_free(struct ggml_threadpool * pool);
+    GGML_API int                      ggml_threadpool_n_threads(const struct ggml_threadpool * pool);
+
+    // n_spin < 0 - never sleep (pure busy-waiting), 0 - sleep right away
+    // takes effect with the next graph
+    GGML_API void ggml_threadpool_set_n_spin(struct ggml_threadpool * pool, int n_spin);
+
+    // must not be called while a graph is being computed with the pool
+    GGML_API struct ggml_threadpool_stats ggml_threadpool_get_stats  (const struct ggml_threadpool * pool);
+    GGML_API void                         ggml_threadpool_reset_stats(struct ggml_threadpool * pool);
+
+    // uses min(cgraph->n_threads, ggml_threadpool_n_threads(pool)) threads, including the calling one
+    // a pool must not be used by more than one graph at a time
+    GGML_API void ggml_graph_compute_with_pool(struct ggml_context * ctx, struct ggml_cgraph * cgraph, struct ggml_threadpool * pool);
+
+    // computes only the nodes [i_begin, i_end) of the graph, the nodes before i_begin must have been computed
+    // the range that starts at node 0 plans the tasks and the work buffer of the whole graph, the following ranges
+    // reuse that plan, so that the ranges can be computed one after the other without planning the graph again
+    GGML_API void ggml_graph_compute_range(struct ggml_context * ctx, struct ggml_cgraph * cgraph, struct ggml_threadpool * pool, int i_begin, int i_end);
+
     GGML_API struct ggml_tensor * ggml_get_tensor_by_name(struct ggml_cgraph * cgraph, const char * name);
 
     // print info and performance information for the graph
@@ -1097,6 +1174,21 @@ extern "C" {
 
     GGML_API size_t ggml_quantize_chunk(enum ggml_type type, const float * src, void * dst, int start, int n, int64_t * hist);
 
+    //
+    // row interleaving
+    //
+    // stores the blocks of GGML_INTERLEAVE_ROWS consecutive rows of a quantized matrix next to each other
+    // (block 0 of rows 0..3, block 1 of rows 0..3, ...), so that mul_mat can compute several rows with a
+    // single pass over src1. an interleaved tensor can only be used as src0 of ggml_mul_mat
+    //
+
+#define GGML_INTERLEAVE_ROWS 4
+
+    GGML_API bool ggml_can_interleave_rows(const struct ggml_tensor * tensor);
+
+    // in place, the size of the data does not change
+    GGML_API void ggml_interleave_rows(struct ggml_tensor * tensor);
+
     //
     // system info
     //
@@ -1133,12 +1225,19 @@ extern "C" {
     typedef void (*quantize_row_q_t)  (const float * GGML_RESTRICT x, void * GGML_RESTRICT y, int k);
     typedef void (*vec_dot_q_t)       (const int n, float * GGML_RESTRICT s, const void * GGML_RESTRICT x, const void * GGML_RESTRICT y);
 
+    // dot products of GGML_VEC_DOT_TILE_M rows of x with GGML_VEC_DOT_TILE_N rows of y
+    // the rows are bx and by bytes apart, the result of x row r and y row c is stored in s[c*bs + r]
+#define GGML_VEC_DOT_TILE_M 2
+#define GGML_VEC_DOT_TILE_N 4
+    typedef void (*vec_dot_q_tile_t)  (const int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT x, size_t bx, const void * GGML_RESTRICT y, size_t by);
+
     typedef struct {
         dequantize_row_q_t dequantize_row_q;
         quantize_row_q_t   quantize_row_q;
         quantize_row_q_t   quantize_row_q_reference;
         quantize_row_q_t   quantize_row_q_dot;
         vec_dot_q_t        vec_dot_q;
+        vec_dot_q_tile_t   vec_dot_q_tile; // NULL if not available on this platform
         enum ggml_type     vec_dot_type;
     } quantize_fns_t;
 
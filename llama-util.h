@@ -14,11 +14,13 @@
 
 #include <string>
 #include <vector>
+#include <algorithm>
 #include <stdexcept>
 
 #ifdef __has_include
     #if __has_include(<unistd.h>)
         #include <unistd.h>
+        #include <fcntl.h>
         #if defined(_POSIX_MAPPED_FILES)
             #include <sys/mman.h>
         #endif
@@ -38,6 +40,11 @@
     #include <stdio.h> // for _fseeki64
 #endif
 
+#if defined(__linux__)
+    #include <sched.h>
+    #include <sys/syscall.h>
+#endif
+
 #define LLAMA_ASSERT(x) \
     do { \
         if (!(x)) { \
@@ -72,6 +79,12 @@ struct llama_file {
     FILE * fp;
     size_t size;
 
+    // the file opened a second time to read it bypassing the page cache, -1 if it is not
+    int fd_direct = -1;
+
+    // O_DIRECT reads must start and end at multiples of the logical block size of the device, 4096 covers them all
+    static constexpr size_t DIRECT_ALIGNMENT = 4096;
+
     llama_file(const char * fname, const char * mode) {
         fp = std::fopen(fname, mode);
         if (fp == NULL) {
@@ -115,6 +128,93 @@ struct llama_file {
         }
     }
 
+    // reads len bytes at offset without moving the file position, several threads can read at the same time
+    void read_raw_at(void * ptr, size_t len, size_t offset) const {
+        char * dst = (char *) ptr;
+        while (len > 0) {
+#ifdef _WIN32
+            HANDLE hFile = (HANDLE) _get_osfhandle(_fileno(fp));
+            OVERLAPPED ov = {};
+            ov.Offset     = (DWORD) offset;
+            ov.OffsetHigh = (DWORD) (offset >> 32);
+            DWORD ret = 0;
+            if (!ReadFile(hFile, dst, (DWORD) (len < (1u << 30) ? len : (1u << 30)), &ret, &ov)) {
+                throw std::runtime_error(format("read error: %lu", (unsigned long) GetLastError()));
+            }
+#else
+            errno = 0;
+            ssize_t ret = pread(fileno(fp), dst, len, (off_t) offset);
+            if (ret < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::runtime_error(format("read error: %s", strerror(errno)));
+            }
+#endif
+            if (ret == 0) {
+                throw std::runtime_error(std::string("unexpectedly reached end of file"));
+            }
+            dst    += ret;
+            len    -= ret;
+            offset += ret;
+        }
+    }
+
+    // opens the file for read_raw_direct(), returns false if the file system or the platform does not support it
+    bool open_direct(const char * fname) {
+#if defined(__linux__) && defined(O_DIRECT)
+        fd_direct = open(fname, O_RDONLY | O_DIRECT);
+#elif defined(__APPLE__)
+        fd_direct = open(fname, O_RDONLY);
+        if (fd_direct >= 0 && fcntl(fd_direct, F_NOCACHE, 1) != 0) {
+            close(fd_direct);
+            fd_direct = -1;
+        }
+#else
+        (void) fname;
+#endif
+        return fd_direct >= 0;
+    }
+
+    // reads len bytes at offset like read_raw_at(), bypassing the page cache if open_direct() succeeded: the aligned
+    // blocks that cover the range are read into buf, grown as needed, and the range is copied from there
+    void read_raw_direct(void * ptr, size_t len, size_t offset, std::vector<uint8_t> & buf) const {
+#if defined(_POSIX_VERSION)
+        if (fd_direct < 0) {
+            read_raw_at(ptr, len, offset);
+            return;
+        }
+
+        const size_t begin = offset/DIRECT_ALIGNMENT*DIRECT_ALIGNMENT;
+        const size_t end   = (offset + len + DIRECT_ALIGNMENT - 1)/DIRECT_ALIGNMENT*DIRECT_ALIGNMENT;
+
+        buf.resize(end - begin + DIRECT_ALIGNMENT);
+        uint8_t * aligned = (uint8_t *) (((uintptr_t) buf.data() + DIRECT_ALIGNMENT - 1)/DIRECT_ALIGNMENT*DIRECT_ALIGNMENT);
+
+        // the last block can be past the end of the file, the read is then short
+        size_t n_read = 0;
+        while (begin + n_read < offset + len) {
+            errno = 0;
+            ssize_t ret = pread(fd_direct, aligned + n_read, end - begin - n_read, (off_t) (begin + n_read));
+            if (ret < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::runtime_error(format("read error: %s", strerror(errno)));
+            }
+            if (ret == 0) {
+                throw std::runtime_error(std::string("unexpectedly reached end of file"));
+            }
+            n_read += ret;
+        }
+
+        memcpy(ptr, aligned + (offset - begin), len);
+#else
+        (void) buf;
+        read_raw_at(ptr, len, offset);
+#endif
+    }
+
     std::uint32_t read_u32() {
         std::uint32_t ret;
         read_raw(&ret, sizeof(ret));
@@ -146,6 +246,11 @@ struct llama_file {
         if (fp) {
             std::fclose(fp);
         }
+#if defined(_POSIX_VERSION)
+        if (fd_direct >= 0) {
+            close(fd_direct);
+        }
+#endif
     }
 };
 
@@ -163,27 +268,268 @@ static std::string llama_format_win_err(DWORD err) {
 }
 #endif
 
+#define LLAMA_HUGE_PAGE_SIZE (2u*1024*1024)
+
+// Where the large buffers (weights, KV cache, scratch) are placed in memory, only implemented on Linux
+struct llama_placement {
+    bool hugepages  = false; // back the buffers with hugetlbfs pages if reserved, else with transparent huge pages
+    bool interleave = false; // interleave the pages of the buffers over all the NUMA nodes
+};
+
+// reads a list of numbers in the sysfs format, like "0-3,8,10-11"
+static std::vector<int> llama_sysfs_read_list(const char * path) {
+    std::vector<int> res;
+    FILE * f = fopen(path, "r");
+    if (f == NULL) {
+        return res;
+    }
+    int first;
+    while (fscanf(f, "%d", &first) == 1) {
+        int last = first;
+        int c = fgetc(f);
+        if (c == '-') {
+            if (fscanf(f, "%d", &last) != 1) {
+                break;
+            }
+            c = fgetc(f);
+        }
+        for (int i = first; i <= last; i++) {
+            res.push_back(i);
+        }
+        if (c != ',') {
+            break;
+        }
+    }
+    fclose(f);
+    return res;
+}
+
+// the NUMA nodes that are online, empty if unknown
+static std::vector<int> llama_numa_nodes() {
+#ifdef __linux__
+    return llama_sysfs_read_list("/sys/devices/system/node/online");
+#else
+    return {};
+#endif
+}
+
+// the system setting of the transparent huge pages: always, madvise or never, empty if unknown
+static std::string llama_thp_mode() {
+    std::string res;
+#ifdef __linux__
+    FILE * f = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+    if (f != NULL) {
+        char buf[128] = {0};
+        if (fgets(buf, sizeof(buf), f)) {
+            const char * begin = strchr(buf, '[');
+            const char * end   = begin ? strchr(begin, ']') : NULL;
+            if (end) {
+                res.assign(begin + 1, end);
+            }
+        }
+        fclose(f);
+    }
+#endif
+    return res;
+}
+
+#ifdef __linux__
+// the memory policies of <linux/mempolicy.h>, set with the raw system calls to not depend on libnuma
+#define LLAMA_MPOL_DEFAULT    0
+#define LLAMA_MPOL_PREFERRED  1
+#define LLAMA_MPOL_INTERLEAVE 3
+
+#define LLAMA_NUMA_MAX_NODES 1024
+
+struct llama_numa_mask {
+    unsigned long bits[LLAMA_NUMA_MAX_NODES/(8*sizeof(unsigned long))] = {0};
+
+    llama_numa_mask() = default;
+
+    llama_numa_mask(const std::vector<int> & nodes) {
+        for (int node : nodes) {
+            if (node >= 0 && node < LLAMA_NUMA_MAX_NODES) {
+                bits[node/(8*sizeof(unsigned long))] |= 1ul << (node % (8*sizeof(unsigned long)));
+            }
+        }
+    }
+
+    // the kernel only reads maxnode - 1 bits
+    static unsigned long maxnode() { return LLAMA_NUMA_MAX_NODES + 1; }
+};
+#endif
+
+// sets the memory policy of the calling thread to interleave over all the nodes until the end of the scope, the
+// threads created meanwhile inherit it, this is what places the page cache of a mapped file when it is read
+struct llama_numa_interleave_scope {
+#ifdef __linux__
+    bool active = false;
+    int old_mode = LLAMA_MPOL_DEFAULT;
+    llama_numa_mask old_mask;
+
+    llama_numa_interleave_scope(bool enable) {
+        const std::vector<int> nodes = llama_numa_nodes();
+        if (!enable || nodes.size() < 2) {
+            return;
+        }
+        if (syscall(SYS_get_mempolicy, &old_mode, old_mask.bits, llama_numa_mask::maxnode(), NULL, 0) != 0) {
+            fprintf(stderr, "warning: get_mempolicy failed: %s\n", strerror(errno));
+            return;
+        }
+        llama_numa_mask mask(nodes);
+        if (syscall(SYS_set_mempolicy, LLAMA_MPOL_INTERLEAVE, mask.bits, llama_numa_mask::maxnode()) != 0) {
+            fprintf(stderr, "warning: set_mempolicy(MPOL_INTERLEAVE) failed: %s\n", strerror(errno));
+            return;
+        }
+        active = true;
+    }
+
+    ~llama_numa_interleave_scope() {
+        if (active) {
+            syscall(SYS_set_mempolicy, old_mode, old_mode == LLAMA_MPOL_DEFAULT ? NULL : old_mask.bits, llama_numa_mask::maxnode());
+        }
+    }
+#else
+    llama_numa_interleave_scope(bool) {}
+#endif
+};
+
+// interleaves the pages of [addr, addr + len) over all the nodes, addr must be page aligned
+static void llama_numa_interleave(void * addr, size_t len) {
+#ifdef __linux__
+    const std::vector<int> nodes = llama_numa_nodes();
+    if (nodes.size() < 2) {
+        return;
+    }
+    llama_numa_mask mask(nodes);
+    if (syscall(SYS_mbind, addr, len, LLAMA_MPOL_INTERLEAVE, mask.bits, llama_numa_mask::maxnode(), 0) != 0) {
+        fprintf(stderr, "warning: mbind(MPOL_INTERLEAVE) failed: %s\n", strerror(errno));
+    }
+#else
+    (void) addr;
+    (void) len;
+#endif
+}
+
+// pins the calling thread, and the threads it creates afterwards, to the CPUs of the NUMA node it runs on, and
+// makes them prefer the memory of this node; returns the node, or -1 on failure
+static int llama_numa_isolate() {
+#ifdef __linux__
+    const int cpu = sched_getcpu();
+    if (cpu < 0) {
+        return -1;
+    }
+    for (int node : llama_numa_nodes()) {
+        const std::vector<int> cpus = llama_sysfs_read_list(format("/sys/devices/system/node/node%d/cpulist", node).c_str());
+        if (std::find(cpus.begin(), cpus.end(), cpu) == cpus.end()) {
+            continue;
+        }
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int c : cpus) {
+            if (c < CPU_SETSIZE) {
+                CPU_SET(c, &set);
+            }
+        }
+        if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+            fprintf(stderr, "warning: sched_setaffinity failed: %s\n", strerror(errno));
+            return -1;
+        }
+        llama_numa_mask mask({node});
+        if (syscall(SYS_set_mempolicy, LLAMA_MPOL_PREFERRED, mask.bits, llama_numa_mask::maxnode()) != 0) {
+            fprintf(stderr, "warning: set_mempolicy(MPOL_PREFERRED) failed: %s\n", strerror(errno));
+        }
+        return node;
+    }
+#endif
+    return -1;
+}
+
+// allocates a buffer placed as requested, returns NULL if the placement is not supported, and the size of the
+// mapping to release with munmap in mapped_size
+static uint8_t * llama_placed_alloc(size_t len, const llama_placement & placement, size_t & mapped_size) {
+#if defined(__linux__) && defined(_POSIX_MAPPED_FILES)
+    if (!placement.hugepages && !placement.interleave) {
+        return NULL;
+    }
+    const size_t size = (len + LLAMA_HUGE_PAGE_SIZE - 1) / LLAMA_HUGE_PAGE_SIZE * LLAMA_HUGE_PAGE_SIZE;
+    void * addr = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    if (placement.hugepages) {
+        // fails unless the administrator reserved enough huge pages (vm.nr_hugepages)
+        addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+#endif
+    if (addr == MAP_FAILED) {
+        // align the buffer to a huge page so that it can be backed entirely by transparent huge pages
+        uint8_t * raw = (uint8_t *) mmap(NULL, size + LLAMA_HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (raw == MAP_FAILED) {
+            return NULL;
+        }
+        uint8_t * aligned = (uint8_t *) (((uintptr_t) raw + LLAMA_HUGE_PAGE_SIZE - 1) & ~((uintptr_t) LLAMA_HUGE_PAGE_SIZE - 1));
+        if (aligned > raw) {
+            munmap(raw, aligned - raw);
+        }
+        if (raw + LLAMA_HUGE_PAGE_SIZE > aligned) {
+            munmap(aligned + size, raw + LLAMA_HUGE_PAGE_SIZE - aligned);
+        }
+        addr = aligned;
+#ifdef MADV_HUGEPAGE
+        if (placement.hugepages && madvise(addr, size, MADV_HUGEPAGE) != 0) {
+            fprintf(stderr, "warning: madvise(.., MADV_HUGEPAGE) failed: %s\n", strerror(errno));
+        }
+#endif
+    }
+    if (placement.interleave) {
+        llama_numa_interleave(addr, size);
+    }
+    mapped_size = size;
+    return (uint8_t *) addr;
+#else
+    (void) len;
+    (void) placement;
+    (void) mapped_size;
+    return NULL;
+#endif
+}
+
 struct llama_mmap {
     void * addr;
     size_t size;
 
     llama_mmap(const llama_mmap &) = delete;
 
+    bool contains(const void * ptr) const {
+        return (const uint8_t *) ptr >= (const uint8_t *) addr && (const uint8_t *) ptr < (const uint8_t *) addr + size;
+    }
+
 #ifdef _POSIX_MAPPED_FILES
     static constexpr bool SUPPORTED = true;
 
-    llama_mmap(struct llama_file * file, size_t prefetch = (size_t) -1 /* -1 = max value */) {
+    llama_mmap(struct llama_file * file, size_t prefetch = (size_t) -1 /* -1 = max value */,
+               const llama_placement & placement = llama_placement()) {
         size = file->size;
+        // the pages read by MAP_POPULATE and MADV_WILLNEED go where the policy of this thread puts them
+        llama_numa_interleave_scope interleave(placement.interleave);
         int fd = fileno(file->fp);
         int flags = MAP_SHARED;
 #ifdef __linux__
-        flags |= MAP_POPULATE;
+        if (prefetch > 0) {
+            flags |= MAP_POPULATE;
+        }
 #endif
         addr = mmap(NULL, file->size, PROT_READ, flags, fd, 0);
         if (addr == MAP_FAILED) {
             throw std::runtime_error(format("mmap failed: %s", strerror(errno)));
         }
 
+#ifdef MADV_HUGEPAGE
+        // only effective on file systems with huge pages in the page cache
+        if (placement.hugepages && madvise(addr, size, MADV_HUGEPAGE) != 0) {
+            fprintf(stderr, "warning: madvise(.., MADV_HUGEPAGE) failed: %s\n", strerror(errno));
+        }
+#endif
+
         if (prefetch > 0) {
             // Advise the kernel to preload the mapped memory
             if (madvise(addr, std::min(file->size, prefetch), MADV_WILLNEED)) {
@@ -196,10 +542,41 @@ struct llama_mmap {
     ~llama_mmap() {
         munmap(addr, size);
     }
+
+    // asks the kernel to read [ptr, ptr + len) of the mapping ahead of its use, without waiting for it
+    void prefetch(const void * ptr, size_t len) const {
+        const size_t page_size = sysconf(_SC_PAGESIZE);
+        const uintptr_t begin = (uintptr_t) ptr / page_size * page_size;
+        const uintptr_t end   = ((uintptr_t) ptr + len + page_size - 1) / page_size * page_size;
+        if (madvise((void *) begin, end - begin, MADV_WILLNEED)) {
+            fprintf(stderr, "warning: madvise(.., MADV_WILLNEED) failed: %s\n", strerror(errno));
+        }
+    }
+
+    // gives back the pages of [ptr, ptr + len) of the mapping to the kernel, they are read again on the next access
+    // only the pages entirely in the range are released
+    void release(const void * ptr, size_t len) const {
+        const size_t page_size = sysconf(_SC_PAGESIZE);
+        const uintptr_t begin = ((uintptr_t) ptr + page_size - 1) / page_size * page_size;
+        const uintptr_t end   = ((uintptr_t) ptr + len) / page_size * page_size;
+        if (end <= begin) {
+            return;
+        }
+#ifdef MADV_PAGEOUT
+        // reclaims the pages right away, needs Linux 5.4
+        if (madvise((void *) begin, end - begin, MADV_PAGEOUT) == 0) {
+            return;
+        }
+#endif
+        if (madvise((void *) begin, end - begin, MADV_DONTNEED)) {
+            fprintf(stderr, "warning: madvise(.., MADV_DONTNEED) failed: %s\n", strerror(errno));
+        }
+    }
 #elif defined(_WIN32)
     static constexpr bool SUPPORTED = true;
 
-    llama_mmap(struct llama_file * file, bool prefetch = true) {
+    llama_mmap(struct llama_file * file, bool prefetch = true, const llama_placement & placement = llama_placement()) {
+        (void) placement;
         size = file->size;
 
         HANDLE hFile = (HANDLE) _get_osfhandle(_fileno(file->fp));
@@ -241,13 +618,38 @@ struct llama_mmap {
                     llama_format_win_err(GetLastError()).c_str());
         }
     }
+
+    void prefetch(const void * ptr, size_t len) const {
+        #if _WIN32_WINNT >= _WIN32_WINNT_WIN8
+        WIN32_MEMORY_RANGE_ENTRY range;
+        range.VirtualAddress = (PVOID) ptr;
+        range.NumberOfBytes = (SIZE_T) len;
+        if (!PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0)) {
+            fprintf(stderr, "warning: PrefetchVirtualMemory failed: %s\n",
+                    llama_format_win_err(GetLastError()).c_str());
+        }
+        #else
+        (void) ptr;
+        (void) len;
+        #endif
+    }
+
+    // not supported, the working set is trimmed by the system
+    void release(const void * ptr, size_t len) const {
+        (void) ptr;
+        (void) len;
+    }
 #else
     static constexpr bool SUPPORTED = false;
 
-    llama_mmap(struct llama_file *, bool prefetch = true) {
+    llama_mmap(struct llama_file *, bool prefetch = true, const llama_placement & placement = llama_placement()) {
         (void)prefetch;
+        (void)placement;
         throw std::runtime_error(std::string("mmap not supported"));
     }
+
+    void prefetch(const void *, size_t) const {}
+    void release(const void *, size_t) const {}
 #endif
 };
 
@@ -401,17 +803,35 @@ struct llama_mlock {
 struct llama_buffer {
     uint8_t * addr = NULL;
     size_t size = 0;
+    size_t mapped_size = 0; // size of the mapping when allocated by llama_placed_alloc
 
     llama_buffer() = default;
 
-    void resize(size_t len) {
-        delete[] addr;
-        addr = new uint8_t[len];
+    void resize(size_t len, const llama_placement & placement = llama_placement()) {
+        free();
+        addr = llama_placed_alloc(len, placement, mapped_size);
+        if (addr == NULL) {
+            addr = new uint8_t[len];
+        }
         size = len;
     }
 
-    ~llama_buffer() {
+    void free() {
+#if defined(__linux__) && defined(_POSIX_MAPPED_FILES)
+        if (mapped_size > 0) {
+            munmap(addr, mapped_size);
+        } else {
+            delete[] addr;
+        }
+#else
         delete[] addr;
+#endif
+        addr = NULL;
+        mapped_size = 0;
+    }
+
+    ~llama_buffer() {
+        free();
     }
 
     // disable copy and move
@@ -430,7 +850,9 @@ struct llama_ctx_buffer {
 
     llama_ctx_buffer() = default;
 
-    void resize(size_t size) {
+    // the buffer is pinned by CUDA, the placement is ignored
+    void resize(size_t size, const llama_placement & placement = llama_placement()) {
+        (void) placement;
         free();
 
         addr = (uint8_t *) ggml_cuda_host_malloc(size);
@@ -22,8 +22,8 @@
 #include <fstream>
 #include <random>
 #include <map>
+#include <set>
 #include <unordered_map>
-#include <queue>
 #include <cassert>
 #include <cstring>
 #include <climits>
@@ -33,12 +33,18 @@
 #include <thread>
 #include <atomic>
 #include <mutex>
+#include <condition_variable>
+#include <functional>
 #include <sstream>
 #include <numeric>
 
 #define LLAMA_USE_SCRATCH
 #define LLAMA_MAX_SCRATCH_BUFFERS 16
 
+// without mmap, the tensors are read with up to LLAMA_LOAD_THREADS concurrent reads of LLAMA_LOAD_CHUNK_SIZE bytes
+#define LLAMA_LOAD_THREADS    8
+#define LLAMA_LOAD_CHUNK_SIZE (8*1024*1024)
+
 // available llama models
 enum e_model {
     MODEL_UNKNOWN,
@@ -137,6 +143,100 @@ struct llama_layer {
     struct ggml_tensor * w3;
 };
 
+// keeps the weights of a memory-mapped model that does not fit in RAM under a resident budget: the first layers that
+// fit stay resident, the others are streamed through two layer-sized slots, read ahead while the previous layer
+// computes and released once computed, instead of leaving the kernel to evict pages at random
+struct llama_pager {
+    const llama_mmap * mapping = NULL; // NULL if disabled
+
+    size_t layer_size = 0; // the largest layer, in bytes
+    int    n_resident = 0; // the layers [0, n_resident) are never released
+
+    // the ranges of the mapping read by each layer
+    std::vector<std::vector<std::pair<const void *, size_t>>> layers;
+
+    bool enabled() const {
+        return mapping != NULL;
+    }
+
+    // returns false, and stays disabled, if all the layers fit in the budget
+    bool init(const llama_mmap * mapping, const std::vector<llama_layer> & model_layers, size_t budget) {
+        layers.clear();
+        layer_size = 0;
+        for (const llama_layer & layer : model_layers) {
+            std::vector<std::pair<const void *, size_t>> ranges;
+            size_t size = 0;
+            for (const ggml_tensor * t : { layer.attention_norm, layer.wq, layer.wk, layer.wv, layer.wo,
+                                           layer.ffn_norm, layer.w1, layer.w2, layer.w3 }) {
+                // the layers offloaded to the GPU are not in the mapping
+                if (mapping->contains(t->data)) {
+                    ranges.emplace_back(t->data, ggml_nbytes(t));
+                    size += ggml_nbytes(t);
+                }
+            }
+            layers.push_back(std::move(ranges));
+            layer_size = std::max(layer_size, size);
+        }
+
+        const int n_layer = layers.size();
+        const int n_fit   = layer_size > 0 ? (int) std::min<size_t>(budget/layer_size, n_layer) : n_layer;
+        if (n_fit >= n_layer) {
+            layers.clear();
+            return false;
+        }
+
+        this->mapping = mapping;
+        n_resident = std::max(0, n_fit - 2);
+        for (int il = 0; il <= n_resident; ++il) {
+            prefetch(il);
+        }
+        return true;
+    }
+
+    void prefetch(int il) const {
+        for (const auto & range : layers[il]) {
+            mapping->prefetch(range.first, range.second);
+        }
+    }
+
+    void release(int il) const {
+        for (const auto & range : layers[il]) {
+            mapping->release(range.first, range.second);
+        }
+    }
+
+    // before layer il is computed: reads ahead the next streamed layer, which is the first one of the next eval after
+    // the last layer
+    void begin_layer(int il) const {
+        const int n_layer = layers.size();
+        int next = std::max(il + 1, n_resident);
+        if (next >= n_layer) {
+            next = n_resident;
+        }
+        if (next != il) {
+            prefetch(next);
+        }
+    }
+
+    // after layer il is computed
+    void end_layer(int il) const {
+        if (il >= n_resident) {
+            release(il);
+        }
+    }
+};
+
+struct llama_kv_cell {
+    int pos   = -1; // position of the token in its sequence, -1 if the cell is free
+    int delta =  0; // shift of pos that has not been applied to the cached K yet
+
+    std::set<llama_seq_id> seq_id;
+
+    bool has_seq_id(llama_seq_id id) const {
+        return seq_id.find(id) != seq_id.end();
+    }
+};
+
 struct llama_kv_cache {
     struct ggml_tensor * k;
     struct ggml_tensor * v;
@@ -145,7 +245,11 @@ struct llama_kv_cache {
 
     llama_ctx_buffer buf;
 
-    int n; // number of tokens currently in the cache
+    int n; // number of cells in use, i.e. 1 + the index of the last occupied cell
+
+    bool has_shift = false; // some cells have a pending delta
+
+    std::vector<llama_kv_cell> cells;
 
     ~llama_kv_cache() {
         if (ctx) {
@@ -154,10 +258,94 @@ struct llama_kv_cache {
     }
 };
 
+struct llama_vocab {
+    using id    = int32_t;
+    using token = std::string;
+
+    struct token_score {
+        token tok;
+        float score;
+    };
+
+    std::unordered_map<token, id> token_to_id;
+    std::vector<token_score> id_to_token;
+
+    // open addressing hash table of the tokens by their text, looked up by the tokenizer without building a
+    // std::string, the size is a power of 2
+    struct token_entry {
+        uint32_t hash;
+        int32_t  id; // -1 = empty
+    };
+
+    std::vector<token_entry> token_table;
+
+    // bit a*256 + b is set if a token contains the byte a followed by the byte b, the tokenizer can split a
+    // text between two bytes whose bit is not set without changing its tokens
+    std::vector<uint64_t> byte_pairs;
+};
+
+static uint32_t llama_vocab_hash(const char * text, size_t n) {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < n; i++) {
+        hash = (hash ^ (uint8_t) text[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static void llama_vocab_init_table(llama_vocab & vocab) {
+    size_t size = 1;
+    while (size < 2*vocab.id_to_token.size()) {
+        size *= 2;
+    }
+    vocab.token_table.assign(size, { 0, -1 });
+
+    for (llama_vocab::id id = 0; id < (llama_vocab::id) vocab.id_to_token.size(); id++) {
+        const std::string & tok = vocab.id_to_token[id].tok;
+        const uint32_t hash = llama_vocab_hash(tok.data(), tok.size());
+        for (size_t i = hash & (size - 1); ; i = (i + 1) & (size - 1)) {
+            auto & entry = vocab.token_table[i];
+            // a text that occurs twice maps to its last id, like token_to_id
+            if (entry.id < 0 || (entry.hash == hash && vocab.id_to_token[entry.id].tok == tok)) {
+                entry = { hash, id };
+                break;
+            }
+        }
+    }
+
+    vocab.byte_pairs.assign(256*256/64, 0);
+    for (const auto & token_score : vocab.id_to_token) {
+        const std::string & tok = token_score.tok;
+        for (size_t i = 1; i < tok.size(); i++) {
+            const size_t pair = (uint8_t) tok[i - 1]*256 + (uint8_t) tok[i];
+            vocab.byte_pairs[pair/64] |= 1ull << (pair%64);
+        }
+    }
+}
+
+// the id of the token with the text [text, text + n), -1 if there is none
+static llama_vocab::id llama_vocab_find(const llama_vocab & vocab, const char * text, size_t n) {
+    const size_t mask = vocab.token_table.size() - 1;
+    const uint32_t hash = llama_vocab_hash(text, n);
+    for (size_t i = hash & mask; ; i = (i + 1) & mask) {
+        const auto & entry = vocab.token_table[i];
+        if (entry.id < 0) {
+            return -1;
+        }
+        if (entry.hash == hash) {
+            const std::string & tok = vocab.id_to_token[entry.id].tok;
+            if (tok.size() == n && memcmp(tok.data(), text, n) == 0) {
+                return entry.id;
+            }
+        }
+    }
+}
+
 struct llama_model {
     e_model type = MODEL_UNKNOWN;
 
     llama_hparams hparams;
+    llama_vocab   vocab;
 
     struct ggml_tensor * tok_embeddings;
 
@@ -169,16 +357,15 @@ struct llama_model {
     // context
     struct ggml_context * ctx = NULL;
 
-    // key + value cache for the self attention
-    // TODO: move to llama_state
-    struct llama_kv_cache kv_self;
-
     // the model memory buffer
     llama_ctx_buffer buf;
 
     // model memory mapped file
     std::unique_ptr<llama_mmap> mapping;
 
+    // residency of the layers of the mapped file, with a resident budget
+    llama_pager pager;
+
     // objects representing data potentially being locked in memory
     llama_mlock mlock_buf;
     llama_mlock mlock_mmap;
@@ -186,6 +373,9 @@ struct llama_model {
     // for quantize-stats only
     std::vector<std::pair<std::string, struct ggml_tensor *>> tensors_by_name;
 
+    int64_t t_load_us = 0;
+    int64_t t_start_us = 0;
+
     ~llama_model() {
         if (ctx) {
             ggml_free(ctx);
@@ -193,20 +383,20 @@ struct llama_model {
     }
 };
 
-struct llama_vocab {
-    using id    = int32_t;
-    using token = std::string;
+struct llama_context {
+    llama_context(llama_model & model) : model(model) {
+        t_load_us  = model.t_load_us;
+        t_start_us = model.t_start_us;
+    }
 
-    struct token_score {
-        token tok;
-        float score;
-    };
+    ~llama_context() {
+        ggml_threadpool_free(threadpool);
 
-    std::unordered_map<token, id> token_to_id;
-    std::vector<token_score> id_to_token;
-};
+        if (model_owner) {
+            delete &model;
+        }
+    }
 
-struct llama_context {
     std::mt19937 rng;
 
     int64_t t_load_us = 0;
@@ -221,8 +411,18 @@ struct llama_context {
     int32_t n_eval   = 0; // number of eval calls
     int32_t n_p_eval = 0; // number of tokens in eval calls for the prompt (with batch size > 1)
 
-    llama_model model;
-    llama_vocab vocab;
+    int32_t n_draft  = 0; // number of draft tokens verified by llama_sample_token_speculative()
+    int32_t n_accept = 0; // number of them that were accepted
+
+    // the weights, possibly shared with other contexts
+    llama_model & model;
+    bool model_owner = false; // the model was loaded by llama_init_from_file() and is freed with the context
+
+    // the hparams of the model, with n_ctx set for this context
+    llama_hparams hparams;
+
+    // key + value cache for the self attention
+    struct llama_kv_cache kv_self;
 
     size_t mem_per_token = 0;
 
@@ -233,6 +433,9 @@ struct llama_context {
     // input embedding (1-dimensional array: [n_embd])
     std::vector<float> embedding;
 
+    // candidates of llama_sample_chain, reused across calls
+    std::vector<llama_token_data> sample_candidates;
+
     // memory buffers used to evaluate the model
     // TODO: move in llama_state
     llama_ctx_buffer buf_compute;
@@ -241,6 +444,11 @@ struct llama_context {
     int    buf_last = 0;
     size_t buf_max_size[LLAMA_MAX_SCRATCH_BUFFERS] = { 0 };
 
+    // worker threads reused across llama_eval() calls
+    // (re)created when the requested number of threads changes
+    struct ggml_threadpool * threadpool = NULL;
+    int n_spin = GGML_DEFAULT_N_SPIN;
+
     void use_buf(struct ggml_context * ctx, int i) {
 #if defined(LLAMA_USE_SCRATCH)
         size_t last_size = 0;
@@ -596,10 +804,11 @@ struct llama_model_loader {
     llama_load_tensors_map tensors_map;
     bool use_mmap;
     size_t num_ggml_tensors_created = 0;
+    size_t num_tensors_repacked = 0;
     struct ggml_context * ggml_ctx = NULL;
     std::unique_ptr<llama_mmap> mapping;
 
-    llama_model_loader(const std::string & fname_base, bool use_mmap, bool vocab_only) {
+    llama_model_loader(const std::string & fname_base, bool use_mmap, bool direct_io, bool vocab_only) {
         auto * first_file = new llama_file_loader(fname_base.c_str(), 0, tensors_map);
         file_loaders.emplace_back(first_file);
         uint32_t n_parts = vocab_only ? 1 : guess_n_parts();
@@ -619,6 +828,17 @@ struct llama_model_loader {
             use_mmap = false;
         }
         this->use_mmap = use_mmap;
+        if (direct_io && use_mmap) {
+            fprintf(stderr, "llama.cpp: can't bypass the page cache for a memory-mapped model; disable mmap to use this\n");
+        } else if (direct_io) {
+            for (size_t i = 0; i < file_loaders.size(); i++) {
+                const std::string fname = i == 0 ? fname_base : fname_base + "." + std::to_string(i);
+                if (!file_loaders[i]->file.open_direct(fname.c_str())) {
+                    fprintf(stderr, "llama.cpp: can't bypass the page cache for %s: %s; reading it through the page cache\n",
+                            fname.c_str(), strerror(errno));
+                }
+            }
+        }
         for (llama_load_tensor & lt : tensors_map.tensors) {
             lt.calc_all();
         }
@@ -688,7 +908,8 @@ struct llama_model_loader {
         }
     }
 
-    void load_all_data(llama_progress_callback progress_callback, void *  progress_callback_user_data, llama_mlock * lmlock) {
+    void load_all_data(llama_progress_callback progress_callback, void *  progress_callback_user_data, llama_mlock * lmlock, bool repack,
+                       const llama_placement & placement, bool prefetch) {
         size_t data_size = 0;
         size_t prefetch_size = 0;
         for (const llama_load_tensor & lt : tensors_map.tensors) {
@@ -699,7 +920,7 @@ struct llama_model_loader {
         }
 
         if (use_mmap) {
-            mapping.reset(new llama_mmap(&file_loaders.at(0)->file, prefetch_size));
+            mapping.reset(new llama_mmap(&file_loaders.at(0)->file, prefetch ? prefetch_size : 0, placement));
             if (!lmlock) {
                 // Don't call the callback since the actual loading will be lazy
                 // and we can't measure it.
@@ -710,6 +931,16 @@ struct llama_model_loader {
             }
         }
 
+        if (repack && use_mmap) {
+            fprintf(stderr, "llama.cpp: can't repack the weights of a memory-mapped model; disable mmap to use this\n");
+            repack = false;
+        }
+
+        if (!use_mmap) {
+            load_all_data_parallel(progress_callback, progress_callback_user_data, repack, data_size);
+            return;
+        }
+
         size_t done_size = 0;
         for (llama_load_tensor & lt : tensors_map.tensors) {
             if (lt.ggml_tensor->backend != GGML_BACKEND_CPU) {
@@ -722,6 +953,11 @@ struct llama_model_loader {
             lt.data = (uint8_t *) lt.ggml_tensor->data;
             load_data_for(lt);
             lt.ggml_tensor->data = lt.data;
+            // the token embeddings are read with ggml_get_rows, all the other matrices only go through ggml_mul_mat
+            if (repack && lt.name != "tok_embeddings.weight" && ggml_can_interleave_rows(lt.ggml_tensor)) {
+                ggml_interleave_rows(lt.ggml_tensor);
+                num_tensors_repacked++;
+            }
             done_size += lt.size;
             if (use_mmap && lmlock) {
                 lmlock->grow_to(done_size);
@@ -729,6 +965,148 @@ struct llama_model_loader {
         }
     }
 
+    // a read of a part of a shard of a tensor
+    struct llama_load_job {
+        size_t    i_tensor;
+        size_t    file_idx;
+        size_t    file_off;
+        size_t    size;
+        uint8_t * dst;
+        size_t    row_size;   // 0 = the data goes to dst as is, else it is rows of row_size bytes ...
+        size_t    dst_stride; // ... that go dst_stride bytes apart (a shard of a tensor split by columns)
+    };
+
+    // reads the CPU tensors with concurrent reads that do not move the file position, in chunks that end at multiples of
+    // LLAMA_LOAD_CHUNK_SIZE in the file, the shards of a tensor split by columns are read by blocks of rows that are
+    // put in place by the thread that read them
+    // the files opened with open_direct() are read bypassing the page cache, through an aligned buffer per thread
+    void load_all_data_parallel(llama_progress_callback progress_callback, void * progress_callback_user_data, bool repack, size_t data_size) {
+        std::vector<llama_load_job> jobs;
+        std::vector<llama_load_tensor *> tensors;
+
+        for (llama_load_tensor & lt : tensors_map.tensors) {
+            if (lt.ggml_tensor->backend != GGML_BACKEND_CPU) {
+                continue;
+            }
+            LLAMA_ASSERT(lt.ggml_tensor); // unused tensors should have been caught by load_data already
+            lt.data = (uint8_t *) lt.ggml_tensor->data;
+
+            const size_t i_tensor = tensors.size();
+            tensors.push_back(&lt);
+
+            if (lt.split_type == SPLIT_BY_COLUMNS) {
+                const size_t num_rows = lt.ne.at(1);
+                const size_t per_shard_row_size = lt.shards.at(0).size / num_rows;
+                const size_t rows_per_job = std::max((size_t) 1, (size_t) LLAMA_LOAD_CHUNK_SIZE / per_shard_row_size);
+                for (size_t i = 0; i < lt.shards.size(); i++) {
+                    const llama_load_tensor_shard & shard = lt.shards.at(i);
+                    for (size_t row = 0; row < num_rows; row += rows_per_job) {
+                        const size_t n_rows = std::min(rows_per_job, num_rows - row);
+                        jobs.push_back({ i_tensor, shard.file_idx, shard.file_off + row*per_shard_row_size, n_rows*per_shard_row_size,
+                                         lt.data + row*lt.shards.size()*per_shard_row_size + i*per_shard_row_size,
+                                         per_shard_row_size, lt.shards.size()*per_shard_row_size });
+                    }
+                }
+            } else {
+                // a tensor that is not split is read from the first file
+                const size_t n_shards = lt.split_type == SPLIT_NONE ? 1 : lt.shards.size();
+                size_t offset = 0;
+                for (size_t i = 0; i < n_shards; i++) {
+                    const llama_load_tensor_shard & shard = lt.shards.at(i);
+                    for (size_t off = shard.file_off; off < shard.file_off + shard.size; ) {
+                        const size_t end = std::min(shard.file_off + shard.size, (off/LLAMA_LOAD_CHUNK_SIZE + 1)*LLAMA_LOAD_CHUNK_SIZE);
+                        jobs.push_back({ i_tensor, shard.file_idx, off, end - off, lt.data + offset + (off - shard.file_off), 0, 0 });
+                        off = end;
+                    }
+                    offset += shard.size;
+                }
+                LLAMA_ASSERT(offset == lt.size);
+            }
+        }
+
+        // the thread that reads the last part of a tensor repacks it
+        std::unique_ptr<std::atomic<size_t>[]> n_pending(new std::atomic<size_t>[tensors.size()]);
+        for (size_t i = 0; i < tensors.size(); i++) {
+            n_pending[i] = 0;
+        }
+        for (const auto & job : jobs) {
+            n_pending[job.i_tensor]++;
+        }
+
+        std::atomic<size_t> next_job(0);
+        std::atomic<size_t> done_size(0);
+        std::atomic<size_t> n_repacked(0);
+        std::atomic<bool>   failed(false);
+        std::exception_ptr  error;
+        std::mutex          error_mutex;
+
+        auto worker = [&](bool report_progress) {
+            std::vector<uint8_t> buf;
+            std::vector<uint8_t> buf_direct;
+            try {
+                while (!failed) {
+                    const size_t i_job = next_job++;
+                    if (i_job >= jobs.size()) {
+                        break;
+                    }
+                    const llama_load_job & job = jobs[i_job];
+                    const llama_file & file = file_loaders.at(job.file_idx)->file;
+
+                    if (job.row_size == 0) {
+                        file.read_raw_direct(job.dst, job.size, job.file_off, buf_direct);
+                    } else {
+                        buf.resize(job.size);
+                        file.read_raw_direct(buf.data(), job.size, job.file_off, buf_direct);
+                        for (size_t row = 0; row < job.size/job.row_size; row++) {
+                            memcpy(job.dst + row*job.dst_stride, buf.data() + row*job.row_size, job.row_size);
+                        }
+                    }
+
+                    if (--n_pending[job.i_tensor] == 0) {
+                        llama_load_tensor & lt = *tensors[job.i_tensor];
+                        // the token embeddings are read with ggml_get_rows, all the other matrices only go through ggml_mul_mat
+                        if (repack && lt.name != "tok_embeddings.weight" && ggml_can_interleave_rows(lt.ggml_tensor)) {
+                            ggml_interleave_rows(lt.ggml_tensor);
+                            n_repacked++;
+                        }
+                    }
+
+                    const size_t done = done_size += job.size;
+                    if (report_progress && progress_callback) {
+                        progress_callback((float) done / data_size, progress_callback_user_data);
+                    }
+                }
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(error_mutex);
+                if (!error) {
+                    error = std::current_exception();
+                }
+                failed = true;
+            }
+        };
+
+        if (progress_callback) {
+            progress_callback(0.0f, progress_callback_user_data);
+        }
+
+        // the calling thread reads too, and is the only one to call the progress callback
+        const size_t n_threads = std::min((size_t) LLAMA_LOAD_THREADS, jobs.size());
+        std::vector<std::thread> threads;
+        for (size_t i = 1; i < n_threads; i++) {
+            threads.emplace_back(worker, false);
+        }
+        worker(true);
+        for (auto & t : threads) {
+            t.join();
+        }
+
+        if (error) {
+            std::rethrow_exception(error);
+        }
+
+        num_tensors_repacked += n_repacked;
+    }
+
     void load_data_for(llama_load_tensor & lt) {
         if (use_mmap) {
             LLAMA_ASSERT(lt.shards.size() == 1);
@@ -792,18 +1170,38 @@ struct llama_model_loader {
 // kv cache
 //
 
+static ggml_type llama_kv_type_to_ggml(enum llama_kv_type type, bool f16_kv) {
+    switch (type) {
+        case LLAMA_KV_TYPE_F32:  return GGML_TYPE_F32;
+        case LLAMA_KV_TYPE_F16:  return GGML_TYPE_F16;
+        case LLAMA_KV_TYPE_Q8_0: return GGML_TYPE_Q8_0;
+        case LLAMA_KV_TYPE_Q4_0: return GGML_TYPE_Q4_0;
+        case LLAMA_KV_TYPE_Q4_1: return GGML_TYPE_Q4_1;
+        case LLAMA_KV_TYPE_Q5_0: return GGML_TYPE_Q5_0;
+        case LLAMA_KV_TYPE_Q5_1: return GGML_TYPE_Q5_1;
+        default:                 return f16_kv ? GGML_TYPE_F16 : GGML_TYPE_F32;
+    }
+}
+
+// the size in bytes of n elements of type, n a multiple of the block size of type
+static size_t llama_row_size(ggml_type type, int64_t n) {
+    return ggml_type_size(type)*n/ggml_blck_size(type);
+}
+
 static bool kv_cache_init(
         const struct llama_hparams & hparams,
              struct llama_kv_cache & cache,
-                         ggml_type   wtype,
-                               int   n_ctx) {
+                         ggml_type   ktype,
+                         ggml_type   vtype,
+                               int   n_ctx,
+             const llama_placement & placement) {
     const int n_embd  = hparams.n_embd;
     const int n_layer = hparams.n_layer;
 
     const int64_t n_mem      = n_layer*n_ctx;
     const int64_t n_elements = n_embd*n_mem;
 
-    cache.buf.resize(2u*n_elements*ggml_type_size(wtype) + 2u*MB);
+    cache.buf.resize(llama_row_size(ktype, n_elements) + llama_row_size(vtype, n_elements) + 2u*MB, placement);
 
     struct ggml_init_params params;
     params.mem_size   = cache.buf.size;
@@ -817,24 +1215,108 @@ static bool kv_cache_init(
         return false;
     }
 
-    cache.k = ggml_new_tensor_1d(cache.ctx, wtype, n_elements);
-    cache.v = ggml_new_tensor_1d(cache.ctx, wtype, n_elements);
+    cache.k = ggml_new_tensor_1d(cache.ctx, ktype, n_elements);
+    cache.v = ggml_new_tensor_1d(cache.ctx, vtype, n_elements);
     ggml_set_name(cache.k, "cache_k");
     ggml_set_name(cache.v, "cache_v");
 
+    cache.n = 0;
+    cache.has_shift = false;
+    cache.cells.clear();
+    cache.cells.resize(n_ctx);
+
     return true;
 }
 
+// find the first run of n_tokens free cells
+static bool kv_cache_find_slot(const struct llama_kv_cache & cache, int n_tokens, int & head) {
+    const int n_ctx = (int) cache.cells.size();
+
+    head = 0;
+    while (head + n_tokens <= n_ctx) {
+        int i = 0;
+        while (i < n_tokens && cache.cells[head + i].pos < 0) {
+            i++;
+        }
+        if (i == n_tokens) {
+            return true;
+        }
+        head += i + 1;
+    }
+
+    return false;
+}
+
+static void kv_cache_update_n(struct llama_kv_cache & cache) {
+    int n = (int) cache.cells.size();
+    while (n > 0 && cache.cells[n - 1].pos < 0) {
+        n--;
+    }
+    cache.n = n;
+}
+
+static void kv_cache_seq_rm(struct llama_kv_cache & cache, llama_seq_id seq_id, int p0, int p1) {
+    if (p1 < 0) {
+        p1 = INT_MAX;
+    }
+
+    for (auto & cell : cache.cells) {
+        if (cell.pos >= p0 && cell.pos < p1 && cell.has_seq_id(seq_id)) {
+            cell.seq_id.erase(seq_id);
+            if (cell.seq_id.empty()) {
+                cell.pos = -1;
+            }
+        }
+    }
+
+    kv_cache_update_n(cache);
+}
+
+// the rotation of the cached K is updated lazily, at the start of the next eval
+static void kv_cache_seq_shift(struct llama_kv_cache & cache, llama_seq_id seq_id, int p0, int p1, int delta) {
+    if (delta == 0) {
+        return;
+    }
+
+    if (p1 < 0) {
+        p1 = INT_MAX;
+    }
+
+    for (auto & cell : cache.cells) {
+        if (cell.pos >= p0 && cell.pos < p1 && cell.has_seq_id(seq_id)) {
+            cell.pos   += delta;
+            cell.delta += delta;
+            cache.has_shift = true;
+
+            if (cell.pos < 0) {
+                cell.pos   = -1;
+                cell.delta =  0;
+                cell.seq_id.clear();
+            }
+        }
+    }
+
+    kv_cache_update_n(cache);
+}
+
 struct llama_context_params llama_context_default_params() {
     struct llama_context_params result = {
         /*.n_ctx                       =*/ 512,
         /*.gpu_layers                  =*/ 0,
         /*.seed                        =*/ -1,
+        /*.n_spin                      =*/ GGML_DEFAULT_N_SPIN,
+        /*.type_k                      =*/ LLAMA_KV_TYPE_DEFAULT,
+        /*.type_v                      =*/ LLAMA_KV_TYPE_DEFAULT,
+        /*.numa                        =*/ LLAMA_NUMA_DISABLED,
+        /*.mmap_budget                 =*/ 0,
         /*.f16_kv                      =*/ true,
         /*.logits_all                  =*/ false,
         /*.vocab_only                  =*/ false,
         /*.use_mmap                    =*/ true,
         /*.use_mlock                   =*/ false,
+        /*.repack                      =*/ false,
+        /*.direct_io                   =*/ false,
+        /*.hugepages                   =*/ false,
         /*.embedding                   =*/ false,
         /*.progress_callback           =*/ nullptr,
         /*.progress_callback_user_data =*/ nullptr,
@@ -909,22 +1391,26 @@ static const char *llama_model_type_name(e_model type) {
 
 static void llama_model_load_internal(
         const std::string & fname,
-        llama_context & lctx,
+        llama_model & model,
         int n_ctx,
         int n_gpu_layers,
         ggml_type memory_type,
         bool use_mmap,
         bool use_mlock,
+        bool repack,
+        bool direct_io,
+        const llama_placement & placement,
+        size_t mmap_budget,
         bool vocab_only,
         llama_progress_callback progress_callback,
         void * progress_callback_user_data) {
 
-    lctx.t_start_us = ggml_time_us();
+    model.t_start_us = ggml_time_us();
 
-    std::unique_ptr<llama_model_loader> ml(new llama_model_loader(fname, use_mmap, vocab_only));
+    std::unique_ptr<llama_model_loader> ml(new llama_model_loader(fname, use_mmap, direct_io, vocab_only));
 
-    lctx.vocab = std::move(ml->file_loaders.at(0)->vocab);
-    auto & model = lctx.model;
+    model.vocab = std::move(ml->file_loaders.at(0)->vocab);
+    llama_vocab_init_table(model.vocab);
     model.hparams = ml->file_loaders.at(0)->hparams;
     llama_file_version file_version = ml->file_loaders.at(0)->file_version;
     auto & hparams = model.hparams;
@@ -985,15 +1471,15 @@ static void llama_model_load_internal(
 
     // create the ggml context
     {
-        lctx.model.buf.resize(ctx_size);
+        model.buf.resize(ctx_size, placement);
         if (use_mlock) {
-            lctx.model.mlock_buf.init(lctx.model.buf.addr);
-            lctx.model.mlock_buf.grow_to(lctx.model.buf.size);
+            model.mlock_buf.init(model.buf.addr);
+            model.mlock_buf.grow_to(model.buf.size);
         }
 
         struct ggml_init_params params = {
-            /*.mem_size   =*/ lctx.model.buf.size,
-            /*.mem_buffer =*/ lctx.model.buf.addr,
+            /*.mem_size   =*/ model.buf.size,
+            /*.mem_buffer =*/ model.buf.addr,
             /*.no_alloc   =*/ ml->use_mmap,
         };
 
@@ -1104,7 +1590,9 @@ static void llama_model_load_internal(
         model.tensors_by_name.emplace_back(lt.name, lt.ggml_tensor);
     }
 
-    ml->load_all_data(progress_callback, progress_callback_user_data, use_mlock ? &lctx.model.mlock_mmap : NULL);
+    // with a resident budget, the pager reads the layers that stay resident once the model is loaded
+    const bool paged = mmap_budget > 0 && ml->use_mmap && !use_mlock;
+    ml->load_all_data(progress_callback, progress_callback_user_data, use_mlock ? &model.mlock_mmap : NULL, repack, placement, !paged);
 
 #ifdef GGML_USE_CUBLAS
     {
@@ -1159,27 +1647,58 @@ static void llama_model_load_internal(
         progress_callback(1.0f, progress_callback_user_data);
     }
 
+    if (repack) {
+        fprintf(stderr, "%s: repacked %zu tensors\n", __func__, ml->num_tensors_repacked);
+    }
+
     model.mapping = std::move(ml->mapping);
 
+    if (mmap_budget > 0 && !paged) {
+        fprintf(stderr, "%s: warning: the resident budget needs a memory-mapped model without mlock, ignoring it\n", __func__);
+    } else if (paged) {
+        // the output matrix is read by every eval, it is always resident
+        size_t fixed_size = 0;
+        for (const ggml_tensor * t : { model.norm, model.output }) {
+            fixed_size += model.mapping->contains(t->data) ? ggml_nbytes(t) : 0;
+        }
+        const size_t budget = mmap_budget > fixed_size ? mmap_budget - fixed_size : 0;
+
+        if (model.pager.init(model.mapping.get(), model.layers, budget)) {
+            fprintf(stderr, "%s: resident budget = %7.2f MB: %d of %d layers resident, the others are streamed\n",
+                    __func__, mmap_budget/1024.0/1024.0, model.pager.n_resident, (int) model.layers.size());
+            if (budget < 2*model.pager.layer_size) {
+                fprintf(stderr, "%s: warning: the resident budget is exceeded, streaming needs %7.2f MB more\n",
+                        __func__, (fixed_size + 2*model.pager.layer_size - mmap_budget)/1024.0/1024.0);
+            }
+        } else {
+            fprintf(stderr, "%s: resident budget = %7.2f MB: the model fits in it\n", __func__, mmap_budget/1024.0/1024.0);
+            model.mapping->prefetch(model.mapping->addr, model.mapping->size);
+        }
+    }
+
     // loading time will be recalculate after the first eval, so
     // we take page faults deferred by mmap() into consideration
-    lctx.t_load_us = ggml_time_us() - lctx.t_start_us;
+    model.t_load_us = ggml_time_us() - model.t_start_us;
 }
 
 static bool llama_model_load(
         const std::string & fname,
-        llama_context & lctx,
+        llama_model & model,
         int n_ctx,
         int n_gpu_layers,
         ggml_type memory_type,
         bool use_mmap,
         bool use_mlock,
+        bool repack,
+        bool direct_io,
+        const llama_placement & placement,
+        size_t mmap_budget,
         bool vocab_only,
         llama_progress_callback progress_callback,
         void *progress_callback_user_data) {
     try {
-        llama_model_load_internal(fname, lctx, n_ctx, n_gpu_layers, memory_type, use_mmap, use_mlock,
-                                  vocab_only, progress_callback, progress_callback_user_data);
+        llama_model_load_internal(fname, model, n_ctx, n_gpu_layers, memory_type, use_mmap, use_mlock, repack,
+                                  direct_io, placement, mmap_budget, vocab_only, progress_callback, progress_callback_user_data);
         return true;
     } catch (const std::string & err) {
         fprintf(stderr, "error loading model: %s\n", err.c_str());
@@ -1189,22 +1708,28 @@ static bool llama_model_load(
 
 // evaluate the transformer
 //
-//   - lctx:      llama context
-//   - tokens:    new batch of tokens to process
-//   - n_past:    the context size so far
-//   - n_threads: number of threads to use
+//   - lctx:       llama context
+//   - tokens:     new batch of tokens to process
+//   - pos:        position of each token in its sequence
+//   - seq_id:     sequence of each token
+//   - n_threads:  number of threads to use
+//   - logits_all: return the logits of every token, not just the last one
 //
 static bool llama_eval_internal(
-        llama_context & lctx,
-    const llama_token * tokens,
-            const int   n_tokens,
-            const int   n_past,
-            const int   n_threads) {
-
-    // enforce that the first token is BOS
-    if (n_past == 0 && tokens[0] != llama_token_bos()) {
-        fprintf(stderr, "%s: first token must be BOS\n", __func__);
-        return false;
+         llama_context & lctx,
+     const llama_token * tokens,
+             const int * pos,
+    const llama_seq_id * seq_id,
+             const int   n_tokens,
+             const int   n_threads,
+            const bool   logits_all) {
+
+    // enforce that the first token of a sequence is BOS
+    for (int i = 0; i < n_tokens; ++i) {
+        if (pos[i] == 0 && tokens[i] != llama_token_bos()) {
+            fprintf(stderr, "%s: first token must be BOS\n", __func__);
+            return false;
+        }
     }
 
     const int64_t t_start_us = ggml_time_us();
@@ -1212,12 +1737,29 @@ static bool llama_eval_internal(
     const int N = n_tokens;
 
     const auto & model   = lctx.model;
-    const auto & hparams = model.hparams;
+    const auto & hparams = lctx.hparams;
 
-    const auto & kv_self = model.kv_self;
+    auto & kv_self = lctx.kv_self;
 
     LLAMA_ASSERT(!!kv_self.ctx);
 
+    // place the batch in the first run of N free cells of the KV cache
+    int head = 0;
+    if (!kv_cache_find_slot(kv_self, N, head)) {
+        fprintf(stderr, "%s: not enough free space in the KV cache for %d tokens\n", __func__, N);
+        return false;
+    }
+
+    for (int i = 0; i < N; ++i) {
+        kv_self.cells[head + i].pos = pos[i];
+        kv_self.cells[head + i].seq_id.insert(seq_id[i]);
+    }
+
+    kv_self.n = std::max(kv_self.n, head + N);
+
+    // the attention covers all the cells in use
+    const int n_kv = kv_self.n;
+
     const int n_embd  = hparams.n_embd;
     const int n_layer = hparams.n_layer;
     const int n_ctx   = hparams.n_ctx;
@@ -1225,6 +1767,10 @@ static bool llama_eval_internal(
     const int n_vocab = hparams.n_vocab;
     const int n_rot   = hparams.n_embd/hparams.n_head;
 
+    // K may be quantized, its rows are addressed in bytes
+    const size_t k_row  = llama_row_size(kv_self.k->type, n_embd);
+    const size_t k_head = llama_row_size(kv_self.k->type, n_embd/n_head);
+
     auto & mem_per_token = lctx.mem_per_token;
     auto & buf_compute   = lctx.buf_compute;
 
@@ -1245,8 +1791,57 @@ static bool llama_eval_internal(
     ggml_set_name(embd, "embd");
     memcpy(embd->data, tokens, N*ggml_element_size(embd));
 
+    // re-rotate the cached K of the shifted cells, before anything reads it
+    if (kv_self.has_shift) {
+        struct ggml_tensor * K_shift = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_kv);
+        ggml_set_name(K_shift, "K_shift");
+
+        for (int i = 0; i < n_kv; ++i) {
+            ((int32_t *) K_shift->data)[i] = kv_self.cells[i].delta;
+        }
+
+        for (int il = 0; il < n_layer; ++il) {
+            struct ggml_tensor * K = ggml_view_3d(ctx0, kv_self.k, n_embd/n_head, n_head, n_kv, k_head, k_row, k_row*n_ctx*il);
+
+            if (ggml_is_quantized(kv_self.k->type)) {
+                // RoPE works on F32, a quantized K is rotated dequantized and quantized again
+                struct ggml_tensor * tmp = ggml_cpy(ctx0, K, ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_embd/n_head, n_head, n_kv));
+                tmp = ggml_rope_pos_inplace(ctx0, tmp, K_shift, n_rot, 0);
+                ggml_build_forward_expand(&gf, ggml_cpy(ctx0, tmp, K));
+            } else {
+                ggml_build_forward_expand(&gf, ggml_rope_pos_inplace(ctx0, K, K_shift, n_rot, 0));
+            }
+        }
+
+        kv_self.has_shift = false;
+        for (auto & cell : kv_self.cells) {
+            cell.delta = 0;
+        }
+    }
+
     struct ggml_tensor * inpL = ggml_get_rows(ctx0, model.tok_embeddings, embd);
 
+    struct ggml_tensor * inp_pos = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
+    ggml_set_name(inp_pos, "inp_pos");
+    memcpy(inp_pos->data, pos, N*ggml_element_size(inp_pos));
+
+    // KQ_mask[j][i] != 0 if token j may attend to cell i: same sequence, same or earlier position
+    struct ggml_tensor * KQ_mask = ggml_new_tensor_2d(ctx0, GGML_TYPE_I32, n_kv, N);
+    ggml_set_name(KQ_mask, "KQ_mask");
+    {
+        int32_t * data = (int32_t *) KQ_mask->data;
+
+        for (int j = 0; j < N; ++j) {
+            for (int i = 0; i < n_kv; ++i) {
+                const llama_kv_cell & cell = kv_self.cells[i];
+                data[j*n_kv + i] = cell.pos >= 0 && cell.pos <= pos[j] && cell.has_seq_id(seq_id[j]);
+            }
+        }
+    }
+
+    // the end of the nodes of each layer in the graph, when the pager computes them one at a time
+    std::vector<int> layer_end;
+
     for (int il = 0; il < n_layer; ++il) {
         struct ggml_tensor * inpSA = inpL;
 
@@ -1265,8 +1860,8 @@ static bool llama_eval_internal(
         // self-attention
         {
             // compute Q and K and RoPE them
-            struct ggml_tensor * Qcur = ggml_rope_inplace(ctx0, ggml_reshape_3d(ctx0, ggml_mul_mat(ctx0, model.layers[il].wq, cur), n_embd/n_head, n_head, N), n_past, n_rot, 0);
-            struct ggml_tensor * Kcur = ggml_rope_inplace(ctx0, ggml_reshape_3d(ctx0, ggml_mul_mat(ctx0, model.layers[il].wk, cur), n_embd/n_head, n_head, N), n_past, n_rot, 0);
+            struct ggml_tensor * Qcur = ggml_rope_pos_inplace(ctx0, ggml_reshape_3d(ctx0, ggml_mul_mat(ctx0, model.layers[il].wq, cur), n_embd/n_head, n_head, N), inp_pos, n_rot, 0);
+            struct ggml_tensor * Kcur = ggml_rope_pos_inplace(ctx0, ggml_reshape_3d(ctx0, ggml_mul_mat(ctx0, model.layers[il].wk, cur), n_embd/n_head, n_head, N), inp_pos, n_rot, 0);
             ggml_set_name(Qcur, "Qcur");
             ggml_set_name(Kcur, "Kcur");
 
@@ -1275,10 +1870,10 @@ static bool llama_eval_internal(
                 // compute the transposed [N, n_embd] V matrix
                 struct ggml_tensor * Vcur = ggml_transpose(ctx0, ggml_reshape_2d(ctx0, ggml_mul_mat(ctx0, model.layers[il].wv, cur), n_embd, N));
 
-                struct ggml_tensor * k = ggml_view_1d(ctx0, kv_self.k, N*n_embd, (ggml_element_size(kv_self.k)*n_embd)*(il*n_ctx + n_past));
+                struct ggml_tensor * k = ggml_view_1d(ctx0, kv_self.k, N*n_embd, k_row*(il*n_ctx + head));
                 struct ggml_tensor * v = ggml_view_2d(ctx0, kv_self.v, N, n_embd,
                         (   n_ctx)*ggml_element_size(kv_self.v),
-                        (il*n_ctx)*ggml_element_size(kv_self.v)*n_embd + n_past*ggml_element_size(kv_self.v));
+                        (il*n_ctx)*ggml_element_size(kv_self.v)*n_embd + head*ggml_element_size(kv_self.v));
 
                 // important: storing RoPE-ed version of K in the KV cache!
                 ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Kcur, k));
@@ -1294,8 +1889,8 @@ static bool llama_eval_internal(
             struct ggml_tensor * K =
                 ggml_permute(ctx0,
                         ggml_reshape_3d(ctx0,
-                            ggml_view_1d(ctx0, kv_self.k, (n_past + N)*n_embd, il*n_ctx*ggml_element_size(kv_self.k)*n_embd),
-                            n_embd/n_head, n_head, n_past + N),
+                            ggml_view_1d(ctx0, kv_self.k, n_kv*n_embd, il*n_ctx*k_row),
+                            n_embd/n_head, n_head, n_kv),
                         0, 2, 1, 3);
             ggml_set_name(K, "K");
 
@@ -1307,12 +1902,12 @@ static bool llama_eval_internal(
             struct ggml_tensor * KQ_scale = ggml_new_f32(ctx0, 1.0f/sqrtf(float(n_embd)/n_head));
             ggml_set_name(KQ_scale, "1/sqrt(n_embd/n_head)");
 
-            // KQ_scaled shape [n_past + N, N, n_head, 1]
+            // KQ_scaled shape [n_kv, N, n_head, 1]
             struct ggml_tensor * KQ_scaled = ggml_scale_inplace(ctx0, KQ, KQ_scale);
             ggml_set_name(KQ_scaled, "KQ_scaled");
 
-            // KQ_masked = mask_past(KQ_scaled)
-            struct ggml_tensor * KQ_masked = ggml_diag_mask_inf_inplace(ctx0, KQ_scaled, n_past);
+            // KQ_masked = mask_seq(KQ_scaled)
+            struct ggml_tensor * KQ_masked = ggml_mask_inf_inplace(ctx0, KQ_scaled, KQ_mask);
             ggml_set_name(KQ_masked, "KQ_masked");
 
             // KQ = soft_max(KQ_masked)
@@ -1323,7 +1918,7 @@ static bool llama_eval_internal(
             // split cached V into n_head heads
             struct ggml_tensor * V =
                 ggml_view_3d(ctx0, kv_self.v,
-                        n_past + N, n_embd/n_head, n_head,
+                        n_kv, n_embd/n_head, n_head,
                         n_ctx*ggml_element_size(kv_self.v),
                         n_ctx*ggml_element_size(kv_self.v)*n_embd/n_head,
                         il*n_ctx*ggml_element_size(kv_self.v)*n_embd);
@@ -1336,7 +1931,7 @@ static bool llama_eval_internal(
             // make V contiguous in memory to speed up the matmul, however we waste time on the copy
             // on M1 this is faster for the perplexity computation, but ~5% slower for the single-token generation
             // is there a better way?
-            struct ggml_tensor * V_cont = ggml_cpy(ctx0, V, ggml_new_tensor_3d(ctx0, kv_self.v->type, n_past + N, n_embd/n_head, n_head));
+            struct ggml_tensor * V_cont = ggml_cpy(ctx0, V, ggml_new_tensor_3d(ctx0, kv_self.v->type, n_kv, n_embd/n_head, n_head));
             struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V_cont, KQ_soft_max);
 #endif
 
@@ -1392,6 +1987,11 @@ static bool llama_eval_internal(
 
         // input for next layer
         inpL = cur;
+
+        if (model.pager.enabled()) {
+            ggml_build_forward_expand(&gf, cur);
+            layer_end.push_back(gf.n_nodes);
+        }
     }
 
     lctx.use_buf(ctx0, 0);
@@ -1419,8 +2019,27 @@ static bool llama_eval_internal(
     //inpL = ggml_soft_max_inplace(ctx0, inpL);
 
     // run the computation
-    ggml_build_forward_expand(&gf, inpL);
-    ggml_graph_compute       (ctx0, &gf);
+    if (!lctx.threadpool || ggml_threadpool_n_threads(lctx.threadpool) != n_threads) {
+        ggml_threadpool_free(lctx.threadpool);
+        lctx.threadpool = ggml_threadpool_new(n_threads);
+        ggml_threadpool_set_n_spin(lctx.threadpool, lctx.n_spin);
+    }
+
+    ggml_build_forward_expand    (&gf, inpL);
+
+    if (model.pager.enabled()) {
+        // one layer at a time, so that the pager streams the layers that are not resident
+        int i_begin = 0;
+        for (int il = 0; il < n_layer; ++il) {
+            model.pager.begin_layer(il);
+            ggml_graph_compute_range(ctx0, &gf, lctx.threadpool, i_begin, layer_end[il]);
+            model.pager.end_layer(il);
+            i_begin = layer_end[il];
+        }
+        ggml_graph_compute_range(ctx0, &gf, lctx.threadpool, i_begin, gf.n_nodes);
+    } else {
+        ggml_graph_compute_with_pool(ctx0, &gf, lctx.threadpool);
+    }
 
 #ifdef GGML_PERF
     // print timing information per ggml operation (for debugging purposes)
@@ -1429,21 +2048,18 @@ static bool llama_eval_internal(
 #endif
 
     // plot the computation graph in dot format (for debugging purposes)
-    //if (n_past%100 == 0) {
+    //if (n_kv%100 == 0) {
     //    ggml_graph_dump_dot(&gf, NULL, "llama.dot");
     //}
 
     //embd_w.resize(n_vocab*N);
     //memcpy(embd_w.data(), ggml_get_data(inpL), sizeof(float)*n_vocab*N);
 
-    // update kv token count
-    lctx.model.kv_self.n = n_past + N;
-
     // extract logits
     {
         auto & logits_out = lctx.logits;
 
-        if (lctx.logits_all) {
+        if (logits_all) {
             logits_out.resize(n_vocab * N);
             memcpy(logits_out.data(), (float *) ggml_get_data(inpL), sizeof(float)*n_vocab*N);
         } else {
@@ -1509,12 +2125,11 @@ static_assert(std::is_trivially_copyable<llama_sp_symbol>::value, "llama_sp_symb
 
 struct llama_sp_bigram {
     struct comparator {
-        bool operator()(llama_sp_bigram & l, llama_sp_bigram & r) {
+        bool operator()(const llama_sp_bigram & l, const llama_sp_bigram & r) const {
             return (l.score < r.score) || (l.score == r.score && l.left > r.left);
         }
     };
     using queue_storage = std::vector<llama_sp_bigram>;
-    using queue = std::priority_queue<llama_sp_bigram, queue_storage, comparator>;
     llama_sp_symbol::index left;
     llama_sp_symbol::index right;
     float score;
@@ -1524,33 +2139,37 @@ struct llama_sp_bigram {
 // original implementation:
 // https://github.com/ggerganov/llama.cpp/commit/074bea2eb1f1349a0118239c4152914aecaa1be4
 struct llama_tokenizer {
-    llama_tokenizer(const llama_vocab & vocab): vocab_(vocab) {}
+    // appends the tokens of text to output, the buffers of the tokenizer are kept for the next call
+    void tokenize(const llama_vocab & vocab, const char * text, size_t n_text, std::vector<llama_vocab::id> & output) {
+        symbols_.clear();
+        work_queue_.clear();
 
-    void tokenize(const std::string & text, std::vector<llama_vocab::id> & output) {
         // split string into utf8 chars
         int index = 0;
         size_t offs = 0;
-        while (offs < text.size()) {
+        while (offs < n_text) {
             llama_sp_symbol sym;
-            size_t char_len = std::min(text.size() - offs, utf8_len(text[offs]));
-            sym.text = text.c_str() + offs;
+            size_t char_len = std::min(n_text - offs, utf8_len(text[offs]));
+            sym.text = text + offs;
             sym.n = char_len;
             offs += char_len;
             sym.prev = index - 1;
-            sym.next = offs == text.size() ? -1 : index + 1;
+            sym.next = offs == n_text ? -1 : index + 1;
             index++;
-            symbols_.emplace_back(sym);
+            symbols_.push_back(sym);
         }
 
         // seed the work queue with all possible 2-character tokens.
         for (size_t i = 1; i < symbols_.size(); ++i) {
-            try_add_bigram(i - 1, i);
+            try_add_bigram(vocab, i - 1, i, false);
         }
+        std::make_heap(work_queue_.begin(), work_queue_.end(), llama_sp_bigram::comparator());
 
         // keep substituting the highest frequency pairs for as long as we can.
         while (!work_queue_.empty()) {
-            auto bigram = work_queue_.top();
-            work_queue_.pop();
+            std::pop_heap(work_queue_.begin(), work_queue_.end(), llama_sp_bigram::comparator());
+            auto bigram = work_queue_.back();
+            work_queue_.pop_back();
 
             auto & left_sym = symbols_[bigram.left];
             auto & right_sym = symbols_[bigram.right];
@@ -1574,92 +2193,646 @@ struct llama_tokenizer {
             }
 
             // find more substitutions
-            try_add_bigram(left_sym.prev, bigram.left);
-            try_add_bigram(bigram.left, left_sym.next);
+            try_add_bigram(vocab, left_sym.prev, bigram.left, true);
+            try_add_bigram(vocab, bigram.left, left_sym.next, true);
         }
 
         for (int i = 0; i != -1; i = symbols_[i].next) {
             auto & symbol = symbols_[i];
-            auto token = vocab_.token_to_id.find(std::string(symbol.text, symbol.n));
+            const llama_vocab::id token = llama_vocab_find(vocab, symbol.text, symbol.n);
 
-            if (token == vocab_.token_to_id.end()) {
+            if (token < 0) {
                 // output any symbols that did not form tokens as bytes.
                 for (int j = 0; j < (int) symbol.n; ++j) {
                     llama_vocab::id token_id = static_cast<uint8_t>(symbol.text[j]) + 3;
                     output.push_back(token_id);
                 }
             } else {
-                output.push_back((*token).second);
+                output.push_back(token);
             }
         }
     }
 
 private:
-    void try_add_bigram(int left, int right) {
+    // the work queue is only kept a heap if heapify is set
+    void try_add_bigram(const llama_vocab & vocab, int left, int right, bool heapify) {
         if (left == -1 || right == -1) {
             return;
         }
 
-        const std::string text = std::string(symbols_[left].text, symbols_[left].n + symbols_[right].n);
-        auto token = vocab_.token_to_id.find(text);
-
-        if (token == vocab_.token_to_id.end()) {
-            return;
-        }
+        const size_t size = symbols_[left].n + symbols_[right].n;
+        const llama_vocab::id token = llama_vocab_find(vocab, symbols_[left].text, size);
 
-        if (static_cast<size_t>((*token).second) >= vocab_.id_to_token.size()) {
+        if (token < 0) {
             return;
         }
 
-        const auto &tok_score = vocab_.id_to_token[(*token).second];
+        const auto &tok_score = vocab.id_to_token[token];
 
         llama_sp_bigram bigram;
         bigram.left = left;
         bigram.right = right;
         bigram.score = tok_score.score;
-        bigram.size = text.size();
-        work_queue_.push(bigram);
+        bigram.size = size;
+        work_queue_.push_back(bigram);
+        if (heapify) {
+            std::push_heap(work_queue_.begin(), work_queue_.end(), llama_sp_bigram::comparator());
+        }
     }
 
-    const llama_vocab & vocab_;
     std::vector<llama_sp_symbol> symbols_;
-    llama_sp_bigram::queue work_queue_;
+    llama_sp_bigram::queue_storage work_queue_; // a max-heap by score
 };
 
-static std::vector<llama_vocab::id> llama_tokenize(const llama_vocab & vocab, const std::string & text, bool bos) {
-    llama_tokenizer tokenizer(vocab);
-    std::vector<llama_vocab::id> output;
+// clears output and fills it with the tokens of text
+static void llama_tokenize(llama_tokenizer & tokenizer, const llama_vocab & vocab, const char * text, size_t n_text, bool bos, std::vector<llama_vocab::id> & output) {
+    output.clear();
 
-    if (text.empty()) {
-        return output;
+    if (n_text == 0) {
+        return;
     }
 
     if (bos) {
         output.push_back(llama_token_bos());
     }
 
-    tokenizer.tokenize(text, output);
-    return output;
+    tokenizer.tokenize(vocab, text, n_text, output);
 }
 
-//
-// sampling
-//
+struct llama_tokenize_piece {
+    const char * text;
+    size_t       n_text;
+    bool         bos;
+};
 
-void llama_sample_softmax(struct llama_context * ctx, llama_token_data_array * candidates) {
-    assert(candidates->size > 0);
+// tokenizes the pieces on n_threads threads, each with its own tokenizer
+static void llama_tokenize_pieces(const llama_vocab & vocab, const std::vector<llama_tokenize_piece> & pieces, int n_threads, std::vector<std::vector<llama_vocab::id>> & results) {
+    results.resize(pieces.size());
 
-    const int64_t t_start_sample_us = ggml_time_us();
+    std::atomic<size_t> next(0);
+    auto compute = [&]() {
+        llama_tokenizer tokenizer;
+        for (size_t i = next++; i < pieces.size(); i = next++) {
+            llama_tokenize(tokenizer, vocab, pieces[i].text, pieces[i].n_text, pieces[i].bos, results[i]);
+        }
+    };
 
-    // Sort the logits in descending order
-    if (!candidates->sorted) {
-        std::sort(candidates->data, candidates->data + candidates->size, [](const llama_token_data & a, const llama_token_data & b) {
-            return a.logit > b.logit;
-        });
-        candidates->sorted = true;
+    const int n_workers = std::min((int) pieces.size(), std::max(1, n_threads)) - 1;
+    std::vector<std::thread> workers;
+    for (int i = 0; i < n_workers; i++) {
+        workers.emplace_back(compute);
+    }
+    compute();
+    for (auto & worker : workers) {
+        worker.join();
     }
+}
 
-    float max_l = candidates->data[0].logit;
+// splits text into pieces of about chunk_size bytes that give the same tokens as the whole text: at the boundaries
+// of the characters the tokenizer sees, between two bytes that no token contains
+static std::vector<llama_tokenize_piece> llama_tokenize_split(const llama_vocab & vocab, const char * text, size_t n_text, size_t chunk_size, bool bos) {
+    std::vector<llama_tokenize_piece> pieces;
+
+    size_t start = 0;
+    size_t offs  = 0;
+    while (offs < n_text) {
+        offs += std::min(n_text - offs, utf8_len(text[offs]));
+        if (offs < n_text && offs - start >= chunk_size) {
+            const size_t pair = (uint8_t) text[offs - 1]*256 + (uint8_t) text[offs];
+            if (!(vocab.byte_pairs[pair/64] & (1ull << (pair%64)))) {
+                pieces.push_back({ text + start, offs - start, bos && start == 0 });
+                start = offs;
+            }
+        }
+    }
+    pieces.push_back({ text + start, n_text - start, bos && start == 0 });
+
+    return pieces;
+}
+
+//
+// grammar - sampling constrained by a context-free grammar
+//
+
+// a grammar state is a set of stacks of positions in the rules, the top of a non-empty stack is a terminal
+using llama_grammar_stack  = std::vector<const llama_grammar_element *>;
+using llama_grammar_stacks = std::vector<llama_grammar_stack>;
+
+struct llama_grammar {
+    std::vector<std::vector<llama_grammar_element>> rules;
+    llama_grammar_stacks                            stacks;
+
+    // the code points of every token of the vocabulary, 0-terminated, empty if the token is not valid UTF-8
+    std::vector<std::vector<uint32_t>> vocab;
+
+    // the tokens allowed in the states met so far, excluding the end of stream token
+    std::map<llama_grammar_stacks, std::vector<bool>> allowed_cache;
+};
+
+// the grammar state cache is dropped when it grows past this number of states
+#define LLAMA_GRAMMAR_MAX_CACHED_STATES 1024
+
+// decodes a complete UTF-8 string without NUL characters, returns false if it is invalid or ends in the middle of a character
+static bool decode_utf8(const std::string & src, std::vector<uint32_t> & code_points) {
+    static const int lookup[] = { 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 2, 2, 3, 4 };
+    code_points.clear();
+    size_t pos = 0;
+    while (pos < src.size()) {
+        const uint8_t first_byte = static_cast<uint8_t>(src[pos]);
+        const int     n_bytes    = lookup[first_byte >> 4];
+        if (n_bytes == 0 || pos + n_bytes > src.size()) {
+            return false;
+        }
+        const uint8_t mask  = (1 << (7 - n_bytes)) - 1;
+        uint32_t      value = first_byte & (n_bytes == 1 ? 0x7f : mask);
+        for (int i = 1; i < n_bytes; ++i) {
+            const uint8_t next_byte = static_cast<uint8_t>(src[pos + i]);
+            if ((next_byte & 0xc0) != 0x80) {
+                return false;
+            }
+            value = (value << 6) + (next_byte & 0x3f);
+        }
+        if (value == 0) {
+            // 0 terminates the code points
+            return false;
+        }
+        code_points.push_back(value);
+        pos += n_bytes;
+    }
+    code_points.push_back(0);
+    return true;
+}
+
+// returns true iff pos points to the end of one of the definitions of a rule
+static bool llama_grammar_is_end_of_sequence(const llama_grammar_element * pos) {
+    return pos->type == LLAMA_GRETYPE_END || pos->type == LLAMA_GRETYPE_ALT;
+}
+
+// returns true iff chr satisfies the char range at pos (regular or inverse range)
+// asserts that pos is pointing to a char range element
+static std::pair<bool, const llama_grammar_element *> llama_grammar_match_char(
+        const llama_grammar_element * pos,
+        const uint32_t                chr) {
+    bool found            = false;
+    bool is_positive_char = pos->type == LLAMA_GRETYPE_CHAR;
+
+    LLAMA_ASSERT(is_positive_char || pos->type == LLAMA_GRETYPE_CHAR_NOT);
+
+    do {
+        if (pos[1].type == LLAMA_GRETYPE_CHAR_RNG_UPPER) {
+            // inclusive range, e.g. [a-z]
+            found = found || (pos->value <= chr && chr <= pos[1].value);
+            pos += 2;
+        } else {
+            // exact char match, e.g. [a] or "a"
+            found = found || pos->value == chr;
+            pos += 1;
+        }
+    } while (pos->type == LLAMA_GRETYPE_CHAR_ALT);
+
+    return std::make_pair(found == is_positive_char, pos);
+}
+
+// transforms a grammar pushdown stack into N possible stacks, all ending
+// at a character range (terminal element)
+static void llama_grammar_advance_stack(
+        const std::vector<std::vector<llama_grammar_element>> & rules,
+        const llama_grammar_stack                             & stack,
+        llama_grammar_stacks                                  & new_stacks) {
+    if (stack.empty()) {
+        if (std::find(new_stacks.begin(), new_stacks.end(), stack) == new_stacks.end()) {
+            new_stacks.push_back(stack);
+        }
+        return;
+    }
+
+    const llama_grammar_element * pos = stack.back();
+
+    switch (pos->type) {
+        case LLAMA_GRETYPE_RULE_REF: {
+            const size_t                  rule_id = static_cast<size_t>(pos->value);
+            const llama_grammar_element * subpos  = rules[rule_id].data();
+            do {
+                // init new stack without the top (pos)
+                llama_grammar_stack new_stack(stack.begin(), stack.end() - 1);
+                if (!llama_grammar_is_end_of_sequence(pos + 1)) {
+                    // if this rule ref is followed by another element, add that to stack
+                    new_stack.push_back(pos + 1);
+                }
+                if (!llama_grammar_is_end_of_sequence(subpos)) {
+                    // if alternate is nonempty, add to stack
+                    new_stack.push_back(subpos);
+                }
+                llama_grammar_advance_stack(rules, new_stack, new_stacks);
+                while (!llama_grammar_is_end_of_sequence(subpos)) {
+                    // scan to end of alternate def
+                    subpos++;
+                }
+                if (subpos->type == LLAMA_GRETYPE_ALT) {
+                    // there's another alternate def of this rule to process
+                    subpos++;
+                } else {
+                    break;
+                }
+            } while (true);
+            break;
+        }
+        case LLAMA_GRETYPE_CHAR:
+        case LLAMA_GRETYPE_CHAR_NOT:
+            if (std::find(new_stacks.begin(), new_stacks.end(), stack) == new_stacks.end()) {
+                new_stacks.push_back(stack);
+            }
+            break;
+        default:
+            // end of alternate (LLAMA_GRETYPE_END, LLAMA_GRETYPE_ALT) or middle of char range
+            // (LLAMA_GRETYPE_CHAR_ALT, LLAMA_GRETYPE_CHAR_RNG_UPPER); stack should never be left on
+            // those
+            LLAMA_ASSERT(false);
+    }
+}
+
+// takes a set of possible pushdown stacks on a grammar, which are required to
+// be positioned at a character range (see `llama_grammar_advance_stack`), and
+// produces the N possible stacks if the given char is accepted at those
+// positions
+static llama_grammar_stacks llama_grammar_accept(
+        const std::vector<std::vector<llama_grammar_element>> & rules,
+        const llama_grammar_stacks                            & stacks,
+        const uint32_t                                          chr) {
+    llama_grammar_stacks new_stacks;
+
+    for (const auto & stack : stacks) {
+        if (stack.empty()) {
+            continue;
+        }
+
+        auto match = llama_grammar_match_char(stack.back(), chr);
+        if (match.first) {
+            const llama_grammar_element * pos = match.second;
+
+            // update top of stack to next element, if any
+            llama_grammar_stack new_stack(stack.begin(), stack.end() - 1);
+            if (!llama_grammar_is_end_of_sequence(pos)) {
+                new_stack.push_back(pos);
+            }
+            llama_grammar_advance_stack(rules, new_stack, new_stacks);
+        }
+    }
+
+    return new_stacks;
+}
+
+// a token being matched: its index in the vocabulary and its remaining code points
+typedef std::pair<llama_token, const uint32_t *> llama_grammar_candidate;
+
+static std::vector<llama_grammar_candidate> llama_grammar_reject_candidates(
+        const std::vector<std::vector<llama_grammar_element>> & rules,
+        const llama_grammar_stacks                            & stacks,
+        const std::vector<llama_grammar_candidate>            & candidates);
+
+// the candidates that cannot be matched from one stack, the candidates sharing their first code point are
+// advanced together so that common prefixes are only matched once
+static std::vector<llama_grammar_candidate> llama_grammar_reject_candidates_for_stack(
+        const std::vector<std::vector<llama_grammar_element>> & rules,
+        const llama_grammar_stack                             & stack,
+        const std::vector<llama_grammar_candidate>            & candidates) {
+    std::vector<llama_grammar_candidate> rejects;
+
+    if (stack.empty()) {
+        // the grammar is complete, only a fully matched token is allowed
+        for (const auto & tok : candidates) {
+            if (*tok.second != 0) {
+                rejects.push_back(tok);
+            }
+        }
+        return rejects;
+    }
+
+    const llama_grammar_element * stack_pos = stack.back();
+
+    std::vector<llama_grammar_candidate> next_candidates;
+    for (const auto & tok : candidates) {
+        if (*tok.second == 0) {
+            // the whole token has been matched
+            continue;
+        }
+        if (llama_grammar_match_char(stack_pos, *tok.second).first) {
+            next_candidates.push_back(llama_grammar_candidate(tok.first, tok.second + 1));
+        } else {
+            rejects.push_back(tok);
+        }
+    }
+
+    if (next_candidates.empty()) {
+        return rejects;
+    }
+
+    const auto * stack_pos_after = llama_grammar_match_char(stack_pos, 0).second;
+
+    // update top of stack to next element, if any
+    llama_grammar_stack stack_after(stack.begin(), stack.end() - 1);
+    if (!llama_grammar_is_end_of_sequence(stack_pos_after)) {
+        stack_after.push_back(stack_pos_after);
+    }
+    llama_grammar_stacks next_stacks;
+    llama_grammar_advance_stack(rules, stack_after, next_stacks);
+
+    for (const auto & tok : llama_grammar_reject_candidates(rules, next_stacks, next_candidates)) {
+        rejects.push_back(llama_grammar_candidate(tok.first, tok.second - 1));
+    }
+
+    return rejects;
+}
+
+// a candidate is rejected when no stack can match it
+static std::vector<llama_grammar_candidate> llama_grammar_reject_candidates(
+        const std::vector<std::vector<llama_grammar_element>> & rules,
+        const llama_grammar_stacks                            & stacks,
+        const std::vector<llama_grammar_candidate>            & candidates) {
+    if (stacks.empty() || candidates.empty()) {
+        return candidates;
+    }
+
+    auto rejects = llama_grammar_reject_candidates_for_stack(rules, stacks.front(), candidates);
+
+    for (size_t i = 1, size = stacks.size(); i < size && !rejects.empty(); ++i) {
+        rejects = llama_grammar_reject_candidates_for_stack(rules, stacks[i], rejects);
+    }
+
+    return rejects;
+}
+
+// the tokens allowed in the current state of the grammar, computed over the whole vocabulary once per state
+static const std::vector<bool> & llama_grammar_allowed_tokens(struct llama_grammar * grammar) {
+    auto it = grammar->allowed_cache.find(grammar->stacks);
+    if (it != grammar->allowed_cache.end()) {
+        return it->second;
+    }
+
+    if (grammar->allowed_cache.size() >= LLAMA_GRAMMAR_MAX_CACHED_STATES) {
+        grammar->allowed_cache.clear();
+    }
+
+    const int n_vocab = (int) grammar->vocab.size();
+
+    std::vector<llama_grammar_candidate> candidates;
+    candidates.reserve(n_vocab);
+    for (llama_token id = 0; id < n_vocab; ++id) {
+        // the empty tokens and the tokens that are not valid UTF-8 on their own are never allowed
+        if (grammar->vocab[id].size() > 1) {
+            candidates.push_back(llama_grammar_candidate(id, grammar->vocab[id].data()));
+        }
+    }
+
+    std::vector<bool> allowed(n_vocab, false);
+    for (const auto & tok : candidates) {
+        allowed[tok.first] = true;
+    }
+    for (const auto & tok : llama_grammar_reject_candidates(grammar->rules, grammar->stacks, candidates)) {
+        allowed[tok.first] = false;
+    }
+
+    return grammar->allowed_cache.emplace(grammar->stacks, std::move(allowed)).first->second;
+}
+
+// a rule is left recursive when it can reach itself without matching a character, through the rule references that
+// start one of its alternates or only follow rules that can match the empty string
+static bool llama_grammar_detect_left_recursion(const std::vector<std::vector<llama_grammar_element>> & rules) {
+    const size_t n_rules = rules.size();
+
+    // the rules that can match the empty string, iterated to a fixed point
+    std::vector<bool> nullable(n_rules, false);
+    for (bool changed = true; changed; ) {
+        changed = false;
+        for (size_t i = 0; i < n_rules; i++) {
+            if (nullable[i]) {
+                continue;
+            }
+            bool alt_nullable = true;
+            for (const auto & elem : rules[i]) {
+                if (llama_grammar_is_end_of_sequence(&elem)) {
+                    if (alt_nullable) {
+                        nullable[i] = true;
+                        changed     = true;
+                        break;
+                    }
+                    alt_nullable = true;
+                } else if (elem.type != LLAMA_GRETYPE_RULE_REF || !nullable[elem.value]) {
+                    alt_nullable = false;
+                }
+            }
+        }
+    }
+
+    // the rules each rule can start with
+    std::vector<std::vector<size_t>> left(n_rules);
+    for (size_t i = 0; i < n_rules; i++) {
+        bool at_start = true;
+        for (const auto & elem : rules[i]) {
+            if (llama_grammar_is_end_of_sequence(&elem)) {
+                at_start = true;
+            } else if (at_start && elem.type == LLAMA_GRETYPE_RULE_REF) {
+                left[i].push_back(elem.value);
+                at_start = nullable[elem.value];
+            } else {
+                at_start = false;
+            }
+        }
+    }
+
+    // a cycle in the graph of the starting rules, found with an iterative depth-first search
+    enum { UNVISITED, IN_PROGRESS, DONE };
+    std::vector<int> state(n_rules, UNVISITED);
+    std::vector<std::pair<size_t, size_t>> dfs; // rule, index of the next rule it starts with
+    for (size_t root = 0; root < n_rules; root++) {
+        if (state[root] != UNVISITED) {
+            continue;
+        }
+        state[root] = IN_PROGRESS;
+        dfs.emplace_back(root, 0);
+        while (!dfs.empty()) {
+            auto & top = dfs.back();
+            if (top.second == left[top.first].size()) {
+                state[top.first] = DONE;
+                dfs.pop_back();
+                continue;
+            }
+            const size_t next = left[top.first][top.second++];
+            if (state[next] == IN_PROGRESS) {
+                return true;
+            }
+            if (state[next] == UNVISITED) {
+                state[next] = IN_PROGRESS;
+                dfs.emplace_back(next, 0);
+            }
+        }
+    }
+
+    return false;
+}
+
+struct llama_grammar * llama_grammar_init(
+            const struct llama_context  * ctx,
+            const llama_grammar_element ** rules,
+                                  size_t   n_rules,
+                                  size_t   start_rule_index) {
+    if (start_rule_index >= n_rules) {
+        return nullptr;
+    }
+
+    // copy the rule definitions into vectors
+    std::vector<std::vector<llama_grammar_element>> vec_rules(n_rules);
+    for (size_t i = 0; i < n_rules; i++) {
+        for (const llama_grammar_element * pos = rules[i]; pos->type != LLAMA_GRETYPE_END; pos++) {
+            if (pos->type == LLAMA_GRETYPE_RULE_REF && pos->value >= n_rules) {
+                return nullptr;
+            }
+            vec_rules[i].push_back(*pos);
+        }
+        vec_rules[i].push_back({LLAMA_GRETYPE_END, 0});
+    }
+
+    // the stacks of a left recursive rule never reach a terminal
+    if (llama_grammar_detect_left_recursion(vec_rules)) {
+        return nullptr;
+    }
+
+    llama_grammar * grammar = new llama_grammar{ std::move(vec_rules), {}, {}, {} };
+
+    // loop over alternates of start rule to build initial stacks
+    const llama_grammar_element * pos = grammar->rules[start_rule_index].data();
+    do {
+        llama_grammar_stack stack;
+        if (!llama_grammar_is_end_of_sequence(pos)) {
+            // if alternate is nonempty, add to stack
+            stack.push_back(pos);
+        }
+        llama_grammar_advance_stack(grammar->rules, stack, grammar->stacks);
+        while (!llama_grammar_is_end_of_sequence(pos)) {
+            // scan to end of alternate def
+            pos++;
+        }
+        if (pos->type == LLAMA_GRETYPE_ALT) {
+            // there's another alternate def of this rule to process
+            pos++;
+        } else {
+            break;
+        }
+    } while (true);
+
+    // decode the vocabulary once, the allowed tokens of every state are computed from it
+    const auto & id_to_token = ctx->model.vocab.id_to_token;
+    grammar->vocab.resize(id_to_token.size());
+    for (size_t i = 0; i < id_to_token.size(); i++) {
+        if (!decode_utf8(id_to_token[i].tok, grammar->vocab[i])) {
+            grammar->vocab[i].clear();
+        }
+    }
+
+    return grammar;
+}
+
+void llama_grammar_free(struct llama_grammar * grammar) {
+    delete grammar;
+}
+
+void llama_sample_grammar(struct llama_context * ctx, llama_token_data_array * candidates, struct llama_grammar * grammar) {
+    const int64_t t_start_sample_us = ggml_time_us();
+
+    bool allow_eos = false;
+    for (const auto & stack : grammar->stacks) {
+        if (stack.empty()) {
+            allow_eos = true;
+            break;
+        }
+    }
+
+    const llama_token eos = llama_token_eos();
+
+    const std::vector<bool> & allowed = llama_grammar_allowed_tokens(grammar);
+
+    size_t n_allowed = 0;
+    for (size_t i = 0; i < candidates->size; ++i) {
+        const llama_token id = candidates->data[i].id;
+        if (id == eos ? !allow_eos : !allowed[id]) {
+            candidates->data[i].logit = -INFINITY;
+        } else {
+            n_allowed++;
+        }
+    }
+
+    // a dead end, no candidate can continue the grammar: the end of stream token is left so that the samplers still
+    // have a token to pick, llama_grammar_accept_token() reports it
+    if (n_allowed == 0) {
+        for (size_t i = 0; i < candidates->size; ++i) {
+            if (candidates->data[i].id == eos) {
+                candidates->data[i].logit = 0.0f;
+            }
+        }
+    }
+
+    if (ctx) {
+        ctx->t_sample_us += ggml_time_us() - t_start_sample_us;
+    }
+}
+
+// the stacks after the code points of token, empty if the grammar does not allow it
+static llama_grammar_stacks llama_grammar_accept_token_stacks(const struct llama_grammar * grammar, llama_token token) {
+    if (token == llama_token_eos()) {
+        for (const auto & stack : grammar->stacks) {
+            if (stack.empty()) {
+                return grammar->stacks;
+            }
+        }
+        return {};
+    }
+
+    const std::vector<uint32_t> & code_points = grammar->vocab[token];
+    if (code_points.empty()) {
+        return {};
+    }
+
+    llama_grammar_stacks stacks = grammar->stacks;
+    for (auto it = code_points.begin(), end = code_points.end() - 1; it != end && !stacks.empty(); ++it) {
+        stacks = llama_grammar_accept(grammar->rules, stacks, *it);
+    }
+    return stacks;
+}
+
+bool llama_grammar_accept_token(struct llama_context * ctx, struct llama_grammar * grammar, llama_token token) {
+    const int64_t t_start_sample_us = ggml_time_us();
+
+    llama_grammar_stacks stacks = llama_grammar_accept_token_stacks(grammar, token);
+    const bool accepted = !stacks.empty();
+    if (accepted) {
+        grammar->stacks = std::move(stacks);
+    }
+
+    if (ctx) {
+        ctx->t_sample_us += ggml_time_us() - t_start_sample_us;
+    }
+
+    return accepted;
+}
+
+//
+// sampling
+//
+
+void llama_sample_softmax(struct llama_context * ctx, llama_token_data_array * candidates) {
+    assert(candidates->size > 0);
+
+    const int64_t t_start_sample_us = ggml_time_us();
+
+    // Sort the logits in descending order
+    if (!candidates->sorted) {
+        std::sort(candidates->data, candidates->data + candidates->size, [](const llama_token_data & a, const llama_token_data & b) {
+            return a.logit > b.logit;
+        });
+        candidates->sorted = true;
+    }
+
+    float max_l = candidates->data[0].logit;
     float cum_sum = 0.0f;
     for (size_t i = 0; i < candidates->size; ++i) {
         float p = expf(candidates->data[i].logit - max_l);
@@ -1919,6 +3092,95 @@ void llama_sample_frequency_and_presence_penalties(struct llama_context * ctx, l
 }
 
 
+struct llama_penalty_state {
+    std::vector<llama_token> window; // ring buffer of the last tokens
+    int head   = 0;                  // index of the oldest token
+    int n_used = 0;
+
+    std::vector<int>         count;       // occurrences of every token of the vocabulary in the window
+    std::vector<llama_token> present;     // the distinct tokens of the window
+    std::vector<int>         present_idx; // index of every token of the vocabulary in present, -1 if absent
+};
+
+struct llama_penalty_state * llama_penalty_state_init(int n_vocab, int n_window) {
+    llama_penalty_state * state = new llama_penalty_state;
+
+    state->window.resize(std::max(0, n_window));
+    state->count.resize(n_vocab, 0);
+    state->present_idx.resize(n_vocab, -1);
+    state->present.reserve(state->window.size());
+
+    return state;
+}
+
+void llama_penalty_state_free(struct llama_penalty_state * state) {
+    delete state;
+}
+
+void llama_penalty_state_reset(struct llama_penalty_state * state) {
+    for (llama_token id : state->present) {
+        state->count[id]       =  0;
+        state->present_idx[id] = -1;
+    }
+    state->present.clear();
+    state->head   = 0;
+    state->n_used = 0;
+}
+
+void llama_penalty_state_push(struct llama_penalty_state * state, llama_token token) {
+    const int n_window = (int) state->window.size();
+    const int n_vocab  = (int) state->count.size();
+
+    if (n_window == 0 || token < 0 || token >= n_vocab) {
+        return;
+    }
+
+    if (state->n_used == n_window) {
+        // the window is full, drop its oldest token
+        const llama_token old = state->window[state->head];
+        if (--state->count[old] == 0) {
+            const int idx = state->present_idx[old];
+            state->present[idx] = state->present.back();
+            state->present_idx[state->present[idx]] = idx;
+            state->present.pop_back();
+            state->present_idx[old] = -1;
+        }
+        state->window[state->head] = token;
+        state->head = (state->head + 1) % n_window;
+    } else {
+        state->window[(state->head + state->n_used) % n_window] = token;
+        state->n_used++;
+    }
+
+    if (state->count[token]++ == 0) {
+        state->present_idx[token] = (int) state->present.size();
+        state->present.push_back(token);
+    }
+}
+
+void llama_sample_penalties(struct llama_context * ctx, float * logits, const struct llama_penalty_state * state, float repeat_penalty, float alpha_frequency, float alpha_presence) {
+    const int64_t t_start_sample_us = ggml_time_us();
+
+    // same as llama_sample_repetition_penalty followed by llama_sample_frequency_and_presence_penalties
+    for (llama_token id : state->present) {
+        const int count = state->count[id];
+
+        float logit = logits[id];
+        if (logit <= 0) {
+            logit *= repeat_penalty;
+        } else {
+            logit /= repeat_penalty;
+        }
+        logit -= float(count) * alpha_frequency + float(count > 0) * alpha_presence;
+
+        logits[id] = logit;
+    }
+
+    if (ctx) {
+        ctx->t_sample_us += ggml_time_us() - t_start_sample_us;
+    }
+}
+
 llama_token llama_sample_token_mirostat(struct llama_context * ctx, llama_token_data_array * candidates, float tau, float eta, int m, float * mu) {
     assert(ctx);
     auto N = float(llama_n_vocab(ctx));
@@ -2006,6 +3268,68 @@ llama_token llama_sample_token_mirostat_v2(struct llama_context * ctx, llama_tok
     return X;
 }
 
+llama_token_data_array llama_sample_chain(struct llama_context * ctx, const float * logits, int top_k, float tfs_z, float typical_p, float top_p, float temp) {
+    const int64_t t_start_sample_us = ggml_time_us();
+
+    const int n_vocab = ctx->hparams.n_vocab;
+    const int k = top_k <= 0 ? n_vocab : std::min(top_k, n_vocab);
+
+    auto & cur = ctx->sample_candidates;
+    cur.clear();
+
+    if (k < n_vocab) {
+        float max_l = logits[0];
+        for (int i = 1; i < n_vocab; ++i) {
+            max_l = logits[i] > max_l ? logits[i] : max_l;
+        }
+
+        // only the tokens above a threshold can be in the top k, lower it until enough of them pass
+        float threshold = -INFINITY;
+        for (float delta = 8.0f; delta <= 64.0f; delta *= 2.0f) {
+            int n_pass = 0;
+            for (int i = 0; i < n_vocab; ++i) {
+                n_pass += logits[i] >= max_l - delta;
+            }
+            if (n_pass >= k) {
+                threshold = max_l - delta;
+                break;
+            }
+        }
+
+        for (llama_token id = 0; id < n_vocab; ++id) {
+            if (logits[id] >= threshold) {
+                cur.push_back(llama_token_data{id, logits[id], 0.0f});
+            }
+        }
+    } else {
+        for (llama_token id = 0; id < n_vocab; ++id) {
+            cur.push_back(llama_token_data{id, logits[id], 0.0f});
+        }
+    }
+
+    llama_token_data_array candidates = { cur.data(), cur.size(), false };
+
+    if (k < (int) candidates.size) {
+        auto comp = [](const llama_token_data & a, const llama_token_data & b) {
+            return a.logit > b.logit;
+        };
+        std::nth_element(cur.begin(), cur.begin() + (k - 1), cur.end(), comp);
+        std::sort(cur.begin(), cur.begin() + k, comp);
+        candidates.size   = k;
+        candidates.sorted = true;
+    }
+
+    // the remaining samplers only see the survivors of top-k
+    llama_sample_tail_free  (nullptr, &candidates, tfs_z, 1);
+    llama_sample_typical    (nullptr, &candidates, typical_p, 1);
+    llama_sample_top_p      (nullptr, &candidates, top_p, 1);
+    llama_sample_temperature(nullptr, &candidates, temp);
+
+    ctx->t_sample_us += ggml_time_us() - t_start_sample_us;
+
+    return candidates;
+}
+
 llama_token llama_sample_token_greedy(struct llama_context * ctx, llama_token_data_array * candidates) {
     const int64_t t_start_sample_us = ggml_time_us();
 
@@ -2044,6 +3368,69 @@ llama_token llama_sample_token(struct llama_context * ctx, llama_token_data_arra
     return result;
 }
 
+llama_token llama_sample_token_speculative_with_rng(struct llama_context * ctx, llama_token_data_array * candidates, const llama_token_data_array * draft_candidates, llama_token draft_token, std::mt19937 & rng) {
+    assert(ctx);
+    const int64_t t_start_sample_us = ggml_time_us();
+    llama_sample_softmax(nullptr, candidates);
+
+    // the draft distribution q, a certain draft has all of its mass on the draft token
+    std::unordered_map<llama_token, float> draft_probs;
+    if (draft_candidates != nullptr) {
+        for (size_t i = 0; i < draft_candidates->size; ++i) {
+            draft_probs[draft_candidates->data[i].id] = draft_candidates->data[i].p;
+        }
+    } else {
+        draft_probs[draft_token] = 1.0f;
+    }
+
+    float p_draft = 0.0f;
+    for (size_t i = 0; i < candidates->size; ++i) {
+        if (candidates->data[i].id == draft_token) {
+            p_draft = candidates->data[i].p;
+            break;
+        }
+    }
+    const float q_draft = draft_probs[draft_token];
+
+    ctx->n_draft++;
+    ctx->n_sample++;
+
+    // accept the draft token with probability min(1, p/q)
+    std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+    if (p_draft > 0.0f && (p_draft >= q_draft || uniform(rng) * q_draft < p_draft)) {
+        ctx->n_accept++;
+        ctx->t_sample_us += ggml_time_us() - t_start_sample_us;
+        return draft_token;
+    }
+
+    // otherwise sample from the residual distribution max(0, p - q), the result is distributed as p overall
+    std::vector<float> probs;
+    probs.reserve(candidates->size);
+    float sum = 0.0f;
+    for (size_t i = 0; i < candidates->size; ++i) {
+        const auto it = draft_probs.find(candidates->data[i].id);
+        const float q = it == draft_probs.end() ? 0.0f : it->second;
+        probs.push_back(std::max(0.0f, candidates->data[i].p - q));
+        sum += probs.back();
+    }
+    if (sum <= 0.0f) {
+        // only reachable through rounding, p and q are the same distribution
+        for (size_t i = 0; i < candidates->size; ++i) {
+            probs[i] = candidates->data[i].p;
+        }
+    }
+
+    std::discrete_distribution<> dist(probs.begin(), probs.end());
+    llama_token result = candidates->data[dist(rng)].id;
+
+    ctx->t_sample_us += ggml_time_us() - t_start_sample_us;
+    return result;
+}
+
+llama_token llama_sample_token_speculative(struct llama_context * ctx, llama_token_data_array * candidates, const llama_token_data_array * draft_candidates, llama_token draft_token) {
+    return llama_sample_token_speculative_with_rng(ctx, candidates, draft_candidates, draft_token, ctx->rng);
+}
+
 //
 // quantization
 //
@@ -2064,7 +3451,7 @@ static void llama_model_quantize_internal(const std::string & fname_inp, const s
     }
 
     std::unique_ptr<llama_model_loader> model_loader(new llama_model_loader(fname_inp, /*use_mmap*/ false,
-                                                                            /*vocab_only*/ false));
+                                                                            /*direct_io*/ false, /*vocab_only*/ false));
     llama_file_saver file_saver(fname_out.c_str(), model_loader->file_loaders.at(0).get(), ftype);
 
     size_t total_size_org = 0;
@@ -2211,17 +3598,42 @@ static void llama_model_quantize_internal(const std::string & fname_inp, const s
 // interface implementation
 //
 
-struct llama_context * llama_init_from_file(
+// the memory placement requested by the last loaded model, for llama_print_system_info
+static struct {
+    enum llama_numa_strategy numa = LLAMA_NUMA_DISABLED;
+    int  numa_node = -1; // with LLAMA_NUMA_ISOLATE
+    bool hugepages = false;
+} llama_mem_state;
+
+static llama_placement llama_placement_from_params(const llama_context_params & params) {
+    llama_placement placement;
+    placement.hugepages  = params.hugepages;
+    placement.interleave = params.numa == LLAMA_NUMA_INTERLEAVE;
+    return placement;
+}
+
+struct llama_model * llama_load_model_from_file(
                              const char * path_model,
             struct llama_context_params   params) {
     ggml_time_init();
 
-    llama_context * ctx = new llama_context;
+    if (params.numa < LLAMA_NUMA_DISABLED || params.numa > LLAMA_NUMA_ISOLATE) {
+        fprintf(stderr, "%s: invalid NUMA strategy %d\n", __func__, (int) params.numa);
+        return nullptr;
+    }
 
-    if (params.seed < 0) {
-        params.seed = time(NULL);
+    llama_mem_state.numa      = params.numa;
+    llama_mem_state.hugepages = params.hugepages;
+    llama_mem_state.numa_node = -1;
+    if (params.numa == LLAMA_NUMA_ISOLATE) {
+        llama_mem_state.numa_node = llama_numa_isolate();
+        if (llama_mem_state.numa_node < 0) {
+            fprintf(stderr, "%s: warning: failed to pin the threads to a NUMA node\n", __func__);
+        }
     }
 
+    llama_model * model = new llama_model;
+
     unsigned cur_percentage = 0;
     if (params.progress_callback == NULL) {
         params.progress_callback_user_data = &cur_percentage;
@@ -2239,33 +3651,75 @@ struct llama_context * llama_init_from_file(
         };
     }
 
-    ctx->rng = std::mt19937(params.seed);
-    ctx->logits_all = params.logits_all;
-
     ggml_type memory_type = params.f16_kv ? GGML_TYPE_F16 : GGML_TYPE_F32;
 
-    if (!llama_model_load(path_model, *ctx, params.n_ctx, params.n_gpu_layers, memory_type,
-                          params.use_mmap, params.use_mlock, params.vocab_only,
+    if (!llama_model_load(path_model, *model, params.n_ctx, params.n_gpu_layers, memory_type,
+                          params.use_mmap, params.use_mlock, params.repack, params.direct_io, llama_placement_from_params(params), params.mmap_budget, params.vocab_only,
                           params.progress_callback, params.progress_callback_user_data)) {
         fprintf(stderr, "%s: failed to load model\n", __func__);
-        llama_free(ctx);
+        delete model;
         return nullptr;
     }
 
+    return model;
+}
+
+void llama_free_model(struct llama_model * model) {
+    delete model;
+}
+
+struct llama_context * llama_new_context_with_model(
+                     struct llama_model * model,
+            struct llama_context_params   params) {
+    if (!model) {
+        return nullptr;
+    }
+
+    llama_context * ctx = new llama_context(*model);
+
+    if (params.seed < 0) {
+        params.seed = time(NULL);
+    }
+
+    ctx->rng = std::mt19937(params.seed);
+    ctx->logits_all = params.logits_all;
+    ctx->n_spin = params.n_spin;
+
+    ctx->hparams = model->hparams;
+    ctx->hparams.n_ctx = params.n_ctx;
+
+    const ggml_type type_k = llama_kv_type_to_ggml(params.type_k, params.f16_kv);
+    const ggml_type type_v = llama_kv_type_to_ggml(params.type_v, params.f16_kv);
+
+    const llama_placement placement = llama_placement_from_params(params);
+
     // reserve memory for context buffers
     if (!params.vocab_only) {
-        if (!kv_cache_init(ctx->model.hparams, ctx->model.kv_self, memory_type, ctx->model.hparams.n_ctx)) {
+        if (ggml_is_quantized(type_v)) {
+            fprintf(stderr, "%s: the V cache cannot be quantized, it is stored transposed\n", __func__);
+            llama_free(ctx);
+            return nullptr;
+        }
+        if ((ctx->hparams.n_embd/ctx->hparams.n_head) % ggml_blck_size(type_k) != 0) {
+            fprintf(stderr, "%s: the K cache cannot be %s, the head size %d is not a multiple of its block size %d\n",
+                    __func__, ggml_type_name(type_k), ctx->hparams.n_embd/ctx->hparams.n_head, ggml_blck_size(type_k));
+            llama_free(ctx);
+            return nullptr;
+        }
+
+        if (!kv_cache_init(ctx->hparams, ctx->kv_self, type_k, type_v, ctx->hparams.n_ctx, placement)) {
             fprintf(stderr, "%s: kv_cache_init() failed for self-attention cache\n", __func__);
             llama_free(ctx);
             return nullptr;
         }
 
         {
-            const size_t memory_size = ggml_nbytes(ctx->model.kv_self.k) + ggml_nbytes(ctx->model.kv_self.v);
-            fprintf(stderr, "%s: kv self size  = %7.2f MB\n", __func__, memory_size / 1024.0 / 1024.0);
+            const size_t memory_size = ggml_nbytes(ctx->kv_self.k) + ggml_nbytes(ctx->kv_self.v);
+            fprintf(stderr, "%s: kv self size  = %7.2f MB (K %s, V %s)\n", __func__, memory_size / 1024.0 / 1024.0,
+                    ggml_type_name(type_k), ggml_type_name(type_v));
         }
 
-        const auto & hparams = ctx->model.hparams;
+        const auto & hparams = ctx->hparams;
 
         // resized during inference
         if (params.logits_all) {
@@ -2278,15 +3732,34 @@ struct llama_context * llama_init_from_file(
             ctx->embedding.resize(hparams.n_embd);
         }
 
-        ctx->buf_compute.resize(MEM_REQ_EVAL().at(ctx->model.type));
+        ctx->buf_compute.resize(MEM_REQ_EVAL().at(ctx->model.type), placement);
 
-        ctx->buf_scratch[0].resize(MEM_REQ_SCRATCH0().at(ctx->model.type));
-        ctx->buf_scratch[1].resize(MEM_REQ_SCRATCH1().at(ctx->model.type));
+        ctx->buf_scratch[0].resize(MEM_REQ_SCRATCH0().at(ctx->model.type), placement);
+        ctx->buf_scratch[1].resize(MEM_REQ_SCRATCH1().at(ctx->model.type), placement);
     }
 
     return ctx;
 }
 
+struct llama_context * llama_init_from_file(
+                             const char * path_model,
+            struct llama_context_params   params) {
+    llama_model * model = llama_load_model_from_file(path_model, params);
+    if (!model) {
+        return nullptr;
+    }
+
+    llama_context * ctx = llama_new_context_with_model(model, params);
+    if (!ctx) {
+        llama_free_model(model);
+        return nullptr;
+    }
+
+    ctx->model_owner = true;
+
+    return ctx;
+}
+
 void llama_free(struct llama_context * ctx) {
     delete ctx;
 }
@@ -2305,6 +3778,138 @@ int llama_model_quantize(
     }
 }
 
+// the tensors of a LoRA adapter are merged by batches of tensors whose BA products fit in this size
+#define LLAMA_LORA_BATCH_SIZE (256*1024*1024)
+
+// converts n elements of type to F32
+static void llama_row_to_f32(ggml_type type, const void * src, float * dst, int64_t n) {
+    switch (type) {
+        case GGML_TYPE_F32: memcpy(dst, src, n*sizeof(float)); break;
+        case GGML_TYPE_F16: ggml_fp16_to_fp32_row((const ggml_fp16_t *) src, dst, n); break;
+        default:            ggml_internal_get_quantize_fn(type).dequantize_row_q(src, dst, n); break;
+    }
+}
+
+// converts n elements from F32 to type
+static void llama_row_from_f32(ggml_type type, const float * src, void * dst, int64_t n) {
+    switch (type) {
+        case GGML_TYPE_F32: memcpy(dst, src, n*sizeof(float)); break;
+        case GGML_TYPE_F16: ggml_fp32_to_fp16_row(src, (ggml_fp16_t *) dst, n); break;
+        default:            ggml_internal_get_quantize_fn(type).quantize_row_q(src, dst, n); break;
+    }
+}
+
+// the threads that merge the rows of the quantized tensors of an adapter, created once for all of them
+struct llama_lora_workers {
+    std::vector<std::thread> threads;
+
+    std::mutex              mutex;
+    std::condition_variable cv_job;
+    std::condition_variable cv_done;
+
+    std::function<void(int, int)> job; // called with the index of the thread and the number of threads
+    int  n_job  = 0; // number of jobs handed out
+    int  n_busy = 0; // workers still running the current job
+    bool stop   = false;
+
+    llama_lora_workers(int n_threads) {
+        for (int ith = 1; ith < n_threads; ++ith) {
+            threads.emplace_back([this, ith] { work(ith); });
+        }
+    }
+
+    ~llama_lora_workers() {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            stop = true;
+        }
+        cv_job.notify_all();
+        for (auto & t : threads) {
+            t.join();
+        }
+    }
+
+    void work(int ith) {
+        const int nth = (int) threads.size() + 1;
+        int n_seen = 0;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv_job.wait(lock, [&] { return stop || n_job != n_seen; });
+                if (stop) {
+                    return;
+                }
+                n_seen = n_job;
+            }
+            job(ith, nth);
+            std::unique_lock<std::mutex> lock(mutex);
+            if (--n_busy == 0) {
+                cv_done.notify_one();
+            }
+        }
+    }
+
+    // runs f on all the threads, the calling one included, and waits for them
+    void run(const std::function<void(int, int)> & f) {
+        const int nth = (int) threads.size() + 1;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            job    = f;
+            n_busy = nth - 1;
+            n_job++;
+        }
+        cv_job.notify_all();
+        f(0, nth);
+        std::unique_lock<std::mutex> lock(mutex);
+        cv_done.wait(lock, [&] { return n_busy == 0; });
+    }
+};
+
+// merges dst = base + scaling*BA a row at a time, for the quantized tensors that ggml cannot add to in place: a
+// thread converts a row of base to F32, adds the same row of BA computed from A and B, and converts it back into dst,
+// so that neither BA nor an F32 copy of the weights is ever materialized
+static void llama_lora_merge_rows(
+           llama_lora_workers & workers,
+                 ggml_tensor * dst,
+           const ggml_tensor * base,
+           const ggml_tensor * loraA,
+           const ggml_tensor * loraB,
+                       float   scaling) {
+    const int64_t n_in  = dst->ne[0];
+    const int64_t n_out = dst->ne[1];
+    const int64_t r     = loraA->ne[0];
+
+    // A transposed, so that a row of BA is the sum of the rows of At weighted by a row of B
+    std::vector<float> A (n_in*r);
+    std::vector<float> At(r*n_in);
+    std::vector<float> B (n_out*r);
+    llama_row_to_f32(loraA->type, loraA->data, A.data(), n_in*r);
+    llama_row_to_f32(loraB->type, loraB->data, B.data(), n_out*r);
+    for (int64_t j = 0; j < n_in; ++j) {
+        for (int64_t k = 0; k < r; ++k) {
+            At[k*n_in + j] = A[j*r + k];
+        }
+    }
+
+    workers.run([&](int ith, int nth) {
+        const int64_t i0 = n_out*ith/nth;
+        const int64_t i1 = n_out*(ith + 1)/nth;
+
+        std::vector<float> row(n_in);
+        for (int64_t i = i0; i < i1; ++i) {
+            llama_row_to_f32(base->type, (const char *) base->data + i*base->nb[1], row.data(), n_in);
+            for (int64_t k = 0; k < r; ++k) {
+                const float   s  = scaling*B[i*r + k];
+                const float * at = At.data() + k*n_in;
+                for (int64_t j = 0; j < n_in; ++j) {
+                    row[j] += s*at[j];
+                }
+            }
+            llama_row_from_f32(dst->type, row.data(), (char *) dst->data + i*dst->nb[1], n_in);
+        }
+    });
+}
+
 int llama_apply_lora_from_file_internal(struct llama_context * ctx, const char * path_lora, const char * path_base_model, int n_threads) {
     fprintf(stderr, "%s: applying lora adapter from '%s' - please wait ...\n", __func__, path_lora);
 
@@ -2312,22 +3917,39 @@ int llama_apply_lora_from_file_internal(struct llama_context * ctx, const char *
 
     const int64_t t_start_lora_us = ggml_time_us();
 
-    auto fin = std::ifstream(path_lora, std::ios::binary);
-    if (!fin) {
-        fprintf(stderr, "%s: failed to open '%s'\n", __func__, path_lora);
-        return 1;
-    }
+    // the tensors of the adapter are read in place from the mapped file
+    llama_file file(path_lora, "rb");
+    std::unique_ptr<llama_mmap> mapping;
+    llama_buffer file_buf;
+    const uint8_t * file_data;
+    if (llama_mmap::SUPPORTED) {
+        mapping.reset(new llama_mmap(&file));
+        file_data = (const uint8_t *) mapping->addr;
+    } else {
+        file_buf.resize(file.size);
+        file.read_raw(file_buf.addr, file.size);
+        file_data = file_buf.addr;
+    }
+
+    size_t file_pos = 0;
+    auto read = [&](void * dst, size_t size) {
+        if (file_pos + size > file.size) {
+            throw std::runtime_error(format("unexpectedly reached end of file '%s'", path_lora));
+        }
+        memcpy(dst, file_data + file_pos, size);
+        file_pos += size;
+    };
 
     // verify magic and version
     {
         uint32_t magic;
-        fin.read((char *) &magic, sizeof(magic));
+        read(&magic, sizeof(magic));
         if (magic != LLAMA_FILE_MAGIC_GGLA) {
             fprintf(stderr, "%s: bad file magic\n", __func__);
             return 1;
         }
         uint32_t format_version;
-        fin.read((char *) &format_version, sizeof(format_version));
+        read(&format_version, sizeof(format_version));
 
         if (format_version != 1) {
             fprintf(stderr, "%s: unsupported file version\n", __func__ );
@@ -2337,85 +3959,53 @@ int llama_apply_lora_from_file_internal(struct llama_context * ctx, const char *
 
     int32_t lora_r;
     int32_t lora_alpha;
-    fin.read((char *) &lora_r, sizeof(lora_r));
-    fin.read((char *) &lora_alpha, sizeof(lora_alpha));
+    read(&lora_r, sizeof(lora_r));
+    read(&lora_alpha, sizeof(lora_alpha));
     float scaling = (float)lora_alpha / (float)lora_r;
 
     fprintf(stderr, "%s: r = %d, alpha = %d, scaling = %.2f\n", __func__, lora_r, lora_alpha, scaling);
 
-
-    // create a temporary ggml context to store the lora tensors
-    // todo: calculate size from biggest possible tensor
-    std::vector<uint8_t> lora_buf(1024ull * 1024ull * 1024ull);
-    struct ggml_init_params params;
-    params.mem_size   = lora_buf.size();
-    params.mem_buffer = lora_buf.data();
-    params.no_alloc   = false;
-
-    ggml_context * lora_ctx = ggml_init(params);
-    std::unordered_map<std::string, struct ggml_tensor *> lora_tensors;
-
     // create a name -> tensor map of the model to accelerate lookups
-    std::unordered_map<std::string, struct ggml_tensor*> model_tensors;
-    for (auto & kv: model.tensors_by_name) {
-        model_tensors.insert(kv);
-    }
-
-
-    // load base model
-    std::unique_ptr<llama_model_loader> model_loader;
-    ggml_context * base_ctx = NULL;
-    llama_buffer base_buf;
-    if (path_base_model) {
-        fprintf(stderr, "%s: loading base model from '%s'\n", __func__, path_base_model);
-        model_loader.reset(new llama_model_loader(path_base_model, /*use_mmap*/ true, /*vocab_only*/ false));
-
-        size_t ctx_size;
-        size_t mmapped_size;
-        model_loader->calc_sizes(&ctx_size, &mmapped_size);
-        base_buf.resize(ctx_size);
-
-        ggml_init_params base_params;
-        base_params.mem_size   = base_buf.size;
-        base_params.mem_buffer = base_buf.addr;
-        base_params.no_alloc   = model_loader->use_mmap;
+    std::unordered_map<std::string, struct ggml_tensor*> model_tensors;
+    for (auto & kv: model.tensors_by_name) {
+        model_tensors.insert(kv);
+    }
 
-        base_ctx = ggml_init(base_params);
+    // the headers of the lora tensors, their data points into the file
+    struct lora_pair {
+        std::string   base_name;
+        ggml_tensor * loraA = NULL;
+        ggml_tensor * loraB = NULL;
+    };
+    std::vector<lora_pair> pairs;
+    std::unordered_map<std::string, size_t> pair_idx;
 
-        model_loader->ggml_ctx = base_ctx;
+    std::vector<uint8_t> lora_buf(2*model_tensors.size()*ggml_tensor_overhead());
+    struct ggml_init_params params;
+    params.mem_size   = lora_buf.size();
+    params.mem_buffer = lora_buf.data();
+    params.no_alloc   = true;
 
-        // maybe this should in llama_model_loader
-        if (model_loader->use_mmap) {
-            model_loader->mapping.reset(new llama_mmap(&model_loader->file_loaders.at(0)->file, /* prefetch */ 0));
-        }
-    }
+    std::unique_ptr<ggml_context, decltype(&ggml_free)> lora_ctx(ggml_init(params), ggml_free);
 
-    // read tensors and apply
-    bool warned = false;
-    int n_tensors = 0;
-    while (true) {
+    // read the tensor headers
+    size_t n_lora_tensors = 0;
+    while (file_pos < file.size) {
         int32_t n_dims;
         int32_t length;
         int32_t ftype;
 
-        fin.read(reinterpret_cast<char *>(&n_dims), sizeof(n_dims));
-        fin.read(reinterpret_cast<char *>(&length), sizeof(length));
-        fin.read(reinterpret_cast<char *>(&ftype),  sizeof(ftype));
-        if (fin.eof()) {
-            break;
-        }
+        read(&n_dims, sizeof(n_dims));
+        read(&length, sizeof(length));
+        read(&ftype,  sizeof(ftype));
 
         int32_t ne[2] = { 1, 1 };
-        for (int i = 0; i < n_dims; ++i) {
-            fin.read(reinterpret_cast<char *>(&ne[i]), sizeof(ne[i]));
+        for (int i = 0; i < n_dims && i < 2; ++i) {
+            read(&ne[i], sizeof(ne[i]));
         }
 
-        std::string name;
-        {
-            char buf[1024];
-            fin.read(buf, length);
-            name = std::string(buf, length);
-        }
+        std::string name(length, 0);
+        read(&name[0], length);
 
         // check for lora suffix and get the type of tensor
         const std::string lora_suffix = ".lora";
@@ -2428,7 +4018,6 @@ int llama_apply_lora_from_file_internal(struct llama_context * ctx, const char *
         std::string lora_type = name.substr(pos + lora_suffix.length());
         std::string base_name = name;
         base_name.erase(pos);
-        // fprintf(stderr, "%s: %s => %s (lora type %s) ", __func__, name.c_str(),base_name.c_str(), lora_type.c_str());
 
         if (model_tensors.find(base_name) == model_tensors.end()) {
             fprintf(stderr, "%s: unknown tensor '%s' in lora adapter\n", __func__, name.data());
@@ -2444,105 +4033,231 @@ int llama_apply_lora_from_file_internal(struct llama_context * ctx, const char *
                     {
                         fprintf(stderr, "%s: invalid tensor data type '%d'\n",
                                 __func__, ftype);
-                        return false;
+                        return 1;
                     }
         }
-        ggml_tensor* lora_tensor;
-        if (n_dims == 2) {
-            lora_tensor = ggml_new_tensor_2d(lora_ctx, wtype, ne[0], ne[1]);
-        }
-        else {
+        if (n_dims != 2) {
             fprintf(stderr, "%s: unsupported tensor dimension %d\n", __func__, n_dims);
             return 1;
         }
+        if (lora_type != "A" && lora_type != "B") {
+            fprintf(stderr, "%s: error: '%s' is not a lora tensor\n", __func__, name.c_str());
+            return 1;
+        }
+        if (n_lora_tensors++ >= 2*model_tensors.size()) {
+            fprintf(stderr, "%s: too many tensors in lora adapter\n", __func__);
+            return 1;
+        }
+
+        ggml_tensor * lora_tensor = ggml_new_tensor_2d(lora_ctx.get(), wtype, ne[0], ne[1]);
+
+        // the data is aligned to 32 bytes
+        file_pos = (file_pos + 31) & -32;
+        if (file_pos + ggml_nbytes(lora_tensor) > file.size) {
+            throw std::runtime_error(format("unexpectedly reached end of file '%s'", path_lora));
+        }
+        lora_tensor->data = const_cast<uint8_t *>(file_data + file_pos);
+        file_pos += ggml_nbytes(lora_tensor);
+
+        auto it = pair_idx.find(base_name);
+        if (it == pair_idx.end()) {
+            it = pair_idx.emplace(base_name, pairs.size()).first;
+            pairs.emplace_back();
+            pairs.back().base_name = base_name;
+        }
+        (lora_type == "A" ? pairs[it->second].loraA : pairs[it->second].loraB) = lora_tensor;
+    }
+
+    // load base model
+    std::unique_ptr<llama_model_loader> model_loader;
+    llama_buffer base_buf;
+    std::unique_ptr<ggml_context, decltype(&ggml_free)> base_ctx(nullptr, ggml_free);
+    if (path_base_model) {
+        fprintf(stderr, "%s: loading base model from '%s'\n", __func__, path_base_model);
+        model_loader.reset(new llama_model_loader(path_base_model, /*use_mmap*/ true, /*direct_io*/ false, /*vocab_only*/ false));
 
-        // load tensor data
-        size_t offset = fin.tellg();
-        size_t tensor_data_size = ggml_nbytes(lora_tensor);
-        offset = (offset + 31) & -32;
-        fin.seekg(offset);
-        fin.read((char*)lora_tensor->data, tensor_data_size);
+        size_t ctx_size;
+        size_t mmapped_size;
+        model_loader->calc_sizes(&ctx_size, &mmapped_size);
+        base_buf.resize(ctx_size);
 
-        lora_tensors[name] = lora_tensor;
+        ggml_init_params base_params;
+        base_params.mem_size   = base_buf.size;
+        base_params.mem_buffer = base_buf.addr;
+        base_params.no_alloc   = model_loader->use_mmap;
 
-        // check if we have both A and B tensors and apply
-        if (lora_tensors.find(base_name + ".loraA") != lora_tensors.end() &&
-            lora_tensors.find(base_name + ".loraB") != lora_tensors.end()) {
+        base_ctx.reset(ggml_init(base_params));
 
-            ggml_tensor * dest_t = model_tensors[base_name];
-            ggml_tensor * base_t;
-            if (model_loader) {
-                // load from base model
-                if (model_loader->tensors_map.name_to_idx.find(base_name) == model_loader->tensors_map.name_to_idx.end()) {
-                    fprintf(stderr, "%s: error: tensor '%s' not found in base model\n", __func__, base_name.c_str());
-                    return 1;
-                }
-                size_t idx = model_loader->tensors_map.name_to_idx[base_name];
-                llama_load_tensor & lt = model_loader->tensors_map.tensors[idx];
-                base_t = model_loader->get_tensor(base_name, { (uint32_t)dest_t->ne[0], (uint32_t)dest_t->ne[1] }, GGML_BACKEND_CPU);
-                lt.data = (uint8_t *) lt.ggml_tensor->data;
-                model_loader->load_data_for(lt);
-                lt.ggml_tensor->data = lt.data;
-            }
-            else {
-                base_t = dest_t;
-            }
-
-            if (ggml_is_quantized(base_t->type)) {
-                if (!warned) {
-                    fprintf(stderr, "%s: warning: using a lora adapter with a quantized model may result in poor quality, "
-                                    "use a f16 or f32 base model with --lora-base\n", __func__);
-                    warned = true;
-                }
-            }
+        model_loader->ggml_ctx = base_ctx.get();
 
-            ggml_tensor * loraA = lora_tensors[base_name + ".loraA"];
-            ggml_tensor * loraB = lora_tensors[base_name + ".loraB"];
+        // maybe this should in llama_model_loader
+        if (model_loader->use_mmap) {
+            model_loader->mapping.reset(new llama_mmap(&model_loader->file_loaders.at(0)->file, /* prefetch */ 0));
+        }
+    }
+
+    // check every pair before merging any, so that a bad adapter leaves the model unchanged
+    for (const lora_pair & pair : pairs) {
+        const std::string & base_name = pair.base_name;
+
+        if (!pair.loraA || !pair.loraB) {
+            fprintf(stderr, "%s: error: tensor '%s' has only one of its lora tensors\n", __func__, base_name.c_str());
+            return 1;
+        }
+
+        const ggml_tensor * dest_t = model_tensors[base_name];
+        if (dest_t->n_interleave > 0) {
+            fprintf(stderr, "%s: error: tensor '%s' has been repacked, load the model without repacking to apply a lora adapter\n", __func__, base_name.c_str());
+            return 1;
+        }
 
-            if (base_t->ne[0] != loraA->ne[1] || base_t->ne[1] != loraB->ne[1]) {
-                fprintf(stderr, "%s: incompatible tensor dimensions (%" PRId64 " and %" PRId64 ");"
-                               " are you sure that this adapter is for this model?\n", __func__, base_t->ne[0], loraA->ne[1]);
+        if (model_loader) {
+            const auto it = model_loader->tensors_map.name_to_idx.find(base_name);
+            if (it == model_loader->tensors_map.name_to_idx.end()) {
+                fprintf(stderr, "%s: error: tensor '%s' not found in base model\n", __func__, base_name.c_str());
                 return 1;
             }
+            const llama_load_tensor & lt = model_loader->tensors_map.tensors[it->second];
+            const std::vector<uint32_t> ne = { (uint32_t) dest_t->ne[0], (uint32_t) dest_t->ne[1] };
+            if (lt.ne != ne) {
+                fprintf(stderr, "%s: error: tensor '%s' has the shape %s in the base model, expected %s\n", __func__, base_name.c_str(),
+                        llama_format_tensor_shape(lt.ne).c_str(), llama_format_tensor_shape(ne).c_str());
+                return 1;
+            }
+        }
+
+        const ggml_tensor * loraA = pair.loraA;
+        const ggml_tensor * loraB = pair.loraB;
+
+        if (dest_t->ne[0] != loraA->ne[1] || dest_t->ne[1] != loraB->ne[1] || loraA->ne[0] != loraB->ne[0]) {
+            fprintf(stderr, "%s: incompatible tensor dimensions (%" PRId64 " and %" PRId64 ");"
+                           " are you sure that this adapter is for this model?\n", __func__, dest_t->ne[0], loraA->ne[1]);
+            return 1;
+        }
+    }
+
+    // the merges that ggml computes in place, by batches in one graph
+    struct lora_merge {
+        ggml_tensor * dst;
+        ggml_tensor * base;
+        ggml_tensor * loraA;
+        ggml_tensor * loraB;
+    };
+    std::vector<lora_merge> batch;
+    size_t batch_size = 0;
+
+    std::unique_ptr<ggml_threadpool, decltype(&ggml_threadpool_free)> pool(ggml_threadpool_new(n_threads), ggml_threadpool_free);
+
+    // the merges of the quantized tensors, a row at a time
+    std::unique_ptr<llama_lora_workers> row_workers;
+
+    auto compute_batch = [&]() {
+        if (batch.empty()) {
+            return;
+        }
+
+        // BA, and B in F32 when it is not, and the work buffer of the F16 A*B
+        size_t size = batch_size + 4*batch.size()*ggml_tensor_overhead() + 1024*1024;
+        for (const auto & m : batch) {
+            size += 2*ggml_nelements(m.loraB)*sizeof(float);
+        }
+        llama_buffer buf;
+        buf.resize(size);
+
+        struct ggml_init_params batch_params;
+        batch_params.mem_size   = buf.size;
+        batch_params.mem_buffer = buf.addr;
+        batch_params.no_alloc   = false;
+
+        ggml_context * batch_ctx = ggml_init(batch_params);
+
+        ggml_cgraph gf = {};
+        gf.n_threads = n_threads;
+
+        ggml_tensor * scale_tensor = ggml_new_f32(batch_ctx, scaling);
+
+        for (const auto & m : batch) {
+            // ggml multiplies F16 by F32 only
+            ggml_tensor * loraB = m.loraB;
+            if (loraB->type != GGML_TYPE_F32) {
+                loraB = ggml_new_tensor_2d(batch_ctx, GGML_TYPE_F32, m.loraB->ne[0], m.loraB->ne[1]);
+                llama_row_to_f32(m.loraB->type, m.loraB->data, (float *) loraB->data, ggml_nelements(loraB));
+            }
 
             // w = w + BA*s
-            ggml_tensor * BA = ggml_mul_mat(lora_ctx, loraA, loraB);
+            ggml_tensor * BA = ggml_mul_mat(batch_ctx, m.loraA, loraB);
 
             if (scaling != 1.0f) {
-                ggml_tensor * scale_tensor = ggml_new_f32(lora_ctx, scaling);
-                BA = ggml_scale_inplace(lora_ctx, BA, scale_tensor);
+                BA = ggml_scale_inplace(batch_ctx, BA, scale_tensor);
             }
 
-            ggml_tensor * r;
-            if (base_t == dest_t) {
-                r = ggml_add_inplace(lora_ctx, dest_t, BA);
-            }
-            else {
-                r = ggml_add(lora_ctx, base_t, BA);
-                r = ggml_cpy(lora_ctx, r, dest_t);
+            ggml_tensor * dst = m.dst;
+            if (m.base != m.dst) {
+                dst = ggml_cpy(batch_ctx, m.base, m.dst);
             }
 
-            struct ggml_cgraph gf = ggml_build_forward(r);
-            gf.n_threads = n_threads;
-            ggml_graph_compute(lora_ctx, &gf);
+            ggml_build_forward_expand(&gf, ggml_add_inplace(batch_ctx, dst, BA));
+        }
 
-            // we won't need these tensors again, reset the context to save memory
-            ggml_free(lora_ctx);
-            lora_ctx = ggml_init(params);
-            lora_tensors.clear();
+        ggml_graph_compute_with_pool(batch_ctx, &gf, pool.get());
 
-            n_tensors++;
-            if (n_tensors % 4 == 0) {
-                fprintf(stderr, ".");
+        ggml_free(batch_ctx);
+
+        batch.clear();
+        batch_size = 0;
+    };
+
+    bool warned = false;
+    int n_tensors = 0;
+    for (const lora_pair & pair : pairs) {
+        const std::string & base_name = pair.base_name;
+
+        ggml_tensor * dest_t = model_tensors[base_name];
+        ggml_tensor * base_t;
+        if (model_loader) {
+            // load from base model
+            size_t idx = model_loader->tensors_map.name_to_idx[base_name];
+            llama_load_tensor & lt = model_loader->tensors_map.tensors[idx];
+            base_t = model_loader->get_tensor(base_name, { (uint32_t)dest_t->ne[0], (uint32_t)dest_t->ne[1] }, GGML_BACKEND_CPU);
+            lt.data = (uint8_t *) lt.ggml_tensor->data;
+            model_loader->load_data_for(lt);
+            lt.ggml_tensor->data = lt.data;
+        }
+        else {
+            base_t = dest_t;
+        }
+
+        if (ggml_is_quantized(base_t->type)) {
+            if (!warned) {
+                fprintf(stderr, "%s: warning: using a lora adapter with a quantized model may result in poor quality, "
+                                "use a f16 or f32 base model with --lora-base\n", __func__);
+                warned = true;
             }
         }
-    }
 
-    // TODO: this should be in a destructor, it will leak on failure
-    ggml_free(lora_ctx);
-    if (base_ctx) {
-        ggml_free(base_ctx);
+        ggml_tensor * loraA = pair.loraA;
+        ggml_tensor * loraB = pair.loraB;
+
+        if (ggml_is_quantized(dest_t->type) || ggml_is_quantized(base_t->type)) {
+            if (!row_workers) {
+                row_workers.reset(new llama_lora_workers(n_threads));
+            }
+            llama_lora_merge_rows(*row_workers, dest_t, base_t, loraA, loraB, scaling);
+        } else {
+            const size_t size = ggml_nelements(dest_t)*sizeof(float);
+            if (!batch.empty() && (batch_size + size > LLAMA_LORA_BATCH_SIZE || 4*(batch.size() + 1) > GGML_MAX_NODES)) {
+                compute_batch();
+            }
+            batch.push_back({ dest_t, base_t, loraA, loraB });
+            batch_size += size;
+        }
+
+        n_tensors++;
+        if (n_tensors % 4 == 0) {
+            fprintf(stderr, ".");
+        }
     }
+    compute_batch();
 
     const int64_t t_lora_us = ggml_time_us() - t_start_lora_us;
     fprintf(stderr, " done (%.2f ms)\n", t_lora_us / 1000.0);
@@ -2556,11 +4271,22 @@ int llama_apply_lora_from_file(struct llama_context * ctx, const char * path_lor
     } catch (const std::string & err) {
         fprintf(stderr, "%s: failed to apply lora adapter: %s\n", __func__, err.c_str());
         return 1;
+    } catch (const std::exception & err) {
+        fprintf(stderr, "%s: failed to apply lora adapter: %s\n", __func__, err.what());
+        return 1;
     }
 }
 
 int llama_get_kv_cache_token_count(const struct llama_context * ctx) {
-    return ctx->model.kv_self.n;
+    return ctx->kv_self.n;
+}
+
+void llama_kv_cache_seq_rm(struct llama_context * ctx, llama_seq_id seq_id, int p0, int p1) {
+    kv_cache_seq_rm(ctx->kv_self, seq_id, p0, p1);
+}
+
+void llama_kv_cache_seq_shift(struct llama_context * ctx, llama_seq_id seq_id, int p0, int p1, int delta) {
+    kv_cache_seq_shift(ctx->kv_self, seq_id, p0, p1, delta);
 }
 
 #define LLAMA_MAX_RNG_STATE (64*1024)
@@ -2585,7 +4311,16 @@ size_t llama_get_state_size(const struct llama_context * ctx) {
     const size_t s_embedding       = ctx->embedding.size() * sizeof(float);
     const size_t s_kv_size         = sizeof(size_t);
     const size_t s_kv_ntok         = sizeof(int);
-    const size_t s_kv              = ctx->model.kv_self.buf.size;
+    const size_t s_kv              = ctx->kv_self.buf.size;
+
+    // every cell stores pos, delta and the count of its seq ids. reserve one seq id per cell, or the ids that are in
+    // use if the cells are shared by more sequences than that.
+    size_t n_seq_id = 0;
+    for (const auto & cell : ctx->kv_self.cells) {
+        n_seq_id += cell.seq_id.size();
+    }
+    const size_t s_kv_cells        = ctx->kv_self.cells.size()*3*sizeof(int)
+                                   + std::max(n_seq_id, ctx->kv_self.cells.size())*sizeof(llama_seq_id);
 
     const size_t s_total = (
         + s_rng_size
@@ -2598,6 +4333,7 @@ size_t llama_get_state_size(const struct llama_context * ctx) {
         + s_kv_size
         + s_kv_ntok
         + s_kv
+        + s_kv_cells
     );
 
     return s_total;
@@ -2651,8 +4387,8 @@ size_t llama_copy_state_data(struct llama_context * ctx, uint8_t * dst) {
 
     // copy kv cache
     {
-        const auto & kv_self = ctx->model.kv_self;
-        const auto & hparams = ctx->model.hparams;
+        const auto & kv_self = ctx->kv_self;
+        const auto & hparams = ctx->hparams;
         const int    n_layer = hparams.n_layer;
         const int    n_embd  = hparams.n_embd;
         const int    n_ctx   = hparams.n_ctx;
@@ -2664,7 +4400,8 @@ size_t llama_copy_state_data(struct llama_context * ctx, uint8_t * dst) {
         memcpy(out, &kv_ntok, sizeof(kv_ntok)); out += sizeof(kv_ntok);
 
         if (kv_size) {
-            const size_t elt_size = ggml_element_size(kv_self.k);
+            const size_t k_row    = llama_row_size(kv_self.k->type, n_embd);
+            const size_t elt_size = ggml_element_size(kv_self.v);
 
             char buffer[4096];
 
@@ -2682,7 +4419,7 @@ size_t llama_copy_state_data(struct llama_context * ctx, uint8_t * dst) {
 
             ggml_tensor * k3d = ggml_view_3d(cpy_ctx, kv_self.k,
                 n_embd, kv_ntok, n_layer,
-                elt_size*n_embd, elt_size*n_embd*n_ctx, 0);
+                k_row, k_row*n_ctx, 0);
 
             ggml_tensor * v3d = ggml_view_3d(cpy_ctx, kv_self.v,
                 kv_ntok, n_embd, n_layer,
@@ -2694,6 +4431,21 @@ size_t llama_copy_state_data(struct llama_context * ctx, uint8_t * dst) {
 
             ggml_free(cpy_ctx);
         }
+
+        // the cells in use, with their positions, pending shifts and sequences
+        for (int i = 0; i < kv_ntok; ++i) {
+            const auto & cell = kv_self.cells[i];
+
+            const int n_seq_id = (int) cell.seq_id.size();
+
+            memcpy(out, &cell.pos,   sizeof(cell.pos));   out += sizeof(cell.pos);
+            memcpy(out, &cell.delta, sizeof(cell.delta)); out += sizeof(cell.delta);
+            memcpy(out, &n_seq_id,   sizeof(n_seq_id));   out += sizeof(n_seq_id);
+
+            for (const llama_seq_id id : cell.seq_id) {
+                memcpy(out, &id, sizeof(id)); out += sizeof(id);
+            }
+        }
     }
 
     const size_t written  = out - dst;
@@ -2731,7 +4483,10 @@ size_t llama_set_state_data(struct llama_context * ctx, uint8_t * src) {
         memcpy(&logits_cap,  inp, sizeof(logits_cap));  inp += sizeof(logits_cap);
         memcpy(&logits_size, inp, sizeof(logits_size)); inp += sizeof(logits_size);
 
-        LLAMA_ASSERT(ctx->logits.capacity() == logits_cap);
+        LLAMA_ASSERT(logits_size <= logits_cap);
+
+        // llama_eval_batch grows the logits to one row per token of the batch
+        ctx->logits.reserve(logits_cap);
 
         if (logits_size) {
             ctx->logits.resize(logits_size);
@@ -2757,8 +4512,8 @@ size_t llama_set_state_data(struct llama_context * ctx, uint8_t * src) {
 
     // set kv cache
     {
-        const auto & kv_self = ctx->model.kv_self;
-        const auto & hparams = ctx->model.hparams;
+        const auto & kv_self = ctx->kv_self;
+        const auto & hparams = ctx->hparams;
         const int    n_layer = hparams.n_layer;
         const int    n_embd  = hparams.n_embd;
         const int    n_ctx   = hparams.n_ctx;
@@ -2772,7 +4527,8 @@ size_t llama_set_state_data(struct llama_context * ctx, uint8_t * src) {
         if (kv_size) {
             LLAMA_ASSERT(kv_self.buf.size == kv_size);
 
-            const size_t elt_size = ggml_element_size(kv_self.k);
+            const size_t k_row    = llama_row_size(kv_self.k->type, n_embd);
+            const size_t elt_size = ggml_element_size(kv_self.v);
 
             char buffer[4096];
 
@@ -2790,7 +4546,7 @@ size_t llama_set_state_data(struct llama_context * ctx, uint8_t * src) {
 
             ggml_tensor * k3d = ggml_view_3d(cpy_ctx, kv_self.k,
                 n_embd, kv_ntok, n_layer,
-                elt_size*n_embd, elt_size*n_embd*n_ctx, 0);
+                k_row, k_row*n_ctx, 0);
 
             ggml_tensor * v3d = ggml_view_3d(cpy_ctx, kv_self.v,
                 kv_ntok, n_embd, n_layer,
@@ -2803,7 +4559,36 @@ size_t llama_set_state_data(struct llama_context * ctx, uint8_t * src) {
             ggml_free(cpy_ctx);
         }
 
-        ctx->model.kv_self.n = kv_ntok;
+        auto & cells = ctx->kv_self.cells;
+
+        bool has_shift = false;
+
+        for (int i = 0; i < (int) cells.size(); ++i) {
+            auto & cell = cells[i];
+
+            cell.pos   = -1;
+            cell.delta = 0;
+            cell.seq_id.clear();
+
+            if (i < kv_ntok) {
+                int n_seq_id;
+
+                memcpy(&cell.pos,   inp, sizeof(cell.pos));   inp += sizeof(cell.pos);
+                memcpy(&cell.delta, inp, sizeof(cell.delta)); inp += sizeof(cell.delta);
+                memcpy(&n_seq_id,   inp, sizeof(n_seq_id));   inp += sizeof(n_seq_id);
+
+                for (int j = 0; j < n_seq_id; ++j) {
+                    llama_seq_id id;
+                    memcpy(&id, inp, sizeof(id)); inp += sizeof(id);
+                    cell.seq_id.insert(id);
+                }
+
+                has_shift = has_shift || cell.delta != 0;
+            }
+        }
+
+        ctx->kv_self.n = kv_ntok;
+        ctx->kv_self.has_shift = has_shift;
     }
 
     const size_t nread    = inp - src;
@@ -2814,6 +4599,111 @@ size_t llama_set_state_data(struct llama_context * ctx, uint8_t * src) {
     return nread;
 }
 
+// the KV data of a token is, for each layer, its row of K followed by its column of V
+static size_t kv_token_size(const struct llama_context * ctx) {
+    const int n_embd = ctx->hparams.n_embd;
+    return ctx->hparams.n_layer*(llama_row_size(ctx->kv_self.k->type, n_embd) + n_embd*ggml_element_size(ctx->kv_self.v));
+}
+
+// copies n elements of elt_size bytes between buffers with the given strides
+static void kv_copy_strided(uint8_t * dst, size_t dst_stride, const uint8_t * src, size_t src_stride, int n, size_t elt_size) {
+    if (elt_size == sizeof(ggml_fp16_t)) {
+        for (int i = 0; i < n; ++i) {
+            *(ggml_fp16_t *) (dst + i*dst_stride) = *(const ggml_fp16_t *) (src + i*src_stride);
+        }
+    } else {
+        for (int i = 0; i < n; ++i) {
+            memcpy(dst + i*dst_stride, src + i*src_stride, elt_size);
+        }
+    }
+}
+
+size_t llama_get_seq_data_size(const struct llama_context * ctx, int n_tokens) {
+    return n_tokens*kv_token_size(ctx);
+}
+
+size_t llama_copy_seq_data(struct llama_context * ctx, llama_seq_id seq_id, int p0, int p1, uint8_t * dst) {
+    const auto & kv_self = ctx->kv_self;
+    const int    n_layer = ctx->hparams.n_layer;
+    const int    n_embd  = ctx->hparams.n_embd;
+    const int    n_ctx   = ctx->hparams.n_ctx;
+
+    const size_t k_row    = llama_row_size(kv_self.k->type, n_embd);
+    const size_t elt_size = ggml_element_size(kv_self.v);
+
+    // find the cell of every position, the keys of a cell waiting for a shift are not usable yet
+    std::vector<int> cell_of(p1 - p0, -1);
+    for (int i = 0; i < kv_self.n; ++i) {
+        const auto & cell = kv_self.cells[i];
+        if (cell.pos >= p0 && cell.pos < p1 && cell.has_seq_id(seq_id)) {
+            if (cell.delta != 0) {
+                return 0;
+            }
+            cell_of[cell.pos - p0] = i;
+        }
+    }
+
+    for (int i : cell_of) {
+        if (i < 0) {
+            return 0;
+        }
+    }
+
+    const uint8_t * k_data = (const uint8_t *) kv_self.k->data;
+    const uint8_t * v_data = (const uint8_t *) kv_self.v->data;
+
+    uint8_t * out = dst;
+    for (int i : cell_of) {
+        for (int il = 0; il < n_layer; ++il) {
+            memcpy(out, k_data + k_row*(il*n_ctx + i), k_row);
+            out += k_row;
+
+            kv_copy_strided(out, elt_size, v_data + elt_size*(il*n_ctx*n_embd + i), elt_size*n_ctx, n_embd, elt_size);
+            out += elt_size*n_embd;
+        }
+    }
+
+    return out - dst;
+}
+
+size_t llama_set_seq_data(struct llama_context * ctx, llama_seq_id seq_id, int p0, int n_tokens, const uint8_t * src) {
+    auto &    kv_self = ctx->kv_self;
+    const int n_layer = ctx->hparams.n_layer;
+    const int n_embd  = ctx->hparams.n_embd;
+    const int n_ctx   = ctx->hparams.n_ctx;
+
+    const size_t k_row    = llama_row_size(kv_self.k->type, n_embd);
+    const size_t elt_size = ggml_element_size(kv_self.v);
+
+    int head = 0;
+    if (!kv_cache_find_slot(kv_self, n_tokens, head)) {
+        return 0;
+    }
+
+    uint8_t * k_data = (uint8_t *) kv_self.k->data;
+    uint8_t * v_data = (uint8_t *) kv_self.v->data;
+
+    const uint8_t * inp = src;
+    for (int j = 0; j < n_tokens; ++j) {
+        const int i = head + j;
+
+        kv_self.cells[i].pos = p0 + j;
+        kv_self.cells[i].seq_id.insert(seq_id);
+
+        for (int il = 0; il < n_layer; ++il) {
+            memcpy(k_data + k_row*(il*n_ctx + i), inp, k_row);
+            inp += k_row;
+
+            kv_copy_strided(v_data + elt_size*(il*n_ctx*n_embd + i), elt_size*n_ctx, inp, elt_size, n_embd, elt_size);
+            inp += elt_size*n_embd;
+        }
+    }
+
+    kv_self.n = std::max(kv_self.n, head + n_tokens);
+
+    return inp - src;
+}
+
 bool llama_load_session_file(struct llama_context * ctx, const char * path_session, llama_token * tokens_out, size_t n_token_capacity, size_t * n_token_count_out) {
     llama_file file(path_session, "rb");
 
@@ -2830,7 +4720,7 @@ bool llama_load_session_file(struct llama_context * ctx, const char * path_sessi
         llama_hparams session_hparams;
         file.read_raw(&session_hparams, sizeof(llama_hparams));
 
-        if (session_hparams != ctx->model.hparams) {
+        if (session_hparams != ctx->hparams) {
             fprintf(stderr, "%s : model hparams didn't match from session file!\n", __func__);
             return false;
         }
@@ -2874,7 +4764,7 @@ bool llama_save_session_file(struct llama_context * ctx, const char * path_sessi
     file.write_u32(LLAMA_SESSION_MAGIC);
     file.write_u32(LLAMA_SESSION_VERSION);
 
-    file.write_raw(&ctx->model.hparams, sizeof(llama_hparams));
+    file.write_raw(&ctx->hparams, sizeof(llama_hparams));
 
     // save the prompt
     file.write_u32((uint32_t) n_token_count);
@@ -2899,14 +4789,45 @@ int llama_eval(
                          int   n_tokens,
                          int   n_past,
                          int   n_threads) {
-    if (!llama_eval_internal(*ctx, tokens, n_tokens, n_past, n_threads)) {
+    // continue sequence 0 at n_past, dropping whatever it had cached beyond that
+    kv_cache_seq_rm(ctx->kv_self, 0, n_past, -1);
+
+    std::vector<int>          pos   (n_tokens);
+    std::vector<llama_seq_id> seq_id(n_tokens, 0);
+
+    for (int i = 0; i < n_tokens; ++i) {
+        pos[i] = n_past + i;
+    }
+
+    if (!llama_eval_internal(*ctx, tokens, pos.data(), seq_id.data(), n_tokens, n_threads, ctx->logits_all)) {
         fprintf(stderr, "%s: failed to eval\n", __func__);
         return 1;
     }
 
     // get a more accurate load time, upon first eval
+    // (only if the context loaded the model itself, a shared model was loaded earlier)
     // TODO: fix this
-    if (!ctx->has_evaluated_once) {
+    if (!ctx->has_evaluated_once && ctx->model_owner) {
+        ctx->t_load_us = ggml_time_us() - ctx->t_start_us;
+        ctx->has_evaluated_once = true;
+    }
+
+    return 0;
+}
+
+int llama_eval_batch(
+        struct llama_context * ctx,
+           const llama_token * tokens,
+                   const int * pos,
+          const llama_seq_id * seq_id,
+                         int   n_tokens,
+                         int   n_threads) {
+    if (!llama_eval_internal(*ctx, tokens, pos, seq_id, n_tokens, n_threads, true)) {
+        fprintf(stderr, "%s: failed to eval\n", __func__);
+        return 1;
+    }
+
+    if (!ctx->has_evaluated_once && ctx->model_owner) {
         ctx->t_load_us = ggml_time_us() - ctx->t_start_us;
         ctx->has_evaluated_once = true;
     }
@@ -2920,7 +4841,11 @@ int llama_tokenize(
                  llama_token * tokens,
                          int   n_max_tokens,
                         bool   add_bos) {
-    auto res = llama_tokenize(ctx->vocab, text, add_bos);
+    // the buffers are reused by the next calls on the same thread
+    static thread_local llama_tokenizer tokenizer;
+    static thread_local std::vector<llama_vocab::id> res;
+
+    llama_tokenize(tokenizer, ctx->model.vocab, text, strlen(text), add_bos, res);
 
     if (n_max_tokens < (int) res.size()) {
         fprintf(stderr, "%s: too many tokens\n", __func__);
@@ -2934,12 +4859,75 @@ int llama_tokenize(
     return res.size();
 }
 
+// copies the results to tokens, returns the number of tokens or the negative of it if they do not fit
+static int llama_tokenize_copy(const std::vector<std::vector<llama_vocab::id>> & results, llama_token * tokens, int n_max_tokens, int * offsets) {
+    int n_tokens = 0;
+    for (size_t i = 0; i < results.size(); i++) {
+        if (offsets) {
+            offsets[i] = n_tokens;
+        }
+        if (n_tokens + (int) results[i].size() <= n_max_tokens) {
+            std::copy(results[i].begin(), results[i].end(), tokens + n_tokens);
+        }
+        n_tokens += results[i].size();
+    }
+    if (offsets) {
+        offsets[results.size()] = n_tokens;
+    }
+
+    if (n_max_tokens < n_tokens) {
+        fprintf(stderr, "%s: too many tokens\n", __func__);
+        return -n_tokens;
+    }
+
+    return n_tokens;
+}
+
+int llama_tokenize_batch(
+        struct llama_context * ctx,
+          const char * const * texts,
+                         int   n_texts,
+                 llama_token * tokens,
+                         int   n_max_tokens,
+                         int * offsets,
+                        bool   add_bos,
+                         int   n_threads) {
+    std::vector<llama_tokenize_piece> pieces(n_texts);
+    for (int i = 0; i < n_texts; i++) {
+        pieces[i] = { texts[i], strlen(texts[i]), add_bos };
+    }
+
+    std::vector<std::vector<llama_vocab::id>> results;
+    llama_tokenize_pieces(ctx->model.vocab, pieces, n_threads, results);
+
+    return llama_tokenize_copy(results, tokens, n_max_tokens, offsets);
+}
+
+int llama_tokenize_parallel(
+        struct llama_context * ctx,
+                  const char * text,
+                 llama_token * tokens,
+                         int   n_max_tokens,
+                        bool   add_bos,
+                         int   n_threads) {
+    // pieces small enough to balance the threads, large enough to amortize the split
+    const size_t n_text = strlen(text);
+    const size_t chunk_size = std::max((size_t) 64*1024, n_text/(16*std::max(1, n_threads)));
+
+    const std::vector<llama_tokenize_piece> pieces = llama_tokenize_split(ctx->model.vocab, text, n_text, chunk_size, add_bos);
+
+    std::vector<std::vector<llama_vocab::id>> results;
+    llama_tokenize_pieces(ctx->model.vocab, pieces, n_threads, results);
+
+    return llama_tokenize_copy(results, tokens, n_max_tokens, NULL);
+}
+
 int llama_n_vocab(const struct llama_context * ctx) {
-    return ctx->vocab.id_to_token.size();
+    return ctx->model.vocab.id_to_token.size();
 }
 
 int llama_n_ctx(const struct llama_context * ctx) {
-    return ctx->model.hparams.n_ctx;
+    return ctx->hparams.n_ctx;
 }
 
 int llama_n_embd(const struct llama_context * ctx) {
@@ -2959,7 +4947,83 @@ const char * llama_token_to_str(const struct llama_context * ctx, llama_token to
         return nullptr;
     }
 
-    return ctx->vocab.id_to_token[token].tok.c_str();
+    return ctx->model.vocab.id_to_token[token].tok.c_str();
+}
+
+struct llama_detokenizer {
+    char   pending[4];     // the first bytes of an incomplete character
+    size_t n_pending  = 0;
+    size_t n_expected = 0; // the length of the character
+};
+
+struct llama_detokenizer * llama_detokenizer_init(void) {
+    return new llama_detokenizer;
+}
+
+void llama_detokenizer_free(struct llama_detokenizer * detok) {
+    delete detok;
+}
+
+int llama_detokenizer_push(struct llama_context * ctx, struct llama_detokenizer * detok, llama_token token, char * buf, int buf_size) {
+    const char * text = llama_token_to_str(ctx, token);
+    if (text == nullptr) {
+        return 0;
+    }
+
+    const size_t n_text = strlen(text);
+    if ((size_t) buf_size < detok->n_pending + n_text) {
+        return -(int) (detok->n_pending + n_text);
+    }
+
+    int n = 0;
+    for (size_t i = 0; i < n_text; i++) {
+        const char c = text[i];
+
+        if (detok->n_pending > 0) {
+            if ((c & 0xC0) == 0x80) {
+                detok->pending[detok->n_pending++] = c;
+                if (detok->n_pending == detok->n_expected) {
+                    memcpy(buf + n, detok->pending, detok->n_pending);
+                    n += detok->n_pending;
+                    detok->n_pending = 0;
+                }
+                continue;
+            }
+
+            // not a continuation byte, the character is broken
+            memcpy(buf + n, detok->pending, detok->n_pending);
+            n += detok->n_pending;
+            detok->n_pending = 0;
+        }
+
+        // a stray continuation byte is passed through like an ASCII character
+        const size_t len = utf8_len(c);
+        if (len == 1) {
+            buf[n++] = c;
+        } else {
+            detok->pending[0] = c;
+            detok->n_pending  = 1;
+            detok->n_expected = len;
+        }
+    }
+
+    return n;
+}
+
+int llama_detokenizer_n_pending(const struct llama_detokenizer * detok) {
+    return detok->n_pending;
+}
+
+int llama_detokenizer_flush(struct llama_detokenizer * detok, char * buf, int buf_size) {
+    const int n = detok->n_pending;
+    if (buf_size < n) {
+        return -n;
+    }
+
+    memcpy(buf, detok->pending, n);
+    detok->n_pending = 0;
+
+    return n;
 }
 
 llama_token llama_token_bos() {
@@ -2987,6 +5051,15 @@ void llama_print_timings(struct llama_context * ctx) {
     fprintf(stderr, "%s:      sample time = %8.2f ms / %5d runs   (%8.2f ms per token)\n", __func__, 1e-3 * ctx->t_sample_us, n_sample, 1e-3 * ctx->t_sample_us / n_sample);
     fprintf(stderr, "%s: prompt eval time = %8.2f ms / %5d tokens (%8.2f ms per token)\n", __func__, 1e-3 * ctx->t_p_eval_us, n_p_eval, 1e-3 * ctx->t_p_eval_us / n_p_eval);
     fprintf(stderr, "%s:        eval time = %8.2f ms / %5d runs   (%8.2f ms per token)\n", __func__, 1e-3 * ctx->t_eval_us,   n_eval,   1e-3 * ctx->t_eval_us   / n_eval);
+    if (ctx->n_draft > 0) {
+        fprintf(stderr, "%s:  draft acceptance = %5d / %5d tokens (%6.2f %%)\n", __func__, ctx->n_accept, ctx->n_draft, 100.0 * ctx->n_accept / ctx->n_draft);
+    }
+    if (ctx->threadpool) {
+        const struct ggml_threadpool_stats stats = ggml_threadpool_get_stats(ctx->threadpool);
+
+        fprintf(stderr, "%s:     threads time = %8.2f ms compute, %8.2f ms spin, %8.2f ms sleep (%" PRId64 " sleeps)\n", __func__,
+                1e-3 * stats.t_compute_us, 1e-3 * stats.t_spin_us, 1e-3 * stats.t_sleep_us, stats.n_sleep);
+    }
     fprintf(stderr, "%s:       total time = %8.2f ms\n", __func__, (t_end_us - ctx->t_start_us)/1000.0);
 }
 
@@ -2995,6 +5068,11 @@ void llama_reset_timings(struct llama_context * ctx) {
     ctx->t_sample_us = ctx->n_sample = 0;
     ctx->t_eval_us   = ctx->n_eval   = 0;
     ctx->t_p_eval_us = ctx->n_p_eval = 0;
+    ctx->n_draft     = ctx->n_accept = 0;
+
+    if (ctx->threadpool) {
+        ggml_threadpool_reset_stats(ctx->threadpool);
+    }
 }
 
 const char * llama_print_system_info(void) {
@@ -3016,6 +5094,17 @@ const char * llama_print_system_info(void) {
     s += "SSE3 = "        + std::to_string(ggml_cpu_has_sse3())        + " | ";
     s += "VSX = "         + std::to_string(ggml_cpu_has_vsx())         + " | ";
 
+    static const char * numa_names[] = { "disabled", "interleave", "isolate" };
+    const std::string thp = llama_thp_mode();
+    s += "NUMA_NODES = "  + std::to_string(llama_numa_nodes().size())  + " | ";
+    s += "NUMA = "        + std::string(numa_names[llama_mem_state.numa]);
+    if (llama_mem_state.numa_node >= 0) {
+        s += " (node " + std::to_string(llama_mem_state.numa_node) + ")";
+    }
+    s += " | ";
+    s += "HUGEPAGES = "   + std::to_string(llama_mem_state.hugepages)  + " | ";
+    s += "THP = "         + (thp.empty() ? std::string("n/a") : thp)   + " | ";
+
     return s.c_str();
 }
 
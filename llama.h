@@ -29,7 +29,7 @@
 #define LLAMA_FILE_MAGIC             LLAMA_FILE_MAGIC_GGJT
 #define LLAMA_FILE_MAGIC_UNVERSIONED LLAMA_FILE_MAGIC_GGML
 #define LLAMA_SESSION_MAGIC          LLAMA_FILE_MAGIC_GGSN
-#define LLAMA_SESSION_VERSION        1
+#define LLAMA_SESSION_VERSION        2
 
 #if defined(GGML_USE_CUBLAS) || defined(GGML_USE_CLBLAST)
 // Defined when llama.cpp is compiled with support for offloading model layers to GPU.
@@ -47,8 +47,10 @@ extern "C" {
     //
 
     struct llama_context;
+    struct llama_penalty_state;
 
     typedef int llama_token;
+    typedef int llama_seq_id;
 
     typedef struct llama_token_data {
         llama_token id; // token id
@@ -64,16 +66,82 @@ extern "C" {
 
     typedef void (*llama_progress_callback)(float progress, void *ctx);
 
+    // grammar types
+
+    struct llama_grammar;
+
+    enum llama_gretype {
+        // end of rule definition
+        LLAMA_GRETYPE_END            = 0,
+
+        // start of alternate definition for rule
+        LLAMA_GRETYPE_ALT            = 1,
+
+        // non-terminal element: reference to rule
+        LLAMA_GRETYPE_RULE_REF       = 2,
+
+        // terminal element: character (code point)
+        LLAMA_GRETYPE_CHAR           = 3,
+
+        // inverse char(s) ([^a], [^a-b] [^abc])
+        LLAMA_GRETYPE_CHAR_NOT       = 4,
+
+        // modifies a preceding LLAMA_GRETYPE_CHAR or LLAMA_GRETYPE_CHAR_ALT to
+        // be an inclusive range ([a-z])
+        LLAMA_GRETYPE_CHAR_RNG_UPPER = 5,
+
+        // modifies a preceding LLAMA_GRETYPE_CHAR or
+        // LLAMA_GRETYPE_CHAR_RNG_UPPER to add an alternate char to match ([ab], [a-zA])
+        LLAMA_GRETYPE_CHAR_ALT       = 6,
+    };
+
+    typedef struct llama_grammar_element {
+        enum llama_gretype type;
+        uint32_t           value; // Unicode code point or rule ID
+    } llama_grammar_element;
+
+
+    // data types of the KV cache
+    enum llama_kv_type {
+        LLAMA_KV_TYPE_DEFAULT = 0, // F16 or F32, as f16_kv says
+        LLAMA_KV_TYPE_F32     = 1,
+        LLAMA_KV_TYPE_F16     = 2,
+        LLAMA_KV_TYPE_Q8_0    = 3,
+        LLAMA_KV_TYPE_Q4_0    = 4,
+        LLAMA_KV_TYPE_Q4_1    = 5,
+        LLAMA_KV_TYPE_Q5_0    = 6,
+        LLAMA_KV_TYPE_Q5_1    = 7,
+    };
+
+    // placement of the weights, the KV cache and the scratch buffers on NUMA systems (Linux only)
+    enum llama_numa_strategy {
+        LLAMA_NUMA_DISABLED   = 0, // pages go to the node of the thread that touches them first
+        LLAMA_NUMA_INTERLEAVE = 1, // interleave the pages over all the nodes, for all the threads of all the nodes
+        LLAMA_NUMA_ISOLATE    = 2, // pin the calling thread and the threads it creates to the CPUs of its node, and keep
+                                   // the memory on this node
+    };
+
     struct llama_context_params {
         int n_ctx;        // text context
         int n_gpu_layers; // number of layers to store in VRAM
         int seed;         // RNG seed, -1 for random
+        int n_spin;       // busy-wait iterations before an idle compute thread goes to sleep, -1 = never sleep
+
+        enum llama_kv_type type_k; // K cache, a quantized K is read directly by the K*Q matmul
+        enum llama_kv_type type_v; // V cache, F16 or F32: V is stored transposed, a token is a column of it
+
+        enum llama_numa_strategy numa; // NUMA placement, interleave does not move the pages already in the page cache
+
+        size_t mmap_budget; // bytes of a memory-mapped model kept resident, the layers beyond are streamed, 0 = no limit
 
         bool f16_kv;     // use fp16 for KV cache
         bool logits_all; // the llama_eval() call computes all logits, not just the last one
         bool vocab_only; // only load the vocabulary, no weights
         bool use_mmap;   // use mmap if possible
         bool use_mlock;  // force system to keep model in RAM
+        bool repack;     // interleave the rows of the quantized weights at load time for faster mul_mat, ignored with mmap
+        bool direct_io;  // read the weights bypassing the page cache (O_DIRECT), ignored with mmap
+        bool hugepages;  // back the weights, the KV cache and the scratch buffers with huge pages (hugetlbfs or THP)
         bool embedding;  // embedding mode only
 
         // called with a progress value between 0 and 1, pass NULL to disable
@@ -108,8 +176,27 @@ extern "C" {
 
     LLAMA_API int64_t llama_time_us();
 
+    // Load the weights of a model once, so that they can be shared by several contexts
+    // Only the loading options of params are used (n_gpu_layers, vocab_only, use_mmap, use_mlock, repack, direct_io, numa,
+    // mmap_budget, hugepages, progress callback)
+    // Return NULL on failure
+    LLAMA_API struct llama_model * llama_load_model_from_file(
+                             const char * path_model,
+            struct llama_context_params   params);
+
+    // Frees the weights, all the contexts of the model must be freed first
+    LLAMA_API void llama_free_model(struct llama_model * model);
+
+    // Create a context for a loaded model, with its own KV cache, compute buffers, logits and RNG
+    // The model must outlive the context
+    // Return NULL on failure
+    LLAMA_API struct llama_context * llama_new_context_with_model(
+                     struct llama_model * model,
+            struct llama_context_params   params);
+
     // Various functions for loading a ggml llama model.
     // Allocate (almost) all memory needed for the model.
+    // The model is owned by the returned context and freed with it
     // Return NULL on failure
     LLAMA_API struct llama_context * llama_init_from_file(
                              const char * path_model,
@@ -128,6 +215,7 @@ extern "C" {
             int          nthread);
 
     // Apply a LoRA adapter to a loaded model
+    // The weights are modified in place, so this affects every context that shares the model
     // path_base_model is the path to a higher quality model to use as a base for
     // the layers modified by the adapter. Can be NULL to use the current loaded model.
     // The model needs to be reloaded before applying a new adapter, otherwise the adapter
@@ -142,11 +230,25 @@ extern "C" {
     // Returns the number of tokens in the KV cache
     LLAMA_API int llama_get_kv_cache_token_count(const struct llama_context * ctx);
 
+    // Removes the tokens of sequence seq_id with positions in [p0, p1) from the KV cache
+    // p1 < 0 removes everything from p0 to the end of the sequence
+    // This also rolls back speculative tokens: after evaluating a batch of draft tokens, the rejected ones are dropped with
+    //   llama_kv_cache_seq_rm(ctx, seq_id, n_past, -1);
+    LLAMA_API void llama_kv_cache_seq_rm(struct llama_context * ctx, llama_seq_id seq_id, int p0, int p1);
+
+    // Adds delta to the positions of the tokens of sequence seq_id with positions in [p0, p1)
+    // p1 < 0 shifts everything from p0 to the end of the sequence, tokens moved to a negative position are removed
+    // The cached keys are re-rotated at the start of the next eval instead of evaluating the tokens again
+    // Together with llama_kv_cache_seq_rm() this discards a range of tokens and moves the following ones back:
+    //   llama_kv_cache_seq_rm   (ctx, seq_id, n_keep,             n_keep + n_discard);
+    //   llama_kv_cache_seq_shift(ctx, seq_id, n_keep + n_discard, n_past, -n_discard);
+    LLAMA_API void llama_kv_cache_seq_shift(struct llama_context * ctx, llama_seq_id seq_id, int p0, int p1, int delta);
+
     // Sets the current rng seed.
     LLAMA_API void llama_set_rng_seed(struct llama_context * ctx, int seed);
 
     // Returns the maximum size in bytes of the state (rng, logits, embedding
-    // and kv_cache) - will often be smaller after compacting tokens
+    // and kv_cache with the positions and sequences of its cells) - will often be smaller after compacting tokens
     LLAMA_API size_t llama_get_state_size(const struct llama_context * ctx);
 
     // Copies the state to the specified destination address.
@@ -158,6 +260,19 @@ extern "C" {
     // Returns the number of bytes read
     LLAMA_API size_t llama_set_state_data(struct llama_context * ctx, uint8_t * src);
 
+    // Returns the size in bytes of the KV cache data of n_tokens tokens
+    LLAMA_API size_t llama_get_seq_data_size(const struct llama_context * ctx, int n_tokens);
+
+    // Copies the KV cache data of the tokens of sequence seq_id with positions in [p0, p1) to dst,
+    // the data of each token is contiguous so that any sub-range can be restored on its own
+    // Returns the number of bytes copied, 0 if a position is missing or has a pending shift
+    LLAMA_API size_t llama_copy_seq_data(struct llama_context * ctx, llama_seq_id seq_id, int p0, int p1, uint8_t * dst);
+
+    // Adds n_tokens tokens with positions p0 .. p0 + n_tokens - 1 to sequence seq_id, with the KV data
+    // read from src, the positions must not be in the sequence already
+    // Returns the number of bytes read, 0 if the KV cache has no room for the tokens
+    LLAMA_API size_t llama_set_seq_data(struct llama_context * ctx, llama_seq_id seq_id, int p0, int n_tokens, const uint8_t * src);
+
     // Save/load session file
     LLAMA_API bool llama_load_session_file(struct llama_context * ctx, const char * path_session, llama_token * tokens_out, size_t n_token_capacity, size_t * n_token_count_out);
     LLAMA_API bool llama_save_session_file(struct llama_context * ctx, const char * path_session, const llama_token * tokens, size_t n_token_count);
@@ -173,6 +288,20 @@ extern "C" {
                              int   n_past,
                              int   n_threads);
 
+    // Run the llama inference on a batch of tokens that may belong to different sequences
+    // pos[i] and seq_id[i] are the position and the sequence of tokens[i]
+    // each token attends only to the cached tokens of its own sequence at the same or earlier positions
+    // llama_eval() is equivalent to a batch of sequence 0 at positions n_past .. n_past + n_tokens - 1
+    // The logits of every token of the batch are returned (see llama_get_logits)
+    // Returns 0 on success
+    LLAMA_API int llama_eval_batch(
+            struct llama_context * ctx,
+               const llama_token * tokens,
+                       const int * pos,
+              const llama_seq_id * seq_id,
+                             int   n_tokens,
+                             int   n_threads);
+
     // Convert the provided text into tokens.
     // The tokens pointer must be large enough to hold the resulting tokens.
     // Returns the number of tokens on success, no more than n_max_tokens
@@ -185,11 +314,34 @@ extern "C" {
                              int   n_max_tokens,
                             bool   add_bos);
 
+    // Tokenizes n_texts texts on n_threads threads, each one as llama_tokenize() does
+    // The tokens of texts[i] are stored in tokens[offsets[i] .. offsets[i + 1]), offsets must hold n_texts + 1 entries
+    // Returns the total number of tokens, or the negative of it if it is more than n_max_tokens (offsets are set either way)
+    LLAMA_API int llama_tokenize_batch(
+            struct llama_context * ctx,
+              const char * const * texts,
+                             int   n_texts,
+                     llama_token * tokens,
+                             int   n_max_tokens,
+                             int * offsets,
+                            bool   add_bos,
+                             int   n_threads);
+
+    // Tokenizes a long text on n_threads threads, the tokens are the same as with llama_tokenize()
+    // The text is split into pieces where no token can cross the split, which are usually the spaces and the newlines
+    LLAMA_API int llama_tokenize_parallel(
+            struct llama_context * ctx,
+                      const char * text,
+                     llama_token * tokens,
+                             int   n_max_tokens,
+                            bool   add_bos,
+                             int   n_threads);
+
     LLAMA_API int llama_n_vocab(const struct llama_context * ctx);
     LLAMA_API int llama_n_ctx  (const struct llama_context * ctx);
     LLAMA_API int llama_n_embd (const struct llama_context * ctx);
 
-    // Token logits obtained from the last call to llama_eval()
+    // Token logits obtained from the last call to llama_eval() or llama_eval_batch()
     // The logits for the last token are stored in the last row
     // Can be mutated in order to change the probabilities of the next token
     // Rows: n_tokens
@@ -203,6 +355,24 @@ extern "C" {
     // Token Id -> String. Uses the vocabulary in the provided context
     LLAMA_API const char * llama_token_to_str(const struct llama_context * ctx, llama_token token);
 
+    // Streaming detokenizer: turns generated tokens into text made of complete UTF-8 characters only, the first bytes
+    // of a character whose bytes are split across tokens are held back until the character is complete
+    LLAMA_API struct llama_detokenizer * llama_detokenizer_init(void);
+
+    LLAMA_API void llama_detokenizer_free(struct llama_detokenizer * detok);
+
+    // Writes the text of token that is ready to buf, which needs room for the text of the token plus 3 bytes
+    // Returns the number of bytes written, or the negative of the room needed if buf_size is too small (nothing is done then)
+    // Bytes that cannot be part of a valid character are passed through as they are
+    LLAMA_API int llama_detokenizer_push(struct llama_context * ctx, struct llama_detokenizer * detok, llama_token token, char * buf, int buf_size);
+
+    // Number of bytes held back, of an incomplete character
+    LLAMA_API int llama_detokenizer_n_pending(const struct llama_detokenizer * detok);
+
+    // Writes the bytes held back to buf, at most 3, e.g. at the end of the generation, and resets the detokenizer
+    // Returns the number of bytes written, or the negative of the room needed if buf_size is too small
+    LLAMA_API int llama_detokenizer_flush(struct llama_detokenizer * detok, char * buf, int buf_size);
+
     // Special tokens
     LLAMA_API llama_token llama_token_bos();
     LLAMA_API llama_token llama_token_eos();
@@ -216,6 +386,40 @@ extern "C" {
     /// @details Frequency and presence penalties described in OpenAI API https://platform.openai.com/docs/api-reference/parameter-details.
     LLAMA_API void llama_sample_frequency_and_presence_penalties(struct llama_context * ctx, llama_token_data_array * candidates, const llama_token * last_tokens, size_t last_tokens_size, float alpha_frequency, float alpha_presence);
 
+    /// @details Counts of the tokens in a sliding window of the last tokens, updated incrementally so that the penalties
+    /// cost O(window) per token instead of a search of the window for every candidate.
+    LLAMA_API struct llama_penalty_state * llama_penalty_state_init(int n_vocab, int n_window);
+    LLAMA_API void llama_penalty_state_free(struct llama_penalty_state * state);
+    LLAMA_API void llama_penalty_state_reset(struct llama_penalty_state * state);
+
+    /// @details Appends a token to the window, dropping the oldest one when it is full.
+    LLAMA_API void llama_penalty_state_push(struct llama_penalty_state * state, llama_token token);
+
+    /// @details Applies the repetition, frequency and presence penalties to the logits of the tokens in the window, in one pass.
+    /// Same result as llama_sample_repetition_penalty() followed by llama_sample_frequency_and_presence_penalties().
+    LLAMA_API void llama_sample_penalties(struct llama_context * ctx, float * logits, const struct llama_penalty_state * state, float repeat_penalty, float alpha_frequency, float alpha_presence);
+
+    /// @details Compiles a grammar for the vocabulary of ctx. A rule is a sequence of elements with its alternates separated by
+    /// LLAMA_GRETYPE_ALT and terminated by LLAMA_GRETYPE_END, start_rule_index is the rule the output must match.
+    /// Returns NULL if the rules are invalid or left recursive, e.g. `root ::= root "a"`.
+    LLAMA_API struct llama_grammar * llama_grammar_init(
+            const struct llama_context  * ctx,
+            const llama_grammar_element ** rules,
+                                  size_t   n_rules,
+                                  size_t   start_rule_index);
+
+    LLAMA_API void llama_grammar_free(struct llama_grammar * grammar);
+
+    /// @details Sets the logit of the candidates that the grammar does not allow at this point to -INFINITY.
+    /// The allowed tokens of a grammar state are computed once over the whole vocabulary and cached, a state seen again
+    /// only costs a lookup. The end of stream token is allowed when the grammar is complete.
+    LLAMA_API void llama_sample_grammar(struct llama_context * ctx, llama_token_data_array * candidates, struct llama_grammar * grammar);
+
+    /// @details Advances the grammar past a sampled token. Returns false and leaves the grammar unchanged if the grammar does
+    /// not allow the token, e.g. at a dead end where llama_sample_grammar() has no candidate left but the end of stream token.
+    /// The generation must end there.
+    LLAMA_API bool llama_grammar_accept_token(struct llama_context * ctx, struct llama_grammar * grammar, llama_token token);
+
     /// @details Sorts candidate tokens by their logits in descending order and calculate probabilities based on logits.
     LLAMA_API void llama_sample_softmax(struct llama_context * ctx, llama_token_data_array * candidates);
 
@@ -232,6 +436,12 @@ extern "C" {
     LLAMA_API void llama_sample_typical(struct llama_context * ctx, llama_token_data_array * candidates, float p, size_t min_keep);
     LLAMA_API void llama_sample_temperature(struct llama_context * ctx, llama_token_data_array * candidates, float temp);
 
+    /// @details Applies top-k, tail free, typical, top-p and temperature, in this order, to the logits of a token.
+    /// The top-k tokens are selected with a threshold pre-filter and a partial selection instead of sorting the whole vocabulary,
+    /// so the other samplers only ever run over k candidates. top_k <= 0 keeps the whole vocabulary.
+    /// The returned candidates are stored in a buffer of ctx that is reused by the next call, sample them with llama_sample_token().
+    LLAMA_API llama_token_data_array llama_sample_chain(struct llama_context * ctx, const float * logits, int top_k, float tfs_z, float typical_p, float top_p, float temp);
+
     /// @details Mirostat 1.0 algorithm described in the paper https://arxiv.org/abs/2007.14966. Uses tokens instead of words.
     /// @param candidates A vector of `llama_token_data` containing the candidate tokens, their probabilities (p), and log-odds (logit) for the current position in the generated text.
     /// @param tau  The target cross-entropy (or surprise) value you want to achieve for the generated text. A higher value corresponds to more surprising or less predictable text, while a lower value corresponds to less surprising or more predictable text.
@@ -253,6 +463,14 @@ extern "C" {
     /// @details Randomly selects a token from the candidates based on their probabilities.
     LLAMA_API llama_token llama_sample_token(struct llama_context * ctx, llama_token_data_array * candidates);
 
+    /// @details Speculative sampling: verifies a token proposed by a draft, e.g. a smaller model. The draft token is accepted with
+    /// probability min(1, p/q), where p is its probability in candidates and q in draft_candidates, otherwise a token is selected
+    /// from the residual distribution max(0, p - q). Either way the result is distributed as candidates, the draft only makes it
+    /// likely to be known in advance. The draft token was accepted if it is returned.
+    /// @param draft_candidates The probabilities the draft token was selected with (see llama_sample_softmax), NULL if the draft was certain.
+    /// Truncating candidates to one token with llama_sample_top_k makes this a greedy match.
+    LLAMA_API llama_token llama_sample_token_speculative(struct llama_context * ctx, llama_token_data_array * candidates, const llama_token_data_array * draft_candidates, llama_token draft_token);
+
     // Performance information
     LLAMA_API void llama_print_timings(struct llama_context * ctx);
     LLAMA_API void llama_reset_timings(struct llama_context * ctx);
@@ -267,12 +485,16 @@ extern "C" {
 // Internal API to be implemented by llama.cpp and used by tests/benchmarks only
 #ifdef LLAMA_API_INTERNAL
 
+#include <random>
 #include <vector>
 #include <string>
 struct ggml_tensor;
 
 std::vector<std::pair<std::string, struct ggml_tensor *>>& llama_internal_get_tensor_map(struct llama_context * ctx);
 
+// llama_sample_token_speculative with the acceptance and the replacement token drawn from rng instead of the RNG of ctx
+llama_token llama_sample_token_speculative_with_rng(struct llama_context * ctx, llama_token_data_array * candidates, const llama_token_data_array * draft_candidates, llama_token draft_token, std::mt19937 & rng);
+
 #endif
 
 #endif // LLAMA_H
@@ -0,0 +1,140 @@
+#include "llama.h"
+#include "grammar-parser.h"
+
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include <cmath>
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// the vocabulary only provides the text of the tokens to the grammar, sampling runs without a context
+static llama_context * ctx = NULL;
+
+static llama_token find_token(const char * text) {
+    for (llama_token id = 0; id < llama_n_vocab(ctx); id++) {
+        if (strcmp(llama_token_to_str(ctx, id), text) == 0) {
+            return id;
+        }
+    }
+    fprintf(stderr, "%s : no token '%s'\n", __func__, text);
+    assert(false);
+    return -1;
+}
+
+static llama_grammar * init_grammar(const char * src) {
+    std::string err;
+    grammar_parser::parse_state parsed_grammar = grammar_parser::parse(src, err);
+    assert(!parsed_grammar.rules.empty());
+
+    std::vector<const llama_grammar_element *> grammar_rules(parsed_grammar.c_rules());
+    return llama_grammar_init(ctx, grammar_rules.data(), grammar_rules.size(), parsed_grammar.symbol_ids.at("root"));
+}
+
+// the candidates of tokens whose logit is still finite after llama_sample_grammar, in order
+static std::vector<llama_token> sample_grammar(llama_grammar * grammar, const std::vector<llama_token> & tokens) {
+    std::vector<llama_token_data> candidates;
+    for (llama_token id : tokens) {
+        candidates.emplace_back(llama_token_data{id, 1.0f, 0.0f});
+    }
+
+    llama_token_data_array candidates_p = { candidates.data(), candidates.size(), false };
+    llama_sample_grammar(nullptr, &candidates_p, grammar);
+
+    std::vector<llama_token> allowed;
+    for (size_t i = 0; i < candidates_p.size; i++) {
+        if (std::isfinite(candidates_p.data[i].logit)) {
+            allowed.push_back(candidates_p.data[i].id);
+        }
+    }
+    return allowed;
+}
+
+static void test_accept(void) {
+    const llama_token yes = find_token("yes");
+    const llama_token no  = find_token("no");
+    const llama_token y   = find_token("y");
+    const llama_token es  = find_token("es");
+    const llama_token eos = llama_token_eos();
+
+    llama_grammar * grammar = init_grammar("root ::= \"yes\" | \"no\"");
+    assert(grammar != NULL);
+
+    // a prefix of an alternate is allowed, the end of stream token only once the grammar is complete
+    assert((sample_grammar(grammar, {yes, no, y, es, eos}) == std::vector<llama_token>{yes, no, y}));
+
+    assert(!llama_grammar_accept_token(nullptr, grammar, es));
+    assert(!llama_grammar_accept_token(nullptr, grammar, eos));
+
+    assert(llama_grammar_accept_token(nullptr, grammar, y));
+    assert((sample_grammar(grammar, {yes, no, y, es, eos}) == std::vector<llama_token>{es}));
+
+    assert(llama_grammar_accept_token(nullptr, grammar, es));
+    assert((sample_grammar(grammar, {yes, no, y, es, eos}) == std::vector<llama_token>{eos}));
+    assert(!llama_grammar_accept_token(nullptr, grammar, no));
+    assert(llama_grammar_accept_token(nullptr, grammar, eos));
+
+    llama_grammar_free(grammar);
+}
+
+static void test_dead_end(void) {
+    const llama_token yes = find_token("yes");
+    const llama_token no  = find_token("no");
+    const llama_token eos = llama_token_eos();
+
+    llama_grammar * grammar = init_grammar("root ::= \"yes\"");
+    assert(grammar != NULL);
+
+    // no candidate continues the grammar, the end of stream token is left but not accepted
+    assert((sample_grammar(grammar, {no, eos}) == std::vector<llama_token>{eos}));
+    assert(!llama_grammar_accept_token(nullptr, grammar, eos));
+    assert(!llama_grammar_accept_token(nullptr, grammar, no));
+
+    // a rejected token leaves the grammar unchanged
+    assert(llama_grammar_accept_token(nullptr, grammar, yes));
+    assert(llama_grammar_accept_token(nullptr, grammar, eos));
+
+    llama_grammar_free(grammar);
+}
+
+static void test_left_recursion(void) {
+    assert(init_grammar("root ::= root \"a\" | \"a\"") == NULL);
+    assert(init_grammar("root ::= expr\n"
+                        "expr ::= term \"+\" term | term\n"
+                        "term ::= expr | [0-9]") == NULL);
+    // through a rule that can match the empty string
+    assert(init_grammar("root ::= opt root \"b\" | \"c\"\n"
+                        "opt  ::= \"a\"?") == NULL);
+
+    llama_grammar * grammar = init_grammar("root ::= \"a\" root | \"b\"");
+    assert(grammar != NULL);
+    llama_grammar_free(grammar);
+}
+
+int main(int argc, char ** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <vocab-file>\n", argv[0]);
+        return 1;
+    }
+
+    auto lparams = llama_context_default_params();
+    lparams.vocab_only = true;
+
+    ctx = llama_init_from_file(argv[1], lparams);
+    if (ctx == NULL) {
+        fprintf(stderr, "%s: error: failed to load vocab '%s'\n", __func__, argv[1]);
+        return 1;
+    }
+
+    test_accept();
+    test_dead_end();
+    test_left_recursion();
+
+    llama_free(ctx);
+
+    printf("OK\n");
+}
@@ -0,0 +1,71 @@
+// The n-gram index of prompt lookup decoding and the drafts of llama_draft_lookup
+
+#include "common.h"
+
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include <cassert>
+#include <cstdio>
+#include <vector>
+
+static std::vector<llama_token> draft_ids(const llama_ngram_index & index, const std::vector<llama_token> & text, int n_draft) {
+    std::vector<llama_token> ids;
+    for (const auto & token : llama_draft_lookup(index, text, n_draft)) {
+        // the tokens of the prompt are certain drafts
+        assert(token.candidates.empty());
+        ids.push_back(token.id);
+    }
+    return ids;
+}
+
+int main(void) {
+    // 2 3 occurs twice, 1 2 3 once
+    const std::vector<llama_token> prompt = { 1, 2, 3, 4, 5, 6, 7, 2, 3, 9, 10 };
+
+    llama_ngram_index index;
+    index.n = 3;
+    llama_ngram_index_update(index, prompt);
+    assert(index.tokens == prompt);
+
+    // the continuation of the n-gram, up to n_draft tokens
+    assert(draft_ids(index, { 20, 1, 2, 3 }, 3) == std::vector<llama_token>({ 4, 5, 6 }));
+    assert(draft_ids(index, { 20, 1, 2, 3 }, 1) == std::vector<llama_token>({ 4 }));
+
+    // the longest n-gram wins over the later occurrence of a shorter one
+    assert(draft_ids(index, { 1, 2, 3 }, 2) == std::vector<llama_token>({ 4, 5 }));
+    assert(draft_ids(index, { 20, 2, 3 }, 2) == std::vector<llama_token>({ 9, 10 }));
+
+    // a shorter n-gram when the longer ones do not occur, and the text may be shorter than index.n
+    assert(draft_ids(index, { 21, 20, 6 }, 2) == std::vector<llama_token>({ 7, 2 }));
+    assert(draft_ids(index, { 6 }, 2) == std::vector<llama_token>({ 7, 2 }));
+
+    // the draft stops at the end of the prompt
+    assert(draft_ids(index, { 20, 2, 3 }, 5) == std::vector<llama_token>({ 9, 10 }));
+
+    // no match: unknown tokens, the last token of the prompt has no continuation, nothing generated yet
+    assert(draft_ids(index, { 2, 3, 20 }, 3).empty());
+    assert(draft_ids(index, { 9, 10 }, 3).empty());
+    assert(draft_ids(index, { }, 3).empty());
+
+    // tokens appended later are indexed, also the n-grams across the end of the previous text
+    std::vector<llama_token> text = prompt;
+    text.insert(text.end(), { 11, 12 });
+    llama_ngram_index_update(index, text);
+    assert(index.tokens == text);
+    assert(draft_ids(index, { 9, 10 }, 3) == std::vector<llama_token>({ 11, 12 }));
+    assert(draft_ids(index, { 2, 3, 9, 10, 11 }, 3) == std::vector<llama_token>({ 12 }));
+
+    // the last occurrence of an n-gram is the one drafted from
+    text.insert(text.end(), { 1, 2, 3, 13 });
+    llama_ngram_index_update(index, text);
+    assert(draft_ids(index, { 1, 2, 3 }, 2) == std::vector<llama_token>({ 13 }));
+
+    // a disabled index drafts nothing
+    llama_ngram_index disabled;
+    llama_ngram_index_update(disabled, prompt);
+    assert(draft_ids(disabled, { 1, 2, 3 }, 3).empty());
+
+    printf("OK\n");
+}
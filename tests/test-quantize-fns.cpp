@@ -6,6 +6,8 @@
 #include <assert.h>
 #include <math.h>
 #include <stdio.h>
+#include <string.h>
+#include <algorithm>
 #include <string>
 #include <vector>
 
@@ -13,6 +15,7 @@
 const float MAX_QUANTIZATION_REFERENCE_ERROR = 0.0001;
 const float MAX_QUANTIZATION_TOTAL_ERROR = 0.002;
 const float MAX_DOT_PRODUCT_ERROR = 0.02;
+const float MAX_DOT_PRODUCT_TILE_ERROR = 0.00001;
 
 const char* RESULT_STR[] = {"ok", "FAILED"};
 
@@ -83,6 +86,91 @@ float dot_product_error(quantize_fns_t & qfns, size_t test_size, const float * t
     return fabsf(result - dot_ref) / test_size;
 }
 
+// Difference between the tiled dot product and the single dot products
+float dot_product_tile_error(quantize_fns_t & qfns, size_t test_size, const float * test_data1, const float * test_data2) {
+    const size_t row_size = 2*test_size;
+
+    std::vector<uint8_t> tmp_q1(GGML_VEC_DOT_TILE_M*row_size);
+    std::vector<uint8_t> tmp_q2(GGML_VEC_DOT_TILE_N*row_size);
+
+    // use different data for every row, so that mixed up rows are detected
+    std::vector<float> tmp_data(test_size);
+    for (int r = 0; r < GGML_VEC_DOT_TILE_M; r++) {
+        for (size_t i = 0; i < test_size; i++) {
+            tmp_data[i] = test_data1[(i + r) % test_size];
+        }
+        qfns.quantize_row_q(tmp_data.data(), tmp_q1.data() + r*row_size, test_size);
+    }
+    for (int c = 0; c < GGML_VEC_DOT_TILE_N; c++) {
+        for (size_t i = 0; i < test_size; i++) {
+            tmp_data[i] = test_data2[(i + 3*c) % test_size];
+        }
+        qfns.quantize_row_q_dot(tmp_data.data(), tmp_q2.data() + c*row_size, test_size);
+    }
+
+    std::vector<float> result(GGML_VEC_DOT_TILE_M*GGML_VEC_DOT_TILE_N, INFINITY);
+    qfns.vec_dot_q_tile(test_size, result.data(), GGML_VEC_DOT_TILE_M, tmp_q1.data(), row_size, tmp_q2.data(), row_size);
+
+    float max_error = 0.0f;
+    for (int r = 0; r < GGML_VEC_DOT_TILE_M; r++) {
+        for (int c = 0; c < GGML_VEC_DOT_TILE_N; c++) {
+            float ref = INFINITY;
+            qfns.vec_dot_q(test_size, &ref, tmp_q1.data() + r*row_size, tmp_q2.data() + c*row_size);
+            max_error = std::max(max_error, fabsf(result[c*GGML_VEC_DOT_TILE_M + r] - ref) / test_size);
+        }
+    }
+
+    return max_error;
+}
+
+// Error of a round trip F32 -> type -> F32 through ggml_cpy, over a few rows and threads
+// The result must match quantize_row_q + dequantize_row_q and a copy of quantized rows must keep their bytes,
+// the error is returned as for total_quantization_error
+float cpy_round_trip_error(ggml_type type, quantize_fns_t & qfns, size_t test_size, const float * test_data) {
+    const int n_rows = 4;
+    const size_t row_size = test_size / n_rows;
+
+    struct ggml_init_params ggml_params = {
+        /* .mem_size   = */ 4*test_size*sizeof(float) + 16*1024,
+        /* .mem_buffer = */ NULL,
+        /* .no_alloc   = */ false,
+    };
+    struct ggml_context * ctx = ggml_init(ggml_params);
+
+    struct ggml_tensor * src = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, row_size, n_rows);
+    memcpy(src->data, test_data, test_size*sizeof(float));
+
+    struct ggml_tensor * q   = ggml_cpy(ctx, src, ggml_new_tensor_2d(ctx, type, row_size, n_rows));
+    struct ggml_tensor * dst = ggml_cpy(ctx, q, ggml_new_tensor_2d(ctx, GGML_TYPE_F32, row_size, n_rows));
+
+    // every other quantized row, the rows of a non-contiguous view are copied as they are
+    struct ggml_tensor * q_view = ggml_view_2d(ctx, q, row_size, n_rows/2, 2*q->nb[1], 0);
+    struct ggml_tensor * q_rows = ggml_cpy(ctx, q_view, ggml_new_tensor_2d(ctx, type, row_size, n_rows/2));
+
+    struct ggml_cgraph gf = ggml_build_forward(dst);
+    ggml_build_forward_expand(&gf, q_rows);
+    gf.n_threads = 3;
+    ggml_graph_compute(ctx, &gf);
+
+    std::vector<uint8_t> tmp_q(2*row_size);
+    std::vector<float> tmp_out(test_size);
+    for (int r = 0; r < n_rows; r++) {
+        qfns.quantize_row_q(test_data + r*row_size, tmp_q.data(), row_size);
+        qfns.dequantize_row_q(tmp_q.data(), tmp_out.data() + r*row_size, row_size);
+    }
+
+    const float * result = (const float *) dst->data;
+    bool same = memcmp(result, tmp_out.data(), test_size*sizeof(float)) == 0;
+    for (int r = 0; r < n_rows/2; r++) {
+        same = same && memcmp((const char *) q_rows->data + r*q_rows->nb[1], (const char *) q->data + 2*r*q->nb[1], q->nb[1]) == 0;
+    }
+    const float error = same ? array_rmse(test_data, result, test_size) : INFINITY;
+
+    ggml_free(ctx);
+
+    return error;
+}
+
 int main(int argc, char * argv[]) {
     bool verbose = false;
     const size_t test_size = 32 * 128;
@@ -141,6 +229,24 @@ int main(int argc, char * argv[]) {
             if (failed || verbose) {
                 printf("%5s dot product error:              %s (%f)\n", ggml_type_name(type), RESULT_STR[failed], vec_dot_error);
             }
+
+            if (type == GGML_TYPE_Q8_0 || type == GGML_TYPE_Q4_0) {
+                const float cpy_error = cpy_round_trip_error(type, qfns, test_size, test_data.data());
+                failed = !(cpy_error < MAX_QUANTIZATION_TOTAL_ERROR);
+                num_failed += failed;
+                if (failed || verbose) {
+                    printf("%5s ggml_cpy round trip error:      %s (%f)\n", ggml_type_name(type), RESULT_STR[failed], cpy_error);
+                }
+            }
+
+            if (qfns.vec_dot_q_tile) {
+                const float vec_dot_tile_error = dot_product_tile_error(qfns, test_size, test_data.data(), test_data2.data());
+                failed = !(vec_dot_tile_error < MAX_DOT_PRODUCT_TILE_ERROR);
+                num_failed += failed;
+                if (failed || verbose) {
+                    printf("%5s tiled dot product error:        %s (%f)\n", ggml_type_name(type), RESULT_STR[failed], vec_dot_tile_error);
+                }
+            }
         }
     }
 
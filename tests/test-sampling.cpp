@@ -173,6 +173,52 @@ void test_frequency_presence_penalty(
     }
 }
 
+void test_penalties(
+                const std::vector<float> & probs,
+                const std::vector<llama_token> & tokens,
+                int n_window,
+                float penalty, float alpha_frequency, float alpha_presence) {
+    size_t n_vocab = probs.size();
+    llama_penalty_state * state = llama_penalty_state_init(n_vocab, n_window);
+
+    for (size_t n = 0; n <= tokens.size(); n++) {
+        if (n > 0) {
+            llama_penalty_state_push(state, tokens[n - 1]);
+        }
+
+        // reference: the separate penalties over the last n_window tokens
+        const size_t n_last = std::min(n, (size_t) n_window);
+        std::vector<llama_token> last_tokens(tokens.begin() + n - n_last, tokens.begin() + n);
+
+        std::vector<llama_token_data> candidates;
+        std::vector<float> logits;
+        for (llama_token token_id = 0; token_id < (llama_token)n_vocab; token_id++) {
+            float logit = log(probs[token_id]);
+            candidates.emplace_back(llama_token_data{token_id, logit, 0.0f});
+            logits.push_back(logit);
+        }
+
+        llama_token_data_array candidates_p = { candidates.data(), candidates.size(), false };
+        llama_sample_repetition_penalty(nullptr, &candidates_p, last_tokens.data(), last_tokens.size(), penalty);
+        llama_sample_frequency_and_presence_penalties(nullptr, &candidates_p, last_tokens.data(), last_tokens.size(), alpha_frequency, alpha_presence);
+
+        llama_sample_penalties(nullptr, logits.data(), state, penalty, alpha_frequency, alpha_presence);
+
+        for (size_t i = 0; i < n_vocab; i++) {
+            assert(logits[candidates[i].id] == candidates[i].logit);
+        }
+    }
+
+    llama_penalty_state_reset(state);
+    std::vector<float> logits(n_vocab, 1.0f);
+    llama_sample_penalties(nullptr, logits.data(), state, penalty, alpha_frequency, alpha_presence);
+    for (size_t i = 0; i < n_vocab; i++) {
+        assert(logits[i] == 1.0f);
+    }
+
+    llama_penalty_state_free(state);
+}
+
 int main(void) {
     ggml_time_init();
 
@@ -198,5 +244,9 @@ int main(void) {
     test_frequency_presence_penalty({0.2, 0.2, 0.2, 0.2, 0.2}, {0, 1, 2},       {0.499966, 0.499966, 0.000023, 0.000023, 0.000023}, 5.0, 5.0);
     test_frequency_presence_penalty({0.2, 0.2, 0.2, 0.2, 0.2}, {0, 1, 2, 0, 0}, {0.499977, 0.499977, 0.000023, 0.000023, 0.000000}, 5.0, 5.0);
 
+    test_penalties({0.1, 0.2, 0.3, 0.4, 0.5, 0.6}, {0, 1, 2, 0, 0, 3, 5, 5, 1, 0, 4, 4, 4, 2}, 4, 1.5, 0.5, 0.25);
+    test_penalties({0.1, 0.2, 0.3, 0.4, 0.5, 0.6}, {0, 1, 2, 0, 0, 3, 5, 5, 1, 0, 4, 4, 4, 2}, 1, 2.0, 0.0, 1.0);
+    test_penalties({0.1, 0.2, 0.3, 0.4, 0.5, 0.6}, {5, 5, 5, 1}, 0, 2.0, 1.0, 1.0);
+
     printf("OK\n");
 }
@@ -0,0 +1,320 @@
+// Round trip of the context state through llama_copy_state_data / llama_set_state_data with a quantized K cache and
+// with several sequences, on a small model with random weights written by the test
+
+#include "ggml.h"
+#include "llama.h"
+
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+static const char * fname_model = "test-state-model.bin";
+
+static const uint32_t n_vocab = 32;
+static const uint32_t n_embd  = 64;
+static const uint32_t n_mult  = 32;
+static const uint32_t n_head  = 2;
+static const uint32_t n_layer = 32; // the buffer sizes of llama.cpp are only known for the layer counts of the LLaMA models
+static const uint32_t n_ff    = ((2*(4*n_embd)/3 + n_mult - 1)/n_mult)*n_mult;
+
+static void write_u32(FILE * f, uint32_t v) {
+    fwrite(&v, sizeof(v), 1, f);
+}
+
+static void write_tensor(FILE * f, std::mt19937 & rng, const std::string & name, std::vector<uint32_t> ne, float scale) {
+    write_u32(f, ne.size());
+    write_u32(f, name.size());
+    write_u32(f, 0); // GGML_TYPE_F32
+    size_t n = 1;
+    for (uint32_t d : ne) {
+        write_u32(f, d);
+        n *= d;
+    }
+    fwrite(name.data(), 1, name.size(), f);
+
+    // the data starts at a multiple of 32 bytes
+    while (ftell(f) % 32 != 0) {
+        fputc(0, f);
+    }
+
+    std::uniform_real_distribution<float> dist(-scale, scale);
+    std::vector<float> data(n);
+    for (auto & x : data) {
+        x = ne.size() == 1 ? 1.0f : dist(rng);
+    }
+    fwrite(data.data(), sizeof(float), n, f);
+}
+
+static void write_model(void) {
+    FILE * f = fopen(fname_model, "wb");
+    assert(f != NULL);
+
+    write_u32(f, LLAMA_FILE_MAGIC);
+    write_u32(f, LLAMA_FILE_VERSION);
+
+    write_u32(f, n_vocab);
+    write_u32(f, n_embd);
+    write_u32(f, n_mult);
+    write_u32(f, n_head);
+    write_u32(f, n_layer);
+    write_u32(f, n_embd/n_head);
+    write_u32(f, LLAMA_FTYPE_ALL_F32);
+
+    for (uint32_t i = 0; i < n_vocab; i++) {
+        const std::string text = i == 1 ? "<s>" : i == 2 ? "</s>" : std::string(1, (char) ('a' + i));
+        const float score = 0.0f;
+        write_u32(f, text.size());
+        fwrite(text.data(), 1, text.size(), f);
+        fwrite(&score, sizeof(score), 1, f);
+    }
+
+    std::mt19937 rng(42);
+    write_tensor(f, rng, "tok_embeddings.weight", {n_embd, n_vocab}, 1.0f);
+    write_tensor(f, rng, "norm.weight",           {n_embd},          1.0f);
+    write_tensor(f, rng, "output.weight",         {n_embd, n_vocab}, 0.2f);
+    for (uint32_t i = 0; i < n_layer; i++) {
+        const std::string layer = "layers." + std::to_string(i);
+        write_tensor(f, rng, layer + ".attention_norm.weight",  {n_embd},         1.0f);
+        write_tensor(f, rng, layer + ".attention.wq.weight",    {n_embd, n_embd}, 0.2f);
+        write_tensor(f, rng, layer + ".attention.wk.weight",    {n_embd, n_embd}, 0.2f);
+        write_tensor(f, rng, layer + ".attention.wv.weight",    {n_embd, n_embd}, 0.2f);
+        write_tensor(f, rng, layer + ".attention.wo.weight",    {n_embd, n_embd}, 0.02f);
+        write_tensor(f, rng, layer + ".ffn_norm.weight",        {n_embd},         1.0f);
+        write_tensor(f, rng, layer + ".feed_forward.w1.weight", {n_embd, n_ff},   0.2f);
+        write_tensor(f, rng, layer + ".feed_forward.w2.weight", {n_ff,   n_embd}, 0.02f);
+        write_tensor(f, rng, layer + ".feed_forward.w3.weight", {n_embd, n_ff},   0.2f);
+    }
+
+    fclose(f);
+}
+
+// the logits of the last token after evaluating tokens at n_past, on one thread so that the result does not depend on the machine
+static std::vector<float> eval(llama_context * ctx, const std::vector<llama_token> & tokens, int n_past) {
+    assert(llama_eval(ctx, tokens.data(), tokens.size(), n_past, 1) == 0);
+    const float * logits = llama_get_logits(ctx);
+    return std::vector<float>(logits, logits + llama_n_vocab(ctx));
+}
+
+// the logits of all the tokens of a batch
+static std::vector<float> eval_batch(llama_context * ctx, const std::vector<llama_token> & tokens, const std::vector<int> & pos, const std::vector<llama_seq_id> & seq_id) {
+    assert(llama_eval_batch(ctx, tokens.data(), pos.data(), seq_id.data(), tokens.size(), 1) == 0);
+    const float * logits = llama_get_logits(ctx);
+    return std::vector<float>(logits, logits + tokens.size()*llama_n_vocab(ctx));
+}
+
+static void test_state_round_trip(llama_model * model, llama_kv_type type_k) {
+    auto lparams = llama_context_default_params();
+    lparams.n_ctx  = 64;
+    lparams.seed   = 42;
+    lparams.type_k = type_k;
+
+    llama_context * ctx = llama_new_context_with_model(model, lparams);
+    assert(ctx != NULL);
+
+    const std::vector<llama_token> prompt = { 1, 5, 9, 13, 17, 21 };
+    const std::vector<llama_token> next   = { 7, 11 };
+
+    eval(ctx, prompt, 0);
+
+    std::vector<uint8_t> state(llama_get_state_size(ctx));
+    assert(llama_copy_state_data(ctx, state.data()) <= state.size());
+
+    const std::vector<float> logits = eval(ctx, next, prompt.size());
+
+    // the same context, restored
+    assert(llama_set_state_data(ctx, state.data()) <= state.size());
+    assert(eval(ctx, next, prompt.size()) == logits);
+
+    // a new context, restored
+    llama_context * ctx2 = llama_new_context_with_model(model, lparams);
+    assert(ctx2 != NULL);
+    assert(llama_set_state_data(ctx2, state.data()) <= state.size());
+
+    std::vector<uint8_t> state2(llama_get_state_size(ctx2));
+    assert(llama_copy_state_data(ctx2, state2.data()) <= state2.size());
+    assert(state2 == state);
+
+    assert(eval(ctx2, next, prompt.size()) == logits);
+
+    llama_free(ctx2);
+    llama_free(ctx);
+}
+
+// the cells of a cache that holds two sequences and went through llama_kv_cache_seq_rm and llama_kv_cache_seq_shift
+// keep their positions, sequences and pending shift through the round trip
+static void test_state_seq_rm_shift(llama_model * model) {
+    auto lparams = llama_context_default_params();
+    lparams.n_ctx = 64;
+    lparams.seed  = 42;
+
+    llama_context * ctx = llama_new_context_with_model(model, lparams);
+    assert(ctx != NULL);
+
+    eval(ctx, { 1, 5, 9, 13, 17, 21, 25, 29 }, 0);
+    eval_batch(ctx, { 1, 6, 10 }, { 0, 1, 2 }, { 1, 1, 1 });
+
+    // drop the positions 2 and 3 of sequence 0 and move the following tokens back
+    llama_kv_cache_seq_rm   (ctx, 0, 2,  4);
+    llama_kv_cache_seq_shift(ctx, 0, 4, -1, -2);
+
+    std::vector<uint8_t> state(llama_get_state_size(ctx));
+    assert(llama_copy_state_data(ctx, state.data()) <= state.size());
+
+    const std::vector<llama_token>  next   = { 7, 11, 3 };
+    const std::vector<int>          pos    = { 6,  7, 3 };
+    const std::vector<llama_seq_id> seq_id = { 0,  0, 1 };
+
+    const std::vector<float> logits = eval_batch(ctx, next, pos, seq_id);
+
+    // the same context, restored
+    assert(llama_set_state_data(ctx, state.data()) <= state.size());
+    assert(eval_batch(ctx, next, pos, seq_id) == logits);
+
+    // a new context, restored
+    llama_context * ctx2 = llama_new_context_with_model(model, lparams);
+    assert(ctx2 != NULL);
+    assert(llama_set_state_data(ctx2, state.data()) <= state.size());
+
+    std::vector<uint8_t> state2(llama_get_state_size(ctx2));
+    assert(llama_copy_state_data(ctx2, state2.data()) <= state2.size());
+    assert(state2 == state);
+
+    assert(eval_batch(ctx2, next, pos, seq_id) == logits);
+
+    llama_free(ctx2);
+    llama_free(ctx);
+}
+
+// the K rows of the tokens at positions [0, n) of sequence 0, per token and layer, as F32
+static std::vector<float> get_k(llama_context * ctx, ggml_type type_k, int n) {
+    std::vector<uint8_t> data(llama_get_seq_data_size(ctx, n));
+    assert(llama_copy_seq_data(ctx, 0, 0, n, data.data()) == data.size());
+
+    const size_t k_row = ggml_type_size(type_k)*n_embd/ggml_blck_size(type_k);
+    const size_t v_col = sizeof(float)*n_embd;
+
+    std::vector<float> k(n*n_layer*n_embd);
+    for (int i = 0; i < n*(int) n_layer; i++) {
+        const uint8_t * row = data.data() + i*(k_row + v_col);
+        if (type_k == GGML_TYPE_F32) {
+            memcpy(&k[i*n_embd], row, k_row);
+        } else {
+            ggml_internal_get_quantize_fn(type_k).dequantize_row_q(row, &k[i*n_embd], n_embd);
+        }
+    }
+    return k;
+}
+
+// llama_kv_cache_seq_shift re-rotates a quantized K cache through F32: the result must be the one of an F32 cache that
+// holds the same values, within the error of quantizing it again
+static void test_quantized_shift(llama_model * model, llama_kv_type type_kv, ggml_type type_k, float tolerance) {
+    auto lparams = llama_context_default_params();
+    lparams.n_ctx  = 64;
+    lparams.seed   = 42;
+    lparams.type_v = LLAMA_KV_TYPE_F32;
+
+    lparams.type_k = type_kv;
+    llama_context * ctx_q = llama_new_context_with_model(model, lparams);
+    assert(ctx_q != NULL);
+
+    lparams.type_k = LLAMA_KV_TYPE_F32;
+    llama_context * ctx_f32 = llama_new_context_with_model(model, lparams);
+    assert(ctx_f32 != NULL);
+
+    const int n_prompt = 8;
+    eval(ctx_q, { 1, 5, 9, 13, 17, 21, 25, 29 }, 0);
+
+    // the same keys in the F32 cache, dequantized
+    {
+        const size_t k_row = ggml_type_size(type_k)*n_embd/ggml_blck_size(type_k);
+        const size_t v_col = sizeof(float)*n_embd;
+
+        std::vector<uint8_t> data(llama_get_seq_data_size(ctx_q, n_prompt));
+        assert(llama_copy_seq_data(ctx_q, 0, 0, n_prompt, data.data()) == data.size());
+
+        const std::vector<float> k = get_k(ctx_q, type_k, n_prompt);
+
+        std::vector<uint8_t> data_f32(llama_get_seq_data_size(ctx_f32, n_prompt));
+        uint8_t * out = data_f32.data();
+        for (int i = 0; i < n_prompt*(int) n_layer; i++) {
+            memcpy(out, &k[i*n_embd], sizeof(float)*n_embd);
+            out += sizeof(float)*n_embd;
+            memcpy(out, data.data() + i*(k_row + v_col) + k_row, v_col);
+            out += v_col;
+        }
+        assert(llama_set_seq_data(ctx_f32, 0, 0, n_prompt, data_f32.data()) == data_f32.size());
+    }
+
+    const std::vector<float> k_before = get_k(ctx_f32, GGML_TYPE_F32, n_prompt);
+
+    // drop the positions 2 and 3, the keys at 4 .. 7 move to 2 .. 5 and are rotated by the next eval
+    for (llama_context * ctx : { ctx_q, ctx_f32 }) {
+        llama_kv_cache_seq_rm   (ctx, 0, 2,  4);
+        llama_kv_cache_seq_shift(ctx, 0, 4, -1, -2);
+        eval(ctx, { 7 }, n_prompt - 2);
+    }
+
+    const std::vector<float> k_q   = get_k(ctx_q,   type_k,         n_prompt - 2);
+    const std::vector<float> k_f32 = get_k(ctx_f32, GGML_TYPE_F32, n_prompt - 2);
+
+    float max_err   = 0.0f;
+    float max_shift = 0.0f;
+    for (int i = 0; i < (n_prompt - 2)*(int) n_layer; i++) {
+        const int pos   = i / n_layer;
+        const int layer = i % n_layer;
+        const float * before = &k_before[((pos < 2 ? pos : pos + 2)*n_layer + layer)*n_embd];
+
+        float amax = 0.0f;
+        for (uint32_t j = 0; j < n_embd; j++) {
+            amax = std::max(amax, std::fabs(k_f32[i*n_embd + j]));
+        }
+        for (uint32_t j = 0; j < n_embd; j++) {
+            max_err   = std::max(max_err,   std::fabs(k_q[i*n_embd + j] - k_f32[i*n_embd + j]) / amax);
+            max_shift = std::max(max_shift, std::fabs(k_f32[i*n_embd + j] - before[j]) / amax);
+        }
+    }
+
+    if (max_err > tolerance) {
+        fprintf(stderr, "%s : %s: error %f above %f\n", __func__, ggml_type_name(type_k), max_err, tolerance);
+        assert(false);
+    }
+    // the shift did rotate the keys
+    assert(max_shift > 4*tolerance);
+
+    llama_free(ctx_f32);
+    llama_free(ctx_q);
+}
+
+int main(void) {
+    llama_init_backend();
+
+    write_model();
+
+    auto lparams = llama_context_default_params();
+    llama_model * model = llama_load_model_from_file(fname_model, lparams);
+    assert(model != NULL);
+
+    test_state_round_trip(model, LLAMA_KV_TYPE_Q8_0);
+    test_state_round_trip(model, LLAMA_KV_TYPE_Q4_0);
+    test_state_seq_rm_shift(model);
+
+    // quantizing again adds up to half a step for Q8_0, 1/254 of the largest value of a block, and up to a full step
+    // for Q4_0, 1/8, as the end of its range opposite to the largest value is clipped
+    test_quantized_shift(model, LLAMA_KV_TYPE_Q8_0, GGML_TYPE_Q8_0, 1.0f/200);
+    test_quantized_shift(model, LLAMA_KV_TYPE_Q4_0, GGML_TYPE_Q4_0, 1.0f/7);
+
+    llama_free_model(model);
+    remove(fname_model);
+
+    printf("OK\n");
+}
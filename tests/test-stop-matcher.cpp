@@ -0,0 +1,142 @@
+// The stop strings found by llama_stop_matcher and the text it holds back, checked against std::string::find on the
+// whole text fed so far
+
+#include "common.h"
+
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include <cassert>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+// the result of feeding a text a chunk at a time, as the server streams it
+struct stop_result {
+    int         word = -1;   // the stop string found, -1 if none
+    std::string released;    // the text before the stop string, or that cannot be the start of one
+    std::string held;        // the end of the text that may be the start of a stop string
+};
+
+// the stop string that starts first in the text, the one that ends first if several start at the same position
+static size_t naive_find(const std::vector<std::string> & words, const std::string & text, int & word) {
+    size_t pos = std::string::npos;
+    word = -1;
+    for (size_t i = 0; i < words.size(); i++) {
+        const size_t p = words[i].empty() ? std::string::npos : text.find(words[i]);
+        if (p != std::string::npos && (pos == std::string::npos || p < pos || (p == pos && words[i].size() < words[word].size()))) {
+            pos  = p;
+            word = (int) i;
+        }
+    }
+    return pos;
+}
+
+// the longest end of the text that is the start of a stop string
+static size_t naive_partial(const std::vector<std::string> & words, const std::string & text) {
+    size_t n = 0;
+    for (const auto & w : words) {
+        for (size_t k = std::min(w.size(), text.size()); k > n; k--) {
+            if (text.compare(text.size() - k, k, w, 0, k) == 0) {
+                n = k;
+                break;
+            }
+        }
+    }
+    return n;
+}
+
+static stop_result feed_chunks(const std::vector<std::string> & words, const std::vector<std::string> & chunks) {
+    llama_stop_matcher matcher;
+    llama_stop_matcher_init(matcher, words);
+
+    stop_result res;
+    std::string text;
+    for (const auto & chunk : chunks) {
+        text += chunk;
+
+        size_t pos = std::string::npos;
+        res.word = llama_stop_matcher_feed(matcher, chunk.data(), chunk.size(), pos);
+
+        int naive_word;
+        const size_t naive_pos = naive_find(words, text, naive_word);
+        if (res.word >= 0) {
+            assert(naive_word >= 0);
+            assert(pos == naive_pos);
+            assert(words[res.word] == words[naive_word]);
+
+            res.released = text.substr(0, pos);
+            res.held.clear();
+            return res;
+        }
+        assert(naive_word < 0);
+
+        const size_t partial = llama_stop_matcher_partial(matcher);
+        assert(partial == naive_partial(words, text));
+
+        res.released = text.substr(0, text.size() - partial);
+        res.held     = text.substr(text.size() - partial);
+    }
+    return res;
+}
+
+static void check(const std::vector<std::string> & words, const std::vector<std::string> & chunks, int word, const char * released, const char * held) {
+    const stop_result res = feed_chunks(words, chunks);
+    if (res.word != word || res.released != released || res.held != held) {
+        fprintf(stderr, "%s : expected %d '%s' '%s', got %d '%s' '%s'\n", __func__, word, released, held,
+            res.word, res.released.c_str(), res.held.c_str());
+        assert(false);
+    }
+}
+
+int main(void) {
+    // overlapping stop strings, the one that starts first wins even if it ends later
+    check({ "bc", "abcd" }, { "xab", "cdy" },    1, "x",    "");
+    check({ "bc", "abcd" }, { "xabc", "dy" },    0, "xa",   "");
+    check({ "abcd", "bcx" }, { "zabcx" },        1, "za",   "");
+    check({ "aab", "ab" }, { "caaab" },          0, "ca",   "");
+    check({ "ab", "b" }, { "xab" },              0, "x",    "");
+    check({ "abc", "ab" }, { "xabc" },           1, "x",    "");
+
+    // a stop string split across chunks, down to one byte per chunk
+    check({ "</s>" }, { "hello <", "/s", "> bye" },          0, "hello ", "");
+    check({ "</s>" }, { "<", "/", "s", ">" },                0, "",       "");
+    check({ "User:" }, { "Hi. Us", "er", ": more" },        0, "Hi. ",   "");
+
+    // a partial match at the end of the stream is held back, a broken one is released
+    check({ "User:" }, { "Hi. Use" },                       -1, "Hi. ",    "Use");
+    check({ "User:" }, { "Hi. Use", "d to" },               -1, "Hi. Used to", "");
+    check({ "aab" }, { "xaa", "a" },                        -1, "xa",      "aa");
+    check({ "###", "##x" }, { "a#", "#" },                  -1, "a",       "##");
+
+    // multi-byte characters and no stop strings at all
+    check({ "\xe2\x80\x94" "end" }, { "a \xe2\x80", "\x94" },  -1, "a ",      "\xe2\x80\x94");
+    check({ }, { "anything" },                              -1, "anything", "");
+    check({ "" }, { "anything" },                           -1, "anything", "");
+
+    // random texts over a small alphabet so that the stop strings overlap a lot
+    std::mt19937 rng(1234);
+    std::uniform_int_distribution<int> letter(0, 2);
+    for (int it = 0; it < 2000; it++) {
+        std::vector<std::string> words(1 + rng() % 4);
+        for (auto & w : words) {
+            w.resize(1 + rng() % 5);
+            for (auto & c : w) {
+                c = (char) ('a' + letter(rng));
+            }
+        }
+        std::vector<std::string> chunks(1 + rng() % 6);
+        for (auto & chunk : chunks) {
+            chunk.resize(rng() % 4);
+            for (auto & c : chunk) {
+                c = (char) ('a' + letter(rng));
+            }
+        }
+        // checks every chunk against the naive search
+        feed_chunks(words, chunks);
+    }
+
+    printf("OK\n");
+}
@@ -0,0 +1,150 @@
+// Benchmark the tokenizer on synthetic text
+
+#include "llama.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define TEXT_SIZE  (1024*1024)
+#define CHUNK_SIZE (4*1024)
+#define ITERATIONS 3
+
+static const char * k_samples[] = {
+    " The quick brown fox jumps over the lazy dog.",
+    " Inference of LLaMA model in pure C/C++, with 4-bit integer quantization.\n",
+    " for (int i = 0; i < n; ++i) { sum += x[i]*y[i]; }\n",
+    " this is 🦙.cpp",
+    " w048 7tuijk dsdfhu",
+    " нещо на Български",
+    " 日本語のテキストも含まれています。",
+    "\n\n    \t",
+};
+
+int main(int argc, char ** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <vocab-file>\n", argv[0]);
+        return 1;
+    }
+
+    const std::string fname = argv[1];
+
+    fprintf(stderr, "%s : reading vocab from: '%s'\n", __func__, fname.c_str());
+
+    llama_context * ctx;
+
+    // load the vocab
+    {
+        auto lparams = llama_context_default_params();
+
+        lparams.vocab_only = true;
+
+        ctx = llama_init_from_file(fname.c_str(), lparams);
+
+        if (ctx == NULL) {
+            fprintf(stderr, "%s: error: failed to load vocab '%s'\n", __func__, fname.c_str());
+            return 1;
+        }
+    }
+
+    std::string text;
+    for (size_t i = 0; text.size() < TEXT_SIZE; i = (i*7 + 3) % (sizeof(k_samples)/sizeof(k_samples[0]))) {
+        text += k_samples[i];
+    }
+
+    // split the text at a space close to every CHUNK_SIZE bytes, like a document tokenized a paragraph at a time
+    std::vector<std::string> chunks;
+    for (size_t i = 0; i < text.size(); ) {
+        size_t end = text.find(' ', i + CHUNK_SIZE);
+        end = end == std::string::npos ? text.size() : end;
+        chunks.push_back(text.substr(i, end - i));
+        i = end;
+    }
+
+    std::vector<llama_token> tokens(CHUNK_SIZE*4);
+    double best_ms = 0.0;
+    size_t n_tokens = 0;
+
+    for (int it = 0; it < ITERATIONS; it++) {
+        const auto t_start = std::chrono::steady_clock::now();
+
+        n_tokens = 0;
+        for (const auto & chunk : chunks) {
+            const int n = llama_tokenize(ctx, chunk.c_str(), tokens.data(), tokens.size(), false);
+            if (n < 0) {
+                fprintf(stderr, "%s : failed to tokenize a chunk of %zu bytes\n", __func__, chunk.size());
+                return 2;
+            }
+            n_tokens += n;
+        }
+
+        const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t_start).count();
+        best_ms = it == 0 ? ms : std::min(best_ms, ms);
+    }
+
+    printf("%s : %zu bytes, %zu tokens in %.2f ms: %.2f MB/s, %.0f tokens/s\n", __func__,
+            text.size(), n_tokens, best_ms, text.size()/(best_ms*1e3), n_tokens/(best_ms*1e-3));
+
+    // the tokens must give back the text
+    for (const auto & chunk : chunks) {
+        const int n = llama_tokenize(ctx, chunk.c_str(), tokens.data(), tokens.size(), false);
+
+        std::string detokenized;
+        for (int i = 0; i < n; i++) {
+            detokenized += llama_token_to_str(ctx, tokens[i]);
+        }
+
+        if (detokenized != chunk) {
+            fprintf(stderr, "%s : the tokens do not match the text: '%s'\n", __func__, chunk.c_str());
+            return 3;
+        }
+    }
+
+    // the parallel tokenization of the whole text and of the chunks must match the serial one
+    const int n_threads = std::max(2u, std::thread::hardware_concurrency());
+
+    std::vector<llama_token> serial(text.size() + 1);
+    std::vector<llama_token> parallel(text.size() + 1);
+
+    auto t_start = std::chrono::steady_clock::now();
+    const int n_serial = llama_tokenize(ctx, text.c_str(), serial.data(), serial.size(), true);
+    const double serial_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t_start).count();
+
+    t_start = std::chrono::steady_clock::now();
+    const int n_parallel = llama_tokenize_parallel(ctx, text.c_str(), parallel.data(), parallel.size(), true, n_threads);
+    const double parallel_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t_start).count();
+
+    printf("%s : whole text, %d tokens: %.2f ms serial, %.2f ms on %d threads\n", __func__, n_serial, serial_ms, parallel_ms, n_threads);
+
+    if (n_parallel != n_serial || !std::equal(serial.begin(), serial.begin() + n_serial, parallel.begin())) {
+        fprintf(stderr, "%s : llama_tokenize_parallel does not match llama_tokenize\n", __func__);
+        return 4;
+    }
+
+    std::vector<const char *> texts;
+    for (const auto & chunk : chunks) {
+        texts.push_back(chunk.c_str());
+    }
+    std::vector<int> offsets(chunks.size() + 1);
+    const int n_batch = llama_tokenize_batch(ctx, texts.data(), texts.size(), parallel.data(), parallel.size(), offsets.data(), false, n_threads);
+
+    if (n_batch < 0) {
+        fprintf(stderr, "%s : llama_tokenize_batch failed\n", __func__);
+        return 5;
+    }
+
+    for (size_t i = 0; i < chunks.size(); i++) {
+        const int n = llama_tokenize(ctx, chunks[i].c_str(), tokens.data(), tokens.size(), false);
+        if (offsets[i + 1] - offsets[i] != n || !std::equal(tokens.begin(), tokens.begin() + n, parallel.begin() + offsets[i])) {
+            fprintf(stderr, "%s : llama_tokenize_batch does not match llama_tokenize for text %zu\n", __func__, i);
+            return 5;
+        }
+    }
+
+    llama_free(ctx);
+
+    return 0;
+}